@@ -453,6 +453,29 @@ def test_causal(
     ), res_sum
 
 
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("window_size", [1, 5, 9])
+def test_local_attention_cpu(causal: bool, window_size: int):
+    # The CPU path applies the window within the attention kernel, check it
+    # against the masked attention
+    from xformers import _has_cpp_library
+    from xformers.components.attention.core import scaled_dot_product_attention
+
+    if not _has_cpp_library:
+        pytest.skip("requires the C++ operators")
+
+    torch.manual_seed(0)
+    attention = build_attention(
+        {"name": "local", "dropout": 0.0, "causal": causal, "window_size": window_size}
+    )
+    q, k, v = (torch.randn((BATCH * 2, SEQ, MODEL)) for _ in range(3))
+
+    res = attention(q, k, v)
+    mask = attention._get_local_mask(q.shape)
+    ref = scaled_dot_product_attention(q=q, k=k, v=v, att_mask=mask)
+    assert torch.allclose(res, ref, atol=1e-5, rtol=1e-4)
+
+
 @pytest.mark.parametrize("attn_dropout", [0.0, 0.1])
 @pytest.mark.parametrize("heads", [2])
 @pytest.mark.parametrize("attention_name", ATTENTION_REGISTRY.keys())
@@ -131,6 +131,56 @@ def test_matmul_with_mask_backward(device, contiguous, is_sparse):
     assert torch.allclose(grad_b, b.grad)
 
 
+@pytest.mark.parametrize("requires_grad", ["a", "b", "ab"])
+@pytest.mark.parametrize("device", _devices)
+def test_matmul_with_dense_mask_block_sparse(device, requires_grad):
+    # tiles of the output fully in, fully out of, and partially in the mask
+    B, M, N, K = 2, 150, 300, 24
+    a = torch.rand(B, M, K, device=device, requires_grad="a" in requires_grad)
+    b = torch.rand(B, K, N, device=device, requires_grad="b" in requires_grad)
+    mask = torch.rand(B, M, N, device=device) > 0.7
+    mask[:, :64, :128] = True
+    mask[:, 64:128, 128:256] = False
+
+    out = torch.ops.xformers.matmul_with_mask(a, b, mask)
+    out_gt = _baseline_matmul_with_dense_mask(a, b, mask)
+    assert torch.equal(out.isinf(), out_gt.isinf())
+    assert torch.allclose(out[mask], out_gt[mask])
+
+    grad = torch.randn_like(out)
+    grads = torch.autograd.grad(out, [t for t in [a, b] if t.requires_grad], grad)
+    grads_gt = torch.autograd.grad(
+        out_gt, [t for t in [a, b] if t.requires_grad], grad
+    )
+    for g, g_gt in zip(grads, grads_gt):
+        assert torch.allclose(g, g_gt, atol=1e-4, rtol=1e-4)
+
+
+@pytest.mark.parametrize("coalesced", [True, False])
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+def test_matmul_with_sparse_mask_cpu_dtypes(dtype, coalesced):
+    B, L, K = 4, 37, 40
+    a = torch.randn(B, L, K, dtype=dtype)
+    b = torch.randn(B, K, L, dtype=dtype)
+    mask = torch.rand(B, L, L) > 0.7
+    # skewed rows: a dense one, and a few empty ones
+    mask[:, 3] = True
+    mask[:, 10:15] = False
+    mask = mask.to_sparse().to(dtype)
+    if not coalesced:
+        idxs = mask.indices().flip(1)
+        mask = torch.sparse_coo_tensor(idxs, mask.values(), mask.shape)
+        assert not mask.is_coalesced()
+
+    res = torch.ops.xformers.matmul_with_mask(a, b, mask)
+    res_gt = _baseline_matmul_with_sparse_mask(a.float(), b.float(), mask.float())
+
+    assert res.dtype == dtype
+    assert torch.allclose(
+        res.to_dense().float(), res_gt.to_dense(), atol=0.2, rtol=2e-2
+    )
+
+
 @pytest.mark.parametrize("device", _devices)
 def test_sddmm_sputnik(device):
     B, L, M, K = 8, 30, 16, 32
@@ -157,6 +207,32 @@ def test_sddmm_sputnik(device):
     assert torch.allclose(res, res_gt)
 
 
+@pytest.mark.parametrize("dtype", [torch.float, torch.half, torch.bfloat16])
+@pytest.mark.parametrize("K", [32, 17])
+def test_sddmm_sputnik_cpu_dtypes(K, dtype):
+    B, L, M = 4, 70, 50
+    a = torch.randn(B, L, K, dtype=dtype)
+    b = torch.randn(B, M, K, dtype=dtype)
+    mask = torch.rand(L, M) > 0.8
+    # skewed rows, to check the split of the work between threads
+    mask[3] = True
+    mask[10:30] = False
+
+    row_offsets = torch.zeros(L + 1, dtype=torch.int32)
+    row_offsets[1:] = mask.sum(-1).cumsum(0)
+    column_indices = mask.nonzero()[:, 1].to(torch.int32)
+    row_indices = torch.arange(L, dtype=torch.int32)
+
+    res = torch.ops.xformers.sddmm_sputnik(
+        a, b, row_indices, row_offsets, column_indices
+    )
+    res_gt = (a.float() @ b.float().transpose(-2, -1))[:, mask]
+
+    assert res.dtype == dtype
+    atol = 1e-5 if dtype == torch.float else 5e-2
+    assert torch.allclose(res.float(), res_gt, atol=atol, rtol=1e-2)
+
+
 @cuda_only
 @pytest.mark.parametrize("prob", [0.5, 1])
 @pytest.mark.parametrize("K", [32, 17])
@@ -324,6 +400,57 @@ def test_sparse_softmax_sputnik_backward(device):
     )
 
 
+@pytest.mark.parametrize("dtype", [torch.float, torch.bfloat16])
+def test_sparse_softmax_sputnik_inplace(dtype):
+    B, L, K = 8, 30, 16
+    prob = 0.5
+    mask = _create_random_sparsity(torch.ones(B, L, L, dtype=torch.bool), prob)
+    mask_csr = xformers.components.attention.core.SparseCS(mask, "cpu")
+    a = torch.randn(B, L, K, dtype=dtype, requires_grad=True)
+    b = torch.randn(B, K, L, dtype=dtype, requires_grad=True)
+
+    fn = xformers.components.attention.core._matmul_with_mask
+    softmax = xformers.components.attention.core._softmax
+
+    att = fn(a, b, mask_csr)
+    res = softmax(att, inplace=True)
+    # the values of `att` were overwritten
+    assert res.values.data_ptr() == att.values.data_ptr()
+    res.values.sum().backward()
+    grad_a, grad_b = a.grad, b.grad
+    a.grad, b.grad = None, None
+
+    res_gt = softmax(fn(a, b, mask_csr))
+    res_gt.values.sum().backward()
+
+    assert torch.allclose(res.values, res_gt.values)
+    assert torch.allclose(grad_a, a.grad)
+    assert torch.allclose(grad_b, b.grad)
+
+    dense = (a.float() @ b.float()).masked_fill(~mask, float("-inf"))
+    assert torch.allclose(
+        res.to_dense().float(),
+        torch.softmax(dense, -1),
+        atol=1e-6 if dtype == torch.float else 1e-2,
+    )
+
+    # The gradient of `res.values` is also the gradient of `other`, and is
+    # contiguous: the backward of the softmax must not overwrite it
+    a.grad, b.grad = None, None
+    res = softmax(fn(a, b, mask_csr), inplace=True)
+    other = torch.zeros_like(res.values, requires_grad=True)
+    grad = torch.randn_like(res.values)
+    grad_ref = grad.clone()
+    (res.values + other).backward(grad)
+    assert torch.equal(grad, grad_ref)
+    assert torch.equal(other.grad, grad_ref)
+    grad_a, grad_b = a.grad, b.grad
+    a.grad, b.grad = None, None
+    softmax(fn(a, b, mask_csr)).values.backward(grad_ref)
+    assert torch.allclose(grad_a, a.grad)
+    assert torch.allclose(grad_b, b.grad)
+
+
 @pytest.mark.parametrize("device", _devices)
 def test_spmm_sputnik(device):
     B, L, K = 8, 30, 32
@@ -349,6 +476,37 @@ def test_spmm_sputnik(device):
     assert torch.allclose(res, res_gt)
 
 
+@pytest.mark.parametrize("dtype", [torch.float, torch.half, torch.bfloat16])
+@pytest.mark.parametrize("N", [32, 17, 600])
+def test_spmm_sputnik_cpu_dtypes(N, dtype):
+    B, L, K = 4, 70, 50
+    mask = torch.rand(L, K) > 0.8
+    # skewed rows, to check the split of the work between threads
+    mask[3] = True
+    mask[10:30] = False
+    # with a batch, the number of nonzeros must be a multiple of 4
+    mask[-1] = False
+    mask[-1, : (-int(mask.sum())) % 4] = True
+
+    row_offsets = torch.zeros(L + 1, dtype=torch.int32)
+    row_offsets[1:] = mask.sum(-1).cumsum(0)
+    column_indices = mask.nonzero()[:, 1].to(torch.int32)
+    row_indices = torch.arange(L, dtype=torch.int32)
+    values = torch.randn(B, column_indices.shape[0], dtype=dtype)
+    b = torch.randn(B, K, N, dtype=dtype)
+
+    res = torch.ops.xformers.spmm_sputnik(
+        b, row_indices, values, row_offsets, column_indices, L
+    )
+    a = torch.zeros(B, L, K)
+    a[:, mask] = values.float()
+    res_gt = a @ b.float()
+
+    assert res.dtype == dtype
+    atol = 1e-5 if dtype == torch.float else 5e-2
+    assert torch.allclose(res.float(), res_gt, atol=atol, rtol=1e-2)
+
+
 @pytest.mark.parametrize("device", _devices)
 def test_spmm_sputnik_backward(device):
     B, M, L, K = 8, 16, 30, 32
@@ -467,3 +625,64 @@ def test_sparse_coo_broadcast(device):
     res_gt = a[None, :, :].expand(B, L, K)
 
     assert torch.allclose(res.to_dense(), res_gt)
+
+
+def _batched_sparsity(B, M, N, device):
+    # a different pattern per batch element, with any number of nonzeros
+    probs = torch.linspace(0.3, 0.9, B, device=device)[:, None, None]
+    mask = torch.rand(B, M, N, device=device) > probs
+    mask[1, 5:] = False
+    mask[-1, 3] = True
+    return mask
+
+
+def test_sputnik_batched():
+    from xformers.sparse._csr_ops import (
+        _sddmm_batched,
+        _SparseSoftmaxBatched,
+        _spmm_batched,
+    )
+    from xformers.sparse.utils import (
+        _dense3d_to_batched_sparse,
+        _get_batched_transpose_info,
+    )
+
+    B, M, N, K = 4, 30, 40, 24
+    mask = _batched_sparsity(B, M, N, "cpu")
+    values, row_offsets, column_indices, batch_offsets = _dense3d_to_batched_sparse(
+        mask.float(), "cpu"
+    )
+    assert batch_offsets[-1] == column_indices.shape[0]
+    transp_info = _get_batched_transpose_info(
+        M, N, row_offsets, column_indices, batch_offsets
+    )
+
+    a = torch.randn(B, M, K, requires_grad=True)
+    b = torch.randn(B, N, K, requires_grad=True)
+    v = torch.randn(B, N, K, requires_grad=True)
+
+    def sparse_fn(a, b, v):
+        att = _sddmm_batched.apply(
+            a, b, row_offsets, column_indices, batch_offsets, transp_info
+        )
+        att = _SparseSoftmaxBatched.apply(
+            M, N, att, row_offsets, column_indices, batch_offsets
+        )
+        return _spmm_batched.apply(
+            v, att, row_offsets, column_indices, batch_offsets, M, transp_info
+        )
+
+    def dense_fn(a, b, v):
+        att = (a @ b.transpose(-2, -1)).masked_fill(~mask, float("-inf"))
+        att = torch.softmax(att, dim=-1).nan_to_num(0.0)
+        return att @ v
+
+    out = sparse_fn(a, b, v)
+    out_gt = dense_fn(a, b, v)
+    assert torch.allclose(out, out_gt, atol=1e-5)
+
+    grad = torch.randn_like(out)
+    grads = torch.autograd.grad(out, [a, b, v], grad)
+    grads_gt = torch.autograd.grad(out_gt, [a, b, v], grad)
+    for g, g_gt in zip(grads, grads_gt):
+        assert torch.allclose(g, g_gt, atol=1e-5)
@@ -13,32 +13,33 @@ import xformers.ops as xops
 from .utils import assert_allclose
 
 cuda_only = pytest.mark.skipif(not torch.cuda.is_available(), reason="requires CUDA")
+DEVICES = [pytest.param("cuda", marks=cuda_only), "cpu"]
 
 
-@cuda_only
+@pytest.mark.parametrize("device", DEVICES)
 @pytest.mark.parametrize("with_scaling", [False, True])
 @pytest.mark.parametrize(
     "out_shape", [(48, 1, 257 * 1536), (48, 257, 1536), (192, 50, 1536)]
 )
-def test_scaled_index_add(out_shape, with_scaling: bool) -> None:
+def test_scaled_index_add(out_shape, with_scaling: bool, device: str) -> None:
     torch.manual_seed(0)
     alpha = 0.73
     dtype = torch.float16
     B_out, M, D = out_shape
     B_src = int(B_out * 0.6)
 
-    inp = torch.randn([B_out, M, D], device="cuda", dtype=dtype, requires_grad=True)
-    src = torch.randn([B_src, M, D], device="cuda", dtype=dtype, requires_grad=True)
+    inp = torch.randn([B_out, M, D], device=device, dtype=dtype, requires_grad=True)
+    src = torch.randn([B_src, M, D], device=device, dtype=dtype, requires_grad=True)
     TENSORS = {"inp": inp, "src": src}
     if with_scaling:
-        scaling = torch.randn([D], device="cuda", dtype=dtype, requires_grad=True)
+        scaling = torch.randn([D], device=device, dtype=dtype, requires_grad=True)
         TENSORS["scaling"] = scaling
     else:
         scaling = torch.Tensor()
 
     index_py = [i for i in range(src.shape[0])]
     random.Random(B_out).shuffle(index_py)
-    index = torch.tensor(index_py, dtype=torch.int64, device="cuda")
+    index = torch.tensor(index_py, dtype=torch.int64, device=device)
 
     if with_scaling:
         ref_src_scaled = scaling.float() * src.float()
@@ -73,16 +74,18 @@ def test_scaled_index_add(out_shape, with_scaling: bool) -> None:
         assert_allclose(v.grad, ref_grads[k], f"{k}.grad", atol=atol, rtol=rtol)  # type: ignore
 
 
-@cuda_only
+@pytest.mark.parametrize("device", DEVICES)
 @pytest.mark.parametrize("D", [1536])
-def test_index_select_cat(D) -> None:
+def test_index_select_cat(D, device: str) -> None:
     torch.manual_seed(0)
     dtype = torch.float16
     srcs = [
         torch.randn([48, 25 * D]),
         torch.randn([192, 50 * D]),
     ]
-    src = torch.cat([s.view([-1, D]) for s in srcs], dim=0).cuda().to(dtype)
+    src = torch.cat([s.view([-1, D]) for s in srcs], dim=0).to(
+        device=device, dtype=dtype
+    )
     src.requires_grad_(True)
 
     indices = []
@@ -93,7 +96,7 @@ def test_index_select_cat(D) -> None:
         random.Random(source_i.shape[0]).shuffle(index)
         indices.append(
             torch.tensor(
-                index[: int(0.6 * source_i.shape[0])], dtype=torch.int64, device="cuda"
+                index[: int(0.6 * source_i.shape[0])], dtype=torch.int64, device=device
             )
         )
         sources.append(
@@ -117,3 +120,50 @@ def test_index_select_cat(D) -> None:
     out.backward(gradient_out)
     assert src.grad is not None
     assert_allclose(src.grad, ref_grad, "src.grad")
+
+
+@pytest.mark.parametrize("device", DEVICES)
+@pytest.mark.parametrize("dtype", [torch.float16, torch.float32])
+@pytest.mark.parametrize("aligned", [False, True], ids=["unaligned", "aligned"])
+def test_grouped_index_select_scatter(aligned: bool, dtype, device: str) -> None:
+    torch.manual_seed(0)
+    # The CUDA kernel uses the widest access all the rows are aligned to: odd
+    # sizes and offsets fall back to element-wise copies
+    Ds = [64, 128, 32, 0, 256] if aligned else [3, 64, 5, 0, 129]
+    num_rows = [20, 17, 9, 6, 30]
+    # an empty index, a group of empty rows, and a non-contiguous source
+    num_selected = [7, 17, 0, 4, 11]
+    sources = [
+        torch.randn([S, D], device=device, dtype=dtype)
+        for S, D in zip(num_rows, Ds)
+    ]
+    pad = 8 if aligned else 1
+    sources[-1] = torch.randn(
+        [num_rows[-1], Ds[-1] + 2 * pad], device=device, dtype=dtype
+    )[:, pad:-pad]
+    assert not sources[-1].is_contiguous()
+    indices = [
+        torch.randperm(S, device=device)[:n] for S, n in zip(num_rows, num_selected)
+    ]
+
+    ref = torch.cat([s[i].flatten() for s, i in zip(sources, indices)], dim=0)
+    output = torch.empty_like(ref)
+    xops.indexing.GroupedIndexSelect.OPERATOR(
+        output=output, sources=sources, indices=indices
+    )
+    assert torch.equal(output, ref)
+
+    # Only the indexed rows of the outputs are written to
+    grads = [torch.randn_like(s) for s in sources]
+    grads[-1] = torch.randn(
+        [num_rows[-1], Ds[-1] + 2 * pad], device=device, dtype=dtype
+    )[:, pad:-pad]
+    expected = [g.clone() for g in grads]
+    chunks = ref.split([n * D for n, D in zip(num_selected, Ds)])
+    for e, i, chunk in zip(expected, indices, chunks):
+        e[i] = chunk.view([i.shape[0], e.shape[1]])
+    xops.indexing.GroupedIndexScatter.OPERATOR(
+        outputs=grads, source=ref, indices=indices
+    )
+    for i, (g, e) in enumerate(zip(grads, expected)):
+        assert torch.equal(g, e), f"outputs[{i}]"
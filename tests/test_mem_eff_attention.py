@@ -172,10 +172,10 @@ def _generate_op_device_dtype_biasT_B_Mq_Mkv_H_K_Kv(
                             is fmha.attn_bias.BlockDiagonalCausalFromBottomRightMask
                         ):
                             Mq, Mkv = min(Mkv, Mq), max(Mkv, Mq) + 2
-                        elif (
-                            bias_type
-                            is fmha.attn_bias.BlockDiagonalCausalWithOffsetPaddedKeysMask
-                        ):
+                        elif bias_type in [
+                            fmha.attn_bias.BlockDiagonalCausalWithOffsetPaddedKeysMask,
+                            fmha.attn_bias.LocalAttentionFromBottomRightMask,
+                        ]:
                             Mq, Mkv = min(Mkv, Mq), max(Mkv, Mq)
                         shape = (B, Mq, Mkv, H, K, Kv)
                     combination.append((op, device, dtype, bias_type, *shape))
@@ -444,6 +444,33 @@ def create_attn_bias(
         if requires_grad:
             attn_bias.requires_grad_(True)
         return fmha.attn_bias.LowerTriangularMaskWithTensorBias(attn_bias)
+    if bias_type is fmha.attn_bias.AlibiBias:
+        assert fmt == "BMHK"
+        # On top of one of the masks supported by all the ALiBi kernels
+        mask_type = r.choice(
+            [
+                type(None),
+                fmha.attn_bias.LowerTriangularMask,
+                fmha.attn_bias.BlockDiagonalCausalMask,
+            ]
+        )
+        mask = create_attn_bias(
+            mask_type,
+            batch_size=batch_size,
+            num_heads=num_heads,
+            q_len=q_len,
+            kv_len=kv_len,
+            device=device,
+            dtype=dtype,
+            requires_grad=False,
+            fmt=fmt,
+            op=op,
+        )
+        return fmha.attn_bias.AlibiBias.from_num_heads(num_heads, mask=mask)
+    if bias_type is fmha.attn_bias.LocalAttentionFromBottomRightMask:
+        return fmha.attn_bias.LocalAttentionFromBottomRightMask(
+            window_left=r.randint(0, kv_len), window_right=r.randint(0, kv_len)
+        )
     if bias_type in [
         fmha.attn_bias.BlockDiagonalMask,
         fmha.attn_bias.BlockDiagonalCausalMask,
@@ -539,7 +566,9 @@ def create_tensors(
             op=op,
         )
         if isinstance(
-            attn_bias,
+            attn_bias.mask
+            if isinstance(attn_bias, fmha.attn_bias.AlibiBias)
+            else attn_bias,
             (
                 fmha.attn_bias.BlockDiagonalMask,
                 fmha.attn_bias.BlockDiagonalCausalWithOffsetPaddedKeysMask,
@@ -1346,11 +1375,11 @@ def test_grad_checkpointing(
     x.mean().backward()
 
 
-ALL_FW_OPS_NO_SMALLK = [op for op in ALL_FW_OPS if op is not fmha.small_k.FwOp]
+ALL_FW_OPS_NO_CPU = [op for op in ALL_FW_OPS if "cpu" not in op.SUPPORTED_DEVICES]
 
 
 @pytest.mark.parametrize(
-    "op", ALL_FW_OPS_NO_SMALLK, ids=[op.NAME for op in ALL_FW_OPS_NO_SMALLK]
+    "op", ALL_FW_OPS_NO_CPU, ids=[op.NAME for op in ALL_FW_OPS_NO_CPU]
 )
 def test_unsupported_cpu(op: Type[fmha.AttentionFwOpBase]):
     q = torch.empty([1, 1, 1, 32])
@@ -1360,7 +1389,7 @@ def test_unsupported_cpu(op: Type[fmha.AttentionFwOpBase]):
 
 @cuda_only
 @pytest.mark.parametrize(
-    "op", ALL_FW_OPS_NO_SMALLK, ids=[op.NAME for op in ALL_FW_OPS_NO_SMALLK]
+    "op", ALL_FW_OPS_NO_CPU, ids=[op.NAME for op in ALL_FW_OPS_NO_CPU]
 )
 def test_unsupported_stride_lastdim(op: Type[fmha.AttentionFwOpBase]):
     q = torch.empty([1, 1, 32, 4], device="cuda", dtype=torch.float16).permute(
@@ -1377,7 +1406,7 @@ def test_unsupported_stride_lastdim(op: Type[fmha.AttentionFwOpBase]):
 
 @cuda_only
 @pytest.mark.parametrize(
-    "op", ALL_FW_OPS_NO_SMALLK, ids=[op.NAME for op in ALL_FW_OPS_NO_SMALLK]
+    "op", ALL_FW_OPS_NO_CPU, ids=[op.NAME for op in ALL_FW_OPS_NO_CPU]
 )
 def test_unsupported_stride_alignment(op: Type[fmha.AttentionFwOpBase]):
     q = torch.empty([1, 2, 1, 33], device="cuda", dtype=torch.float16)[:, :, :, :32]
@@ -1407,6 +1436,62 @@ def test_unsupported_dropout_combine_flash_cutlass() -> None:
         out.backward(out)
 
 
+@pytest.mark.parametrize("positions", [False, True], ids=["", "positions"])
+def test_cpu_fused_rotary_embedding(positions: bool) -> None:
+    torch.manual_seed(0)
+    B, M, H, K = 2, 37, 3, 16
+    q, k, v, grad_out = (torch.randn([B, M, H, K]) for _ in range(4))
+    inv_freq = 100.0 ** -(torch.arange(K // 2).float() / (K // 2))
+    angles = torch.arange(M + 5).float()[:, None] * inv_freq
+    cos, sin = angles.cos(), angles.sin()
+    pos = torch.randperm(M + 5)[:M] if positions else None
+    rotary = dict(rotary_cos=cos, rotary_sin=sin, rotary_positions=pos)
+
+    # Q and K are rotated in the kernels, as they are loaded
+    fw = torch.ops.xformers.efficient_attention_forward_cutlass
+    bw = torch.ops.xformers.efficient_attention_backward_cutlass
+    out, lse, _, _ = fw(
+        q, k, v, None, None, None, None, 0.0, True, 1, None, None, **rotary
+    )
+    grad_q, grad_k, grad_v, _ = bw(
+        grad_out,
+        q,
+        k,
+        v,
+        None,
+        None,
+        None,
+        -1,
+        -1,
+        lse,
+        out,
+        0.0,
+        0,
+        0,
+        1,
+        None,
+        -1,
+        **rotary,
+    )
+
+    def rotate(x: torch.Tensor) -> torch.Tensor:
+        idx = torch.arange(M) if pos is None else pos
+        c = torch.cat([cos, cos], dim=-1)[idx][:, None]
+        s = torch.cat([sin, sin], dim=-1)[idx][:, None]
+        x1, x2 = x.chunk(2, dim=-1)
+        return x * c + torch.cat([-x2, x1], dim=-1) * s
+
+    q_ref, k_ref, v_ref = (t.clone().requires_grad_(True) for t in (q, k, v))
+    ref = ref_attention_bmhk(
+        rotate(q_ref), rotate(k_ref), v_ref, fmha.attn_bias.LowerTriangularMask()
+    )
+    ref.backward(grad_out)
+    assert_allclose(out, ref, "out", atol=2e-5, rtol=1e-4)
+    assert_allclose(grad_q, q_ref.grad, "grad_q", atol=2e-5, rtol=1e-4)
+    assert_allclose(grad_k, k_ref.grad, "grad_k", atol=2e-5, rtol=1e-4)
+    assert_allclose(grad_v, v_ref.grad, "grad_v", atol=2e-5, rtol=1e-4)
+
+
 def test_attn_bias_causal() -> None:
     m = -math.inf
     causal_mask = torch.tensor([[0, m], [0, 0], [0, 0]])
@@ -1432,6 +1517,30 @@ def test_attn_bias_torch_tensor() -> None:
     )
 
 
+def test_attn_bias_alibi() -> None:
+    attn_bias = fmha.attn_bias.AlibiBias.from_num_heads(8)
+    assert_allclose(attn_bias.slopes, 2.0 ** -torch.arange(1, 9).float(), "slopes")
+
+    m = -math.inf
+    slopes = torch.tensor([0.5, 1.0])
+    attn_bias = fmha.attn_bias.AlibiBias(
+        slopes, mask=fmha.attn_bias.LowerTriangularMask()
+    )
+    expected = torch.tensor([[0, m, m], [-1, 0, m]])
+    assert_allclose(
+        attn_bias.materialize((2, 2, 3)),
+        torch.stack([expected * 0.5, expected]),
+        "alibi+causal",
+    )
+
+    # Positions restart in every block
+    attn_bias = fmha.attn_bias.AlibiBias(
+        slopes[:1], mask=fmha.BlockDiagonalMask.from_seqlens([2, 1], [1, 2])
+    )
+    expected = torch.tensor([[0, m, m], [-0.5, m, m], [m, 0, 0.5]])
+    assert_allclose(attn_bias.materialize((1, 3, 3))[0], expected, "alibi+blockdiag")
+
+
 def test_attn_bias_blockdiag() -> None:
     queries = [
         torch.randn([1, 3, 1, 8]),
@@ -1632,28 +1741,36 @@ def test_attn_bias_padded() -> None:
     )
 
 
-@sm70_or_better_only
 @pytest.mark.parametrize("op", [fmha.decoder.FwOp])
+@pytest.mark.parametrize("device", _devices)
 @pytest.mark.parametrize("multiquery", [True, False], ids=lambda x: "mq" if x else "")
 @pytest.mark.parametrize("n_heads", [1, 16, 32])
 @pytest.mark.parametrize("padding", [32, 4096])
 @pytest.mark.parametrize("bsz", [1, 8])
 @pytest.mark.parametrize("dtype", ["f16", "bf16", "f32"])
 def test_decoder(
-    op, multiquery: bool, n_heads: int, padding: int, bsz: int, dtype: str
+    op,
+    device: str,
+    multiquery: bool,
+    n_heads: int,
+    padding: int,
+    bsz: int,
+    dtype: str,
 ) -> None:
+    if device == "cuda" and compute_capability < (7, 0):
+        pytest.skip("requires sm70+")
     dtype_ = {"f16": torch.float16, "bf16": torch.bfloat16, "f32": torch.float32}[dtype]
     torch.manual_seed(1)
     d = 128
     k_shape = (1, bsz * padding, n_heads, d)
     # TODO: support 2 kv heads etc.
-    k = torch.randn(k_shape, dtype=dtype_).cuda()
+    k = torch.randn(k_shape, dtype=dtype_).to(device)
     k_seqlen = torch.randint(1, padding + 1, (bsz,)).tolist()
-    v = torch.randn(k_shape, dtype=dtype_).cuda()
-    q = torch.randn((1, bsz, n_heads, d), dtype=dtype_).cuda()
+    v = torch.randn(k_shape, dtype=dtype_).to(device)
+    q = torch.randn((1, bsz, n_heads, d), dtype=dtype_).to(device)
     causal_diagonal = torch.tensor(  # TODO: make unnecessary
         [i - 1 for i in k_seqlen], dtype=torch.int32
-    ).cuda()
+    ).to(device)
 
     if multiquery:
         k = k[:, :, :1].expand(k_shape)
@@ -1673,17 +1790,139 @@ def test_decoder(
         q, k, v, attn_bias, op=fmha.decoder.FwOp
     )
 
-    if dtype == "bf16" and compute_capability < (8, 0):
+    if device == "cpu":
+        ref_output = ref_attention_bmhk(q, k, v, attn_bias).to(dtype_)
+    elif dtype == "bf16" and compute_capability < (8, 0):
         # cutlass not supported. This test only checks there is a result.
         assert not decoder_output.isnan().any()
         return
+    else:
+        ref_output = fmha.memory_efficient_attention_forward(
+            q, k, v, attn_bias, op=fmha.cutlass.FwOp
+        )
+    assert_allclose(
+        decoder_output,
+        ref_output,
+        atol=fmha.cutlass.FwOp.ERROR_ATOL[dtype_] * 4,
+        rtol=fmha.cutlass.FwOp.ERROR_RTOL[dtype_],
+    )
+
+
+@pytest.mark.parametrize("device", _devices)
+@pytest.mark.parametrize("split_k", [1, 3, 7, 64])
+@pytest.mark.parametrize("multiquery", [True, False], ids=lambda x: "mq" if x else "")
+def test_decoder_split_k(device: str, split_k: int, multiquery: bool) -> None:
+    op = fmha.decoder.FwOp
+    if not op.is_available():
+        pytest.skip("decoder operator not available")
+    if device == "cuda" and compute_capability < (7, 0):
+        pytest.skip("requires sm70+")
+    torch.manual_seed(1)
+    bsz, n_heads, d, padding = 3, 4, 128, 20000
+    k_seqlen = [padding, 1, 9000]
+    k_shape = (bsz, padding, n_heads, d)
+    k = torch.randn(k_shape, device=device)
+    v = torch.randn(k_shape, device=device)
+    if multiquery:
+        k = k[:, :, :1]
+        v = v[:, :, :1]
+    q = torch.randn((bsz, 1, n_heads, d), device=device)
+    seq_positions = torch.tensor(k_seqlen, dtype=torch.int32, device=device)
+    scale = 1.0 / d**0.5
+
+    def run():
+        return op.OPERATOR(
+            query=q,
+            key=k,
+            value=v,
+            seq_positions=seq_positions,
+            scale=scale,
+            split_k=split_k,
+        )
+
+    if device == "cuda" and split_k == 1:
+        # A single CUDA block can't hold the scores of that many keys
+        with pytest.raises(RuntimeError):
+            run()
+        return
+    out = run()
+    for b, seqlen in enumerate(k_seqlen):
+        ref = ref_attention_bmhk(
+            q[b : b + 1],
+            k[b : b + 1, :seqlen].expand(1, seqlen, n_heads, d),
+            v[b : b + 1, :seqlen].expand(1, seqlen, n_heads, d),
+            None,
+            scale=scale,
+        )
+        assert_allclose(
+            out[b : b + 1],
+            ref,
+            atol=fmha.cutlass.FwOp.ERROR_ATOL[torch.float],
+            rtol=fmha.cutlass.FwOp.ERROR_RTOL[torch.float],
+        )
+
+
+@pytest.mark.parametrize("multiquery", [True, False], ids=lambda x: "mq" if x else "")
+@pytest.mark.parametrize("page_size", [16, 256])
+@pytest.mark.parametrize("dtype", ["f16", "bf16", "f32"])
+def test_decoder_paged(multiquery: bool, page_size: int, dtype: str) -> None:
+    op = fmha.decoder.FwOp
+    if not op.is_available():
+        pytest.skip("decoder operator not available")
+    dtype_ = {"f16": torch.float16, "bf16": torch.bfloat16, "f32": torch.float32}[dtype]
+    torch.manual_seed(1)
+    bsz, n_heads, d, max_pages = 4, 8, 64, 8
+    padding = max_pages * page_size
+    k_seqlen = [padding, 1, page_size, page_size * 3 + 5]
+    k_shape = (1, bsz * padding, n_heads, d)
+    k = torch.randn(k_shape, dtype=dtype_)
+    v = torch.randn(k_shape, dtype=dtype_)
+    q = torch.randn((1, bsz, n_heads, d), dtype=dtype_)
+    if multiquery:
+        k = k[:, :, :1].expand(k_shape)
+        v = v[:, :, :1].expand(k_shape)
 
-    cutlass_output = fmha.memory_efficient_attention_forward(
-        q, k, v, attn_bias, op=fmha.cutlass.FwOp
+    # Scatter the pages of the contiguous cache in a larger pool
+    num_pages = bsz * max_pages + 5
+    block_tables = torch.randperm(num_pages)[: bsz * max_pages].view(bsz, max_pages)
+    block_tables = block_tables.to(torch.int32)
+    pool_shape = (num_pages, page_size, n_heads, d)
+    k_pool = torch.randn(pool_shape, dtype=dtype_)
+    v_pool = torch.randn(pool_shape, dtype=dtype_)
+    k_pool[block_tables.flatten().long()] = k.reshape(-1, page_size, n_heads, d)
+    v_pool[block_tables.flatten().long()] = v.reshape(-1, page_size, n_heads, d)
+    k_pool = k_pool.view(1, num_pages * page_size, n_heads, d)
+    v_pool = v_pool.view(1, num_pages * page_size, n_heads, d)
+    if multiquery:
+        k_pool = k_pool[:, :, :1].expand(k_pool.shape)
+        v_pool = v_pool[:, :, :1].expand(v_pool.shape)
+
+    attn_bias = fmha.attn_bias.BlockDiagonalCausalWithOffsetPaddedKeysMask.from_seqlens(
+        q_seqlen=[1] * bsz,
+        kv_seqlen=k_seqlen,
+        kv_padding=padding,
+    )
+    paged_bias = (
+        fmha.attn_bias.PagedBlockDiagonalCausalWithOffsetPaddedKeysMask.from_seqlens(
+            q_seqlen=[1] * bsz,
+            kv_seqlen=k_seqlen,
+            block_tables=block_tables,
+            page_size=page_size,
+        )
     )
+    assert op.supports(fmha.Inputs(q, k_pool, v_pool, attn_bias=paged_bias))
+
+    out = fmha.memory_efficient_attention_forward(q, k, v, attn_bias, op=op)
+    paged_out = fmha.memory_efficient_attention_forward(
+        q, k_pool, v_pool, paged_bias, op=op
+    )
+    # Same keys in the same order: only the addressing differs
+    assert_allclose(paged_out, out, atol=0, rtol=0)
+
+    ref_output = ref_attention_bmhk(q, k_pool, v_pool, paged_bias).to(dtype_)
     assert_allclose(
-        decoder_output,
-        cutlass_output,
+        paged_out,
+        ref_output,
         atol=fmha.cutlass.FwOp.ERROR_ATOL[dtype_] * 4,
         rtol=fmha.cutlass.FwOp.ERROR_RTOL[dtype_],
     )
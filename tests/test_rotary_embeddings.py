@@ -11,6 +11,7 @@ from xformers.components.positional_embedding.rotary import (
     apply_rotary_pos_emb,
     rotate_half,
 )
+from xformers.ops import rotary_embedding, rotary_embedding_
 
 DEVICES = (
     [torch.device("cpu")]
@@ -89,3 +90,60 @@ def test_rotary_embeddings(device, dtype):
 
     # Test that different sequence lengths is ok
     _, _ = rotary(q[:, :, :-16, :], k)
+
+
+@pytest.mark.parametrize("device", DEVICES)
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16, torch.float32])
+def test_rotary_embedding_op(device, dtype):
+    torch.manual_seed(0)
+    num_positions = 2 * SEQ
+    freqs = torch.outer(
+        torch.arange(num_positions, device=device, dtype=torch.float32),
+        RotaryEmbedding(EMB).inv_freq.to(device),
+    )
+    cos, sin = freqs.cos(), freqs.sin()
+    positions = torch.randint(0, num_positions, (SEQ,), device=device)
+
+    def ref(x):
+        cos_ref = torch.cat((cos, cos), dim=-1)[positions][None, None]
+        sin_ref = torch.cat((sin, sin), dim=-1)[positions][None, None]
+        return apply_rotary_pos_emb(x.float(), cos_ref, sin_ref)
+
+    atol = 1e-5 if dtype == torch.float32 else 2e-2
+    # BMHK inputs, rotated through a [B, H, M, K] view
+    x = torch.randn((BATCH, SEQ, HEADS, EMB), device=device, dtype=dtype)
+    x_bhmk = x.transpose(1, 2)
+    x_bhmk.requires_grad_(True)
+    out = rotary_embedding(x_bhmk, cos, sin, positions)
+    assert out.dtype == dtype
+    assert torch.allclose(out.float(), ref(x_bhmk.detach()), atol=atol)
+
+    grad = torch.randn_like(out)
+    out.backward(grad)
+    x_ref = x_bhmk.detach().float().requires_grad_(True)
+    ref(x_ref).backward(grad.float())
+    assert torch.allclose(x_bhmk.grad.float(), x_ref.grad, atol=atol)
+
+    # In-place, without positions
+    expected = apply_rotary_pos_emb(
+        x.transpose(1, 2).float(),
+        torch.cat((cos, cos), dim=-1)[None, None],
+        torch.cat((sin, sin), dim=-1)[None, None],
+    )
+    rotary_embedding_(x.transpose(1, 2), cos, sin)
+    assert torch.allclose(x.transpose(1, 2).float(), expected, atol=atol)
+
+
+@pytest.mark.parametrize("device", DEVICES)
+@pytest.mark.parametrize("bad_position", [-1, 2 * SEQ])
+def test_rotary_embedding_op_out_of_bounds(device, bad_position):
+    # Out-of-range positions would index `cos` and `sin` out of bounds
+    cos = torch.ones((2 * SEQ, EMB // 2), device=device)
+    sin = torch.zeros_like(cos)
+    positions = torch.arange(SEQ, device=device)
+    positions[SEQ // 2] = bad_position
+    x = torch.randn((BATCH, HEADS, SEQ, EMB), device=device)
+    with pytest.raises(RuntimeError, match="positions should be in"):
+        rotary_embedding_(x, cos, sin, positions)
+    with pytest.raises(RuntimeError, match="positions should be in"):
+        rotary_embedding(x, cos, sin, positions)
@@ -303,3 +303,155 @@ def test_module_buffer(tensor_type, device):
 
     module.load_state_dict({"a_sparse": b_sparse})
     assert torch.equal(module.a_sparse, b_sparse.to(device))
+
+
+@pytest.mark.parametrize("device", _devices)
+def test_csr_plan_cache(device):
+    from xformers.sparse.utils import (
+        _clear_csr_plan_cache,
+        _diffsort,
+        _get_transpose_info,
+    )
+
+    _seed()
+    _clear_csr_plan_cache()
+    a = _create_tensor(
+        SparseCSRTensor, device, dtype=torch.float32, shape=(2, 64, 48), sparsity=0.8
+    )
+    # same sparsity pattern, other values: the plan is reused
+    b = SparseCSRTensor.from_dense(a.to_dense() * 2)
+    assert b._csr_row_indices is a._csr_row_indices
+    for t_a, t_b in zip(a._csr_transp_info, b._csr_transp_info):
+        assert t_a is t_b
+
+    _, m, n = a.shape
+    row_indices = _diffsort(a._csr_row_offsets).to(a._csr_row_offsets.dtype)
+    assert torch.equal(a._csr_row_indices, row_indices)
+    transp_info = _get_transpose_info(
+        m, n, row_indices, a._csr_row_offsets, a._csr_column_indices
+    )
+    for t, t_ref in zip(a._csr_transp_info, transp_info):
+        assert torch.equal(t, t_ref)
+
+    # the plan of the transposed pattern transposes back
+    a_t = a.transpose(-2, -1)
+    assert torch.equal(a_t.to_dense(), a.to_dense().transpose(-2, -1))
+    assert torch.equal(a_t.transpose(-2, -1).to_dense(), a.to_dense())
+
+    # another pattern with as many nonzeros gets its own plan
+    c = SparseCSRTensor.from_dense(a.to_dense().flip(-1))
+    assert c._csr_row_indices is not a._csr_row_indices
+    assert torch.equal(c.transpose(-2, -1).to_dense(), c.to_dense().transpose(-2, -1))
+
+
+def test_csr_plan_cache_bounded():
+    from xformers.sparse.utils import _CSRPlanCache
+
+    x = torch.zeros(5, dtype=torch.int32)
+    cache = _CSRPlanCache(max_bytes=90)
+    cache.put("a", (x, (x, x)))
+    cache.put("b", (x,))
+    assert cache.get("a") is not None
+    # the least recently used plan is evicted to stay within the bound
+    cache.put("c", (x,))
+    assert cache.get("b") is None
+    assert cache.get("a") is not None and cache.get("c") is not None
+    assert cache.nbytes == 4 * x.numel() * x.element_size()
+    # plans larger than the bound are not kept
+    cache.put("d", (torch.zeros(100, dtype=torch.int32),))
+    assert len(cache) == 0 and cache.nbytes == 0
+
+
+@pytest.mark.parametrize("dtype", [torch.float32, torch.bfloat16])
+def test_blocksparse_cpu_ops(dtype):
+    from xformers.sparse import _bsr_ops
+    from xformers.sparse.blocksparse_tensor import _sddmm, _softmax, _spmm
+
+    _seed()
+    N, C, block_size, K = 2, 3, 16, 40
+    layout = torch.randint(2, (C, 4, 5))
+    layout[1, 2] = 0  # empty block row
+    layout[:, 0, 0] = 1
+    bsr_info = _bsr_ops._get_bsr_info(layout)
+    H, W = 4 * block_size, 5 * block_size
+    tol = 1e-4 if dtype == torch.float32 else 5e-2
+
+    a = (torch.randn(N, C, H, K) * K**-0.5).to(dtype).requires_grad_(True)
+    b = torch.randn(N, C, W, K, dtype=dtype, requires_grad=True)
+    v = torch.randn(N, C, W, K, dtype=dtype, requires_grad=True)
+    grad = torch.randn(N, C, H, K, dtype=dtype)
+
+    def _attention(a, b, v, sddmm, softmax, spmm):
+        att = sddmm(a, b)
+        att = softmax(att)
+        out = spmm(att, v)
+        return out, torch.autograd.grad(out, [a, b, v], grad.to(out.dtype))
+
+    out, grads = _attention(
+        a,
+        b,
+        v,
+        lambda a, b: _bsr_ops._bsr_sddmm.apply(a, b, bsr_info, block_size),
+        lambda x: _bsr_ops._bsr_softmax.apply(x, bsr_info),
+        lambda x, v: _bsr_ops._bsr_spmm.apply(x, v, bsr_info),
+    )
+    out_ref, grads_ref = _attention(
+        *[t.detach().float().requires_grad_(True) for t in (a, b, v)],
+        lambda a, b: _sddmm(a, b, layout),
+        lambda x: _softmax(layout, x),
+        lambda x, v: _spmm(v, layout, x),
+    )
+    assert out.dtype == dtype
+    assert torch.allclose(out.float(), out_ref, atol=tol, rtol=tol)
+    for g, g_ref in zip(grads, grads_ref):
+        assert torch.allclose(g.float(), g_ref, atol=tol, rtol=tol)
+
+
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("config_name", ["BigBird", "BSLongformer"])
+def test_blocksparse_attention_cpu(config_name, causal):
+    from xformers.components.attention import sparsity_config
+    from xformers.components.attention.blocksparse import BlockSparseAttention
+
+    _seed()
+    B, H, block_size, K = 2, 3, 16, 40
+    seq_len = 8 * block_size
+    config = getattr(sparsity_config, f"{config_name}SparsityConfig")(
+        num_heads=H, block_size=block_size, different_layout_per_head=True
+    )
+    layout = config.make_layout(seq_len)
+    attention = BlockSparseAttention(
+        layout=layout, block_size=block_size, num_heads=H, causal=causal
+    )
+
+    q, k, v = [torch.randn(B, H, seq_len, K, requires_grad=True) for _ in range(3)]
+    grad = torch.randn(B, H, seq_len, K)
+    out = attention(q, k, v)
+    grads = torch.autograd.grad(out, [q, k, v], grad)
+
+    mask = layout.bool()
+    mask = mask.repeat_interleave(block_size, 1).repeat_interleave(block_size, 2)
+    if causal:
+        mask = mask.tril()
+    att = (q @ k.transpose(-2, -1)) * K**-0.5
+    att = torch.softmax(att.masked_fill(~mask, float("-inf")), dim=-1)
+    out_ref = att @ v
+    grads_ref = torch.autograd.grad(out_ref, [q, k, v], grad)
+
+    assert torch.allclose(out, out_ref, atol=1e-5, rtol=1e-5)
+    for g, g_ref in zip(grads, grads_ref):
+        assert torch.allclose(g, g_ref, atol=1e-4, rtol=1e-4)
+
+
+def test_blocksparse_attention_without_triton(monkeypatch):
+    from xformers.components.attention import blocksparse
+
+    # Non-CPU inputs need the Triton kernels, which may not be importable
+    monkeypatch.setattr(blocksparse, "_is_triton_blocksparse_available", False)
+    block_size = 16
+    attention = blocksparse.BlockSparseAttention(
+        layout=torch.ones(1, 4, 4, dtype=torch.long), block_size=block_size
+    )
+    q = torch.empty(1, 1, 4 * block_size, 8, device="meta")
+    with pytest.raises(AssertionError, match="requires Triton"):
+        attention(q, q, q)
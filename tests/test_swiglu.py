@@ -119,6 +119,7 @@ def create_module_cached(**kwargs) -> xsw.SwiGLU:
 @pytest.mark.parametrize("device", _devices)
 @pytest.mark.parametrize("bias", [False, True], ids=["nobias", "bias"])
 @pytest.mark.parametrize("pack_weights", [False, True], ids=["regular", "packed"])
+@pytest.mark.parametrize("recompute", [False, True], ids=["", "recompute"])
 @pytest.mark.parametrize(
     "shape",
     _test_shapes,
@@ -132,6 +133,7 @@ def test_forward_backward(
     autocast: bool,
     pack_weights: bool,
     bias: bool,
+    recompute: bool,
 ):
     torch.manual_seed(shape[0] * shape[1] * shape[2])
     FORWARD_ATOL = {torch.float: 2e-6, torch.half: 1e-2, torch.bfloat16: 1e-2}
@@ -189,7 +191,7 @@ def test_forward_backward(
     )
     with cm:
         ref = module(x)
-        out = xsw.swiglu(x, *module._ordered_params(), op=op)
+        out = xsw.swiglu(x, *module._ordered_params(), op=op, recompute=recompute)
 
     if ref_f32 is None:
         ref_f32 = ref
@@ -230,3 +232,27 @@ def test_forward_backward(
         )
         # Ensure `gout >> atol`, so that the test is meaningful
         assert gout.norm(2) > BACKWARD_ATOL[dtype] / BACKWARD_RTOL[dtype]
+
+
+_cpu_dtypes = [torch.float, torch.bfloat16]
+
+
+@pytest.mark.parametrize("op", _ops, ids=[x.NAME for x in _ops])
+@pytest.mark.parametrize("dtype", _cpu_dtypes, ids=[str(x) for x in _cpu_dtypes])
+@pytest.mark.parametrize("bias", [False, True], ids=["nobias", "bias"])
+@pytest.mark.parametrize("pack_weights", [False, True], ids=["regular", "packed"])
+@pytest.mark.parametrize("shape", [(130, 64, 96), (17, 40, 300)], ids=str)
+@pytest.mark.parametrize("recompute", [False, True], ids=["", "recompute"])
+def test_forward_backward_cpu(
+    shape, op, dtype, pack_weights: bool, bias: bool, recompute: bool
+):
+    test_forward_backward(
+        shape,
+        "cpu",
+        op,
+        dtype,
+        autocast=False,
+        pack_weights=pack_weights,
+        bias=bias,
+        recompute=recompute,
+    )
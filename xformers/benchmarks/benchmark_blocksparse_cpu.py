@@ -0,0 +1,82 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+
+import itertools
+
+import torch
+from torch.utils import benchmark
+
+from xformers.benchmarks.utils import benchmark_main_helper
+from xformers.components.attention.blocksparse import BlockSparseAttention
+from xformers.ops import masked_matmul
+from xformers.sparse import BlockSparseTensor
+
+min_run_time = 0.5
+device = torch.device("cpu")
+
+# Format: [B, H, M, K]
+SHAPES = [(2, 8, 1024, 64), (1, 8, 4096, 64)]
+BLOCK_SIZES = [32, 64]
+SPARSITIES = [0.5, 0.9]
+
+CASES = [
+    dict(shape=shape, block_size=block_size, sparsity=sparsity)
+    for shape, block_size, sparsity in itertools.product(
+        SHAPES, BLOCK_SIZES, SPARSITIES
+    )
+]
+
+
+def benchmark_blocksparse_attention(shape, block_size, sparsity):
+    """
+    Attention with a `BlockSparseTensor` mask (`bsr_*` operators) and with the
+    fused `BlockSparseAttention` kernel against dense attention, forward and
+    backward
+    """
+    B, H, M, K = shape
+    torch.manual_seed(0)
+    num_blocks = M // block_size
+    layout = torch.rand(H, num_blocks, num_blocks) > sparsity
+    layout |= torch.eye(num_blocks, dtype=torch.bool)
+    values = torch.zeros(B, int(layout.sum()), block_size, block_size)
+    mask = BlockSparseTensor(values, layout.long())
+    fused_attention = BlockSparseAttention(layout.long(), block_size=block_size)
+
+    q, k, v = [
+        torch.randn(B, H, M, K, device=device, requires_grad=True) for _ in range(3)
+    ]
+    grad = torch.randn(B, H, M, K, device=device)
+    sub_label = f"B={B}, H={H}, M={M}, K={K}, bs={block_size}, sparsity={sparsity}"
+
+    def blocksparse():
+        att = masked_matmul(q, k.transpose(-2, -1), mask)
+        att = torch.softmax(att, dim=-1)
+        (att @ v).backward(grad)
+
+    def fused():
+        fused_attention(q, k, v).backward(grad)
+
+    def dense():
+        att = q @ k.transpose(-2, -1)
+        att = torch.softmax(att, dim=-1)
+        (att @ v).backward(grad)
+
+    for description, fn in [
+        ("blocksparse", blocksparse),
+        ("fused", fused),
+        ("dense", dense),
+    ]:
+        fn()
+        yield benchmark.Timer(
+            stmt="fn()",
+            globals={"fn": fn},
+            label="blocksparse_attention_fwbw",
+            description=description,
+            sub_label=sub_label,
+        )
+
+
+benchmark_main_helper(benchmark_blocksparse_attention, CASES, min_run_time=min_run_time)
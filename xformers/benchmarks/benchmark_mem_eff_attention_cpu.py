@@ -0,0 +1,229 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+"""
+Benchmarks the CPU kernels of `memory_efficient_attention`.
+
+To compare against another build of the kernels (for instance the
+scalar `small_k` loop), run this script once with `--label <name>` on
+that build, then with `--compare <name>` on the current one.
+"""
+
+import itertools
+import os
+from functools import partial
+
+import torch
+from torch.utils import benchmark
+from xformers.benchmarks.utils import benchmark_main_helper
+
+import xformers.ops
+import xformers.ops.fmha as fmha
+
+min_run_time = 0.5
+device = torch.device("cpu")
+
+# Powers of two up to the number of cores, to check how the kernels scale
+NUM_THREADS = sorted(
+    {1 << i for i in range((os.cpu_count() or 1).bit_length())}
+    | {os.cpu_count() or 1}
+)
+SHAPES = [
+    # B, M, H, K
+    *sorted(itertools.product([1, 8], [128, 512, 2048], [1, 8], [16, 32])),
+    (1, 4096, 1, 32),
+    (32, 197, 4, 8),
+]
+
+OPS = [
+    (fmha.small_k.FwOp, fmha.small_k.BwOp),
+]
+
+
+def product_dict(**kwargs):
+    keys = kwargs.keys()
+    vals = kwargs.values()
+    for instance in itertools.product(*vals):
+        yield dict(zip(keys, instance))
+
+
+CASES = list(
+    product_dict(
+        shape=SHAPES,
+        num_threads=NUM_THREADS,
+        dtype=[torch.float, torch.half, torch.bfloat16],
+    )
+)
+
+
+def ref_attention(q, k, v):
+    q = q.transpose(1, 2) * (1.0 / q.shape[-1] ** 0.5)
+    attn = (q @ k.transpose(1, 2).transpose(-2, -1)).softmax(-1)
+    return (attn @ v.transpose(1, 2)).transpose(1, 2)
+
+
+def create_tensors(shape, dtype, requires_grad=False):
+    B, M, H, K = shape
+    qkv = torch.rand(
+        [B, M, 3, H, K], device=device, dtype=dtype, requires_grad=requires_grad
+    )
+    q, k, v = xformers.ops.unbind(qkv, 2)
+    return qkv, q, k, v
+
+
+def _sub_label(shape, dtype) -> str:
+    B, M, H, K = shape
+    dtype_str = {
+        torch.bfloat16: "b16",
+        torch.half: "f16",
+        torch.float: "f32",
+    }[dtype]
+    return f"{dtype_str} {B}-{M}-{H}-{K}"
+
+
+def mem_eff_attention_cpu_fw(shape, num_threads: int, dtype):
+    _, q, k, v = create_tensors(shape, dtype)
+    inp = fmha.Inputs(query=q, key=k, value=v)
+    sub_label = _sub_label(shape, dtype)
+
+    has_run = False
+    for fw_op, bw_op in OPS:
+        if not fw_op.supports(inp):
+            continue
+        yield benchmark.Timer(
+            stmt="fn(q, k, v)",
+            globals={
+                "q": q,
+                "k": k,
+                "v": v,
+                "fn": partial(
+                    xformers.ops.memory_efficient_attention, op=(fw_op, bw_op)
+                ),
+            },
+            label="attention",
+            description=fw_op.NAME,
+            sub_label=sub_label,
+            num_threads=num_threads,
+        )
+        has_run = True
+
+    if not has_run:
+        return
+
+    yield benchmark.Timer(
+        stmt="fn(q, k, v)",
+        globals={
+            "q": q,
+            "k": k,
+            "v": v,
+            "fn": ref_attention,
+        },
+        label="attention",
+        description="eager",
+        sub_label=sub_label,
+        num_threads=num_threads,
+    )
+
+
+def mem_eff_attention_cpu_bw(shape, num_threads: int, dtype):
+    _, q, k, v = create_tensors(shape, dtype, requires_grad=True)
+    inp = fmha.Inputs(query=q, key=k, value=v)
+    sub_label = _sub_label(shape, dtype)
+    grad_benchmark = torch.ones_like(q)
+
+    has_run = False
+    for fw_op, bw_op in OPS:
+        if not fw_op.supports(inp) or not bw_op.supports(inp):
+            continue
+        has_run = True
+        out = xformers.ops.memory_efficient_attention(q, k, v, op=(fw_op, bw_op))
+        yield benchmark.Timer(
+            stmt="out.backward(grad, retain_graph=True)",
+            globals={
+                "out": out,
+                "grad": grad_benchmark,
+            },
+            label="attention backward",
+            description=bw_op.NAME,
+            sub_label=sub_label,
+            num_threads=num_threads,
+        )
+        del out
+
+    if not has_run:
+        return
+    yield benchmark.Timer(
+        stmt="out.backward(grad, retain_graph=True)",
+        globals={
+            "out": ref_attention(q, k, v),
+            "grad": grad_benchmark,
+        },
+        label="attention backward",
+        description="vanilla",
+        sub_label=sub_label,
+        num_threads=num_threads,
+    )
+
+
+DECODER_CASES = list(
+    product_dict(
+        # n_keys, padding_length, batchsize
+        kv_shape=[(32, 1024, 64), (1000, 1024, 2), (8000, 8192, 1)],
+        n_heads=[8, 32],
+        num_threads=NUM_THREADS,
+        multiquery=[True, False],
+    )
+)
+
+
+def mem_eff_attention_cpu_decoder(
+    kv_shape, n_heads: int, num_threads: int, multiquery: bool
+):
+    n_keys, padding, B = kv_shape
+    torch.manual_seed(42)
+    k_seqlen = torch.randint(1, n_keys + 1, (B,)).tolist()
+    K = 128
+    dtype = torch.bfloat16
+
+    q = torch.rand(1, B, n_heads, K, device=device, dtype=dtype)
+    kv_heads = 1 if multiquery else n_heads
+    k = torch.rand(1, B * padding, kv_heads, K, device=device, dtype=dtype)
+    v = torch.rand(1, B * padding, kv_heads, K, device=device, dtype=dtype)
+    k = k.expand(1, B * padding, n_heads, K)
+    v = v.expand(1, B * padding, n_heads, K)
+    bias = fmha.attn_bias.BlockDiagonalCausalWithOffsetPaddedKeysMask.from_seqlens(
+        q_seqlen=[1] * B,
+        kv_seqlen=k_seqlen,
+        kv_padding=padding,
+    )
+
+    sub_label = f"{B}batch-{k_seqlen[0]}keys-{n_heads}heads"
+    if multiquery:
+        sub_label += "-mq"
+
+    fw_op = fmha.decoder.FwOp
+    if not fw_op.supports(fmha.Inputs(q, k, v, attn_bias=bias)):
+        return
+    yield benchmark.Timer(
+        stmt="fn(q, k, v, attn_bias)",
+        globals={
+            "q": q,
+            "k": k,
+            "v": v,
+            "attn_bias": bias,
+            "fn": partial(xformers.ops.memory_efficient_attention_forward, op=fw_op),
+        },
+        label="attention decoder",
+        description=fw_op.NAME,
+        sub_label=sub_label,
+        num_threads=num_threads,
+    )
+
+
+benchmark_main_helper(mem_eff_attention_cpu_fw, CASES, min_run_time=min_run_time)
+benchmark_main_helper(mem_eff_attention_cpu_bw, CASES, min_run_time=min_run_time)
+benchmark_main_helper(
+    mem_eff_attention_cpu_decoder, DECODER_CASES, min_run_time=min_run_time
+)
@@ -72,6 +72,7 @@ KV_SHAPES = [
     (240, 256, 32),
     (2048, 2 * 1024, 4),
     (4096 * 2, 8 * 1024, 1),
+    (32 * 1024, 32 * 1024, 1),
 ]
 
 N_HEADS = [8, 16, 64]
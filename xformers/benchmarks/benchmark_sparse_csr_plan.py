@@ -0,0 +1,80 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+
+import itertools
+
+import torch
+from torch.utils import benchmark
+
+from xformers.benchmarks.utils import benchmark_main_helper
+from xformers.components.attention.core import _create_random_sparsity
+from xformers.ops import masked_matmul
+from xformers.sparse import SparseCSRTensor
+from xformers.sparse.utils import _clear_csr_plan_cache
+
+min_run_time = 0.5
+device = torch.device("cpu")
+
+# Format: [B, M, K]
+SHAPES = [(8, 1024, 32), (8, 1024, 64), (4, 4096, 64)]
+SPARSITIES = [0.9, 0.98]
+
+CASES = [
+    dict(shape=shape, sparsity=sparsity)
+    for shape, sparsity in itertools.product(SHAPES, SPARSITIES)
+]
+
+
+def _mask(B, M, sparsity):
+    mask = _create_random_sparsity(torch.ones(1, M, M), sparsity, divisible_by=4)
+    return mask.expand(B, M, M)
+
+
+def benchmark_csr_plan(shape, sparsity):
+    """
+    A training step of sparse attention, where the mask is re-created at every
+    step from its (static) sparsity pattern, as in modules that don't keep the
+    `SparseCSRTensor` around.
+    `rebuild` computes the transposition and the row ordering every time,
+    `cached` reuses the ones of the first step.
+    """
+    B, M, K = shape
+    mask = _mask(B, M, sparsity)
+    q = torch.randn(B, M, K, device=device, requires_grad=True)
+    k = torch.randn(B, M, K, device=device, requires_grad=True)
+    v = torch.randn(B, M, K, device=device, requires_grad=True)
+    grad = torch.randn(B, M, K, device=device)
+    sub_label = f"B={B}, M={M}, K={K}, sparsity={sparsity}"
+
+    def step_create():
+        SparseCSRTensor.from_dense(mask)
+
+    def step_fwbw():
+        sparse_mask = SparseCSRTensor.from_dense(mask)
+        att = masked_matmul(q, k.transpose(-2, -1), sparse_mask)
+        att = torch.softmax(att, dim=-1)
+        out = torch.bmm(att, v)
+        out.backward(grad)
+
+    for name, step in [("create", step_create), ("fwbw", step_fwbw)]:
+        for description, clear_cache in [("rebuild", True), ("cached", False)]:
+
+            def fn(step=step, clear_cache=clear_cache):
+                if clear_cache:
+                    _clear_csr_plan_cache()
+                step()
+
+            fn()
+            yield benchmark.Timer(
+                stmt="fn()",
+                globals={"fn": fn},
+                label=f"csr_plan_{name}",
+                description=description,
+                sub_label=sub_label,
+            )
+
+
+benchmark_main_helper(benchmark_csr_plan, CASES, min_run_time=min_run_time)
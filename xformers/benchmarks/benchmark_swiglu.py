@@ -156,5 +156,52 @@ def benchmark_swiglu_bw(shape, dtype, bias: bool):
     )
 
 
+def benchmark_swiglu_fwbw(shape, dtype, bias: bool):
+    """
+    Full training step, so that the peak memory includes the activations
+    saved for the backward: `recompute` trades them for a second dual GEMM
+    """
+    if dtype == "autocast_half":
+        inp_dtype, model_dtype, autocast = torch.float, torch.float, True
+    else:
+        inp_dtype, model_dtype, autocast = dtype, dtype, False
+
+    x = torch.randn(shape[:2], device=device, dtype=inp_dtype)
+    x.requires_grad_()
+    module = (
+        xsw.SwiGLU(in_features=shape[1], hidden_features=shape[2], bias=bias)
+        .to(device)
+        .to(model_dtype)
+    )
+
+    dtype_str = DTYPE2STR.get(dtype, dtype)
+    bstr = "bias" if bias else "nobi"
+    sub_label = f"{dtype_str} B={shape[0]}, I={shape[1]}, H={shape[2]} {bstr}"
+
+    params = module._ordered_params()
+    grad = torch.zeros([shape[0], shape[1]], device=device, dtype=model_dtype)
+
+    PREFIX = 'with torch.autocast("cuda", dtype=torch.half):\n    ' if autocast else ""
+    for op, recompute in [
+        (OP, False),
+        (OP, True),
+        (xsw.SwiGLUEagerOp, False),
+        (xsw.SwiGLUEagerOp, True),
+    ]:
+        yield benchmark.Timer(
+            stmt=f"{PREFIX}out = fn(x, *args)\nout.backward(grad)",
+            globals={
+                "x": x,
+                "args": params,
+                "grad": grad,
+                "fn": partial(xsw.swiglu, op=op, recompute=recompute),
+            },
+            label="swiglu_fwbw",
+            description=f"{op.NAME}.recompute" if recompute else op.NAME,
+            sub_label=sub_label,
+        )
+
+
 benchmark_main_helper(benchmark_swiglu, CASES, min_run_time=min_run_time)
 benchmark_main_helper(benchmark_swiglu_bw, CASES, min_run_time=min_run_time)
+benchmark_main_helper(benchmark_swiglu_fwbw, CASES, min_run_time=min_run_time)
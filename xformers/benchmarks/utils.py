@@ -521,6 +521,7 @@ def benchmark_run_and_compare(
         )
     except (RuntimeError, AssertionError):  # No GPU
         env = "cpu"
+    has_cuda = env != "cpu"
     assert (
         "." not in optimized_label
     ), f"label=`{optimized_label}` should not contain dots"
@@ -587,19 +588,23 @@ def benchmark_run_and_compare(
 
                 memory = math.inf
                 try:
-                    torch.cuda.synchronize()
-                    torch.cuda.reset_peak_memory_stats()
-                    mem_begin = torch.cuda.max_memory_allocated() / 2**20
+                    mem_begin = 0.0
+                    if has_cuda:
+                        torch.cuda.synchronize()
+                        torch.cuda.reset_peak_memory_stats()
+                        mem_begin = torch.cuda.max_memory_allocated() / 2**20
                     benchmark_object._task_spec = replace(
                         benchmark_object._task_spec, env=env
                     )
                     measurement = benchmark_object.blocked_autorange(
                         min_run_time=min_run_time
                     )
-                    torch.cuda.synchronize()
+                    memory = 0.0
+                    if has_cuda:
+                        torch.cuda.synchronize()
+                        memory = torch.cuda.max_memory_allocated() / 2**20 - mem_begin
                     results.append((metadata, measurement))
                     name = measurement.task_spec.description
-                    memory = torch.cuda.max_memory_allocated() / 2**20 - mem_begin
                     measurement.mem_use = memory
                 except RuntimeError as e:
                     if "CUDA out of memory" not in str(e):
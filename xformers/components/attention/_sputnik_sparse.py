@@ -92,8 +92,12 @@ class SparseCS:
     def matmul_with_mask(self, a, b):
         return type(self)._wrap(masked_matmul(a, b, self._mat))
 
-    def softmax(self):
-        out = torch.nn.functional.softmax(self._mat, -1)
+    def softmax(self, inplace: bool = False):
+        if inplace:
+            # Reuses the storage of the values of `self`
+            out = SparseCSRTensor._softmax(self._mat, -1, inplace=True)
+        else:
+            out = torch.nn.functional.softmax(self._mat, -1)
         return type(self)._wrap(out)
 
     def spmm(self, b):
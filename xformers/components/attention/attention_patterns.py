@@ -225,6 +225,9 @@ def alibi_pattern(threshold: float, mask_shape: torch.Size) -> torch.Tensor:
 
     .. note: mask_shape is expected to hold the [heads, seq, seq] dimensions
 
+    .. note: to use ALiBi as an attention bias, :attr:`xformers.ops.fmha.attn_bias.AlibiBias`
+        lets `memory_efficient_attention` compute it on the fly instead
+
     .. _ALiBi: https://arxiv.org/pdf/2108.12409.pdf
     """
 
@@ -10,16 +10,16 @@ from dataclasses import dataclass
 
 import torch
 
-from xformers import _is_triton_available
+from xformers import _has_cpp_library, _is_triton_available
 from xformers.components.attention import Attention, AttentionConfig, register_attention
 
 logger = logging.getLogger("xformers")
 
 
-_is_blocksparse_available = _is_triton_available()
+_is_triton_blocksparse_available = _is_triton_available()
 
 
-if _is_blocksparse_available:
+if _is_triton_blocksparse_available:
     from triton.ops.blocksparse import matmul as blocksparse_matmul  # type: ignore
     from triton.ops.blocksparse import softmax as blocksparse_softmax  # type: ignore
 
@@ -30,10 +30,14 @@ if _is_blocksparse_available:
         logger.warning(
             "Blocksparse is not available: the current GPU does not expose Tensor cores"
         )
-        _is_blocksparse_available = False
+        _is_triton_blocksparse_available = False
+
+# CPU inputs use the fused `bsr_attention_*` operators instead of Triton
+_is_blocksparse_available = _is_triton_blocksparse_available or _has_cpp_library
 
 
 if _is_blocksparse_available:
+    from xformers.sparse._bsr_ops import _bsr_attention, _get_bsr_info
 
     @dataclass
     class BlockSparseAttentionConfig(AttentionConfig):
@@ -42,11 +46,13 @@ if _is_blocksparse_available:
         dropout: float
         num_heads: int
 
-    @register_attention("blocksparse", BlockSparseAttentionConfig)
     class BlockSparseAttention(Attention):
         r"""
         Thin wrap over the Triton blocksparse computations. The sparsity pattern is determined through the layout.
 
+        On CPU, a fused kernel streams the active key blocks of each query block with an online softmax,
+        so that the attention matrix is never stored. Dropout is not supported in that case.
+
         .. warning: the layout is assumed to have the dimensions [heads, seq, seq].
             If some dimensions are missing, we assume that the same layout is to be used across heads.
 
@@ -94,6 +100,7 @@ if _is_blocksparse_available:
             # Pure blocksparse data
             self.layout = layout
             self.block_size = block_size
+            self._bsr_info = None
 
             # make sure that the head dimension is not folded down with the batch
             self.requires_head_dimension = True
@@ -150,11 +157,6 @@ if _is_blocksparse_available:
             .. note: Per element attention mask is not supported, but you can specify causality
             """
 
-            # Delayed triton init, to make sure that we get the right device
-            # Infer device from query
-            if not hasattr(self, "sparse_dot_sdd"):
-                self.create_triton_kernels(q.device)
-
             assert (
                 q.shape[-2] == k.shape[-2]
             ), "Blocksparse requires the same dimensions for K and Q for now"
@@ -172,6 +174,19 @@ if _is_blocksparse_available:
                 q.shape[-2], self.block_size
             )
 
+            if q.device.type == "cpu":
+                return self._cpu_forward(q, k, v, scale)
+
+            assert _is_triton_blocksparse_available, (
+                "Blocksparse attention on {} inputs requires Triton, "
+                "only CPU inputs are supported without it".format(q.device.type)
+            )
+
+            # Delayed triton init, to make sure that we get the right device
+            # Infer device from query
+            if not hasattr(self, "sparse_dot_sdd"):
+                self.create_triton_kernels(q.device)
+
             # Self-attend: (B, nh, S, hs) x (B, nh, hs, S) -> (B, nh, S, S)
             # When the computations are block sparse, the matrix types change along the way:
             # - (sparse) attention matrix = (dense) Kt * (dense) Q
@@ -188,3 +203,35 @@ if _is_blocksparse_available:
             # - then (dense) attention is (sparse) attention matrix * dense (value)
             a = self.sparse_dot_dsd(sparse_att_mat, v)
             return a
+
+        def _cpu_forward(
+            self, q: torch.Tensor, k: torch.Tensor, v: torch.Tensor, scale: float
+        ) -> torch.Tensor:
+            assert (
+                not self.training or self.attn_drop.p == 0.0
+            ), "Blocksparse attention does not support dropout on CPU"
+            assert (
+                q.shape[1] == self.layout.shape[0]
+            ), "The layout must have as many heads as the inputs"
+
+            # The CSR description of the layout is only computed once
+            if self._bsr_info is None:
+                self._bsr_info = _get_bsr_info(self.layout.cpu())
+
+            # Same scaling as the Triton path: q / sqrt(d), then `scale` in the softmax
+            return _bsr_attention.apply(
+                q,
+                k,
+                v,
+                self._bsr_info,
+                self.block_size,
+                scale / math.sqrt(q.size(-1)),
+                self.causal,
+            )
+
+    # The attention tests of the registry use sequence lengths and dropouts
+    # that the CPU path can't serve, so it is only registered along Triton
+    if _is_triton_blocksparse_available:
+        register_attention("blocksparse", BlockSparseAttentionConfig)(
+            BlockSparseAttention
+        )
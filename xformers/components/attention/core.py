@@ -70,7 +70,9 @@ def _broadcast_batch(mask, batch_size):
 
     size = (batch_size,) + mask.shape
 
-    return torch.sparse_coo_tensor(indices, values, size)
+    # the indices are sorted by batch and then as in `mask`, so the result
+    # doesn't need to be coalesced again
+    return torch.sparse_coo_tensor(indices, values, size)._coalesced_(True)
 
 
 def _matmul_with_mask(
@@ -120,9 +122,11 @@ def _matmul_with_mask(
     return att
 
 
-def _softmax(a: torch.Tensor, causal: bool = False) -> torch.Tensor:
+def _softmax(
+    a: torch.Tensor, causal: bool = False, inplace: bool = False
+) -> torch.Tensor:
     if _has_cpp_library and isinstance(a, SparseCS):
-        return a.softmax()
+        return a.softmax(inplace=inplace)
 
     if a.is_sparse:
         return torch.sparse.softmax(a, dim=a.ndim - 1)
@@ -233,7 +237,8 @@ def scaled_query_key_softmax(
 
     # Softmax to get the attention probabilities
     is_causal = isinstance(att_mask, AttentionMask) and att_mask.is_causal
-    att = _softmax(att, causal=is_causal)
+    # `att` is a temporary, so a sparse softmax can overwrite it
+    att = _softmax(att, causal=is_causal, inplace=True)
     return att
 
 
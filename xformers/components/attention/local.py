@@ -10,6 +10,7 @@ from typing import Optional, Union
 import torch
 import torch.nn as nn
 
+from xformers import _has_cpp_library
 from xformers.components.attention import (
     Attention,
     AttentionConfig,
@@ -24,6 +25,9 @@ from xformers.components.attention.attention_patterns import (
 )
 from xformers.components.attention.core import scaled_dot_product_attention
 
+if _has_cpp_library:
+    from xformers.ops import fmha
+
 
 @dataclass
 class LocalAttentionConfig(AttentionConfig):
@@ -93,6 +97,16 @@ class LocalAttention(Attention):
 
         return mask
 
+    def _get_local_attn_bias(self):
+        # Same window as `_get_local_mask`, as it is seen from each query
+        if self.causal:
+            return fmha.attn_bias.LocalAttentionFromBottomRightMask(
+                window_left=self.window_size, window_right=0
+            )
+        return fmha.attn_bias.LocalAttentionFromBottomRightMask(
+            window_left=self.window_size // 2, window_right=self.window_size // 2
+        )
+
     def forward(
         self,
         q: torch.Tensor,
@@ -102,6 +116,22 @@ class LocalAttention(Attention):
         *args,
         **kwargs,
     ):
+        # On CPU, the window is applied within the attention kernel: only the
+        # keys inside of the window are visited, and no mask is allocated
+        if (
+            _has_cpp_library
+            and q.device.type == "cpu"
+            and att_mask is None
+            and (not self.training or self.attn_drop.p == 0.0)
+        ):
+            return fmha.memory_efficient_attention(
+                q,
+                k,
+                v,
+                attn_bias=self._get_local_attn_bias(),
+                op=fmha.MemoryEfficientAttentionCpuOp,
+            )
+
         # Local window attention masking
         if self.attention_mask is None or self.attention_mask.shape[1] != q.shape[1]:
             self.attention_mask = self._get_local_mask(q.shape).to(q.device)
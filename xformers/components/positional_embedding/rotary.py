@@ -5,12 +5,13 @@
 
 
 # CREDITS: This implementation is inspired by GPT-NeoX https://github.com/EleutherAI/gpt-neox
-# NOTE: Almost the same right now, moving parts to Triton is the next step
 
 from typing import Tuple
 
 import torch
 
+from xformers.ops.rotary import _rotary_supported, rotary_embedding
+
 
 def rotate_half(x):
     x1, x2 = x.chunk(2, dim=-1)
@@ -19,8 +20,6 @@ def rotate_half(x):
 
 @torch.jit.script
 def apply_rotary_pos_emb(x, cos, sin):
-    # NOTE: This could probably be moved to Triton
-
     # Handle a possible sequence length mismatch in between q and k
     cos = cos[:, :, : x.shape[-2], :]
     sin = sin[:, :, : x.shape[-2], :]
@@ -52,40 +51,46 @@ class RotaryEmbedding(torch.nn.Module):
         inv_freq = 1.0 / (10000 ** (torch.arange(0, dim_model, 2).float() / dim_model))
         self.register_buffer("inv_freq", inv_freq)
 
-        self._seq_len_cached = None
+        # [num_positions, dim_model / 2] f32 tables, indexed by position
         self._cos_cached = None
         self._sin_cached = None
 
     def _update_cos_sin_tables(self, x, seq_dimension=1):
         seq_len = x.shape[seq_dimension]
 
-        # Reset the tables if the sequence length has changed,
-        # or if we're on a new device (possibly due to tracing for instance)
+        # The tables only grow: shorter sequences use their first rows.
+        # Rebuild them if we're on a new device (possibly due to tracing for instance)
         if (
-            seq_len != self._seq_len_cached
+            self._cos_cached is None
+            or seq_len > self._cos_cached.shape[0]
             or self._cos_cached.device != x.device
-            or self._cos_cached.dtype != x.dtype
         ):
-            self._seq_len_cached = seq_len
-            t = torch.arange(
-                x.shape[seq_dimension], device=x.device, dtype=torch.float32
-            )
-            freqs = torch.einsum("i,j->ij", t, self.inv_freq.to(x.dtype))
-            emb = torch.cat((freqs, freqs), dim=-1).to(x.device)
+            num_positions = seq_len
+            if self._cos_cached is not None:
+                num_positions = max(num_positions, 2 * self._cos_cached.shape[0])
+            t = torch.arange(num_positions, device=x.device, dtype=torch.float32)
+            inv_freq = self.inv_freq.to(device=x.device, dtype=torch.float32)
+            freqs = torch.outer(t, inv_freq)
 
-            self._cos_cached = emb.cos()[None, None, :, :].to(x.dtype)
-            self._sin_cached = emb.sin()[None, None, :, :].to(x.dtype)
+            self._cos_cached = freqs.cos()
+            self._sin_cached = freqs.sin()
 
         return self._cos_cached, self._sin_cached
 
     def forward(
         self, q: torch.Tensor, k: torch.Tensor
     ) -> Tuple[torch.Tensor, torch.Tensor]:
-        self._cos_cached, self._sin_cached = self._update_cos_sin_tables(
-            k, seq_dimension=-2
-        )
+        self._update_cos_sin_tables(q, seq_dimension=-2)
+        cos, sin = self._update_cos_sin_tables(k, seq_dimension=-2)
+
+        if _rotary_supported(q) and _rotary_supported(k):
+            # Native kernels: one pass per tensor, no intermediate tensors
+            return rotary_embedding(q, cos, sin), rotary_embedding(k, cos, sin)
 
+        seq_len = max(q.shape[-2], k.shape[-2])
+        cos = torch.cat((cos, cos), dim=-1)[None, None, :seq_len, :].to(k.dtype)
+        sin = torch.cat((sin, sin), dim=-1)[None, None, :seq_len, :].to(k.dtype)
         return (
-            apply_rotary_pos_emb(q, self._cos_cached, self._sin_cached),
-            apply_rotary_pos_emb(k, self._cos_cached, self._sin_cached),
+            apply_rotary_pos_emb(q, cos, sin),
+            apply_rotary_pos_emb(k, cos, sin),
         )
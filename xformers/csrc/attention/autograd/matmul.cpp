@@ -38,14 +38,21 @@ class MatmulWithMask : public torch::autograd::Function<MatmulWithMask> {
     auto b = saved[1];
 
     auto grad_o = grad_output[0];
+    std::array<bool, 2> output_mask = {
+        ctx->needs_input_grad(0), ctx->needs_input_grad(1)};
+    at::Tensor grad_a, grad_b;
     if (saved.size() == 3) {
-      // mask is dense, need to mask manually
-      auto mask = saved[2];
-      grad_o = grad_o.masked_fill(mask.logical_not(), 0.);
+      // mask is dense: the kernels skip the masked parts of `grad_o`
+      std::tie(grad_a, grad_b) =
+          matmul_with_mask_backward(grad_o, a, b, saved[2], output_mask);
+    } else {
+      if (output_mask[0]) {
+        grad_a = grad_o.bmm(b.transpose(-2, -1));
+      }
+      if (output_mask[1]) {
+        grad_b = grad_o.transpose(-2, -1).bmm(a).transpose(-2, -1);
+      }
     }
-    // TODO: compute grad only if they require grad
-    auto grad_a = grad_o.bmm(b.transpose(-2, -1));
-    auto grad_b = grad_o.transpose(-2, -1).bmm(a).transpose(-2, -1);
     return {grad_a, grad_b, torch::autograd::Variable()};
   }
 };
@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <torch/types.h>
+
+TORCH_LIBRARY_FRAGMENT(xformers, m) {
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::bsr_sddmm(Tensor a, Tensor b, Tensor row_offsets, Tensor column_indices, int block_size) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::bsr_spmm(Tensor values, Tensor b, Tensor row_offsets, Tensor column_indices, Tensor? block_indices, bool transpose_blocks) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::bsr_softmax(Tensor values, Tensor row_offsets, Tensor column_indices) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::bsr_softmax_backward(Tensor output, Tensor grad, Tensor row_offsets, Tensor column_indices) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::bsr_attention_forward(Tensor query, Tensor key, Tensor value, Tensor row_offsets, Tensor column_indices, int block_size, float scale, bool causal) -> (Tensor, Tensor)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::bsr_attention_backward(Tensor grad_out, Tensor query, Tensor key, Tensor value, Tensor output, Tensor logsumexp, Tensor row_offsets, Tensor column_indices, Tensor row_offsets_t, Tensor column_indices_t, int block_size, float scale, bool causal) -> (Tensor, Tensor, Tensor)"));
+}
@@ -0,0 +1,549 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/OpMathType.h>
+#include <ATen/Parallel.h>
+#include <torch/types.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
+#include <ATen/cpu/vec/functional.h>
+#include <ATen/cpu/vec/vec.h>
+
+#include "../../cpu/vec_utils.h"
+#include "csr_utils.h"
+
+// Block-sparse (BSR) matrices, as in `BlockSparseTensor`: `values` is
+// `[batch, nnz, block_size, block_size]`, with one block per nonzero of a
+// `[heads, block_rows, block_cols]` layout, in row-major order. The layout
+// is given as CSR over the `heads * block_rows` block rows: `row_offsets`
+// indexes the blocks of each block row, and `column_indices` holds their
+// block columns. All the ops walk the layout directly, one block row per
+// task, and run a small dense GEMM per block.
+
+namespace {
+
+using xformers::cpu::_load_row;
+using xformers::cpu::_out_row;
+using xformers::cpu::_store_row;
+using xformers::cpu::_vec_axpy;
+
+// Columns of the dense operand of `bsr_spmm` processed at a time, so that
+// the accumulators of a block row stay in L1
+constexpr int64_t kBlockD = 128;
+
+void check_bsr_layout(
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    int64_t num_block_rows,
+    int64_t num_block_cols) {
+  TORCH_CHECK(row_offsets.dim() == 1);
+  TORCH_CHECK(column_indices.dim() == 1);
+  TORCH_CHECK(row_offsets.size(0) == num_block_rows + 1);
+  TORCH_CHECK(row_offsets.scalar_type() == at::ScalarType::Int);
+  TORCH_CHECK(column_indices.scalar_type() == at::ScalarType::Int);
+  TORCH_CHECK(!row_offsets.is_cuda(), "row_offsets must be a CPU tensor");
+  TORCH_CHECK(!column_indices.is_cuda(), "column_indices must be a CPU tensor");
+  TORCH_CHECK(
+      row_offsets.is_contiguous(), "row_offsets must be a contiguous tensor");
+  TORCH_CHECK(
+      column_indices.is_contiguous(),
+      "column_indices must be a contiguous tensor");
+
+  const int* row_offsets_p = row_offsets.data_ptr<int>();
+  const int* column_indices_p = column_indices.data_ptr<int>();
+  TORCH_CHECK(
+      row_offsets_p[0] == 0 &&
+          row_offsets_p[num_block_rows] == column_indices.size(0),
+      "row_offsets must cover column_indices, from 0 to its size");
+  for (int64_t r = 0; r < num_block_rows; ++r) {
+    TORCH_CHECK(
+        row_offsets_p[r] <= row_offsets_p[r + 1],
+        "row_offsets must be non-decreasing");
+  }
+  for (int64_t l = 0; l < column_indices.size(0); ++l) {
+    TORCH_CHECK(
+        column_indices_p[l] >= 0 && column_indices_p[l] < num_block_cols,
+        "column_indices out of range");
+  }
+}
+
+// `out[n, l] = a[n, h, r] @ b[n, h, c].T` for every block `l` of the
+// layout, at block row `r` and block column `c` of head `h`. Each block of
+// `b` is transposed into `bt` so that the rows of the output block are
+// accumulated with contiguous vector updates.
+template <typename scalar_t>
+void bsr_sddmm_kernel(
+    const at::Tensor& a,
+    const at::Tensor& b,
+    const int* row_offsets,
+    const int* column_indices,
+    int64_t block_size,
+    at::Tensor& out,
+    at::Tensor& buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  const int64_t N = a.size(0);
+  const int64_t H = a.size(1);
+  const int64_t M = a.size(2);
+  const int64_t Mb = b.size(2);
+  const int64_t K = a.size(3);
+  const int64_t bs = block_size;
+  const int64_t num_block_rows = M / bs;
+  const int64_t nnz = out.size(1);
+
+  const scalar_t* a_p = a.data_ptr<scalar_t>();
+  const scalar_t* b_p = b.data_ptr<scalar_t>();
+  scalar_t* out_p = out.data_ptr<scalar_t>();
+  accum_t* buffer_p = buffer.data_ptr<accum_t>();
+
+  xformers::cpu::csr_parallel_for_rows(
+      N, H * num_block_rows, row_offsets, [&](int64_t n, int64_t hr) {
+        accum_t* a_buf = buffer_p + at::get_thread_num() * buffer.size(1);
+        accum_t* bt = a_buf + bs * K;
+        accum_t* acc_buf = bt + K * bs;
+        const int64_t h = hr / num_block_rows;
+        const int64_t r = hr % num_block_rows;
+        const int64_t begin = row_offsets[hr];
+        const int64_t end = row_offsets[hr + 1];
+        if (begin == end) {
+          return;
+        }
+        // The rows of the block of `a` are contiguous
+        const accum_t* a_blk =
+            _load_row(a_p + ((n * H + h) * M + r * bs) * K, a_buf, bs * K);
+        for (int64_t l = begin; l < end; ++l) {
+          const scalar_t* b_blk =
+              b_p + ((n * H + h) * Mb + column_indices[l] * bs) * K;
+          for (int64_t j = 0; j < bs; ++j) {
+            for (int64_t k = 0; k < K; ++k) {
+              bt[k * bs + j] = accum_t(b_blk[j * K + k]);
+            }
+          }
+          scalar_t* out_blk = out_p + (n * nnz + l) * bs * bs;
+          for (int64_t i = 0; i < bs; ++i) {
+            accum_t* acc = _out_row(out_blk + i * bs, acc_buf);
+            std::fill(acc, acc + bs, accum_t(0));
+            for (int64_t k = 0; k < K; ++k) {
+              _vec_axpy(acc, a_blk[i * K + k], bt + k * bs, bs);
+            }
+            _store_row(acc, out_blk + i * bs, bs);
+          }
+        }
+      });
+}
+
+// `out[n, h, r] = sum(values[n, l] @ b[n, h, c])` over the blocks `l` of
+// block row `r` of head `h`, at block column `c`. With `block_indices`,
+// the block at position `p` of the layout is `values[n, block_indices[p]]`,
+// and with `transpose_blocks` it is used transposed: together, they run the
+// product with the transposed matrix without materializing it.
+template <typename scalar_t>
+void bsr_spmm_kernel(
+    const at::Tensor& values,
+    const at::Tensor& b,
+    const int* row_offsets,
+    const int* column_indices,
+    const int* block_indices,
+    bool transpose_blocks,
+    at::Tensor& out,
+    at::Tensor& buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  const int64_t N = b.size(0);
+  const int64_t H = b.size(1);
+  const int64_t Kb = b.size(2);
+  const int64_t D = b.size(3);
+  const int64_t M = out.size(2);
+  const int64_t bs = values.size(2);
+  const int64_t nnz = values.size(1);
+  const int64_t num_block_rows = M / bs;
+
+  const scalar_t* values_p = values.data_ptr<scalar_t>();
+  const scalar_t* b_p = b.data_ptr<scalar_t>();
+  scalar_t* out_p = out.data_ptr<scalar_t>();
+  accum_t* buffer_p = buffer.data_ptr<accum_t>();
+
+  xformers::cpu::csr_parallel_for_rows(
+      N, H * num_block_rows, row_offsets, [&](int64_t n, int64_t hr) {
+        accum_t* acc = buffer_p + at::get_thread_num() * buffer.size(1);
+        accum_t* b_buf = acc + bs * kBlockD;
+        accum_t* v_buf = b_buf + kBlockD;
+        const int64_t h = hr / num_block_rows;
+        const int64_t r = hr % num_block_rows;
+        const scalar_t* b_head = b_p + (n * H + h) * Kb * D;
+        scalar_t* out_blk = out_p + ((n * H + h) * M + r * bs) * D;
+        for (int64_t d0 = 0; d0 < D; d0 += kBlockD) {
+          const int64_t d_len = std::min(kBlockD, D - d0);
+          std::fill(acc, acc + bs * d_len, accum_t(0));
+          for (int64_t p = row_offsets[hr]; p < row_offsets[hr + 1]; ++p) {
+            const int64_t l = block_indices ? block_indices[p] : p;
+            const accum_t* v =
+                _load_row(values_p + (n * nnz + l) * bs * bs, v_buf, bs * bs);
+            const int64_t v_row_stride = transpose_blocks ? 1 : bs;
+            const int64_t v_col_stride = transpose_blocks ? bs : 1;
+            const scalar_t* b_blk = b_head + column_indices[p] * bs * D + d0;
+            for (int64_t j = 0; j < bs; ++j) {
+              const accum_t* b_row = _load_row(b_blk + j * D, b_buf, d_len);
+              for (int64_t i = 0; i < bs; ++i) {
+                _vec_axpy(
+                    acc + i * d_len,
+                    v[i * v_row_stride + j * v_col_stride],
+                    b_row,
+                    d_len);
+              }
+            }
+          }
+          for (int64_t i = 0; i < bs; ++i) {
+            scalar_t* out_row = out_blk + i * D + d0;
+            if constexpr (std::is_same<scalar_t, accum_t>::value) {
+              std::copy(acc + i * d_len, acc + (i + 1) * d_len, out_row);
+            } else {
+              at::vec::convert(acc + i * d_len, out_row, d_len);
+            }
+          }
+        }
+      });
+}
+
+// Softmax over each row of a block row, which is split across its blocks:
+// row `i` is `values[n, l, i]` for the blocks `l` in `[begin, end)`. The
+// max and the normalization are computed in a single pass, with the sum
+// rescaled whenever a block raises the max.
+template <typename scalar_t>
+void bsr_softmax_kernel(
+    const at::Tensor& values,
+    const int* row_offsets,
+    int64_t num_block_rows,
+    at::Tensor& out,
+    at::Tensor& buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  using Vec = at::vec::Vectorized<accum_t>;
+  const int64_t N = values.size(0);
+  const int64_t nnz = values.size(1);
+  const int64_t bs = values.size(2);
+  const scalar_t* values_p = values.data_ptr<scalar_t>();
+  scalar_t* out_p = out.data_ptr<scalar_t>();
+  accum_t* buffer_p = buffer.data_ptr<accum_t>();
+  const accum_t neg_inf = -std::numeric_limits<accum_t>::infinity();
+
+  xformers::cpu::csr_parallel_for_rows(
+      N, num_block_rows, row_offsets, [&](int64_t n, int64_t br) {
+        accum_t* buf = buffer_p + at::get_thread_num() * buffer.size(1);
+        const int64_t begin = row_offsets[br];
+        const int64_t end = row_offsets[br + 1];
+        for (int64_t i = 0; i < bs; ++i) {
+          const int64_t offset = n * nnz * bs * bs + i * bs;
+          accum_t max = neg_inf;
+          accum_t norm = 0;
+          for (int64_t l = begin; l < end; ++l) {
+            const accum_t* x =
+                _load_row(values_p + offset + l * bs * bs, buf, bs);
+            const accum_t block_max = at::vec::reduce_all<accum_t>(
+                [](Vec& a, Vec& b) { return at::vec::maximum(a, b); }, x, bs);
+            const accum_t new_max = std::max(max, block_max);
+            if (new_max == neg_inf) {
+              continue;
+            }
+            norm = norm * std::exp(max - new_max) +
+                at::vec::map_reduce_all<accum_t>(
+                       [new_max](Vec a) { return (a - Vec(new_max)).exp(); },
+                       [](Vec a, Vec b) { return a + b; },
+                       x,
+                       bs);
+            max = new_max;
+          }
+          norm = accum_t(1) / norm;
+          for (int64_t l = begin; l < end; ++l) {
+            const accum_t* x =
+                _load_row(values_p + offset + l * bs * bs, buf, bs);
+            accum_t* y = _out_row(out_p + offset + l * bs * bs, buf);
+            at::vec::map(
+                [max, norm](Vec a) { return (a - Vec(max)).exp() * Vec(norm); },
+                y,
+                x,
+                bs);
+            _store_row(y, out_p + offset + l * bs * bs, bs);
+          }
+        }
+      });
+}
+
+// `grad_in = out * (grad - sum(out * grad))`, the sums being over the rows
+// of the block rows as in `bsr_softmax_kernel`
+template <typename scalar_t>
+void bsr_softmax_backward_kernel(
+    const at::Tensor& output,
+    const at::Tensor& grad,
+    const int* row_offsets,
+    int64_t num_block_rows,
+    at::Tensor& grad_in,
+    at::Tensor& buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  using Vec = at::vec::Vectorized<accum_t>;
+  const int64_t N = output.size(0);
+  const int64_t nnz = output.size(1);
+  const int64_t bs = output.size(2);
+  const scalar_t* output_p = output.data_ptr<scalar_t>();
+  const scalar_t* grad_p = grad.data_ptr<scalar_t>();
+  scalar_t* grad_in_p = grad_in.data_ptr<scalar_t>();
+  accum_t* buffer_p = buffer.data_ptr<accum_t>();
+
+  xformers::cpu::csr_parallel_for_rows(
+      N, num_block_rows, row_offsets, [&](int64_t n, int64_t br) {
+        accum_t* y_buf = buffer_p + at::get_thread_num() * buffer.size(1);
+        accum_t* g_buf = y_buf + bs;
+        const int64_t begin = row_offsets[br];
+        const int64_t end = row_offsets[br + 1];
+        for (int64_t i = 0; i < bs; ++i) {
+          const int64_t offset = n * nnz * bs * bs + i * bs;
+          accum_t sum = 0;
+          for (int64_t l = begin; l < end; ++l) {
+            const accum_t* y =
+                _load_row(output_p + offset + l * bs * bs, y_buf, bs);
+            const accum_t* g =
+                _load_row(grad_p + offset + l * bs * bs, g_buf, bs);
+            sum += at::vec::map2_reduce_all<accum_t>(
+                [](Vec a, Vec b) { return a * b; },
+                [](Vec a, Vec b) { return a + b; },
+                y,
+                g,
+                bs);
+          }
+          for (int64_t l = begin; l < end; ++l) {
+            const accum_t* y =
+                _load_row(output_p + offset + l * bs * bs, y_buf, bs);
+            const accum_t* g =
+                _load_row(grad_p + offset + l * bs * bs, g_buf, bs);
+            accum_t* dx = _out_row(grad_in_p + offset + l * bs * bs, g_buf);
+            at::vec::map2(
+                [sum](Vec a, Vec b) { return a * (b - Vec(sum)); },
+                dx,
+                y,
+                g,
+                bs);
+            _store_row(dx, grad_in_p + offset + l * bs * bs, bs);
+          }
+        }
+      });
+}
+
+void check_bsr_values(const at::Tensor& values, const char* name) {
+  TORCH_CHECK(values.dim() == 4, name, " must be [batch, nnz, bs, bs]");
+  TORCH_CHECK(values.size(2) == values.size(3), name, " blocks must be square");
+  TORCH_CHECK(values.size(2) > 0);
+  TORCH_CHECK(!values.is_cuda(), name, " must be a CPU tensor");
+  TORCH_CHECK(values.is_contiguous(), name, " must be a contiguous tensor");
+}
+
+void check_bsr_dense(const at::Tensor& x, const char* name) {
+  TORCH_CHECK(x.dim() == 4, name, " must be [batch, heads, rows, cols]");
+  TORCH_CHECK(!x.is_cuda(), name, " must be a CPU tensor");
+  TORCH_CHECK(x.is_contiguous(), name, " must be a contiguous tensor");
+}
+
+at::Tensor bsr_sddmm(
+    const at::Tensor& a,
+    const at::Tensor& b,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    int64_t block_size) {
+  check_bsr_dense(a, "a");
+  check_bsr_dense(b, "b");
+  TORCH_CHECK(block_size > 0);
+  TORCH_CHECK(a.size(0) == b.size(0));
+  TORCH_CHECK(a.size(1) == b.size(1));
+  TORCH_CHECK(a.size(3) == b.size(3));
+  TORCH_CHECK(a.size(2) % block_size == 0);
+  TORCH_CHECK(b.size(2) % block_size == 0);
+  TORCH_CHECK(
+      a.scalar_type() == b.scalar_type(), "a and b must have the same dtype");
+  check_bsr_layout(
+      row_offsets,
+      column_indices,
+      a.size(1) * (a.size(2) / block_size),
+      b.size(2) / block_size);
+
+  const int64_t K = a.size(3);
+  at::Tensor out = at::empty(
+      {a.size(0), column_indices.size(0), block_size, block_size}, a.options());
+  // Converted block of `a`, transposed block of `b` and accumulators
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), 2 * block_size * K + block_size},
+      a.options().dtype(at::toOpMathType(a.scalar_type())));
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      a.scalar_type(),
+      "bsr_sddmm",
+      [&] {
+        bsr_sddmm_kernel<scalar_t>(
+            a,
+            b,
+            row_offsets.data_ptr<int>(),
+            column_indices.data_ptr<int>(),
+            block_size,
+            out,
+            buffer);
+      });
+  return out;
+}
+
+at::Tensor bsr_spmm(
+    const at::Tensor& values,
+    const at::Tensor& b,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    const c10::optional<at::Tensor>& block_indices,
+    bool transpose_blocks) {
+  check_bsr_values(values, "values");
+  check_bsr_dense(b, "b");
+  const int64_t bs = values.size(2);
+  const int64_t H = b.size(1);
+  TORCH_CHECK(values.size(0) == b.size(0));
+  TORCH_CHECK(b.size(2) % bs == 0);
+  TORCH_CHECK(
+      values.scalar_type() == b.scalar_type(),
+      "values and b must have the same dtype");
+  TORCH_CHECK(row_offsets.dim() == 1);
+  TORCH_CHECK(
+      H > 0 && (row_offsets.size(0) - 1) % H == 0,
+      "row_offsets must cover the block rows of all the heads");
+  const int64_t num_block_rows = (row_offsets.size(0) - 1) / H;
+  check_bsr_layout(
+      row_offsets, column_indices, H * num_block_rows, b.size(2) / bs);
+  if (block_indices.has_value()) {
+    TORCH_CHECK(block_indices->dim() == 1);
+    TORCH_CHECK(block_indices->size(0) == column_indices.size(0));
+    TORCH_CHECK(block_indices->scalar_type() == at::ScalarType::Int);
+    TORCH_CHECK(
+        !block_indices->is_cuda(), "block_indices must be a CPU tensor");
+    TORCH_CHECK(
+        block_indices->is_contiguous(),
+        "block_indices must be a contiguous tensor");
+    const int* block_indices_p = block_indices->data_ptr<int>();
+    for (int64_t p = 0; p < block_indices->size(0); ++p) {
+      TORCH_CHECK(
+          block_indices_p[p] >= 0 && block_indices_p[p] < values.size(1),
+          "block_indices out of range");
+    }
+  } else {
+    TORCH_CHECK(column_indices.size(0) == values.size(1));
+  }
+
+  at::Tensor out = at::empty(
+      {b.size(0), H, num_block_rows * bs, b.size(3)}, b.options());
+  // Accumulators, converted rows of `b` and converted block of `values`
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), (bs + 1) * kBlockD + bs * bs},
+      b.options().dtype(at::toOpMathType(b.scalar_type())));
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      b.scalar_type(),
+      "bsr_spmm",
+      [&] {
+        bsr_spmm_kernel<scalar_t>(
+            values,
+            b,
+            row_offsets.data_ptr<int>(),
+            column_indices.data_ptr<int>(),
+            block_indices.has_value() ? block_indices->data_ptr<int>()
+                                      : nullptr,
+            transpose_blocks,
+            out,
+            buffer);
+      });
+  return out;
+}
+
+at::Tensor bsr_softmax(
+    const at::Tensor& values,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices) {
+  check_bsr_values(values, "values");
+  TORCH_CHECK(values.size(1) == column_indices.size(0));
+  TORCH_CHECK(row_offsets.dim() == 1 && row_offsets.size(0) > 0);
+  const int64_t num_block_rows = row_offsets.size(0) - 1;
+  check_bsr_layout(
+      row_offsets,
+      column_indices,
+      num_block_rows,
+      std::numeric_limits<int>::max());
+
+  at::Tensor out = at::empty_like(values);
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), values.size(2)},
+      values.options().dtype(at::toOpMathType(values.scalar_type())));
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      values.scalar_type(),
+      "bsr_softmax",
+      [&] {
+        bsr_softmax_kernel<scalar_t>(
+            values, row_offsets.data_ptr<int>(), num_block_rows, out, buffer);
+      });
+  return out;
+}
+
+at::Tensor bsr_softmax_backward(
+    const at::Tensor& output,
+    const at::Tensor& grad,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices) {
+  check_bsr_values(output, "output");
+  check_bsr_values(grad, "grad");
+  TORCH_CHECK(output.sizes() == grad.sizes());
+  TORCH_CHECK(
+      output.scalar_type() == grad.scalar_type(),
+      "output and grad must have the same dtype");
+  TORCH_CHECK(output.size(1) == column_indices.size(0));
+  TORCH_CHECK(row_offsets.dim() == 1 && row_offsets.size(0) > 0);
+  const int64_t num_block_rows = row_offsets.size(0) - 1;
+  check_bsr_layout(
+      row_offsets,
+      column_indices,
+      num_block_rows,
+      std::numeric_limits<int>::max());
+
+  at::Tensor grad_in = at::empty_like(output);
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), 2 * output.size(2)},
+      output.options().dtype(at::toOpMathType(output.scalar_type())));
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      output.scalar_type(),
+      "bsr_softmax_backward",
+      [&] {
+        bsr_softmax_backward_kernel<scalar_t>(
+            output,
+            grad,
+            row_offsets.data_ptr<int>(),
+            num_block_rows,
+            grad_in,
+            buffer);
+      });
+  return grad_in;
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(TORCH_SELECTIVE_NAME("xformers::bsr_sddmm"), TORCH_FN(bsr_sddmm));
+  m.impl(TORCH_SELECTIVE_NAME("xformers::bsr_spmm"), TORCH_FN(bsr_spmm));
+  m.impl(TORCH_SELECTIVE_NAME("xformers::bsr_softmax"), TORCH_FN(bsr_softmax));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::bsr_softmax_backward"),
+      TORCH_FN(bsr_softmax_backward));
+}
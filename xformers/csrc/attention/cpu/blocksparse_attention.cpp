@@ -0,0 +1,600 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+// Fused block-sparse attention on CPU: `softmax(q @ k.T * scale) @ v`,
+// where the scores are only computed for the blocks of a `[heads,
+// M / block_size, N / block_size]` layout (as from `sparsity_config.py` or
+// `attention_patterns.pattern_to_layout`), given as CSR over the block rows
+// of all the heads like for the `bsr_*` operators. Each query block streams
+// its active key blocks with an online softmax, so the score matrix is
+// never stored, and only the logsumexp of every query is kept for the
+// backward pass.
+#include <ATen/ATen.h>
+#include <ATen/OpMathType.h>
+#include <ATen/Parallel.h>
+#include <torch/types.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <tuple>
+
+#include <ATen/cpu/vec/functional.h>
+#include <ATen/cpu/vec/vec.h>
+
+#include "../../cpu/vec_utils.h"
+#include "csr_utils.h"
+
+namespace {
+
+using xformers::cpu::_vec_scale;
+using xformers::cpu::_vec_axpy;
+using xformers::cpu::_vec_dot;
+using xformers::cpu::_pack_transposed;
+
+// Number of keys of block column `c` that query `i` of block row `r` sees:
+// with a causal mask, the diagonal blocks are lower triangular and the
+// blocks above them are skipped
+inline int64_t _num_visible_keys(
+    bool causal,
+    int64_t r,
+    int64_t c,
+    int64_t i,
+    int64_t bs) {
+  if (!causal || c < r) {
+    return bs;
+  }
+  return c == r ? i + 1 : 0;
+}
+
+// Per-thread scratch of `bsr_attention_forward_kernel`
+int64_t _forward_scratch_size(int64_t bs, int64_t K, int64_t Kv) {
+  return bs * K // scaled query block
+      + K * bs // transposed key block
+      + bs * Kv // value block
+      + bs // scores of a query
+      + bs * Kv // output accumulator
+      + 2 * bs; // running max and sum of the online softmax
+}
+
+// Work is split over (batch, head, query block) triplets, balanced by
+// their number of key blocks. Queries without any visible key get a zero
+// output and a logsumexp of -inf.
+template <typename scalar_t>
+void bsr_attention_forward_kernel(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const int* row_offsets,
+    const int* column_indices,
+    int64_t bs,
+    double scale_,
+    bool causal,
+    at::Tensor& output,
+    at::Tensor& logsumexp,
+    at::Tensor& buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  using Vec = at::vec::Vectorized<accum_t>;
+  const int64_t B = query.size(0);
+  const int64_t H = query.size(1);
+  const int64_t M = query.size(2);
+  const int64_t N = key.size(2);
+  const int64_t K = query.size(3);
+  const int64_t Kv = value.size(3);
+  const int64_t num_block_rows = M / bs;
+  const accum_t scale = accum_t(scale_);
+  const accum_t neg_inf = -std::numeric_limits<accum_t>::infinity();
+
+  const scalar_t* q_p = query.data_ptr<scalar_t>();
+  const scalar_t* k_p = key.data_ptr<scalar_t>();
+  const scalar_t* v_p = value.data_ptr<scalar_t>();
+  scalar_t* out_p = output.data_ptr<scalar_t>();
+  float* lse_p = logsumexp.data_ptr<float>();
+  accum_t* buffer_p = buffer.data_ptr<accum_t>();
+
+  xformers::cpu::csr_parallel_for_rows(
+      B, H * num_block_rows, row_offsets, [&](int64_t b, int64_t hr) {
+        accum_t* q_tile = buffer_p + at::get_thread_num() * buffer.size(1);
+        accum_t* kt_tile = q_tile + bs * K;
+        accum_t* v_tile = kt_tile + K * bs;
+        accum_t* si = v_tile + bs * Kv;
+        accum_t* acc = si + bs;
+        accum_t* m_prime = acc + bs * Kv;
+        accum_t* s_prime = m_prime + bs;
+        const int64_t h = hr / num_block_rows;
+        const int64_t r = hr % num_block_rows;
+        const int64_t bh = b * H + h;
+
+        at::vec::convert(q_p + (bh * M + r * bs) * K, q_tile, bs * K);
+        _vec_scale(q_tile, scale, bs * K);
+        std::fill(m_prime, m_prime + bs, neg_inf);
+        std::fill(s_prime, s_prime + bs, accum_t(0));
+        std::fill(acc, acc + bs * Kv, accum_t(0));
+
+        for (int64_t p = row_offsets[hr]; p < row_offsets[hr + 1]; ++p) {
+          const int64_t c = column_indices[p];
+          if (_num_visible_keys(causal, r, c, bs - 1, bs) == 0) {
+            continue;
+          }
+          _pack_transposed(kt_tile, bs, k_p + (bh * N + c * bs) * K, K, bs, K);
+          at::vec::convert(v_p + (bh * N + c * bs) * Kv, v_tile, bs * Kv);
+          for (int64_t i = 0; i < bs; ++i) {
+            const int64_t n_valid = _num_visible_keys(causal, r, c, i, bs);
+            std::fill(si, si + n_valid, accum_t(0));
+            const accum_t* qi = q_tile + i * K;
+            for (int64_t k = 0; k < K; ++k) {
+              _vec_axpy(si, qi[k], kt_tile + k * bs, n_valid);
+            }
+
+            // Online softmax update for the whole block at once
+            accum_t m_i = at::vec::reduce_all<accum_t>(
+                [](Vec& x, Vec& y) { return at::vec::maximum(x, y); },
+                si,
+                n_valid);
+            m_i = std::max(m_i, m_prime[i]);
+            at::vec::map(
+                [m_i](Vec x) { return (x - Vec(m_i)).exp(); },
+                si,
+                si,
+                n_valid);
+            const accum_t m_delta = std::exp(m_prime[i] - m_i);
+            const accum_t s_delta = at::vec::reduce_all<accum_t>(
+                [](Vec& x, Vec& y) { return x + y; }, si, n_valid);
+            s_prime[i] = s_prime[i] * m_delta + s_delta;
+            m_prime[i] = m_i;
+
+            accum_t* acc_i = acc + i * Kv;
+            if (m_delta != accum_t(1)) {
+              _vec_scale(acc_i, m_delta, Kv);
+            }
+            for (int64_t j = 0; j < n_valid; ++j) {
+              _vec_axpy(acc_i, si[j], v_tile + j * Kv, Kv);
+            }
+          }
+        }
+
+        for (int64_t i = 0; i < bs; ++i) {
+          accum_t* acc_i = acc + i * Kv;
+          const bool is_empty = s_prime[i] == accum_t(0);
+          if (!is_empty) {
+            _vec_scale(acc_i, accum_t(1) / s_prime[i], Kv);
+          }
+          const int64_t row = bh * M + r * bs + i;
+          at::vec::convert(acc_i, out_p + row * Kv, Kv);
+          lse_p[row] = is_empty
+              ? -std::numeric_limits<float>::infinity()
+              : static_cast<float>(m_prime[i] + std::log(s_prime[i]));
+        }
+      });
+}
+
+// Per-thread scratch of `bsr_attention_backward_kernel`
+int64_t _backward_scratch_size(int64_t bs, int64_t K, int64_t Kv) {
+  const int64_t shared = (K + Kv) * bs // transposed key and value blocks
+      + 2 * bs; // probabilities and their gradients for one query
+  // query and grad_out rows, grad_k and grad_v accumulators
+  const int64_t dkdv = K + Kv + bs * (K + Kv);
+  // query and grad_out blocks, grad_q accumulator
+  const int64_t dq = bs * (2 * K + Kv);
+  return shared + std::max(dkdv, dq);
+}
+
+// Recomputes, for a query against the first `n_len` keys packed in
+// `kt_tile` / `vt_tile`, the attention probabilities `p` and the gradient
+// of the softmax input `ds = p * (dp - delta)`. `query_i` is already
+// scaled.
+template <typename accum_t>
+inline void _backward_scores(
+    int64_t bs,
+    int64_t n_len,
+    int64_t K,
+    int64_t Kv,
+    const accum_t* query_i,
+    const accum_t* grad_out_i,
+    accum_t lse_i,
+    accum_t delta_i,
+    const accum_t* kt_tile,
+    const accum_t* vt_tile,
+    accum_t* p,
+    accum_t* ds) {
+  using Vec = at::vec::Vectorized<accum_t>;
+  std::fill(p, p + n_len, -lse_i);
+  std::fill(ds, ds + n_len, accum_t(0));
+  for (int64_t k = 0; k < K; k++) {
+    _vec_axpy(p, query_i[k], kt_tile + k * bs, n_len);
+  }
+  for (int64_t k = 0; k < Kv; k++) {
+    _vec_axpy(ds, grad_out_i[k], vt_tile + k * bs, n_len);
+  }
+  at::vec::map([](Vec x) { return x.exp(); }, p, p, n_len);
+  at::vec::map2(
+      [delta_i](Vec pp, Vec dp) { return pp * (dp - Vec(delta_i)); },
+      ds,
+      p,
+      ds,
+      n_len);
+}
+
+// FlashAttention-2 style backward, as for `efficient_attention_backward`
+// on CPU:
+// - `delta = rowsum(grad_out * output)` is computed once per query
+// - dK/dV are computed in parallel over (batch, head, key block) triplets,
+// walking the query blocks of the transposed layout
+// - dQ is computed in parallel over (batch, head, query block) triplets,
+// walking the key blocks of the layout
+template <typename scalar_t>
+void bsr_attention_backward_kernel(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& output,
+    const at::Tensor& logsumexp,
+    const int* row_offsets,
+    const int* column_indices,
+    const int* row_offsets_t,
+    const int* column_indices_t,
+    int64_t bs,
+    double scale_,
+    bool causal,
+    at::Tensor& grad_q,
+    at::Tensor& grad_k,
+    at::Tensor& grad_v,
+    at::Tensor& delta,
+    at::Tensor& buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  const int64_t B = query.size(0);
+  const int64_t H = query.size(1);
+  const int64_t M = query.size(2);
+  const int64_t N = key.size(2);
+  const int64_t K = query.size(3);
+  const int64_t Kv = value.size(3);
+  const int64_t num_block_rows = M / bs;
+  const int64_t num_block_cols = N / bs;
+  const accum_t scale = accum_t(scale_);
+  const float neg_inf = -std::numeric_limits<float>::infinity();
+
+  const scalar_t* go_p = grad_out.data_ptr<scalar_t>();
+  const scalar_t* q_p = query.data_ptr<scalar_t>();
+  const scalar_t* k_p = key.data_ptr<scalar_t>();
+  const scalar_t* v_p = value.data_ptr<scalar_t>();
+  const scalar_t* o_p = output.data_ptr<scalar_t>();
+  const float* lse_p = logsumexp.data_ptr<float>();
+  scalar_t* gq_p = grad_q.data_ptr<scalar_t>();
+  scalar_t* gk_p = grad_k.data_ptr<scalar_t>();
+  scalar_t* gv_p = grad_v.data_ptr<scalar_t>();
+  accum_t* delta_p = delta.data_ptr<accum_t>();
+  accum_t* buffer_p = buffer.data_ptr<accum_t>();
+
+  at::parallel_for(0, B * H * M, bs, [&](int64_t start, int64_t end) {
+    accum_t* grad_out_i = buffer_p + at::get_thread_num() * buffer.size(1);
+    accum_t* output_i = grad_out_i + Kv;
+    for (int64_t row = start; row < end; ++row) {
+      at::vec::convert(go_p + row * Kv, grad_out_i, Kv);
+      at::vec::convert(o_p + row * Kv, output_i, Kv);
+      delta_p[row] = _vec_dot(grad_out_i, output_i, Kv);
+    }
+  });
+
+  // dK and dV
+  xformers::cpu::csr_parallel_for_rows(
+      B, H * num_block_cols, row_offsets_t, [&](int64_t b, int64_t hc) {
+        accum_t* kt_tile = buffer_p + at::get_thread_num() * buffer.size(1);
+        accum_t* vt_tile = kt_tile + K * bs;
+        accum_t* p = vt_tile + Kv * bs;
+        accum_t* ds = p + bs;
+        accum_t* query_i = ds + bs;
+        accum_t* grad_out_i = query_i + K;
+        accum_t* grad_k_acc = grad_out_i + Kv;
+        accum_t* grad_v_acc = grad_k_acc + bs * K;
+        const int64_t h = hc / num_block_cols;
+        const int64_t c = hc % num_block_cols;
+        const int64_t bh = b * H + h;
+        _pack_transposed(kt_tile, bs, k_p + (bh * N + c * bs) * K, K, bs, K);
+        _pack_transposed(vt_tile, bs, v_p + (bh * N + c * bs) * Kv, Kv, bs, Kv);
+        std::fill(grad_k_acc, grad_k_acc + bs * K, accum_t(0));
+        std::fill(grad_v_acc, grad_v_acc + bs * Kv, accum_t(0));
+        for (int64_t p_t = row_offsets_t[hc]; p_t < row_offsets_t[hc + 1];
+             ++p_t) {
+          const int64_t r = column_indices_t[p_t];
+          for (int64_t i = 0; i < bs; ++i) {
+            const int64_t row = bh * M + r * bs + i;
+            const int64_t n_valid = _num_visible_keys(causal, r, c, i, bs);
+            if (lse_p[row] == neg_inf || n_valid == 0) {
+              continue;
+            }
+            at::vec::convert(q_p + row * K, query_i, K);
+            _vec_scale(query_i, scale, K);
+            at::vec::convert(go_p + row * Kv, grad_out_i, Kv);
+            _backward_scores(
+                bs,
+                n_valid,
+                K,
+                Kv,
+                query_i,
+                grad_out_i,
+                accum_t(lse_p[row]),
+                delta_p[row],
+                kt_tile,
+                vt_tile,
+                p,
+                ds);
+            for (int64_t j = 0; j < n_valid; ++j) {
+              _vec_axpy(grad_v_acc + j * Kv, p[j], grad_out_i, Kv);
+              _vec_axpy(grad_k_acc + j * K, ds[j], query_i, K);
+            }
+          }
+        }
+        // Keys in blocks without any query get a zero gradient
+        at::vec::convert(grad_k_acc, gk_p + (bh * N + c * bs) * K, bs * K);
+        at::vec::convert(grad_v_acc, gv_p + (bh * N + c * bs) * Kv, bs * Kv);
+      });
+
+  // dQ
+  xformers::cpu::csr_parallel_for_rows(
+      B, H * num_block_rows, row_offsets, [&](int64_t b, int64_t hr) {
+        accum_t* kt_tile = buffer_p + at::get_thread_num() * buffer.size(1);
+        accum_t* vt_tile = kt_tile + K * bs;
+        accum_t* p = vt_tile + Kv * bs;
+        accum_t* ds = p + bs;
+        accum_t* q_tile = ds + bs;
+        accum_t* grad_out_tile = q_tile + bs * K;
+        accum_t* grad_q_acc = grad_out_tile + bs * Kv;
+        const int64_t h = hr / num_block_rows;
+        const int64_t r = hr % num_block_rows;
+        const int64_t bh = b * H + h;
+        at::vec::convert(q_p + (bh * M + r * bs) * K, q_tile, bs * K);
+        _vec_scale(q_tile, scale, bs * K);
+        at::vec::convert(
+            go_p + (bh * M + r * bs) * Kv, grad_out_tile, bs * Kv);
+        std::fill(grad_q_acc, grad_q_acc + bs * K, accum_t(0));
+        for (int64_t p_r = row_offsets[hr]; p_r < row_offsets[hr + 1]; ++p_r) {
+          const int64_t c = column_indices[p_r];
+          if (_num_visible_keys(causal, r, c, bs - 1, bs) == 0) {
+            continue;
+          }
+          _pack_transposed(kt_tile, bs, k_p + (bh * N + c * bs) * K, K, bs, K);
+          _pack_transposed(
+              vt_tile, bs, v_p + (bh * N + c * bs) * Kv, Kv, bs, Kv);
+          for (int64_t i = 0; i < bs; ++i) {
+            const int64_t row = bh * M + r * bs + i;
+            const int64_t n_valid = _num_visible_keys(causal, r, c, i, bs);
+            if (lse_p[row] == neg_inf || n_valid == 0) {
+              continue;
+            }
+            _backward_scores(
+                bs,
+                n_valid,
+                K,
+                Kv,
+                q_tile + i * K,
+                grad_out_tile + i * Kv,
+                accum_t(lse_p[row]),
+                delta_p[row],
+                kt_tile,
+                vt_tile,
+                p,
+                ds);
+            accum_t* grad_q_i = grad_q_acc + i * K;
+            for (int64_t k = 0; k < K; ++k) {
+              grad_q_i[k] += scale * _vec_dot(ds, kt_tile + k * bs, n_valid);
+            }
+          }
+        }
+        at::vec::convert(grad_q_acc, gq_p + (bh * M + r * bs) * K, bs * K);
+      });
+}
+
+void _check_layout(
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    int64_t num_block_rows,
+    int64_t num_block_cols,
+    const char* name) {
+  TORCH_CHECK(row_offsets.dim() == 1 && column_indices.dim() == 1);
+  TORCH_CHECK(
+      row_offsets.size(0) == num_block_rows + 1,
+      name,
+      ": the layout doesn't match the shape of the inputs");
+  TORCH_CHECK(row_offsets.scalar_type() == at::ScalarType::Int);
+  TORCH_CHECK(column_indices.scalar_type() == at::ScalarType::Int);
+  TORCH_CHECK(!row_offsets.is_cuda(), name, " must be on the CPU");
+  TORCH_CHECK(!column_indices.is_cuda(), name, " must be on the CPU");
+  TORCH_CHECK(row_offsets.is_contiguous() && column_indices.is_contiguous());
+  const int* row_offsets_p = row_offsets.data_ptr<int>();
+  const int* column_indices_p = column_indices.data_ptr<int>();
+  TORCH_CHECK(
+      row_offsets_p[0] == 0 &&
+          row_offsets_p[num_block_rows] == column_indices.size(0),
+      name,
+      ": row_offsets must cover column_indices");
+  for (int64_t r = 0; r < num_block_rows; ++r) {
+    TORCH_CHECK(
+        row_offsets_p[r] <= row_offsets_p[r + 1],
+        name,
+        ": row_offsets must be non-decreasing");
+  }
+  for (int64_t l = 0; l < column_indices.size(0); ++l) {
+    TORCH_CHECK(
+        column_indices_p[l] >= 0 && column_indices_p[l] < num_block_cols,
+        name,
+        ": column_indices out of range");
+  }
+}
+
+void _check_inputs(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    int64_t block_size,
+    bool causal) {
+  TORCH_CHECK(query.dim() == 4, "query must be [batch, heads, seqlen, K]");
+  TORCH_CHECK(key.dim() == 4, "key must be [batch, heads, seqlen, K]");
+  TORCH_CHECK(value.dim() == 4, "value must be [batch, heads, seqlen, Kv]");
+  TORCH_CHECK(query.size(0) == key.size(0) && key.size(0) == value.size(0));
+  TORCH_CHECK(query.size(1) == key.size(1) && key.size(1) == value.size(1));
+  TORCH_CHECK(key.size(2) == value.size(2));
+  TORCH_CHECK(query.size(3) == key.size(3));
+  TORCH_CHECK(block_size > 0);
+  TORCH_CHECK(
+      query.size(2) % block_size == 0 && key.size(2) % block_size == 0,
+      "the sequence lengths must be multiples of the block size");
+  TORCH_CHECK(
+      !causal || query.size(2) == key.size(2),
+      "causal attention requires as many queries as keys");
+  TORCH_CHECK(query.scalar_type() == key.scalar_type());
+  TORCH_CHECK(query.scalar_type() == value.scalar_type());
+  for (const at::Tensor* t : {&query, &key, &value}) {
+    TORCH_CHECK(!t->is_cuda(), "inputs must be CPU tensors");
+    TORCH_CHECK(t->is_contiguous(), "inputs must be contiguous");
+  }
+}
+
+std::tuple<at::Tensor, at::Tensor> bsr_attention_forward(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    int64_t block_size,
+    double scale,
+    bool causal) {
+  _check_inputs(query, key, value, block_size, causal);
+  const int64_t H = query.size(1);
+  _check_layout(
+      row_offsets,
+      column_indices,
+      H * (query.size(2) / block_size),
+      key.size(2) / block_size,
+      "layout");
+
+  at::Tensor output = at::empty(
+      {query.size(0), H, query.size(2), value.size(3)}, query.options());
+  at::Tensor logsumexp = at::empty(
+      {query.size(0), H, query.size(2)},
+      query.options().dtype(at::ScalarType::Float));
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(),
+       _forward_scratch_size(block_size, query.size(3), value.size(3))},
+      query.options().dtype(at::toOpMathType(query.scalar_type())));
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      query.scalar_type(),
+      "bsr_attention_forward",
+      [&] {
+        bsr_attention_forward_kernel<scalar_t>(
+            query,
+            key,
+            value,
+            row_offsets.data_ptr<int>(),
+            column_indices.data_ptr<int>(),
+            block_size,
+            scale,
+            causal,
+            output,
+            logsumexp,
+            buffer);
+      });
+  return std::make_tuple(output, logsumexp);
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor> bsr_attention_backward(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& output,
+    const at::Tensor& logsumexp,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    const at::Tensor& row_offsets_t,
+    const at::Tensor& column_indices_t,
+    int64_t block_size,
+    double scale,
+    bool causal) {
+  _check_inputs(query, key, value, block_size, causal);
+  const int64_t B = query.size(0);
+  const int64_t H = query.size(1);
+  const int64_t M = query.size(2);
+  const int64_t num_block_rows = M / block_size;
+  const int64_t num_block_cols = key.size(2) / block_size;
+  _check_layout(
+      row_offsets,
+      column_indices,
+      H * num_block_rows,
+      num_block_cols,
+      "layout");
+  _check_layout(
+      row_offsets_t,
+      column_indices_t,
+      H * num_block_cols,
+      num_block_rows,
+      "transposed layout");
+  TORCH_CHECK(column_indices_t.size(0) == column_indices.size(0));
+  for (const at::Tensor* t : {&grad_out, &output}) {
+    TORCH_CHECK(
+        t->sizes() == at::IntArrayRef({B, H, M, value.size(3)}),
+        "grad_out and output must be [batch, heads, seqlen, Kv]");
+    TORCH_CHECK(t->scalar_type() == query.scalar_type());
+    TORCH_CHECK(!t->is_cuda(), "inputs must be CPU tensors");
+    TORCH_CHECK(t->is_contiguous(), "inputs must be contiguous");
+  }
+  TORCH_CHECK(logsumexp.sizes() == at::IntArrayRef({B, H, M}));
+  TORCH_CHECK(logsumexp.scalar_type() == at::ScalarType::Float);
+  TORCH_CHECK(!logsumexp.is_cuda() && logsumexp.is_contiguous());
+
+  at::Tensor grad_q = at::empty_like(query);
+  at::Tensor grad_k = at::empty_like(key);
+  at::Tensor grad_v = at::empty_like(value);
+  const auto accum_options =
+      query.options().dtype(at::toOpMathType(query.scalar_type()));
+  at::Tensor delta = at::empty({B, H, M}, accum_options);
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(),
+       _backward_scratch_size(block_size, query.size(3), value.size(3))},
+      accum_options);
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      query.scalar_type(),
+      "bsr_attention_backward",
+      [&] {
+        bsr_attention_backward_kernel<scalar_t>(
+            grad_out,
+            query,
+            key,
+            value,
+            output,
+            logsumexp,
+            row_offsets.data_ptr<int>(),
+            column_indices.data_ptr<int>(),
+            row_offsets_t.data_ptr<int>(),
+            column_indices_t.data_ptr<int>(),
+            block_size,
+            scale,
+            causal,
+            grad_q,
+            grad_k,
+            grad_v,
+            delta,
+            buffer);
+      });
+  return std::make_tuple(grad_q, grad_k, grad_v);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::bsr_attention_forward"),
+      TORCH_FN(bsr_attention_forward));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::bsr_attention_backward"),
+      TORCH_FN(bsr_attention_backward));
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#pragma once
+
+#include <ATen/ATen.h>
+#include <ATen/Parallel.h>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace xformers {
+namespace cpu {
+
+// Chunks of rows per thread in `csr_parallel_for_rows`
+constexpr int64_t kCsrChunksPerThread = 4;
+
+// Work needed for the first `row` rows of a batch of CSR matrices sharing
+// the sparsity pattern `row_offsets`: one unit per nonzero, and one per row
+template <typename index_t>
+inline int64_t csr_rows_cost(
+    const index_t* row_offsets,
+    int64_t m,
+    int64_t row) {
+  const int64_t nonzeros = row_offsets[m] - row_offsets[0];
+  const int64_t b = row / m;
+  const int64_t i = row % m;
+  return b * (nonzeros + m) + row_offsets[i] - row_offsets[0] + i;
+}
+
+// Calls `f(b, i)` for every row `i < m` of every batch element
+// `b < batch_size`, in parallel. The rows are split in chunks of roughly
+// the same number of nonzeros, a few per thread, so that a skewed sparsity
+// pattern (e.g. a handful of dense "global" rows) doesn't serialize on a
+// single thread.
+template <typename index_t, typename F>
+void csr_parallel_for_rows(
+    int64_t batch_size,
+    int64_t m,
+    const index_t* row_offsets,
+    const F& f) {
+  const int64_t num_rows = batch_size * m;
+  if (num_rows == 0) {
+    return;
+  }
+
+  // Chunk c covers rows [chunk_rows[c], chunk_rows[c + 1])
+  const int64_t num_chunks =
+      std::min(num_rows, at::get_num_threads() * kCsrChunksPerThread);
+  const int64_t total_cost = csr_rows_cost(row_offsets, m, num_rows);
+  std::vector<int64_t> chunk_rows(num_chunks + 1, num_rows);
+  chunk_rows[0] = 0;
+  for (int64_t c = 1; c < num_chunks; c++) {
+    const int64_t target = total_cost * c / num_chunks;
+    int64_t lo = chunk_rows[c - 1];
+    int64_t hi = num_rows;
+    while (lo < hi) {
+      const int64_t mid = lo + (hi - lo) / 2;
+      if (csr_rows_cost(row_offsets, m, mid) < target) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    chunk_rows[c] = lo;
+  }
+
+  at::parallel_for(0, num_chunks, 1, [&](int64_t begin, int64_t end) {
+    for (int64_t row = chunk_rows[begin]; row < chunk_rows[end]; row++) {
+      f(row / m, row % m);
+    }
+  });
+}
+
+// Offsets of the rows of `batch_size` CSR matrices of `m` rows, each with its
+// own sparsity pattern, whose nonzeros are concatenated: `row_offsets` is
+// `[batch_size, m + 1]`, relative to each matrix, and matrix `b` starts at
+// `batch_offsets[b]` in the concatenation. Row `i` of matrix `b` covers
+// `[offsets[b * m + i], offsets[b * m + i + 1])` of the concatenation, so
+// that the batch can be processed as a single matrix of `batch_size * m` rows
+// with `csr_parallel_for_rows`.
+inline std::vector<int64_t> csr_batched_row_offsets(
+    const int* row_offsets,
+    const int* batch_offsets,
+    int64_t batch_size,
+    int64_t m) {
+  std::vector<int64_t> offsets(batch_size * m + 1);
+  offsets[0] = batch_offsets[0];
+  for (int64_t b = 0; b < batch_size; b++) {
+    const int* matrix_offsets = row_offsets + b * (m + 1);
+    TORCH_CHECK(
+        matrix_offsets[m] - matrix_offsets[0] ==
+            batch_offsets[b + 1] - batch_offsets[b],
+        "row_offsets and batch_offsets disagree on the number of nonzeros "
+        "of batch element ",
+        b);
+    for (int64_t i = 0; i < m; i++) {
+      TORCH_CHECK(
+          matrix_offsets[i] <= matrix_offsets[i + 1],
+          "row_offsets must be non-decreasing");
+      offsets[b * m + i + 1] =
+          batch_offsets[b] + matrix_offsets[i + 1] - matrix_offsets[0];
+    }
+  }
+  return offsets;
+}
+
+// Checks the sparsity patterns of a batch of `batch_size` CSR matrices of `m`
+// rows, as described in `csr_batched_row_offsets`
+inline void check_batched_csr_inputs(
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    const at::Tensor& batch_offsets,
+    int64_t batch_size,
+    int64_t m) {
+  TORCH_CHECK(row_offsets.dim() == 2);
+  TORCH_CHECK(column_indices.dim() == 1);
+  TORCH_CHECK(batch_offsets.dim() == 1);
+  TORCH_CHECK(row_offsets.size(0) == batch_size);
+  TORCH_CHECK(row_offsets.size(1) == m + 1);
+  TORCH_CHECK(batch_offsets.size(0) == batch_size + 1);
+  TORCH_CHECK(row_offsets.scalar_type() == at::ScalarType::Int);
+  TORCH_CHECK(column_indices.scalar_type() == at::ScalarType::Int);
+  TORCH_CHECK(batch_offsets.scalar_type() == at::ScalarType::Int);
+
+  TORCH_CHECK(!row_offsets.is_cuda(), "row_offsets must be a CPU tensor");
+  TORCH_CHECK(!column_indices.is_cuda(), "column_indices must be a CPU tensor");
+  TORCH_CHECK(!batch_offsets.is_cuda(), "batch_offsets must be a CPU tensor");
+
+  TORCH_CHECK(
+      row_offsets.is_contiguous(), "row_offsets must be a contiguous tensor");
+  TORCH_CHECK(
+      column_indices.is_contiguous(),
+      "column_indices must be a contiguous tensor");
+  TORCH_CHECK(
+      batch_offsets.is_contiguous(),
+      "batch_offsets must be a contiguous tensor");
+
+  TORCH_CHECK(!row_offsets.is_sparse(), "row_offsets must be a dense tensor");
+  TORCH_CHECK(
+      !column_indices.is_sparse(), "column_indices must be a dense tensor");
+  TORCH_CHECK(
+      !batch_offsets.is_sparse(), "batch_offsets must be a dense tensor");
+
+  const int* batch_offsets_p = batch_offsets.data_ptr<int>();
+  TORCH_CHECK(
+      batch_offsets_p[0] == 0 &&
+          batch_offsets_p[batch_size] == column_indices.size(0),
+      "batch_offsets must cover column_indices, from 0 to its size");
+}
+
+} // namespace cpu
+} // namespace xformers
@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/OpMathType.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
+#include <ATen/cpu/vec/functional.h>
+#include <ATen/cpu/vec/vec.h>
+
+#include "../../cpu/vec_utils.h"
+
+namespace {
+
+using xformers::cpu::_load_row;
+using xformers::cpu::_vec_scale;
+using xformers::cpu::_vec_axpy;
+using xformers::cpu::_vec_dot;
+
+// CPU counterpart of `cuda/fmha/decoder.cu`: a single query token per
+// (batch, head) attends to the first `seq_positions[b]` entries of a
+// [B, T, H or 1, D] KV cache.
+//
+// Work is split over (batch, head, cache split) triples, with the keys of
+// every batch element divided evenly between the splits as in the CUDA
+// split-K kernel. Each split runs an online softmax over its keys and
+// writes its normalized partial output and logsumexp; a second pass merges
+// the splits of every (batch, head). Passing `split_k` explicitly makes
+// this a reference for the CUDA split / merge.
+//
+// The cache is read as pages of `page_size` keys: with a block table
+// ([B, max_pages]) the p-th page of batch element b is page
+// `block_tables[b][p]` of a [num_pages, page_size, H or 1, D] pool, and
+// without one every batch element is a single page of T keys.
+
+// Keys scored at a time: the softmax state is rescaled once per block
+constexpr int64_t kBlockT = 64;
+// Keys below which splitting the cache further is not worth a merge
+constexpr int64_t kMinSplitT = 256;
+
+// Number of splits of the cache of each (batch, head): enough to give
+// every thread some work, but with at least `kMinSplitT` keys per split
+int64_t _num_splits(int64_t BH, int64_t T) {
+  const int64_t num_threads = at::get_num_threads();
+  const int64_t max_splits = std::max<int64_t>(1, T / kMinSplitT);
+  const int64_t splits = (num_threads + BH - 1) / BH;
+  return std::max<int64_t>(1, std::min(splits, max_splits));
+}
+
+// Number of elements of per-thread scratch used by `mqa_attn_kernel`
+int64_t _decoder_scratch_size(int64_t D) {
+  return D // scaled query
+      + kBlockT * D // converted key / value rows
+      + kBlockT; // scores / probabilities
+}
+
+template <typename scalar_t, typename accum_t = at::opmath_type<scalar_t>>
+void mqa_attn_kernel(
+    at::TensorAccessor<scalar_t, 4> XQ,
+    at::TensorAccessor<scalar_t, 4> cache_K,
+    at::TensorAccessor<scalar_t, 4> cache_V,
+    at::TensorAccessor<scalar_t, 4> O,
+    at::TensorAccessor<int32_t, 1> seq_positions,
+    at::TensorAccessor<int32_t, 2> block_tables,
+    accum_t qk_scale,
+    at::TensorAccessor<accum_t, 2> O_splits,
+    at::TensorAccessor<accum_t, 1> LSE_splits,
+    at::TensorAccessor<accum_t, 2> buffer) {
+  using Vec = at::vec::Vectorized<accum_t>;
+  const int64_t B = XQ.size(0);
+  const int64_t H = XQ.size(2);
+  const int64_t D = XQ.size(3);
+  const int64_t num_splits = LSE_splits.size(0) / (B * H);
+  const int64_t page_size = cache_K.size(1);
+  const bool paged = block_tables.data() != nullptr;
+  const bool multiquery = cache_K.size(2) == 1;
+  const accum_t neg_inf = -std::numeric_limits<accum_t>::infinity();
+  int64_t grain_size = 1;
+
+  at::parallel_for(
+      0, B * H * num_splits, grain_size, [&](int64_t start, int64_t end) {
+        accum_t* q = buffer[at::get_thread_num()].data();
+        accum_t* kv_tile = q + D;
+        accum_t* s = kv_tile + kBlockT * D;
+        for (int64_t w = start; w < end; w++) {
+          const int64_t b = w / (H * num_splits);
+          const int64_t h = (w / num_splits) % H;
+          const int64_t split = w % num_splits;
+          const int64_t hk = multiquery ? 0 : h;
+          const int64_t t_max = seq_positions[b];
+          const int64_t split_t = (t_max + num_splits - 1) / num_splits;
+          const int64_t t_begin = std::min(split * split_t, t_max);
+          const int64_t t_end = std::min(t_begin + split_t, t_max);
+
+          accum_t* acc = O_splits[w].data();
+          accum_t m_prime = neg_inf;
+          accum_t s_prime = 0;
+          std::fill(acc, acc + D, accum_t(0));
+          at::vec::convert(XQ[b][0][h].data(), q, D);
+          _vec_scale(q, qk_scale, D);
+
+          for (int64_t t0 = t_begin; t0 < t_end; t0 += kBlockT) {
+            const int64_t t_len = std::min(kBlockT, t_end - t0);
+            for (int64_t c = 0; c < t_len; c++) {
+              const int64_t t = t0 + c;
+              const int64_t page = paged ? block_tables[b][t / page_size] : b;
+              const accum_t* k_row = _load_row(
+                  cache_K[page][t % page_size][hk].data(), kv_tile + c * D, D);
+              s[c] = _vec_dot(q, k_row, D);
+            }
+
+            // Online softmax update for the whole block at once
+            accum_t m_i = at::vec::reduce_all<accum_t>(
+                [](Vec& x, Vec& y) { return at::vec::maximum(x, y); },
+                s,
+                t_len);
+            m_i = std::max(m_i, m_prime);
+            at::vec::map(
+                [m_i](Vec x) { return (x - Vec(m_i)).exp(); }, s, s, t_len);
+            const accum_t m_delta = std::exp(m_prime - m_i);
+            s_prime = s_prime * m_delta +
+                at::vec::reduce_all<accum_t>(
+                          [](Vec& x, Vec& y) { return x + y; }, s, t_len);
+            m_prime = m_i;
+            if (m_delta != accum_t(1)) {
+              _vec_scale(acc, m_delta, D);
+            }
+            for (int64_t c = 0; c < t_len; c++) {
+              const int64_t t = t0 + c;
+              const int64_t page = paged ? block_tables[b][t / page_size] : b;
+              const accum_t* v_row = _load_row(
+                  cache_V[page][t % page_size][hk].data(), kv_tile + c * D, D);
+              _vec_axpy(acc, s[c], v_row, D);
+            }
+          }
+          if (s_prime > 0) {
+            _vec_scale(acc, accum_t(1) / s_prime, D);
+            LSE_splits[w] = m_prime + std::log(s_prime);
+          } else {
+            // Empty split
+            LSE_splits[w] = neg_inf;
+          }
+          if (num_splits == 1) {
+            at::vec::convert(acc, O[b][0][h].data(), D);
+          }
+        }
+      });
+  if (num_splits == 1) {
+    return;
+  }
+
+  // Merge the splits of every (batch, head)
+  at::parallel_for(0, B * H, grain_size, [&](int64_t start, int64_t end) {
+    accum_t* out = buffer[at::get_thread_num()].data();
+    for (int64_t w = start; w < end; w++) {
+      const int64_t b = w / H;
+      const int64_t h = w % H;
+      accum_t lse_max = neg_inf;
+      for (int64_t split = 0; split < num_splits; split++) {
+        lse_max = std::max(lse_max, LSE_splits[w * num_splits + split]);
+      }
+      std::fill(out, out + D, accum_t(0));
+      // Every split is empty if the maximum is -inf: the output is zero
+      if (lse_max != neg_inf) {
+        accum_t denominator = 0;
+        for (int64_t split = 0; split < num_splits; split++) {
+          const accum_t lse = LSE_splits[w * num_splits + split];
+          if (lse == neg_inf) {
+            continue;
+          }
+          const accum_t alpha = std::exp(lse - lse_max);
+          denominator += alpha;
+          _vec_axpy(out, alpha, O_splits[w * num_splits + split].data(), D);
+        }
+        _vec_scale(out, accum_t(1) / denominator, D);
+      }
+      at::vec::convert(out, O[b][0][h].data(), D);
+    }
+  });
+}
+
+// Shared by the contiguous and paged entry points. `block_tables` is
+// undefined for a contiguous cache
+at::Tensor mqa_attn_impl(
+    const at::Tensor& XQ,
+    const at::Tensor& cache_K,
+    const at::Tensor& cache_V,
+    const at::Tensor& seq_positions,
+    const at::Tensor& block_tables,
+    double qk_scale,
+    c10::optional<int64_t> split_k) {
+  TORCH_CHECK(!XQ.is_cuda(), "query must be a CPU tensor");
+  TORCH_CHECK(!cache_K.is_cuda(), "key must be a CPU tensor");
+  TORCH_CHECK(!cache_V.is_cuda(), "value must be a CPU tensor");
+  TORCH_CHECK(!seq_positions.is_cuda(), "seq_positions must be a CPU tensor");
+
+  TORCH_CHECK(XQ.dim() == 4);
+  TORCH_CHECK(cache_K.dim() == 4);
+  TORCH_CHECK(cache_V.dim() == 4);
+  TORCH_CHECK(XQ.size(1) == 1, "decoding expects a single query");
+  TORCH_CHECK(cache_K.sizes() == cache_V.sizes());
+  TORCH_CHECK(cache_K.size(2) == 1 || cache_K.size(2) == XQ.size(2));
+  TORCH_CHECK(cache_K.size(3) == XQ.size(3));
+  TORCH_CHECK(XQ.scalar_type() == cache_K.scalar_type());
+  TORCH_CHECK(XQ.scalar_type() == cache_V.scalar_type());
+  TORCH_CHECK(
+      XQ.stride(3) == 1 && cache_K.stride(3) == 1 && cache_V.stride(3) == 1,
+      "expects the head dimension to be contiguous");
+
+  TORCH_CHECK(seq_positions.dim() == 1);
+  TORCH_CHECK(seq_positions.size(0) == XQ.size(0));
+  TORCH_CHECK(seq_positions.scalar_type() == at::ScalarType::Int);
+
+  const int64_t B = XQ.size(0);
+  const int64_t H = XQ.size(2);
+  const int64_t D = XQ.size(3);
+  const int64_t page_size = cache_K.size(1);
+  // Longest sequence the cache can hold
+  const int64_t T = block_tables.defined()
+      ? block_tables.size(1) * page_size
+      : page_size;
+  auto positions = seq_positions.accessor<int32_t, 1>();
+  for (int64_t b = 0; b < B; b++) {
+    TORCH_CHECK(
+        positions[b] >= 0 && positions[b] <= T,
+        "seq_positions must be in [0, ",
+        T,
+        "]");
+  }
+  if (block_tables.defined()) {
+    auto tables = block_tables.accessor<int32_t, 2>();
+    const int64_t num_pages = cache_K.size(0);
+    for (int64_t b = 0; b < B; b++) {
+      for (int64_t p = 0; p * page_size < positions[b]; p++) {
+        TORCH_CHECK(
+            tables[b][p] >= 0 && tables[b][p] < num_pages,
+            "block_tables[",
+            b,
+            "][",
+            p,
+            "] is not a page of the cache");
+      }
+    }
+  }
+
+  const int64_t num_splits =
+      split_k.has_value() ? *split_k : _num_splits(B * H, T);
+  TORCH_CHECK(num_splits >= 1, "invalid split_k");
+
+  auto O = at::empty_like(XQ);
+  const auto accum_options =
+      XQ.options().dtype(at::toOpMathType(XQ.scalar_type()));
+  at::Tensor O_splits = at::empty({B * H * num_splits, D}, accum_options);
+  at::Tensor LSE_splits = at::empty({B * H * num_splits}, accum_options);
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), _decoder_scratch_size(D)}, accum_options);
+  const std::array<int64_t, 2> zeros{{0}};
+  auto tables = block_tables.defined()
+      ? block_tables.accessor<int32_t, 2>()
+      : at::TensorAccessor<int32_t, 2>(nullptr, zeros.data(), zeros.data());
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      XQ.scalar_type(),
+      "mqa_attn_kernel",
+      [&] {
+        using accum_t = at::opmath_type<scalar_t>;
+        mqa_attn_kernel<scalar_t>(
+            XQ.accessor<scalar_t, 4>(),
+            cache_K.accessor<scalar_t, 4>(),
+            cache_V.accessor<scalar_t, 4>(),
+            O.accessor<scalar_t, 4>(),
+            positions,
+            tables,
+            static_cast<accum_t>(qk_scale),
+            O_splits.accessor<accum_t, 2>(),
+            LSE_splits.accessor<accum_t, 1>(),
+            buffer.accessor<accum_t, 2>());
+      });
+  return O;
+}
+
+at::Tensor mqa_attn(
+    const at::Tensor& XQ, // [B, 1, H, D]
+    const at::Tensor& cache_K, // [B, T, H or 1, D]
+    const at::Tensor& cache_V, // [B, T, H or 1, D]
+    const at::Tensor& seq_positions, // [B]
+    double qk_scale,
+    c10::optional<int64_t> split_k) {
+  TORCH_CHECK(cache_K.dim() == 4 && cache_K.size(0) == XQ.size(0));
+  return mqa_attn_impl(
+      XQ, cache_K, cache_V, seq_positions, at::Tensor(), qk_scale, split_k);
+}
+
+at::Tensor mqa_attn_paged(
+    const at::Tensor& XQ, // [B, 1, H, D]
+    const at::Tensor& cache_K, // [num_pages, page_size, H or 1, D]
+    const at::Tensor& cache_V, // [num_pages, page_size, H or 1, D]
+    const at::Tensor& seq_positions, // [B]
+    const at::Tensor& block_tables, // [B, max_pages]
+    double qk_scale,
+    c10::optional<int64_t> split_k) {
+  TORCH_CHECK(!block_tables.is_cuda(), "block_tables must be a CPU tensor");
+  TORCH_CHECK(block_tables.dim() == 2);
+  TORCH_CHECK(block_tables.size(0) == XQ.size(0));
+  TORCH_CHECK(block_tables.scalar_type() == at::ScalarType::Int);
+  return mqa_attn_impl(
+      XQ, cache_K, cache_V, seq_positions, block_tables, qk_scale, split_k);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::efficient_attention_forward_decoder"),
+      TORCH_FN(mqa_attn));
+  m.impl(
+      TORCH_SELECTIVE_NAME(
+          "xformers::efficient_attention_forward_decoder_paged"),
+      TORCH_FN(mqa_attn_paged));
+}
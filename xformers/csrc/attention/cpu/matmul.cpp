@@ -6,36 +6,79 @@
  * LICENSE file in the root directory of this source tree.
  */
 #include <ATen/ATen.h>
+#include <ATen/OpMathType.h>
 #include <ATen/Parallel.h>
 #include <torch/library.h>
-#include <cmath>
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <type_traits>
 #include <vector>
 
+#include <ATen/cpu/vec/functional.h>
+#include <ATen/cpu/vec/vec.h>
+
+#include "../../cpu/gemm_utils.h"
+#include "../../cpu/vec_utils.h"
+#include "csr_utils.h"
+
 namespace {
 
+using xformers::cpu::_load_row;
+using xformers::cpu::_vec_dot;
+
+// Offsets of the rows `(b, i)` of a coalesced mask: its indices are sorted,
+// so the nonzeros of a row are contiguous. Empty rows are skipped.
+std::vector<int64_t> _coo_row_offsets(const int64_t* idxs, int64_t nnz) {
+  std::vector<int64_t> row_offsets;
+  for (int64_t j = 0; j < nnz; j++) {
+    if (j == 0 || idxs[j] != idxs[j - 1] ||
+        idxs[nnz + j] != idxs[nnz + j - 1]) {
+      row_offsets.push_back(j);
+    }
+  }
+  row_offsets.push_back(nnz);
+  return row_offsets;
+}
+
+// `output[j] = a[b, i] . bt[b, k]` for the nonzeros `j = (b, i, k)` of the
+// mask, processed row by row: each row of `a` is loaded once for all its
+// nonzeros, and the rows are split between threads by number of nonzeros
 template <typename scalar_t>
 void matmul_with_sparse_mask_kernel(
-    at::TensorAccessor<scalar_t, 1> output,
-    at::TensorAccessor<scalar_t, 3> a,
-    at::TensorAccessor<scalar_t, 3> b,
-    at::TensorAccessor<int64_t, 2> idxs) {
-  int64_t nnz = output.size(0);
-  int64_t K = a.size(2);
-  int64_t grain_size = 128; // TODO: tune this
-  at::parallel_for(0, nnz, grain_size, [&](int64_t start, int64_t end) {
-    for (int64_t i = start; i < end; i++) {
-      auto i1 = idxs[0][i];
-      auto i2 = idxs[1][i];
-      auto i3 = idxs[2][i];
-      auto aar = a[i1][i2];
-      auto bar = b[i1][i3];
-      scalar_t r = 0;
-      for (int64_t k = 0; k < K; k++) {
-        r += aar[k] * bar[k];
-      }
-      output[i] = r;
-    }
-  });
+    at::Tensor& output,
+    const at::Tensor& a,
+    const at::Tensor& bt,
+    const at::Tensor& idxs,
+    at::Tensor& buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  const int64_t nnz = output.size(0);
+  const int64_t M = a.size(1);
+  const int64_t N = bt.size(1);
+  const int64_t K = a.size(2);
+  const scalar_t* a_p = a.data_ptr<scalar_t>();
+  const scalar_t* bt_p = bt.data_ptr<scalar_t>();
+  const int64_t* idxs_p = idxs.data_ptr<int64_t>();
+  scalar_t* output_p = output.data_ptr<scalar_t>();
+  accum_t* buffer_p = buffer.data_ptr<accum_t>();
+
+  const std::vector<int64_t> row_offsets = _coo_row_offsets(idxs_p, nnz);
+  const int64_t num_rows = row_offsets.size() - 1;
+  xformers::cpu::csr_parallel_for_rows(
+      1, num_rows, row_offsets.data(), [&](int64_t, int64_t r) {
+        accum_t* a_buf = buffer_p + at::get_thread_num() * 2 * K;
+        accum_t* b_buf = a_buf + K;
+        const int64_t first = row_offsets[r];
+        const int64_t b = idxs_p[first];
+        const accum_t* a_row =
+            _load_row(a_p + (b * M + idxs_p[nnz + first]) * K, a_buf, K);
+        const scalar_t* bt_batch = bt_p + b * N * K;
+        for (int64_t j = first; j < row_offsets[r + 1]; j++) {
+          const accum_t* b_row =
+              _load_row(bt_batch + idxs_p[2 * nnz + j] * K, b_buf, K);
+          output_p[j] = static_cast<scalar_t>(_vec_dot(a_row, b_row, K));
+        }
+      });
 }
 
 at::Tensor matmul_with_sparse_mask(
@@ -50,6 +93,8 @@ at::Tensor matmul_with_sparse_mask(
   TORCH_CHECK(a.size(1) == mask.size(1));
   TORCH_CHECK(b.size(2) == mask.size(2));
   TORCH_CHECK(a.size(0) == mask.size(0));
+  TORCH_CHECK(
+      a.scalar_type() == b.scalar_type(), "a and b must have the same dtype");
 
   TORCH_CHECK(!a.is_cuda(), "a must be a CPU tensor");
   TORCH_CHECK(!b.is_cuda(), "b must be a CPU tensor");
@@ -62,30 +107,372 @@ at::Tensor matmul_with_sparse_mask(
   int64_t B = a.size(0);
   int64_t M = a.size(1);
   int64_t N = b.size(2);
+  int64_t K = a.size(2);
 
-  auto mask_ = mask.coalesce();
-  auto idxs = mask_.indices();
+  // Masks built as coalesced (see `_broadcast_batch`) don't need to be
+  // sorted again
+  auto mask_ = mask.is_coalesced() ? mask : mask.coalesce();
+  auto idxs = mask_.indices().contiguous();
   int64_t nnz = idxs.size(1);
-  auto bt = b.transpose(-2, -1);
+  // Rows of `a` and columns of `b` are read contiguously
+  auto a_ = a.contiguous();
+  auto bt = b.transpose(-2, -1).contiguous();
 
   at::Tensor res = at::empty({nnz}, a.options());
+  // Rows of `a` and `b` converted to the accumulation type, per thread
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), 2 * K},
+      a.options().dtype(at::toOpMathType(a.scalar_type())));
 
-  AT_DISPATCH_FLOATING_TYPES(
-      a.scalar_type(), "matmul_with_sparse_mask_kernel", [&] {
-        matmul_with_sparse_mask_kernel<scalar_t>(
-            res.accessor<scalar_t, 1>(),
-            a.accessor<scalar_t, 3>(),
-            bt.accessor<scalar_t, 3>(),
-            idxs.accessor<int64_t, 2>());
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      a.scalar_type(),
+      "matmul_with_sparse_mask_kernel",
+      [&] {
+        matmul_with_sparse_mask_kernel<scalar_t>(res, a_, bt, idxs, buffer);
       });
 
+  // The indices are those of the coalesced mask
   auto out = at::sparse_coo_tensor(idxs, res, {B, M, N});
+  out._coalesced_(true);
+
+  return out;
+}
+
+// Output tiles of the dense-mask kernels
+constexpr int64_t kBlockM = 64;
+constexpr int64_t kBlockN = 128;
+
+// Entries of an output tile that are in the mask
+enum class TileMask : int8_t { kNone, kPartial, kFull };
+
+// Tiles of the dense-mask kernels, for `[B, M, N]` outputs
+struct MaskTiles {
+  int64_t B, M, N;
+  int64_t num_m_blocks, num_n_blocks;
+  const bool* mask_p;
+  std::array<int64_t, 3> mask_strides;
+  std::vector<TileMask> tiles;
+
+  TileMask tile(int64_t b, int64_t mb, int64_t nb) const {
+    return tiles[(b * num_m_blocks + mb) * num_n_blocks + nb];
+  }
+  bool in_mask(int64_t b, int64_t m, int64_t n) const {
+    return mask_p
+        [b * mask_strides[0] + m * mask_strides[1] + n * mask_strides[2]];
+  }
+};
+
+// `mask` is a boolean `[B, M, N]` tensor, possibly broadcast
+MaskTiles _mask_tiles(const at::Tensor& mask) {
+  MaskTiles t;
+  t.B = mask.size(0);
+  t.M = mask.size(1);
+  t.N = mask.size(2);
+  t.num_m_blocks = (t.M + kBlockM - 1) / kBlockM;
+  t.num_n_blocks = (t.N + kBlockN - 1) / kBlockN;
+  t.mask_p = mask.data_ptr<bool>();
+  t.mask_strides = {mask.stride(0), mask.stride(1), mask.stride(2)};
+  t.tiles.resize(t.B * t.num_m_blocks * t.num_n_blocks);
+  const int64_t grain_size =
+      std::max<int64_t>(1, at::internal::GRAIN_SIZE / (kBlockM * kBlockN));
+  at::parallel_for(
+      0, t.tiles.size(), grain_size, [&](int64_t start, int64_t end) {
+        for (int64_t i = start; i < end; i++) {
+          const int64_t b = i / (t.num_m_blocks * t.num_n_blocks);
+          const int64_t m0 = (i / t.num_n_blocks % t.num_m_blocks) * kBlockM;
+          const int64_t n0 = (i % t.num_n_blocks) * kBlockN;
+          int64_t count = 0;
+          for (int64_t m = m0; m < std::min(m0 + kBlockM, t.M); m++) {
+            for (int64_t n = n0; n < std::min(n0 + kBlockN, t.N); n++) {
+              count += t.in_mask(b, m, n);
+            }
+          }
+          const int64_t size =
+              std::min(kBlockM, t.M - m0) * std::min(kBlockN, t.N - n0);
+          t.tiles[i] = count == 0 ? TileMask::kNone
+              : count == size     ? TileMask::kFull
+                                  : TileMask::kPartial;
+        }
+      });
+  return t;
+}
+
+// `out = a @ b`, with `-inf` outside of the mask. Tiles without any entry
+// in the mask are filled directly, without computing their GEMM.
+template <typename scalar_t>
+void matmul_with_dense_mask_kernel(
+    at::Tensor& out,
+    const at::Tensor& a,
+    const at::Tensor& b,
+    const MaskTiles& t) {
+  using accum_t = at::opmath_type<scalar_t>;
+  const scalar_t neg_inf = -std::numeric_limits<scalar_t>::infinity();
+  const int64_t K = a.size(2);
+  scalar_t* out_p = out.data_ptr<scalar_t>();
+  at::parallel_for(0, t.tiles.size(), 1, [&](int64_t start, int64_t end) {
+    for (int64_t i = start; i < end; i++) {
+      const int64_t bi = i / (t.num_m_blocks * t.num_n_blocks);
+      const int64_t mb = i / t.num_n_blocks % t.num_m_blocks;
+      const int64_t nb = i % t.num_n_blocks;
+      const int64_t m0 = mb * kBlockM;
+      const int64_t n0 = nb * kBlockN;
+      const int64_t m_len = std::min(kBlockM, t.M - m0);
+      const int64_t n_len = std::min(kBlockN, t.N - n0);
+      const TileMask tile = t.tile(bi, mb, nb);
+      if (tile != TileMask::kNone) {
+        xformers::cpu::gemm<scalar_t>(
+            m_len,
+            n_len,
+            K,
+            accum_t(1),
+            xformers::cpu::gemm_operand<scalar_t>(a, bi).block(m0, 0),
+            xformers::cpu::gemm_operand<scalar_t>(b, bi).block(0, n0),
+            accum_t(0),
+            out_p + (bi * t.M + m0) * t.N + n0,
+            t.N);
+      }
+      if (tile == TileMask::kFull) {
+        continue;
+      }
+      for (int64_t m = m0; m < m0 + m_len; m++) {
+        scalar_t* out_row = out_p + (bi * t.M + m) * t.N;
+        for (int64_t n = n0; n < n0 + n_len; n++) {
+          if (tile == TileMask::kNone || !t.in_mask(bi, m, n)) {
+            out_row[n] = neg_inf;
+          }
+        }
+      }
+    }
+  });
+}
+
+// Tile of `grad` at `(bi, mb, nb)`, with zeros outside of the mask. Tiles
+// partially in the mask are copied to `buf`, which holds `kBlockM * kBlockN`
+// elements.
+template <typename scalar_t>
+xformers::cpu::GemmOperand<scalar_t> _masked_grad_tile(
+    const at::Tensor& grad,
+    const MaskTiles& t,
+    int64_t bi,
+    int64_t mb,
+    int64_t nb,
+    scalar_t* buf) {
+  const int64_t m0 = mb * kBlockM;
+  const int64_t n0 = nb * kBlockN;
+  const int64_t m_len = std::min(kBlockM, t.M - m0);
+  const int64_t n_len = std::min(kBlockN, t.N - n0);
+  const auto grad_tile =
+      xformers::cpu::gemm_operand<scalar_t>(grad, bi).block(m0, n0);
+  if (t.tile(bi, mb, nb) == TileMask::kFull) {
+    return grad_tile;
+  }
+  for (int64_t m = 0; m < m_len; m++) {
+    for (int64_t n = 0; n < n_len; n++) {
+      buf[m * n_len + n] = t.in_mask(bi, m0 + m, n0 + n)
+          ? grad_tile.data[m * grad_tile.stride0 + n * grad_tile.stride1]
+          : scalar_t(0);
+    }
+  }
+  return {buf, n_len, 1};
+}
+
+// `grad_a = (grad * mask) @ b.T` and `grad_b = a.T @ (grad * mask)`, from
+// the tiles with entries in the mask only
+template <typename scalar_t>
+void matmul_with_dense_mask_backward_kernel(
+    const at::Tensor& grad,
+    const at::Tensor& a,
+    const at::Tensor& b,
+    const MaskTiles& t,
+    at::Tensor& grad_a,
+    at::Tensor& grad_b,
+    const at::Tensor& buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  const int64_t K = a.size(2);
+  scalar_t* buffer_p = buffer.data_ptr<scalar_t>();
+  if (grad_a.defined()) {
+    scalar_t* grad_a_p = grad_a.data_ptr<scalar_t>();
+    at::parallel_for(
+        0, t.B * t.num_m_blocks, 1, [&](int64_t start, int64_t end) {
+          scalar_t* buf = buffer_p + at::get_thread_num() * kBlockM * kBlockN;
+          for (int64_t i = start; i < end; i++) {
+            const int64_t bi = i / t.num_m_blocks;
+            const int64_t mb = i % t.num_m_blocks;
+            const int64_t m0 = mb * kBlockM;
+            const int64_t m_len = std::min(kBlockM, t.M - m0);
+            for (int64_t nb = 0; nb < t.num_n_blocks; nb++) {
+              if (t.tile(bi, mb, nb) == TileMask::kNone) {
+                continue;
+              }
+              const int64_t n0 = nb * kBlockN;
+              const int64_t n_len = std::min(kBlockN, t.N - n0);
+              xformers::cpu::gemm<scalar_t>(
+                  m_len,
+                  K,
+                  n_len,
+                  accum_t(1),
+                  _masked_grad_tile<scalar_t>(grad, t, bi, mb, nb, buf),
+                  xformers::cpu::gemm_operand<scalar_t>(b, bi)
+                      .block(0, n0)
+                      .t(),
+                  accum_t(1),
+                  grad_a_p + (bi * t.M + m0) * K,
+                  K);
+            }
+          }
+        });
+  }
+  if (grad_b.defined()) {
+    scalar_t* grad_b_p = grad_b.data_ptr<scalar_t>();
+    at::parallel_for(
+        0, t.B * t.num_n_blocks, 1, [&](int64_t start, int64_t end) {
+          scalar_t* buf = buffer_p + at::get_thread_num() * kBlockM * kBlockN;
+          for (int64_t i = start; i < end; i++) {
+            const int64_t bi = i / t.num_n_blocks;
+            const int64_t nb = i % t.num_n_blocks;
+            const int64_t n0 = nb * kBlockN;
+            const int64_t n_len = std::min(kBlockN, t.N - n0);
+            for (int64_t mb = 0; mb < t.num_m_blocks; mb++) {
+              if (t.tile(bi, mb, nb) == TileMask::kNone) {
+                continue;
+              }
+              const int64_t m0 = mb * kBlockM;
+              const int64_t m_len = std::min(kBlockM, t.M - m0);
+              xformers::cpu::gemm<scalar_t>(
+                  K,
+                  n_len,
+                  m_len,
+                  accum_t(1),
+                  xformers::cpu::gemm_operand<scalar_t>(a, bi)
+                      .block(m0, 0)
+                      .t(),
+                  _masked_grad_tile<scalar_t>(grad, t, bi, mb, nb, buf),
+                  accum_t(1),
+                  grad_b_p + bi * K * t.N + n0,
+                  t.N);
+            }
+          }
+        });
+  }
+}
 
+// The mask as a boolean `[B, M, N]` tensor
+at::Tensor _expand_dense_mask(
+    const at::Tensor& mask,
+    int64_t B,
+    int64_t M,
+    int64_t N) {
+  TORCH_CHECK(!mask.is_cuda(), "mask must be a CPU tensor");
+  TORCH_CHECK(!mask.is_sparse(), "mask must be a dense tensor");
+  at::Tensor mask_ = mask.scalar_type() == at::ScalarType::Bool
+      ? mask
+      : mask.ne(0);
+  return mask_.expand({B, M, N});
+}
+
+at::Tensor matmul_with_dense_mask(
+    const at::Tensor& a,
+    const at::Tensor& b,
+    const at::Tensor& mask) {
+  TORCH_CHECK(!a.is_cuda(), "a must be a CPU tensor");
+  TORCH_CHECK(!b.is_cuda(), "b must be a CPU tensor");
+  if (a.dim() != 3 || b.dim() != 3) {
+    return at::matmul(a, b).masked_fill(
+        mask.logical_not(), -std::numeric_limits<float>::infinity());
+  }
+  TORCH_CHECK(a.size(0) == b.size(0));
+  TORCH_CHECK(a.size(2) == b.size(1));
+  TORCH_CHECK(
+      a.scalar_type() == b.scalar_type(), "a and b must have the same dtype");
+
+  int64_t B = a.size(0);
+  int64_t M = a.size(1);
+  int64_t N = b.size(2);
+  at::Tensor mask_ = _expand_dense_mask(mask, B, M, N);
+  const MaskTiles tiles = _mask_tiles(mask_);
+
+  at::Tensor a_ = xformers::cpu::is_gemm_operand(a) ? a : a.contiguous();
+  at::Tensor b_ = xformers::cpu::is_gemm_operand(b) ? b : b.contiguous();
+
+  at::Tensor out = at::empty({B, M, N}, a.options());
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      a.scalar_type(),
+      "matmul_with_dense_mask_kernel",
+      [&] { matmul_with_dense_mask_kernel<scalar_t>(out, a_, b_, tiles); });
   return out;
 }
 
+std::tuple<at::Tensor, at::Tensor> matmul_with_dense_mask_backward(
+    const at::Tensor& grad,
+    const at::Tensor& a,
+    const at::Tensor& b,
+    const at::Tensor& mask,
+    std::array<bool, 2> output_mask) {
+  TORCH_CHECK(!grad.is_cuda(), "grad must be a CPU tensor");
+  TORCH_CHECK(!a.is_cuda(), "a must be a CPU tensor");
+  TORCH_CHECK(!b.is_cuda(), "b must be a CPU tensor");
+  TORCH_CHECK(a.dim() == 3);
+  TORCH_CHECK(b.dim() == 3);
+  TORCH_CHECK(grad.dim() == 3);
+  TORCH_CHECK(a.size(0) == b.size(0));
+  TORCH_CHECK(a.size(2) == b.size(1));
+  TORCH_CHECK(grad.size(0) == a.size(0));
+  TORCH_CHECK(grad.size(1) == a.size(1));
+  TORCH_CHECK(grad.size(2) == b.size(2));
+  TORCH_CHECK(grad.scalar_type() == a.scalar_type());
+  TORCH_CHECK(b.scalar_type() == a.scalar_type());
+
+  int64_t B = a.size(0);
+  int64_t M = a.size(1);
+  int64_t N = b.size(2);
+  int64_t K = a.size(2);
+  at::Tensor grad_a, grad_b;
+  if (output_mask[0]) {
+    grad_a = at::zeros({B, M, K}, a.options());
+  }
+  if (output_mask[1]) {
+    grad_b = at::zeros({B, K, N}, b.options());
+  }
+  if (!grad_a.defined() && !grad_b.defined()) {
+    return std::make_tuple(grad_a, grad_b);
+  }
+  at::Tensor mask_ = _expand_dense_mask(mask, B, M, N);
+  const MaskTiles tiles = _mask_tiles(mask_);
+  // Tiles of `grad` partially in the mask, with zeros outside of it
+  at::Tensor buffer =
+      at::empty({at::get_num_threads(), kBlockM * kBlockN}, grad.options());
+  at::Tensor grad_ =
+      xformers::cpu::is_gemm_operand(grad) ? grad : grad.contiguous();
+  at::Tensor a_ = xformers::cpu::is_gemm_operand(a) ? a : a.contiguous();
+  at::Tensor b_ = xformers::cpu::is_gemm_operand(b) ? b : b.contiguous();
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      a.scalar_type(),
+      "matmul_with_dense_mask_backward_kernel",
+      [&] {
+        matmul_with_dense_mask_backward_kernel<scalar_t>(
+            grad_, a_, b_, tiles, grad_a, grad_b, buffer);
+      });
+  return std::make_tuple(grad_a, grad_b);
+}
+
 } // namespace
 
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::matmul_with_mask"),
+      TORCH_FN(matmul_with_dense_mask));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::matmul_with_mask_backward"),
+      TORCH_FN(matmul_with_dense_mask_backward));
+}
+
 TORCH_LIBRARY_IMPL(xformers, SparseCPU, m) {
   m.impl(
       TORCH_SELECTIVE_NAME("xformers::matmul_with_mask"),
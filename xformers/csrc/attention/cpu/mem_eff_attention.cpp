@@ -0,0 +1,1187 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+// CPU implementation of `efficient_attention_forward_cutlass` and
+// `efficient_attention_backward_cutlass`, with the same semantics as the
+// CUDA kernels (see `cuda/fmha/kernel_forward.h`): BMHK inputs, variable
+// sequence lengths through `seqstart_q` / `seqstart_k` (and `seqlen_k`),
+// in-kernel causal and sliding window masks, additive tensor bias, ALiBi
+// slopes, rotary embedding of Q and K and custom scale.
+#include <ATen/ATen.h>
+#include <ATen/OpMathType.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <ATen/cpu/vec/functional.h>
+#include <ATen/cpu/vec/vec.h>
+
+#include "../../cpu/vec_utils.h"
+#include "../rotary.h"
+
+namespace {
+
+using xformers::cpu::_vec_scale;
+using xformers::cpu::_vec_axpy;
+using xformers::cpu::_vec_dot;
+using xformers::cpu::_pack_transposed;
+using xformers::cpu::_pack_rows;
+using xformers::rotary::RotaryParams;
+
+// Tile sizes: a tile of `kBlockM` queries is scored against `kBlockN` keys
+// at a time, and the online softmax is updated once per tile
+constexpr int64_t kBlockM = 32;
+constexpr int64_t kBlockN = 64;
+// The logsumexp is padded to a multiple of this, like on CUDA
+constexpr int64_t kAlignLSE = 32;
+
+// Matches `CustomMaskType` in `cuda/fmha/kernel_forward.h`
+enum CustomMaskType {
+  NoCustomMask = 0,
+  CausalFromTopLeft = 1,
+  CausalFromBottomRight = 2,
+  LocalFromBottomRight = 3,
+  NumCustomMaskTypes,
+};
+
+// One sequence of the batch. Without `seqstart_q` / `seqstart_k`, every
+// batch element is a sequence of `M` queries and `N` keys. Otherwise all
+// the sequences are concatenated along the sequence dimension of a single
+// batch element.
+struct SeqInfo {
+  // Index in the batch dimension of the inputs and the output
+  int64_t batch;
+  int64_t q_start;
+  int64_t num_queries;
+  int64_t k_start;
+  int64_t num_keys;
+  // Query `i` only attends to the keys `j` such that
+  // `i + diagonal_offset - window_left <= j <= i + diagonal_offset +
+  // window_right`, where a negative window is unbounded on that side: a
+  // causal mask has `window_left = -1` and `window_right = 0`
+  int64_t diagonal_offset;
+  int64_t window_left;
+  int64_t window_right;
+};
+
+std::vector<SeqInfo> _get_seqs(
+    int64_t B,
+    int64_t M,
+    int64_t N,
+    const c10::optional<at::Tensor>& seqstart_q,
+    const c10::optional<at::Tensor>& seqstart_k,
+    const c10::optional<at::Tensor>& seqlen_k,
+    int64_t custom_mask_type,
+    const c10::optional<int64_t>& window_left,
+    const c10::optional<int64_t>& window_right) {
+  std::vector<SeqInfo> seqs;
+  if (seqstart_q.has_value()) {
+    const int* sq = seqstart_q->data_ptr<int>();
+    const int* sk = seqstart_k->data_ptr<int>();
+    const int* lk = seqlen_k.has_value() ? seqlen_k->data_ptr<int>() : nullptr;
+    for (int64_t b = 0; b < seqstart_q->size(0) - 1; b++) {
+      const int64_t num_keys = lk != nullptr ? lk[b] : sk[b + 1] - sk[b];
+      TORCH_CHECK(
+          sq[b] >= 0 && sq[b] <= sq[b + 1] && sq[b + 1] <= M,
+          "invalid seqstart_q");
+      TORCH_CHECK(
+          sk[b] >= 0 && num_keys >= 0 && sk[b] + num_keys <= N,
+          "invalid seqstart_k / seqlen_k");
+      seqs.push_back({0, sq[b], sq[b + 1] - sq[b], sk[b], num_keys});
+    }
+  } else {
+    for (int64_t b = 0; b < B; b++) {
+      seqs.push_back({b, 0, M, 0, N});
+    }
+  }
+  for (SeqInfo& seq : seqs) {
+    seq.diagonal_offset = custom_mask_type == CausalFromTopLeft
+        ? 0
+        : seq.num_keys - seq.num_queries;
+    seq.window_left = -1;
+    seq.window_right = -1;
+    if (custom_mask_type == CausalFromTopLeft ||
+        custom_mask_type == CausalFromBottomRight) {
+      seq.window_right = 0;
+    } else if (custom_mask_type == LocalFromBottomRight) {
+      seq.window_left = window_left.value_or(-1);
+      seq.window_right = window_right.value_or(-1);
+    }
+  }
+  return seqs;
+}
+
+// First key that query `i` of `seq` attends to
+inline int64_t _first_visible_key(const SeqInfo& seq, int64_t i) {
+  if (seq.window_left < 0) {
+    return 0;
+  }
+  return std::max<int64_t>(0, i + seq.diagonal_offset - seq.window_left);
+}
+
+// One past the last key that query `i` of `seq` attends to
+inline int64_t _end_visible_keys(const SeqInfo& seq, int64_t i) {
+  if (seq.window_right < 0) {
+    return seq.num_keys;
+  }
+  return std::max<int64_t>(
+      0,
+      std::min<int64_t>(
+          seq.num_keys, i + seq.diagonal_offset + seq.window_right + 1));
+}
+
+// Range [c_begin, c_begin + n_valid) of the keys [n0, n0 + n_len) that query
+// `i` of `seq` attends to, relative to `n0`
+struct VisibleKeys {
+  int64_t c_begin;
+  int64_t n_valid;
+};
+
+inline VisibleKeys _visible_keys(
+    const SeqInfo& seq,
+    int64_t i,
+    int64_t n0,
+    int64_t n_len) {
+  const int64_t c_begin = std::max<int64_t>(0, _first_visible_key(seq, i) - n0);
+  const int64_t c_end =
+      std::min<int64_t>(n_len, _end_visible_keys(seq, i) - n0);
+  return {c_begin, std::max<int64_t>(0, c_end - c_begin)};
+}
+
+template <typename scalar_t>
+void fill_zero(scalar_t* buf, int64_t K) {
+  for (int64_t k = 0; k < K; k++) {
+    buf[k] = 0;
+  }
+}
+
+// x[c] += slope * (rel + c) for c in [0, size): the ALiBi bias of a query
+// against consecutive keys, `rel` being the (key - query) position of the
+// first one
+template <typename scalar_t>
+inline void _add_alibi(scalar_t* x, scalar_t slope, int64_t rel, int64_t size) {
+  for (int64_t c = 0; c < size; c++) {
+    x[c] += slope * static_cast<scalar_t>(rel + c);
+  }
+}
+
+// Rotary embedding of the query and key rows, which is applied to their
+// tiles once packed, as `rotary_embedding_` would have rotated Q and K in
+// memory
+struct QKRotary {
+  c10::optional<RotaryParams> q;
+  c10::optional<RotaryParams> k;
+};
+
+// Rotates `n_len` rows of a packed tile, row `r` being at index `row0 + r`
+// of the sequence dimension. Consecutive rows are `ld` apart, or
+// consecutive elements for a `transposed` tile.
+template <typename accum_t>
+void _rotate_rows(
+    const c10::optional<RotaryParams>& rot,
+    accum_t* tile,
+    int64_t ld,
+    bool transposed,
+    int64_t row0,
+    int64_t n_len) {
+  if (!rot.has_value()) {
+    return;
+  }
+  for (int64_t r = 0; r < n_len; r++) {
+    const int64_t pos = xformers::rotary::row_position(*rot, row0 + r);
+    if (transposed) {
+      xformers::rotary::rotate_row(*rot, tile + r, ld, pos);
+    } else {
+      xformers::rotary::rotate_row(*rot, tile + r * ld, 1, pos);
+    }
+  }
+}
+
+template <typename scalar_t>
+at::TensorAccessor<scalar_t, 4> _tensor_accessor_or_dummy(
+    const at::Tensor& t,
+    const std::array<int64_t, 4> zeros) {
+  if (t.defined()) {
+    return t.accessor<scalar_t, 4>();
+  } else {
+    return at::TensorAccessor<scalar_t, 4>(nullptr, zeros.data(), zeros.data());
+  }
+}
+
+// Number of rows (queries or keys) processed per work item. Starts from
+// `block` and is halved while there are fewer work items than threads to
+// distribute them to
+int64_t _block_size(int64_t block, int64_t num_seqs, int64_t max_seqlen) {
+  const int64_t num_threads = at::get_num_threads();
+  while (block > 4 &&
+         num_seqs * ((max_seqlen + block - 1) / block) < num_threads) {
+    block /= 2;
+  }
+  return block;
+}
+
+// Number of elements of per-thread scratch used by
+// `attention_forward_kernel`
+int64_t _attention_scratch_size(int64_t K, int64_t Kv) {
+  return kBlockM * K // scaled query tile
+      + K * kBlockN // transposed key tile
+      + kBlockN * Kv // value tile
+      + kBlockM * kBlockN // scores / probabilities
+      + kBlockM * Kv // output accumulator
+      + 2 * kBlockM; // running max and sum of the online softmax
+}
+
+// Work is split over (sequence, head, query block) triplets. Masked keys
+// are never scored: a query block only visits the keys between the first
+// one visible from its first query and the last one visible from its last
+// query, so that a sliding window costs O(window) per query, and every query
+// of the block only scores the keys it can see. Queries without any visible
+// key get a zero output and a logsumexp of -inf.
+template <typename scalar_t, typename accum_t = at::opmath_type<scalar_t>>
+void attention_forward_kernel(
+    at::TensorAccessor<scalar_t, 4> output,
+    at::TensorAccessor<float, 3> logsumexp,
+    at::TensorAccessor<scalar_t, 4> query,
+    at::TensorAccessor<scalar_t, 4> key,
+    at::TensorAccessor<scalar_t, 4> value,
+    at::TensorAccessor<scalar_t, 4> attn_bias,
+    const float* alibi_slopes,
+    const QKRotary& rotary,
+    at::TensorAccessor<accum_t, 2> buffer,
+    const std::vector<SeqInfo>& seqs,
+    int64_t max_seqlen_q,
+    accum_t scale,
+    bool compute_logsumexp) {
+  using Vec = at::vec::Vectorized<accum_t>;
+  const int64_t H = query.size(2);
+  const int64_t K = query.size(3);
+  const int64_t Kv = value.size(3);
+  const int64_t num_seqs = seqs.size();
+  const accum_t neg_inf = -std::numeric_limits<accum_t>::infinity();
+  const int64_t block_m = _block_size(kBlockM, num_seqs * H, max_seqlen_q);
+  const int64_t num_m_blocks = (max_seqlen_q + block_m - 1) / block_m;
+  const int64_t num_work = num_seqs * H * num_m_blocks;
+  at::parallel_for(0, num_work, 1, [&](int64_t start, int64_t end) {
+    accum_t* q_tile = buffer[at::get_thread_num()].data();
+    accum_t* kt_tile = q_tile + kBlockM * K;
+    accum_t* v_tile = kt_tile + K * kBlockN;
+    accum_t* s_tile = v_tile + kBlockN * Kv;
+    accum_t* acc = s_tile + kBlockM * kBlockN;
+    accum_t* m_prime = acc + kBlockM * Kv;
+    accum_t* s_prime = m_prime + kBlockM;
+    for (int64_t w = start; w < end; w++) {
+      const int64_t s = w / (H * num_m_blocks);
+      const int64_t h = (w / num_m_blocks) % H;
+      const int64_t m0 = (w % num_m_blocks) * block_m;
+      const SeqInfo& seq = seqs[s];
+      if (m0 >= seq.num_queries) {
+        continue;
+      }
+      const int64_t b = seq.batch;
+      const int64_t m_len = std::min(block_m, seq.num_queries - m0);
+      const int64_t n_begin = _first_visible_key(seq, m0);
+      const int64_t n_end = _end_visible_keys(seq, m0 + m_len - 1);
+      const accum_t alibi_slope = alibi_slopes ? alibi_slopes[h] : 0;
+      _pack_rows(
+          q_tile,
+          query[b][seq.q_start + m0][h].data(),
+          query.stride(1),
+          m_len,
+          K);
+      _rotate_rows(rotary.q, q_tile, K, false, seq.q_start + m0, m_len);
+      _vec_scale(q_tile, scale, m_len * K);
+      for (int64_t r = 0; r < m_len; r++) {
+        m_prime[r] = neg_inf;
+        s_prime[r] = 0;
+      }
+      fill_zero<accum_t>(acc, m_len * Kv);
+
+      for (int64_t n0 = n_begin; n0 < n_end; n0 += kBlockN) {
+        const int64_t n_len = std::min(kBlockN, n_end - n0);
+        _pack_transposed(
+            kt_tile,
+            kBlockN,
+            key[b][seq.k_start + n0][h].data(),
+            key.stride(1),
+            n_len,
+            K);
+        _rotate_rows(
+            rotary.k, kt_tile, kBlockN, true, seq.k_start + n0, n_len);
+        _pack_rows(
+            v_tile,
+            value[b][seq.k_start + n0][h].data(),
+            value.stride(1),
+            n_len,
+            Kv);
+        for (int64_t r = 0; r < m_len; r++) {
+          const VisibleKeys vis = _visible_keys(seq, m0 + r, n0, n_len);
+          const int64_t c_begin = vis.c_begin;
+          const int64_t n_valid = vis.n_valid;
+          if (n_valid == 0) {
+            continue;
+          }
+          accum_t* si = s_tile + r * kBlockN;
+          if (attn_bias.data() != nullptr) {
+            const scalar_t* bias_row =
+                attn_bias[s][h][m0 + r].data() + n0 + c_begin;
+            for (int64_t c = 0; c < n_valid; c++) {
+              si[c] = static_cast<accum_t>(bias_row[c]);
+            }
+          } else {
+            fill_zero<accum_t>(si, n_valid);
+          }
+          if (alibi_slope != accum_t(0)) {
+            _add_alibi(si, alibi_slope, n0 + c_begin - (m0 + r), n_valid);
+          }
+          const accum_t* qr = q_tile + r * K;
+          for (int64_t k = 0; k < K; k++) {
+            _vec_axpy(si, qr[k], kt_tile + k * kBlockN + c_begin, n_valid);
+          }
+
+          // Online softmax update for the whole tile at once
+          accum_t m_i = at::vec::reduce_all<accum_t>(
+              [](Vec& x, Vec& y) { return at::vec::maximum(x, y); },
+              si,
+              n_valid);
+          m_i = m_i > m_prime[r] ? m_i : m_prime[r];
+          if (m_i == neg_inf) {
+            // Every key seen so far is masked out by the bias
+            continue;
+          }
+          at::vec::map(
+              [m_i](Vec x) { return (x - Vec(m_i)).exp(); }, si, si, n_valid);
+          accum_t m_delta = std::exp(m_prime[r] - m_i);
+          accum_t s_delta = at::vec::reduce_all<accum_t>(
+              [](Vec& x, Vec& y) { return x + y; }, si, n_valid);
+          s_prime[r] = s_prime[r] * m_delta + s_delta;
+          m_prime[r] = m_i;
+
+          accum_t* acc_r = acc + r * Kv;
+          if (m_delta != accum_t(1)) {
+            _vec_scale(acc_r, m_delta, Kv);
+          }
+          for (int64_t c = 0; c < n_valid; c++) {
+            if (si[c] != accum_t(0)) {
+              _vec_axpy(acc_r, si[c], v_tile + (c_begin + c) * Kv, Kv);
+            }
+          }
+        }
+      }
+
+      for (int64_t r = 0; r < m_len; r++) {
+        accum_t* acc_r = acc + r * Kv;
+        const bool is_empty = s_prime[r] == accum_t(0);
+        if (!is_empty) {
+          _vec_scale(acc_r, accum_t(1) / s_prime[r], Kv);
+        }
+        at::vec::convert(acc_r, output[b][seq.q_start + m0 + r][h].data(), Kv);
+        if (compute_logsumexp) {
+          logsumexp[s][h][m0 + r] = is_empty
+              ? -std::numeric_limits<float>::infinity()
+              : static_cast<float>(m_prime[r] + std::log(s_prime[r]));
+        }
+      }
+    }
+  });
+}
+
+void _check_bias(
+    const at::Tensor& bias,
+    const at::Tensor& query,
+    const at::Tensor& key) {
+  TORCH_CHECK(!bias.is_cuda(), "attn_bias must be a CPU tensor");
+  TORCH_CHECK(
+      bias.scalar_type() == query.scalar_type(),
+      "invalid dtype for bias - should match query's dtype");
+  TORCH_CHECK(bias.dim() == 4, "Bias expected in BMHK format");
+  TORCH_CHECK(
+      bias.size(0) == query.size(0),
+      "attn_bias: wrong shape (batch dimension)");
+  TORCH_CHECK(
+      bias.size(1) == query.size(2), "attn_bias: wrong shape (head dimension)");
+  TORCH_CHECK(
+      bias.size(2) == query.size(1),
+      "attn_bias: wrong shape (seqlenQ dimension)");
+  TORCH_CHECK(
+      bias.size(3) == key.size(1),
+      "attn_bias: wrong shape (seqlenKV dimension)");
+  TORCH_CHECK(
+      bias.stride(3) == 1,
+      "attn_bias: wrong alignment (last dimension must be contiguous)");
+}
+
+void _check_seqstart(
+    const c10::optional<at::Tensor>& seqstart_q,
+    const c10::optional<at::Tensor>& seqstart_k,
+    const c10::optional<at::Tensor>& seqlen_k,
+    const at::Tensor& query) {
+  TORCH_CHECK(seqstart_q.has_value() == seqstart_k.has_value());
+  if (!seqstart_q.has_value()) {
+    return;
+  }
+  TORCH_CHECK(seqstart_q->scalar_type() == at::ScalarType::Int);
+  TORCH_CHECK(seqstart_k->scalar_type() == at::ScalarType::Int);
+  TORCH_CHECK(seqstart_q->dim() == 1 && seqstart_k->dim() == 1);
+  TORCH_CHECK(!seqstart_q->is_cuda(), "seqstart_q must be a CPU tensor");
+  TORCH_CHECK(!seqstart_k->is_cuda(), "seqstart_k must be a CPU tensor");
+  TORCH_CHECK(seqstart_q->is_contiguous());
+  TORCH_CHECK(seqstart_k->is_contiguous());
+  TORCH_CHECK(seqstart_q->size(0) == seqstart_k->size(0));
+  TORCH_CHECK(query.size(0) == 1, "cu_seqlen only supports batch_size=1");
+  if (seqlen_k.has_value()) {
+    TORCH_CHECK(seqlen_k->scalar_type() == at::ScalarType::Int);
+    TORCH_CHECK(!seqlen_k->is_cuda(), "seqlen_k must be a CPU tensor");
+    TORCH_CHECK(seqlen_k->is_contiguous());
+    TORCH_CHECK(seqlen_k->size(0) == seqstart_k->size(0) - 1);
+  }
+}
+
+void _check_window(
+    int64_t custom_mask_type,
+    const c10::optional<int64_t>& window_left,
+    const c10::optional<int64_t>& window_right) {
+  TORCH_CHECK(
+      custom_mask_type == LocalFromBottomRight ||
+          (!window_left.has_value() && !window_right.has_value()),
+      "window_left / window_right require `custom_mask_type=LocalFromBottomRight`");
+  TORCH_CHECK(
+      window_left.value_or(0) >= 0 && window_right.value_or(0) >= 0,
+      "window_left / window_right must be non-negative");
+}
+
+void _check_alibi_slopes(
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const at::Tensor& query) {
+  if (!alibi_slopes.has_value()) {
+    return;
+  }
+  TORCH_CHECK(!alibi_slopes->is_cuda(), "alibi_slopes must be a CPU tensor");
+  TORCH_CHECK(
+      alibi_slopes->scalar_type() == at::ScalarType::Float,
+      "alibi_slopes must be a float32 tensor");
+  TORCH_CHECK(
+      alibi_slopes->dim() == 1 && alibi_slopes->size(0) == query.size(2),
+      "alibi_slopes: expected one slope per head");
+  TORCH_CHECK(alibi_slopes->is_contiguous(), "alibi_slopes must be contiguous");
+}
+
+// The tables and positions are those of `rotary_embedding_`, the positions
+// indexing the sequence dimension of both Q and K
+QKRotary _get_rotary(
+    const c10::optional<at::Tensor>& rotary_cos,
+    const c10::optional<at::Tensor>& rotary_sin,
+    const c10::optional<at::Tensor>& rotary_positions,
+    const at::Tensor& query,
+    const at::Tensor& key) {
+  TORCH_CHECK(
+      rotary_cos.has_value() == rotary_sin.has_value(),
+      "rotary_cos and rotary_sin must be given together");
+  TORCH_CHECK(
+      rotary_cos.has_value() || !rotary_positions.has_value(),
+      "rotary_positions requires rotary_cos and rotary_sin");
+  QKRotary rotary;
+  if (rotary_cos.has_value()) {
+    // BMHK -> BHMK, as `make_rotary_params` expects
+    rotary.q = xformers::rotary::make_rotary_params(
+        query.transpose(1, 2),
+        *rotary_cos,
+        *rotary_sin,
+        rotary_positions,
+        false);
+    rotary.k = xformers::rotary::make_rotary_params(
+        key.transpose(1, 2),
+        *rotary_cos,
+        *rotary_sin,
+        rotary_positions,
+        false);
+  }
+  return rotary;
+}
+
+void _check_input(const at::Tensor& t, const char* name) {
+  TORCH_CHECK(!t.is_cuda(), name, " must be a CPU tensor");
+  TORCH_CHECK(!t.is_sparse(), name, " must be a dense tensor");
+  TORCH_CHECK(t.stride(-1) == 1, name, ": last dimension must be contiguous");
+}
+
+std::tuple<at::Tensor, at::Tensor, int64_t, int64_t>
+efficient_attention_forward_cpu(
+    const at::Tensor& query, // [b, seqlen, num_heads, K]
+    const at::Tensor& key, // [b, seqlen, num_heads, K]
+    const at::Tensor& value, // [b, seqlen, num_heads, Kv]
+    const c10::optional<at::Tensor>& bias, // [b, num_heads, seqlen, seqlen]
+    // (Mode 1MHK only) [b+1]: cu_seqlens_q[b] contains the
+    // position of the first query token for batch $b
+    const c10::optional<at::Tensor>& seqstart_q,
+    // (Mode 1MHK only) [b+1]: cu_seqlen_k[b] contains the
+    // position of the first key token for batch $b
+    const c10::optional<at::Tensor>& seqstart_k,
+    // (Mode 1MHK only) Maximum sequence length across batches
+    const c10::optional<int64_t> max_seqlen_q_,
+    double dropout_p, // attention matrix dropout probability
+    bool compute_logsumexp,
+    int64_t custom_mask_type,
+    c10::optional<double> scale,
+    const c10::optional<at::Tensor>& seqlen_k,
+    // Only with `LocalFromBottomRight`: number of keys visible on the left /
+    // on the right of the (bottom-right aligned) diagonal, unbounded if not
+    // set
+    const c10::optional<int64_t> window_left,
+    const c10::optional<int64_t> window_right,
+    // [num_heads] ALiBi slopes: `slope * (key_pos - query_pos)` is added to
+    // the attention scores, without materializing it
+    const c10::optional<at::Tensor>& alibi_slopes,
+    // [num_positions, K / 2] f32 tables and optional [seqlen] positions of
+    // the rotary embedding, applied to Q and K as they are loaded instead
+    // of by `rotary_embedding_` beforehand
+    const c10::optional<at::Tensor>& rotary_cos,
+    const c10::optional<at::Tensor>& rotary_sin,
+    const c10::optional<at::Tensor>& rotary_positions) {
+  TORCH_CHECK(query.dim() == 4);
+  TORCH_CHECK(key.dim() == 4);
+  TORCH_CHECK(value.dim() == 4);
+
+  // Batch sizes
+  TORCH_CHECK(query.size(0) == key.size(0));
+  TORCH_CHECK(query.size(0) == value.size(0));
+
+  // Sequence length
+  TORCH_CHECK(key.size(1) == value.size(1));
+
+  // Num heads
+  TORCH_CHECK(query.size(2) == key.size(2));
+  TORCH_CHECK(query.size(2) == value.size(2));
+
+  // Embedding per head
+  TORCH_CHECK(query.size(3) == key.size(3));
+
+  TORCH_CHECK(query.scalar_type() == key.scalar_type());
+  TORCH_CHECK(query.scalar_type() == value.scalar_type());
+  _check_input(query, "query");
+  _check_input(key, "key");
+  _check_input(value, "value");
+
+  TORCH_CHECK(
+      custom_mask_type >= 0 && custom_mask_type < NumCustomMaskTypes,
+      "invalid value for `custom_mask_type`");
+  _check_window(custom_mask_type, window_left, window_right);
+  _check_alibi_slopes(alibi_slopes, query);
+  const QKRotary rotary =
+      _get_rotary(rotary_cos, rotary_sin, rotary_positions, query, key);
+  TORCH_CHECK(dropout_p == 0, "CPU implementation does not support dropout");
+
+  int64_t max_seqlen_q;
+  _check_seqstart(seqstart_q, seqstart_k, seqlen_k, query);
+  if (seqstart_q.has_value()) {
+    TORCH_CHECK(max_seqlen_q_.has_value());
+    max_seqlen_q = *max_seqlen_q_;
+    TORCH_CHECK(
+        !bias.has_value(), "cu seqlen + bias not supported on CPU");
+  } else {
+    max_seqlen_q = query.size(1);
+  }
+
+  at::Tensor attn_bias;
+  if (bias.has_value()) {
+    attn_bias = *bias;
+    _check_bias(attn_bias, query, key);
+  }
+
+  int64_t B = query.size(0);
+  int64_t M = query.size(1);
+  int64_t N = key.size(1);
+  int64_t num_heads = query.size(2);
+  int64_t K = query.size(3);
+  int64_t Kv = value.size(3);
+
+  const std::vector<SeqInfo> seqs = _get_seqs(
+      B,
+      M,
+      N,
+      seqstart_q,
+      seqstart_k,
+      seqlen_k,
+      custom_mask_type,
+      window_left,
+      window_right);
+  for (const SeqInfo& seq : seqs) {
+    TORCH_CHECK(
+        seq.num_queries <= max_seqlen_q, "Invalid max_seqlen_q:", max_seqlen_q);
+  }
+
+  at::Tensor res = at::empty({B, M, num_heads, Kv}, query.options());
+  at::Tensor logsumexp = at::empty(
+      {static_cast<int64_t>(seqs.size()),
+       num_heads,
+       compute_logsumexp ? (max_seqlen_q + kAlignLSE - 1) / kAlignLSE * kAlignLSE
+                         : 0},
+      query.options().dtype(at::ScalarType::Float));
+
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), _attention_scratch_size(K, Kv)},
+      query.options().dtype(at::toOpMathType(query.scalar_type())));
+  const std::array<int64_t, 4> zeros{{0}};
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      query.scalar_type(),
+      "efficient_attention_forward_cpu",
+      [&] {
+        using accum_t = at::opmath_type<scalar_t>;
+        attention_forward_kernel<scalar_t>(
+            res.accessor<scalar_t, 4>(),
+            logsumexp.accessor<float, 3>(),
+            query.accessor<scalar_t, 4>(),
+            key.accessor<scalar_t, 4>(),
+            value.accessor<scalar_t, 4>(),
+            _tensor_accessor_or_dummy<scalar_t>(attn_bias, zeros),
+            alibi_slopes.has_value() ? alibi_slopes->data_ptr<float>()
+                                     : nullptr,
+            rotary,
+            buffer.accessor<accum_t, 2>(),
+            seqs,
+            max_seqlen_q,
+            scale.has_value() ? accum_t(*scale)
+                              : accum_t(1.0 / std::sqrt(accum_t(K))),
+            compute_logsumexp);
+      });
+
+  return std::make_tuple(res, logsumexp, 0, 0);
+}
+
+// Number of elements of per-thread scratch used by
+// `attention_backward_kernel`
+int64_t _attention_backward_scratch_size(int64_t K, int64_t Kv) {
+  const int64_t shared = (K + Kv) * kBlockN // transposed key and value tiles
+      + 2 * kBlockN; // probabilities and their gradients for one query
+  // query and grad_out rows, grad_k and grad_v accumulators
+  const int64_t dkdv = K + Kv + kBlockN * (K + Kv);
+  // query and grad_out tiles, grad_q accumulator
+  const int64_t dq = kBlockM * (2 * K + Kv);
+  return shared + std::max(dkdv, dq);
+}
+
+// Recomputes, for query row `i` of `seq` against the first `n_len` keys
+// packed in `kt_tile` / `vt_tile`, the attention probabilities `p` and the
+// gradient of the softmax input `ds = p * (dp - delta)`. `query_i` is
+// already scaled, and `alibi_rel` is the (key - query) position of the first
+// key.
+template <typename scalar_t, typename accum_t>
+inline void _attention_backward_scores(
+    const scalar_t* bias_row,
+    accum_t alibi_slope,
+    int64_t alibi_rel,
+    int64_t n_len,
+    int64_t K,
+    int64_t Kv,
+    const accum_t* query_i,
+    const accum_t* grad_out_i,
+    accum_t lse_i,
+    accum_t delta_i,
+    const accum_t* kt_tile,
+    const accum_t* vt_tile,
+    accum_t* p,
+    accum_t* ds) {
+  using Vec = at::vec::Vectorized<accum_t>;
+  if (bias_row != nullptr) {
+    for (int64_t c = 0; c < n_len; c++) {
+      p[c] = static_cast<accum_t>(bias_row[c]) - lse_i;
+    }
+  } else {
+    for (int64_t c = 0; c < n_len; c++) {
+      p[c] = -lse_i;
+    }
+  }
+  if (alibi_slope != accum_t(0)) {
+    _add_alibi(p, alibi_slope, alibi_rel, n_len);
+  }
+  fill_zero<accum_t>(ds, n_len);
+  for (int64_t k = 0; k < K; k++) {
+    _vec_axpy(p, query_i[k], kt_tile + k * kBlockN, n_len);
+  }
+  for (int64_t k = 0; k < Kv; k++) {
+    _vec_axpy(ds, grad_out_i[k], vt_tile + k * kBlockN, n_len);
+  }
+  at::vec::map([](Vec x) { return x.exp(); }, p, p, n_len);
+  at::vec::map2(
+      [delta_i](Vec pp, Vec dp) { return pp * (dp - Vec(delta_i)); },
+      ds,
+      p,
+      ds,
+      n_len);
+}
+
+// FlashAttention-2 style backward, as for `small_k`:
+// - `delta = rowsum(grad_out * output)` is computed once per query row
+// - dK/dV (and the bias gradient) are computed in parallel over
+// (sequence, head, key block) triplets, each owning its rows of grad_k /
+// grad_v
+// - dQ is computed in parallel over (sequence, head, query block) triplets,
+// each owning its rows of grad_q
+// Masked (query, key) pairs are skipped the same way as in the forward.
+template <typename scalar_t, typename accum_t = at::opmath_type<scalar_t>>
+void attention_backward_kernel(
+    at::TensorAccessor<scalar_t, 4> grad_q,
+    at::TensorAccessor<scalar_t, 4> grad_k,
+    at::TensorAccessor<scalar_t, 4> grad_v,
+    at::TensorAccessor<scalar_t, 4> grad_bias,
+    at::TensorAccessor<scalar_t, 4> grad_out,
+    at::TensorAccessor<scalar_t, 4> q,
+    at::TensorAccessor<scalar_t, 4> k,
+    at::TensorAccessor<scalar_t, 4> v,
+    at::TensorAccessor<scalar_t, 4> output,
+    at::TensorAccessor<scalar_t, 4> attn_bias,
+    const float* alibi_slopes,
+    const QKRotary& rotary,
+    at::TensorAccessor<float, 3> logsumexp,
+    at::TensorAccessor<accum_t, 3> delta,
+    at::TensorAccessor<accum_t, 2> buffer,
+    const std::vector<SeqInfo>& seqs,
+    int64_t max_seqlen_q,
+    int64_t max_seqlen_k,
+    accum_t scale) {
+  const int64_t H = q.size(2);
+  const int64_t K = q.size(3);
+  const int64_t Kv = v.size(3);
+  const int64_t num_seqs = seqs.size();
+  const float neg_inf = -std::numeric_limits<float>::infinity();
+  const bool has_bias = attn_bias.data() != nullptr;
+  // The gradients are computed for the rotated Q and K, and rotated back
+  QKRotary inverse = rotary;
+  if (inverse.q.has_value()) {
+    inverse.q->sign = -rotary.q->sign;
+    inverse.k->sign = -rotary.k->sign;
+  }
+
+  at::parallel_for(
+      0, num_seqs * H * max_seqlen_q, kBlockM, [&](int64_t start, int64_t end) {
+        accum_t* grad_out_i = buffer[at::get_thread_num()].data();
+        accum_t* output_i = grad_out_i + Kv;
+        for (int64_t w = start; w < end; w++) {
+          const int64_t s = w / (H * max_seqlen_q);
+          const int64_t h = (w / max_seqlen_q) % H;
+          const int64_t i = w % max_seqlen_q;
+          const SeqInfo& seq = seqs[s];
+          if (i >= seq.num_queries) {
+            continue;
+          }
+          const int64_t row = seq.q_start + i;
+          at::vec::convert(
+              grad_out[seq.batch][row][h].data(), grad_out_i, Kv);
+          at::vec::convert(output[seq.batch][row][h].data(), output_i, Kv);
+          delta[s][h][i] = _vec_dot(grad_out_i, output_i, Kv);
+        }
+      });
+
+  // dK and dV
+  const int64_t block_n = _block_size(kBlockN, num_seqs * H, max_seqlen_k);
+  const int64_t num_n_blocks = (max_seqlen_k + block_n - 1) / block_n;
+  const int64_t num_n_work = num_seqs * H * num_n_blocks;
+  at::parallel_for(0, num_n_work, 1, [&](int64_t start, int64_t end) {
+    accum_t* kt_tile = buffer[at::get_thread_num()].data();
+    accum_t* vt_tile = kt_tile + K * kBlockN;
+    accum_t* p = vt_tile + Kv * kBlockN;
+    accum_t* ds = p + kBlockN;
+    accum_t* query_i = ds + kBlockN;
+    accum_t* grad_out_i = query_i + K;
+    accum_t* grad_k_acc = grad_out_i + Kv;
+    accum_t* grad_v_acc = grad_k_acc + kBlockN * K;
+    for (int64_t w = start; w < end; w++) {
+      const int64_t s = w / (H * num_n_blocks);
+      const int64_t h = (w / num_n_blocks) % H;
+      const int64_t n0 = (w % num_n_blocks) * block_n;
+      const SeqInfo& seq = seqs[s];
+      if (n0 >= seq.num_keys) {
+        continue;
+      }
+      const int64_t b = seq.batch;
+      const int64_t n_len = std::min(block_n, seq.num_keys - n0);
+      const accum_t alibi_slope = alibi_slopes ? alibi_slopes[h] : 0;
+      _pack_transposed(
+          kt_tile,
+          kBlockN,
+          k[b][seq.k_start + n0][h].data(),
+          k.stride(1),
+          n_len,
+          K);
+      _rotate_rows(rotary.k, kt_tile, kBlockN, true, seq.k_start + n0, n_len);
+      _pack_transposed(
+          vt_tile,
+          kBlockN,
+          v[b][seq.k_start + n0][h].data(),
+          v.stride(1),
+          n_len,
+          Kv);
+      fill_zero<accum_t>(grad_k_acc, n_len * K);
+      fill_zero<accum_t>(grad_v_acc, n_len * Kv);
+      // Only the queries whose window intersects these keys see them
+      int64_t i_begin = 0;
+      int64_t i_end = seq.num_queries;
+      if (seq.window_right >= 0) {
+        i_begin = std::max<int64_t>(
+            0, n0 - seq.diagonal_offset - seq.window_right);
+      }
+      if (seq.window_left >= 0) {
+        i_end = std::min<int64_t>(
+            i_end, n0 + n_len - seq.diagonal_offset + seq.window_left);
+      }
+      for (int64_t i = i_begin; i < i_end; i++) {
+        const float lse_i = logsumexp[s][h][i];
+        const VisibleKeys vis = _visible_keys(seq, i, n0, n_len);
+        const int64_t c_begin = vis.c_begin;
+        const int64_t n_valid = vis.n_valid;
+        if (lse_i == neg_inf || n_valid == 0) {
+          // Fully masked row: it does not contribute to any gradient
+          continue;
+        }
+        const int64_t row = seq.q_start + i;
+        at::vec::convert(q[b][row][h].data(), query_i, K);
+        _rotate_rows(rotary.q, query_i, K, false, row, 1);
+        _vec_scale(query_i, scale, K);
+        at::vec::convert(grad_out[b][row][h].data(), grad_out_i, Kv);
+        _attention_backward_scores(
+            has_bias ? attn_bias[s][h][i].data() + n0 + c_begin : nullptr,
+            alibi_slope,
+            n0 + c_begin - i,
+            n_valid,
+            K,
+            Kv,
+            query_i,
+            grad_out_i,
+            accum_t(lse_i),
+            delta[s][h][i],
+            kt_tile + c_begin,
+            vt_tile + c_begin,
+            p,
+            ds);
+        for (int64_t c = 0; c < n_valid; c++) {
+          _vec_axpy(grad_v_acc + (c_begin + c) * Kv, p[c], grad_out_i, Kv);
+          _vec_axpy(grad_k_acc + (c_begin + c) * K, ds[c], query_i, K);
+        }
+        if (grad_bias.data() != nullptr) {
+          scalar_t* grad_bias_row = grad_bias[s][h][i].data() + n0 + c_begin;
+          for (int64_t c = 0; c < n_valid; c++) {
+            grad_bias_row[c] = static_cast<scalar_t>(ds[c]);
+          }
+        }
+      }
+      _rotate_rows(inverse.k, grad_k_acc, K, false, seq.k_start + n0, n_len);
+      for (int64_t c = 0; c < n_len; c++) {
+        const int64_t row = seq.k_start + n0 + c;
+        at::vec::convert(grad_k_acc + c * K, grad_k[b][row][h].data(), K);
+        at::vec::convert(grad_v_acc + c * Kv, grad_v[b][row][h].data(), Kv);
+      }
+    }
+  });
+
+  // dQ
+  const int64_t block_m = _block_size(kBlockM, num_seqs * H, max_seqlen_q);
+  const int64_t num_m_blocks = (max_seqlen_q + block_m - 1) / block_m;
+  const int64_t num_m_work = num_seqs * H * num_m_blocks;
+  at::parallel_for(0, num_m_work, 1, [&](int64_t start, int64_t end) {
+    accum_t* kt_tile = buffer[at::get_thread_num()].data();
+    accum_t* vt_tile = kt_tile + K * kBlockN;
+    accum_t* p = vt_tile + Kv * kBlockN;
+    accum_t* ds = p + kBlockN;
+    accum_t* q_tile = ds + kBlockN;
+    accum_t* grad_out_tile = q_tile + kBlockM * K;
+    accum_t* grad_q_acc = grad_out_tile + kBlockM * Kv;
+    for (int64_t w = start; w < end; w++) {
+      const int64_t s = w / (H * num_m_blocks);
+      const int64_t h = (w / num_m_blocks) % H;
+      const int64_t m0 = (w % num_m_blocks) * block_m;
+      const SeqInfo& seq = seqs[s];
+      if (m0 >= seq.num_queries) {
+        continue;
+      }
+      const int64_t b = seq.batch;
+      const int64_t m_len = std::min(block_m, seq.num_queries - m0);
+      const int64_t n_begin = _first_visible_key(seq, m0);
+      const int64_t n_end = _end_visible_keys(seq, m0 + m_len - 1);
+      const accum_t alibi_slope = alibi_slopes ? alibi_slopes[h] : 0;
+      _pack_rows(
+          q_tile, q[b][seq.q_start + m0][h].data(), q.stride(1), m_len, K);
+      _rotate_rows(rotary.q, q_tile, K, false, seq.q_start + m0, m_len);
+      _vec_scale(q_tile, scale, m_len * K);
+      _pack_rows(
+          grad_out_tile,
+          grad_out[b][seq.q_start + m0][h].data(),
+          grad_out.stride(1),
+          m_len,
+          Kv);
+      fill_zero<accum_t>(grad_q_acc, m_len * K);
+      for (int64_t n0 = n_begin; n0 < n_end; n0 += kBlockN) {
+        const int64_t n_len = std::min(kBlockN, n_end - n0);
+        _pack_transposed(
+            kt_tile,
+            kBlockN,
+            k[b][seq.k_start + n0][h].data(),
+            k.stride(1),
+            n_len,
+            K);
+        _rotate_rows(
+            rotary.k, kt_tile, kBlockN, true, seq.k_start + n0, n_len);
+        _pack_transposed(
+            vt_tile,
+            kBlockN,
+            v[b][seq.k_start + n0][h].data(),
+            v.stride(1),
+            n_len,
+            Kv);
+        for (int64_t r = 0; r < m_len; r++) {
+          const int64_t i = m0 + r;
+          const float lse_i = logsumexp[s][h][i];
+          const VisibleKeys vis = _visible_keys(seq, i, n0, n_len);
+          const int64_t c_begin = vis.c_begin;
+          const int64_t n_valid = vis.n_valid;
+          if (lse_i == neg_inf || n_valid == 0) {
+            continue;
+          }
+          _attention_backward_scores(
+              has_bias ? attn_bias[s][h][i].data() + n0 + c_begin : nullptr,
+              alibi_slope,
+              n0 + c_begin - i,
+              n_valid,
+              K,
+              Kv,
+              q_tile + r * K,
+              grad_out_tile + r * Kv,
+              accum_t(lse_i),
+              delta[s][h][i],
+              kt_tile + c_begin,
+              vt_tile + c_begin,
+              p,
+              ds);
+          accum_t* grad_q_i = grad_q_acc + r * K;
+          for (int64_t kk = 0; kk < K; kk++) {
+            grad_q_i[kk] += scale *
+                _vec_dot(ds, kt_tile + kk * kBlockN + c_begin, n_valid);
+          }
+        }
+      }
+      _rotate_rows(inverse.q, grad_q_acc, K, false, seq.q_start + m0, m_len);
+      for (int64_t r = 0; r < m_len; r++) {
+        at::vec::convert(
+            grad_q_acc + r * K, grad_q[b][seq.q_start + m0 + r][h].data(), K);
+      }
+    }
+  });
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor>
+efficient_attention_backward_cpu(
+    const at::Tensor& grad_out_,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const c10::optional<at::Tensor>& bias, // additive attention bias
+    // (Mode 1MHK only) [b+1]: cu_seqlens_q[b] contains the
+    // position of the first query token for batch $b
+    const c10::optional<at::Tensor>& cu_seqlens_q,
+    // (Mode 1MHK only) [b+1]: cu_seqlens_k[b] contains the
+    // position of the first key token for batch $b
+    const c10::optional<at::Tensor>& cu_seqlens_k,
+    // (Mode 1MHK only) Maximum sequence length across batches
+    int64_t max_seqlen_q,
+    // (Mode 1MHK only) Maximum sequence length across batches
+    int64_t max_seqlen_k,
+    const at::Tensor& logsumexp,
+    const at::Tensor& out,
+    double dropout_p, // dropout probability
+    int64_t rng_seed, // seed using for generating random numbers for dropout
+    int64_t rng_offset, // offset into random number sequence
+    int64_t custom_mask_type,
+    const c10::optional<double> scale,
+    // unused: the key blocks are always processed in parallel on CPU
+    int64_t num_splits_key,
+    // (Mode 1MHK only) [b]: number of keys used in each sequence, when
+    // they are padded. Gradients of the padding keys are zero.
+    const c10::optional<at::Tensor>& seqlen_k,
+    // Only with `LocalFromBottomRight`, see the forward
+    const c10::optional<int64_t> window_left,
+    const c10::optional<int64_t> window_right,
+    // [num_heads] ALiBi slopes, see the forward
+    const c10::optional<at::Tensor>& alibi_slopes,
+    // Rotary embedding of Q and K, see the forward. `query` and `key` are
+    // not rotated, and neither are their gradients.
+    const c10::optional<at::Tensor>& rotary_cos,
+    const c10::optional<at::Tensor>& rotary_sin,
+    const c10::optional<at::Tensor>& rotary_positions) {
+  // ndim
+  TORCH_CHECK(query.dim() == grad_out_.dim());
+  TORCH_CHECK(query.dim() == key.dim());
+  TORCH_CHECK(query.dim() == value.dim());
+  TORCH_CHECK(query.dim() == 4);
+
+  // batch size
+  TORCH_CHECK(query.size(0) == grad_out_.size(0));
+  TORCH_CHECK(query.size(0) == key.size(0));
+  TORCH_CHECK(query.size(0) == value.size(0));
+
+  // seqlen
+  TORCH_CHECK(key.size(1) == value.size(1));
+  TORCH_CHECK(query.size(1) == grad_out_.size(1));
+
+  // Num heads
+  TORCH_CHECK(query.size(2) == key.size(2));
+  TORCH_CHECK(query.size(2) == value.size(2));
+  TORCH_CHECK(query.size(2) == grad_out_.size(2));
+
+  // Embedding per head
+  TORCH_CHECK(query.size(3) == key.size(3));
+  TORCH_CHECK(value.size(3) == grad_out_.size(3));
+  TORCH_CHECK(grad_out_.sizes() == out.sizes());
+
+  TORCH_CHECK(query.scalar_type() == key.scalar_type());
+  TORCH_CHECK(query.scalar_type() == value.scalar_type());
+  TORCH_CHECK(query.scalar_type() == grad_out_.scalar_type());
+  TORCH_CHECK(query.scalar_type() == out.scalar_type());
+  TORCH_CHECK(
+      logsumexp.scalar_type() == at::ScalarType::Float,
+      "logsumexp should be float");
+
+  // handle potentially non-contiguous grad_out through a copy
+  auto grad_out = grad_out_.contiguous();
+  _check_input(grad_out, "grad_out");
+  _check_input(query, "query");
+  _check_input(key, "key");
+  _check_input(value, "value");
+  _check_input(out, "output");
+  TORCH_CHECK(!logsumexp.is_cuda(), "logsumexp must be a CPU tensor");
+
+  TORCH_CHECK(
+      custom_mask_type >= 0 && custom_mask_type < NumCustomMaskTypes,
+      "invalid value for `custom_mask_type`");
+  _check_window(custom_mask_type, window_left, window_right);
+  _check_alibi_slopes(alibi_slopes, query);
+  const QKRotary rotary =
+      _get_rotary(rotary_cos, rotary_sin, rotary_positions, query, key);
+  TORCH_CHECK(dropout_p == 0, "CPU implementation does not support dropout");
+
+  _check_seqstart(cu_seqlens_q, cu_seqlens_k, seqlen_k, query);
+  TORCH_CHECK(
+      !(cu_seqlens_q.has_value() && bias.has_value()),
+      "cu seqlen + bias not supported");
+  if (cu_seqlens_q.has_value()) {
+    TORCH_CHECK(max_seqlen_q > 0, "max_seqlen_q required with `cu_seqlens_q`");
+    TORCH_CHECK(max_seqlen_k > 0, "max_seqlen_k required with `cu_seqlens_k`");
+    TORCH_CHECK(
+        max_seqlen_k <= key.size(1), "Invalid max_seqlen_k:", max_seqlen_k);
+    TORCH_CHECK(
+        max_seqlen_q <= query.size(1), "Invalid max_seqlen_q:", max_seqlen_q);
+  } else {
+    max_seqlen_q = query.size(1);
+    max_seqlen_k = key.size(1);
+  }
+
+  at::Tensor attn_bias;
+  if (bias.has_value()) {
+    attn_bias = *bias;
+    _check_bias(attn_bias, query, key);
+  }
+
+  int64_t B = query.size(0);
+  int64_t M = query.size(1);
+  int64_t N = key.size(1);
+  int64_t nH = query.size(2);
+  int64_t K = query.size(3);
+  int64_t Kv = value.size(3);
+
+  const std::vector<SeqInfo> seqs = _get_seqs(
+      B,
+      M,
+      N,
+      cu_seqlens_q,
+      cu_seqlens_k,
+      seqlen_k,
+      custom_mask_type,
+      window_left,
+      window_right);
+  for (const SeqInfo& seq : seqs) {
+    TORCH_CHECK(
+        seq.num_queries <= max_seqlen_q, "Invalid max_seqlen_q:", max_seqlen_q);
+    TORCH_CHECK(
+        seq.num_keys <= max_seqlen_k, "Invalid max_seqlen_k:", max_seqlen_k);
+  }
+  TORCH_CHECK(logsumexp.dim() == 3);
+  TORCH_CHECK(logsumexp.size(0) == static_cast<int64_t>(seqs.size()));
+  TORCH_CHECK(logsumexp.size(1) == nH);
+  TORCH_CHECK(logsumexp.size(2) >= max_seqlen_q);
+
+  // Without `cu_seqlens`, every row of the gradients is written exactly once
+  // by the kernel. Otherwise the rows that are not part of any sequence,
+  // including the padding keys past `seqlen_k`, are left at zero.
+  auto alloc = [&](const at::Tensor& t) {
+    return cu_seqlens_q.has_value() ? at::zeros(t.sizes(), t.options())
+                                    : at::empty(t.sizes(), t.options());
+  };
+  at::Tensor grad_q = alloc(query);
+  at::Tensor grad_k = alloc(key);
+  at::Tensor grad_v = alloc(value);
+  at::Tensor grad_bias;
+  if (bias.has_value() && bias->requires_grad()) {
+    // Masked entries are never visited by the kernel
+    grad_bias = at::zeros(bias->sizes(), bias->options());
+  }
+
+  const auto accum_options =
+      query.options().dtype(at::toOpMathType(query.scalar_type()));
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), _attention_backward_scratch_size(K, Kv)},
+      accum_options);
+  at::Tensor delta = at::empty(
+      {static_cast<int64_t>(seqs.size()), nH, max_seqlen_q}, accum_options);
+  const std::array<int64_t, 4> zeros{{0}};
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      query.scalar_type(),
+      "efficient_attention_backward_cpu",
+      [&] {
+        using accum_t = at::opmath_type<scalar_t>;
+        attention_backward_kernel<scalar_t>(
+            grad_q.accessor<scalar_t, 4>(),
+            grad_k.accessor<scalar_t, 4>(),
+            grad_v.accessor<scalar_t, 4>(),
+            _tensor_accessor_or_dummy<scalar_t>(grad_bias, zeros),
+            grad_out.accessor<scalar_t, 4>(),
+            query.accessor<scalar_t, 4>(),
+            key.accessor<scalar_t, 4>(),
+            value.accessor<scalar_t, 4>(),
+            out.accessor<scalar_t, 4>(),
+            _tensor_accessor_or_dummy<scalar_t>(attn_bias, zeros),
+            alibi_slopes.has_value() ? alibi_slopes->data_ptr<float>()
+                                     : nullptr,
+            rotary,
+            logsumexp.accessor<float, 3>(),
+            delta.accessor<accum_t, 3>(),
+            buffer.accessor<accum_t, 2>(),
+            seqs,
+            max_seqlen_q,
+            max_seqlen_k,
+            scale.has_value() ? accum_t(*scale)
+                              : accum_t(1.0 / std::sqrt(accum_t(K))));
+      });
+
+  return std::make_tuple(grad_q, grad_k, grad_v, grad_bias);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::efficient_attention_forward_cutlass"),
+      TORCH_FN(efficient_attention_forward_cpu));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::efficient_attention_backward_cutlass"),
+      TORCH_FN(efficient_attention_backward_cpu));
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/Parallel.h>
+#include <torch/types.h>
+#include <algorithm>
+#include <vector>
+
+#include <ATen/cpu/vec/functional.h>
+#include <ATen/cpu/vec/vec.h>
+
+#include "../rotary.h"
+
+namespace {
+
+using xformers::rotary::RotaryParams;
+
+// Each row is converted to f32, rotated and written back: `x` is read and
+// written once, without the temporaries of `x * cos + rotate_half(x) * sin`
+template <typename scalar_t>
+void rotary_embedding_kernel(scalar_t* x, const RotaryParams& p) {
+  using Vec = at::vec::Vectorized<float>;
+  const int64_t D = p.head_dim;
+  const int64_t half = D / 2;
+  const int64_t grain = std::max<int64_t>(1, at::internal::GRAIN_SIZE / D);
+  at::parallel_for(0, p.num_rows, grain, [&](int64_t start, int64_t end) {
+    std::vector<float> buf(D);
+    float* x1 = buf.data();
+    float* x2 = x1 + half;
+    const Vec sign(p.sign);
+    for (int64_t row = start; row < end; row++) {
+      scalar_t* x_row = x + xformers::rotary::row_offset(p, row);
+      const int64_t pos = xformers::rotary::row_position(p, row);
+      const float* cos_row = p.cos + pos * half;
+      const float* sin_row = p.sin + pos * half;
+      at::vec::convert(x_row, x1, D);
+      for (int64_t i = 0; i < half; i += Vec::size()) {
+        const int64_t n = std::min<int64_t>(Vec::size(), half - i);
+        const Vec a = Vec::loadu(x1 + i, n);
+        const Vec b = Vec::loadu(x2 + i, n);
+        const Vec c = Vec::loadu(cos_row + i, n);
+        const Vec s = Vec::loadu(sin_row + i, n) * sign;
+        (a * c - b * s).store(x1 + i, n);
+        (b * c + a * s).store(x2 + i, n);
+      }
+      at::vec::convert(x1, x_row, D);
+    }
+  });
+}
+
+void rotary_embedding_cpu(
+    const at::Tensor& x,
+    const at::Tensor& cos,
+    const at::Tensor& sin,
+    const c10::optional<at::Tensor>& positions,
+    bool inverse) {
+  TORCH_CHECK(x.device().is_cpu(), "x must be a CPU tensor");
+  RotaryParams p =
+      xformers::rotary::make_rotary_params(x, cos, sin, positions, inverse);
+  if (p.num_rows == 0 || p.head_dim == 0) {
+    return;
+  }
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      x.scalar_type(),
+      "rotary_embedding_cpu",
+      [&] { rotary_embedding_kernel<scalar_t>(x.data_ptr<scalar_t>(), p); });
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::rotary_embedding_"),
+      TORCH_FN(rotary_embedding_cpu));
+}
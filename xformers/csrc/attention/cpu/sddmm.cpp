@@ -1,37 +1,113 @@
 #include <ATen/ATen.h>
+#include <ATen/OpMathType.h>
+#include <ATen/Parallel.h>
 #include <torch/types.h>
+#include <type_traits>
+#include <vector>
+
+#include <ATen/cpu/vec/functional.h>
+#include <ATen/cpu/vec/vec.h>
+
+#include "../../cpu/vec_utils.h"
+#include "csr_utils.h"
 
 namespace {
 
+using xformers::cpu::_load_row;
+using xformers::cpu::_vec_dot;
+
+// `output[j] = lhs_row . rhs_batch[column_indices[j]]` for the nonzeros
+// `j` in `[begin, end)` of a row
+template <typename scalar_t, typename accum_t>
+inline void _sddmm_row(
+    const accum_t* lhs_row,
+    const scalar_t* rhs_batch,
+    int64_t k,
+    const int* column_indices,
+    int64_t begin,
+    int64_t end,
+    scalar_t* output,
+    accum_t* rhs_buf) {
+  for (int64_t j = begin; j < end; ++j) {
+    const accum_t* rhs_row =
+        _load_row(rhs_batch + column_indices[j] * k, rhs_buf, k);
+    output[j] = static_cast<scalar_t>(_vec_dot(lhs_row, rhs_row, k));
+  }
+}
+
 // taken from
 // https://github.com/google-research/google-research/blob/master/sgk/sparse/ops/cc/sddmm_launcher.cc
-// with modifications to add batch support
-// Simple CPU kernel launcher.
+// with modifications to add batch support, and parallelized over the
+// rows of every batch element
+template <typename scalar_t>
 void LaunchSddmm(
-    int m,
-    int k,
-    int n,
-    int nonzeros,
-    const int* row_indices,
+    int64_t m,
+    int64_t k,
+    int64_t n,
+    int64_t nonzeros,
     const int* row_offsets,
     const int* column_indices,
-    const float* lhs_matrix,
-    const float* rhs_matrix,
-    float* output_values,
-    int batch_size) {
-  for (int b = 0; b < batch_size; b++) {
-    for (int i = 0; i < m; ++i) {
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        int idx_n = column_indices[j];
-        float accumulator = 0.0f;
-        for (int l = 0; l < k; ++l) {
-          accumulator += lhs_matrix[b * m * k + i * k + l] *
-              rhs_matrix[b * n * k + idx_n * k + l];
+    const scalar_t* lhs_matrix,
+    const scalar_t* rhs_matrix,
+    scalar_t* output_values,
+    int64_t batch_size,
+    at::opmath_type<scalar_t>* buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  xformers::cpu::csr_parallel_for_rows(
+      batch_size, m, row_offsets, [&](int64_t b, int64_t i) {
+        if (row_offsets[i] == row_offsets[i + 1]) {
+          return;
         }
-        output_values[b * nonzeros + j] = accumulator;
-      }
-    }
-  }
+        accum_t* lhs_buf = buffer + at::get_thread_num() * 2 * k;
+        accum_t* rhs_buf = lhs_buf + k;
+        const accum_t* lhs_row =
+            _load_row(lhs_matrix + (b * m + i) * k, lhs_buf, k);
+        _sddmm_row(
+            lhs_row,
+            rhs_matrix + b * n * k,
+            k,
+            column_indices,
+            row_offsets[i],
+            row_offsets[i + 1],
+            output_values + b * nonzeros,
+            rhs_buf);
+      });
+}
+
+// Same as `LaunchSddmm`, where each batch element has its own sparsity
+// pattern: `row_offsets` are the offsets of the `batch_size * m` rows in the
+// concatenation of their nonzeros, see `csr_batched_row_offsets`
+template <typename scalar_t>
+void LaunchSddmmBatched(
+    int64_t m,
+    int64_t k,
+    int64_t n,
+    const int64_t* row_offsets,
+    const int* column_indices,
+    const scalar_t* lhs_matrix,
+    const scalar_t* rhs_matrix,
+    scalar_t* output_values,
+    int64_t batch_size,
+    at::opmath_type<scalar_t>* buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  xformers::cpu::csr_parallel_for_rows(
+      1, batch_size * m, row_offsets, [&](int64_t, int64_t r) {
+        if (row_offsets[r] == row_offsets[r + 1]) {
+          return;
+        }
+        accum_t* lhs_buf = buffer + at::get_thread_num() * 2 * k;
+        accum_t* rhs_buf = lhs_buf + k;
+        const accum_t* lhs_row = _load_row(lhs_matrix + r * k, lhs_buf, k);
+        _sddmm_row(
+            lhs_row,
+            rhs_matrix + (r / m) * n * k,
+            k,
+            column_indices,
+            row_offsets[r],
+            row_offsets[r + 1],
+            output_values,
+            rhs_buf);
+      });
 }
 
 at::Tensor sddmm_sputnik(
@@ -47,6 +123,11 @@ at::Tensor sddmm_sputnik(
   TORCH_CHECK(row_indices.dim() == 1);
   TORCH_CHECK(row_offsets.dim() == 1);
   TORCH_CHECK(column_indices.dim() == 1);
+  TORCH_CHECK(row_offsets.size(0) == a.size(1) + 1);
+  TORCH_CHECK(
+      a.scalar_type() == b.scalar_type(), "a and b must have the same dtype");
+  TORCH_CHECK(row_offsets.scalar_type() == at::ScalarType::Int);
+  TORCH_CHECK(column_indices.scalar_type() == at::ScalarType::Int);
 
   TORCH_CHECK(!a.is_cuda(), "a must be a CPU tensor");
   TORCH_CHECK(!b.is_cuda(), "b must be a CPU tensor");
@@ -71,27 +152,98 @@ at::Tensor sddmm_sputnik(
   TORCH_CHECK(
       !column_indices.is_sparse(), "column_offsets must be a dense tensor");
 
-  int batch = a.size(0);
-  int m = a.size(1);
-  int k = a.size(2);
-  int n = b.size(1);
+  int64_t batch = a.size(0);
+  int64_t m = a.size(1);
+  int64_t k = a.size(2);
+  int64_t n = b.size(1);
 
-  int nonzeros = column_indices.size(0);
+  int64_t nonzeros = column_indices.size(0);
 
   at::Tensor output = at::empty({batch, nonzeros}, a.options());
+  // Rows of `a` and `b` converted to the accumulation type, per thread
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), 2 * k},
+      a.options().dtype(at::toOpMathType(a.scalar_type())));
 
-  LaunchSddmm(
-      m,
-      k,
-      n,
-      nonzeros,
-      row_indices.data_ptr<int>(),
-      row_offsets.data_ptr<int>(),
-      column_indices.data_ptr<int>(),
-      a.data_ptr<float>(),
-      b.data_ptr<float>(),
-      output.data_ptr<float>(),
-      batch);
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      a.scalar_type(),
+      "sddmm_sputnik",
+      [&] {
+        using accum_t = at::opmath_type<scalar_t>;
+        LaunchSddmm<scalar_t>(
+            m,
+            k,
+            n,
+            nonzeros,
+            row_offsets.data_ptr<int>(),
+            column_indices.data_ptr<int>(),
+            a.data_ptr<scalar_t>(),
+            b.data_ptr<scalar_t>(),
+            output.data_ptr<scalar_t>(),
+            batch,
+            buffer.data_ptr<accum_t>());
+      });
+
+  return output;
+}
+
+// `output[j] = a[b, i] . b[b, column_indices[j]]` for the nonzeros `j` of
+// the rows `i` of the sparsity pattern of batch element `b`
+at::Tensor sddmm_sputnik_batched(
+    const at::Tensor& a,
+    const at::Tensor& b,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    const at::Tensor& batch_offsets) {
+  TORCH_CHECK(a.dim() == b.dim());
+  TORCH_CHECK(a.dim() == 3);
+  TORCH_CHECK(a.size(0) == b.size(0));
+  TORCH_CHECK(a.size(2) == b.size(2));
+  TORCH_CHECK(
+      a.scalar_type() == b.scalar_type(), "a and b must have the same dtype");
+  TORCH_CHECK(!a.is_cuda(), "a must be a CPU tensor");
+  TORCH_CHECK(!b.is_cuda(), "b must be a CPU tensor");
+  TORCH_CHECK(a.is_contiguous(), "a must be a contiguous tensor");
+  TORCH_CHECK(b.is_contiguous(), "b must be a contiguous tensor");
+  TORCH_CHECK(!a.is_sparse(), "a must be a dense tensor");
+  TORCH_CHECK(!b.is_sparse(), "b must be a dense tensor");
+
+  int64_t batch = a.size(0);
+  int64_t m = a.size(1);
+  int64_t k = a.size(2);
+  int64_t n = b.size(1);
+  xformers::cpu::check_batched_csr_inputs(
+      row_offsets, column_indices, batch_offsets, batch, m);
+  const std::vector<int64_t> offsets = xformers::cpu::csr_batched_row_offsets(
+      row_offsets.data_ptr<int>(), batch_offsets.data_ptr<int>(), batch, m);
+
+  at::Tensor output = at::empty({column_indices.size(0)}, a.options());
+  // Rows of `a` and `b` converted to the accumulation type, per thread
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), 2 * k},
+      a.options().dtype(at::toOpMathType(a.scalar_type())));
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      a.scalar_type(),
+      "sddmm_sputnik_batched",
+      [&] {
+        using accum_t = at::opmath_type<scalar_t>;
+        LaunchSddmmBatched<scalar_t>(
+            m,
+            k,
+            n,
+            offsets.data(),
+            column_indices.data_ptr<int>(),
+            a.data_ptr<scalar_t>(),
+            b.data_ptr<scalar_t>(),
+            output.data_ptr<scalar_t>(),
+            batch,
+            buffer.data_ptr<accum_t>());
+      });
 
   return output;
 }
@@ -100,4 +252,7 @@ at::Tensor sddmm_sputnik(
 TORCH_LIBRARY_IMPL(xformers, CPU, m) {
   m.impl(
       TORCH_SELECTIVE_NAME("xformers::sddmm_sputnik"), TORCH_FN(sddmm_sputnik));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sddmm_sputnik_batched"),
+      TORCH_FN(sddmm_sputnik_batched));
 }
@@ -6,16 +6,33 @@
  * LICENSE file in the root directory of this source tree.
  */
 #include <ATen/ATen.h>
+#include <ATen/OpMathType.h>
 #include <ATen/Parallel.h>
 #include <torch/library.h>
+#include <algorithm>
 #include <cmath>
+#include <limits>
 #include <vector>
 
 #include <ATen/cpu/vec/functional.h>
 #include <ATen/cpu/vec/vec.h>
 
+#include "../../cpu/vec_utils.h"
+
 namespace {
 
+using xformers::cpu::_vec_scale;
+using xformers::cpu::_vec_axpy;
+using xformers::cpu::_vec_dot;
+using xformers::cpu::_pack_transposed;
+using xformers::cpu::_pack_rows;
+
+// Tile sizes of the forward pass: a tile of `kBlockM` queries is scored
+// against `kBlockN` keys at a time, and the online softmax is updated once
+// per tile rather than once per key.
+constexpr int64_t kBlockM = 32;
+constexpr int64_t kBlockN = 64;
+
 template <typename scalar_t>
 void fill_zero(scalar_t* buf, int64_t K) {
   for (int64_t k = 0; k < K; k++) {
@@ -43,80 +60,132 @@ at::TensorAccessor<scalar_t, 3> _tensor_accessor_or_dummy(
   }
 }
 
-template <typename scalar_t>
+// Number of query rows processed per work item. Starts from `kBlockM`
+// and is halved while there are fewer (batch, query block) pairs than
+// threads to distribute them to
+int64_t _query_block_size(int64_t B, int64_t M) {
+  const int64_t num_threads = at::get_num_threads();
+  int64_t block_m = kBlockM;
+  while (block_m > 4 && B * ((M + block_m - 1) / block_m) < num_threads) {
+    block_m /= 2;
+  }
+  return block_m;
+}
+
+// Number of elements of per-thread scratch used by `attention_kernel`
+int64_t _attention_scratch_size(int64_t K) {
+  return kBlockM * K // scaled query tile
+      + K * kBlockN // transposed key tile
+      + kBlockN * K // value tile
+      + kBlockM * kBlockN // scores / probabilities
+      + kBlockM * K // output accumulator
+      + 2 * kBlockM; // running max and sum of the online softmax
+}
+
+// Half and BFloat16 inputs are converted to float as they are loaded in
+// the tiles, and every intermediate value, including the softmax state,
+// is kept in `accum_t`
+template <typename scalar_t, typename accum_t = at::opmath_type<scalar_t>>
 void attention_kernel(
     at::TensorAccessor<scalar_t, 3> output,
-    at::TensorAccessor<scalar_t, 2> logsumexp,
+    at::TensorAccessor<accum_t, 2> logsumexp,
     at::TensorAccessor<scalar_t, 3> query,
     at::TensorAccessor<scalar_t, 3> key,
     at::TensorAccessor<scalar_t, 3> value,
-    at::TensorAccessor<scalar_t, 3> buffer,
+    at::TensorAccessor<accum_t, 2> buffer,
     bool compute_logsumexp,
     at::TensorAccessor<scalar_t, 3> attn_bias) {
-  // TODO: optimize the code by adding blocking
-  // over multiple dimensions. Doing this allows
-  // the compiler to group reads and operations
-  // for vectorization
-  constexpr int64_t BLOCK = 1; // 8;
+  using Vec = at::vec::Vectorized<accum_t>;
   int64_t K = query.size(2);
   int64_t B = query.size(0);
   int64_t M = query.size(1);
   int64_t N = key.size(1);
   int64_t grain_size = 1;
-  scalar_t scale = 1.0 / std::sqrt(scalar_t(K));
-  at::parallel_for(0, B, grain_size, [&](int64_t start, int64_t end) {
-    auto buf = buffer[at::get_thread_num()][0].data();
-    for (int64_t i = start; i < end; i++) {
-      for (int64_t j = 0; j < M; j++) {
-        fill_zero<scalar_t>(buf, K);
-        auto aar = query[i][j].data();
-        scalar_t s_prime = 0;
-        scalar_t m_prime = -std::numeric_limits<scalar_t>::infinity();
-        for (int64_t l = 0; l < N; l += BLOCK) {
-          auto bar = key[i][l].data();
-          scalar_t si[BLOCK] = {0};
-          for (int64_t k = 0; k < K; k++) {
-            auto aaar = aar[k] * scale;
-            for (int64_t rr = 0; rr < BLOCK; rr++)
-              si[rr] += aaar * bar[k + K * rr];
-          }
+  accum_t scale = 1.0 / std::sqrt(accum_t(K));
+  const accum_t neg_inf = -std::numeric_limits<accum_t>::infinity();
+  // Work is split over (batch, query block) pairs, so that a single long
+  // sequence still keeps every thread busy
+  const int64_t block_m = _query_block_size(B, M);
+  const int64_t num_m_blocks = (M + block_m - 1) / block_m;
+  const int64_t num_work = B * num_m_blocks;
+  at::parallel_for(0, num_work, grain_size, [&](int64_t start, int64_t end) {
+    accum_t* q_tile = buffer[at::get_thread_num()].data();
+    accum_t* kt_tile = q_tile + kBlockM * K;
+    accum_t* v_tile = kt_tile + K * kBlockN;
+    accum_t* s_tile = v_tile + kBlockN * K;
+    accum_t* acc = s_tile + kBlockM * kBlockN;
+    accum_t* m_prime = acc + kBlockM * K;
+    accum_t* s_prime = m_prime + kBlockM;
+    for (int64_t w = start; w < end; w++) {
+      const int64_t i = w / num_m_blocks;
+      const int64_t m0 = (w % num_m_blocks) * block_m;
+      const int64_t m_len = std::min(block_m, M - m0);
+      _pack_rows(q_tile, query[i][m0].data(), query.stride(1), m_len, K);
+      _vec_scale(q_tile, scale, m_len * K);
+      for (int64_t r = 0; r < m_len; r++) {
+        m_prime[r] = neg_inf;
+        s_prime[r] = 0;
+      }
+      fill_zero<accum_t>(acc, m_len * K);
+
+      for (int64_t n0 = 0; n0 < N; n0 += kBlockN) {
+        const int64_t n_len = std::min(kBlockN, N - n0);
+        // Pack the key tile as [K, n_len] so that the scores of one query
+        // against the whole tile are computed with vector FMAs over keys
+        _pack_transposed(
+            kt_tile, kBlockN, key[i][n0].data(), key.stride(1), n_len, K);
+        _pack_rows(v_tile, value[i][n0].data(), value.stride(1), n_len, K);
+        for (int64_t r = 0; r < m_len; r++) {
+          accum_t* si = s_tile + r * kBlockN;
           if (attn_bias.data() != nullptr) {
-            for (int64_t rr = 0; rr < BLOCK; rr++) {
-              si[rr] += attn_bias[i][j][l + rr];
+            auto bias_row = attn_bias[i][m0 + r];
+            for (int64_t c = 0; c < n_len; c++) {
+              si[c] = static_cast<accum_t>(bias_row[n0 + c]);
             }
+          } else {
+            fill_zero<accum_t>(si, n_len);
           }
-
-          scalar_t m_i = si[0] > m_prime ? si[0] : m_prime;
-          for (int64_t rr = 1; rr < BLOCK; rr++) {
-            m_i = si[rr] > m_i ? si[rr] : m_i;
-          }
-
-          auto vi = value[i][l].data();
-
-          scalar_t m_delta;
-          scalar_t s_delta[BLOCK];
-          m_delta = std::exp(m_prime - m_i);
-
-          for (int64_t rr = 0; rr < BLOCK; rr++)
-            s_delta[rr] = std::exp(si[rr] - m_i);
-
+          const accum_t* qr = q_tile + r * K;
           for (int64_t k = 0; k < K; k++) {
-            buf[k] = buf[k] * m_delta;
-            for (int64_t rr = 0; rr < BLOCK; rr++)
-              buf[k] += vi[k + K * rr] * s_delta[rr];
+            _vec_axpy(si, qr[k], kt_tile + k * kBlockN, n_len);
           }
-          s_prime = s_prime * m_delta;
-          for (int64_t rr = 0; rr < BLOCK; rr++)
-            s_prime += s_delta[rr];
 
-          m_prime = m_i;
-        }
-        auto oo = output[i][j].data();
-        for (int64_t k = 0; k < K; k++) {
-          oo[k] = buf[k] / s_prime;
+          // Online softmax update for the whole tile at once
+          accum_t m_i = at::vec::reduce_all<accum_t>(
+              [](Vec& x, Vec& y) { return at::vec::maximum(x, y); },
+              si,
+              n_len);
+          m_i = m_i > m_prime[r] ? m_i : m_prime[r];
+          if (m_i == neg_inf) {
+            // Every key seen so far is masked out
+            continue;
+          }
+          at::vec::map(
+              [m_i](Vec x) { return (x - Vec(m_i)).exp(); }, si, si, n_len);
+          accum_t m_delta = std::exp(m_prime[r] - m_i);
+          accum_t s_delta = at::vec::reduce_all<accum_t>(
+              [](Vec& x, Vec& y) { return x + y; }, si, n_len);
+          s_prime[r] = s_prime[r] * m_delta + s_delta;
+          m_prime[r] = m_i;
+
+          accum_t* acc_r = acc + r * K;
+          if (m_delta != accum_t(1)) {
+            _vec_scale(acc_r, m_delta, K);
+          }
+          for (int64_t c = 0; c < n_len; c++) {
+            if (si[c] != accum_t(0)) {
+              _vec_axpy(acc_r, si[c], v_tile + c * K, K);
+            }
+          }
         }
+      }
+
+      for (int64_t r = 0; r < m_len; r++) {
+        accum_t* acc_r = acc + r * K;
+        _vec_scale(acc_r, accum_t(1) / s_prime[r], K);
+        at::vec::convert(acc_r, output[i][m0 + r].data(), K);
         if (compute_logsumexp)
-          logsumexp[i][j] = m_prime + std::log(s_prime);
+          logsumexp[i][m0 + r] = m_prime[r] + std::log(s_prime[r]);
       }
     }
   });
@@ -140,6 +209,8 @@ std::tuple<at::Tensor, at::Tensor, int64_t, int64_t> attention(
   TORCH_CHECK(
       query.size(2) ==
       value.size(2)); // TODO: drop this limitation in the future
+  TORCH_CHECK(query.scalar_type() == key.scalar_type());
+  TORCH_CHECK(query.scalar_type() == value.scalar_type());
 
   at::Tensor attn_bias;
   if (attn_bias_.has_value()) {
@@ -149,6 +220,7 @@ std::tuple<at::Tensor, at::Tensor, int64_t, int64_t> attention(
     TORCH_CHECK(query.size(1) == attn_bias.size(1));
     TORCH_CHECK(key.size(1) == attn_bias.size(2));
     TORCH_CHECK(attn_bias.stride(1) == 0);
+    TORCH_CHECK(query.scalar_type() == attn_bias.scalar_type());
   }
 
   TORCH_CHECK(!query.is_cuda(), "query must be a CPU tensor");
@@ -169,28 +241,112 @@ std::tuple<at::Tensor, at::Tensor, int64_t, int64_t> attention(
   int64_t M = query.size(1);
   int64_t K = query.size(2);
 
+  // The logsumexp is kept in the accumulation type (float for Half and
+  // BFloat16), like the CUDA kernels do
+  const auto accum_options =
+      query.options().dtype(at::toOpMathType(query.scalar_type()));
   at::Tensor res = at::empty({B, M, K}, query.options());
-  at::Tensor logsumexp = at::empty({B, M}, query.options());
+  at::Tensor logsumexp = at::empty({B, M}, accum_options);
 
-  at::Tensor buffer = at::empty({at::get_num_threads(), 1, K}, query.options());
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), _attention_scratch_size(K)}, accum_options);
   const std::array<int64_t, 3> zeros{{0}};
 
-  AT_DISPATCH_FLOATING_TYPES(query.scalar_type(), "attention_kernel", [&] {
-    attention_kernel<scalar_t>(
-        res.accessor<scalar_t, 3>(),
-        logsumexp.accessor<scalar_t, 2>(),
-        query.accessor<scalar_t, 3>(),
-        key.accessor<scalar_t, 3>(),
-        value.accessor<scalar_t, 3>(),
-        buffer.accessor<scalar_t, 3>(),
-        compute_logsumexp,
-        _tensor_accessor_or_dummy<scalar_t>(attn_bias, zeros));
-  });
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      query.scalar_type(),
+      "attention_kernel",
+      [&] {
+        using accum_t = at::opmath_type<scalar_t>;
+        attention_kernel<scalar_t>(
+            res.accessor<scalar_t, 3>(),
+            logsumexp.accessor<accum_t, 2>(),
+            query.accessor<scalar_t, 3>(),
+            key.accessor<scalar_t, 3>(),
+            value.accessor<scalar_t, 3>(),
+            buffer.accessor<accum_t, 2>(),
+            compute_logsumexp,
+            _tensor_accessor_or_dummy<scalar_t>(attn_bias, zeros));
+      });
 
   return std::make_tuple(res, logsumexp, 1, 1);
 }
 
-template <typename scalar_t>
+// Number of keys processed per work item of the dK/dV pass of the backward,
+// following the same policy as `_query_block_size`
+int64_t _key_block_size(int64_t B, int64_t N) {
+  const int64_t num_threads = at::get_num_threads();
+  int64_t block_n = kBlockN;
+  while (block_n > 4 && B * ((N + block_n - 1) / block_n) < num_threads) {
+    block_n /= 2;
+  }
+  return block_n;
+}
+
+// Number of elements of per-thread scratch used by
+// `attention_backward_kernel`
+int64_t _attention_backward_scratch_size(int64_t K) {
+  return 2 * K * kBlockN // transposed key and value tiles
+      + 2 * kBlockN // probabilities and their gradients for one query
+      + 2 * kBlockM * K // query and grad_out rows
+      + 2 * kBlockN * K; // grad_k / grad_v (or grad_q) accumulators
+}
+
+// Recomputes, for query row `j` of batch `i` against the keys packed in
+// `kt_tile` / `vt_tile`, the attention probabilities `p` and the gradient
+// of the softmax input `ds = p * (dp - delta)`. `query_j` is already scaled.
+template <typename scalar_t, typename accum_t>
+inline void _attention_backward_scores(
+    int64_t i,
+    int64_t j,
+    int64_t n0,
+    int64_t n_len,
+    int64_t K,
+    const accum_t* query_j,
+    const accum_t* grad_out_j,
+    accum_t normalizer,
+    accum_t delta_j,
+    const accum_t* kt_tile,
+    const accum_t* vt_tile,
+    accum_t* p,
+    accum_t* ds,
+    at::TensorAccessor<scalar_t, 3> attn_bias) {
+  using Vec = at::vec::Vectorized<accum_t>;
+  if (attn_bias.data() != nullptr) {
+    auto bias_row = attn_bias[i][j];
+    for (int64_t c = 0; c < n_len; c++) {
+      p[c] = static_cast<accum_t>(bias_row[n0 + c]) - normalizer;
+    }
+  } else {
+    for (int64_t c = 0; c < n_len; c++) {
+      p[c] = -normalizer;
+    }
+  }
+  fill_zero<accum_t>(ds, n_len);
+  for (int64_t k = 0; k < K; k++) {
+    _vec_axpy(p, query_j[k], kt_tile + k * kBlockN, n_len);
+    _vec_axpy(ds, grad_out_j[k], vt_tile + k * kBlockN, n_len);
+  }
+  at::vec::map([](Vec x) { return x.exp(); }, p, p, n_len);
+  at::vec::map2(
+      [delta_j](Vec pp, Vec dp) { return pp * (dp - Vec(delta_j)); },
+      ds,
+      p,
+      ds,
+      n_len);
+}
+
+// FlashAttention-2 style backward:
+// - `delta = rowsum(grad_out * output)` is computed once per query row
+// - dK/dV are computed in parallel over (batch, key block) pairs, each
+// owning its rows of grad_k / grad_v
+// - dQ is computed in parallel over (batch, query block) pairs, each owning
+// its rows of grad_q
+// The attention probabilities are recomputed in both passes, so that no
+// output is ever written by two threads. Gradients are accumulated in
+// `accum_t` tiles and converted once when written out.
+template <typename scalar_t, typename accum_t = at::opmath_type<scalar_t>>
 void attention_backward_kernel(
     at::TensorAccessor<scalar_t, 3> grad_q,
     at::TensorAccessor<scalar_t, 3> grad_k,
@@ -199,74 +355,146 @@ void attention_backward_kernel(
     at::TensorAccessor<scalar_t, 3> q,
     at::TensorAccessor<scalar_t, 3> k,
     at::TensorAccessor<scalar_t, 3> v,
-    at::TensorAccessor<scalar_t, 2> logsumexp_normalizer,
-    at::TensorAccessor<scalar_t, 3> buffer,
-    at::TensorAccessor<scalar_t, 3> buffer2,
+    at::TensorAccessor<scalar_t, 3> output,
+    at::TensorAccessor<accum_t, 2> logsumexp_normalizer,
+    at::TensorAccessor<accum_t, 2> delta,
+    at::TensorAccessor<accum_t, 2> buffer,
     at::TensorAccessor<scalar_t, 3> attn_bias) {
   int64_t K = q.size(2);
   int64_t B = q.size(0);
   int64_t M = q.size(1);
   int64_t N = k.size(1);
-  int64_t grain_size = 1; // buffer.size(1);
-  scalar_t scale = 1.0 / std::sqrt(scalar_t(K));
-  at::parallel_for(0, B, grain_size, [&](int64_t start, int64_t end) {
-    auto buf = buffer[at::get_thread_num()][0];
-    auto buf2 = buffer2[at::get_thread_num()][0];
-    for (int64_t i = start; i < end; i++) {
+  accum_t scale = 1.0 / std::sqrt(accum_t(K));
+  const accum_t neg_inf = -std::numeric_limits<accum_t>::infinity();
+
+  at::parallel_for(0, B * M, kBlockM, [&](int64_t start, int64_t end) {
+    accum_t* grad_out_j = buffer[at::get_thread_num()].data();
+    accum_t* output_j = grad_out_j + K;
+    for (int64_t w = start; w < end; w++) {
+      const int64_t i = w / M;
+      const int64_t j = w % M;
+      at::vec::convert(grad_out[i][j].data(), grad_out_j, K);
+      at::vec::convert(output[i][j].data(), output_j, K);
+      delta[i][j] = _vec_dot(grad_out_j, output_j, K);
+    }
+  });
+
+  // dK and dV
+  const int64_t block_n = _key_block_size(B, N);
+  const int64_t num_n_blocks = (N + block_n - 1) / block_n;
+  const int64_t num_n_work = B * num_n_blocks;
+  at::parallel_for(0, num_n_work, 1, [&](int64_t start, int64_t end) {
+    accum_t* kt_tile = buffer[at::get_thread_num()].data();
+    accum_t* vt_tile = kt_tile + K * kBlockN;
+    accum_t* p = vt_tile + K * kBlockN;
+    accum_t* ds = p + kBlockN;
+    accum_t* query_j = ds + kBlockN;
+    accum_t* grad_out_j = query_j + kBlockM * K;
+    accum_t* grad_k_acc = grad_out_j + kBlockM * K;
+    accum_t* grad_v_acc = grad_k_acc + kBlockN * K;
+    for (int64_t w = start; w < end; w++) {
+      const int64_t i = w / num_n_blocks;
+      const int64_t n0 = (w % num_n_blocks) * block_n;
+      const int64_t n_len = std::min(block_n, N - n0);
+      _pack_transposed(
+          kt_tile, kBlockN, k[i][n0].data(), k.stride(1), n_len, K);
+      _pack_transposed(
+          vt_tile, kBlockN, v[i][n0].data(), v.stride(1), n_len, K);
+      fill_zero<accum_t>(grad_k_acc, n_len * K);
+      fill_zero<accum_t>(grad_v_acc, n_len * K);
       for (int64_t j = 0; j < M; j++) {
-        for (int64_t k = 0; k < K; k++) {
-          buf[k] = 0;
+        const accum_t normalizer = logsumexp_normalizer[i][j];
+        if (normalizer == neg_inf) {
+          // Fully masked row: it does not contribute to any gradient
+          continue;
         }
-        auto query_i = q[i][j];
-        auto normalizer = logsumexp_normalizer[i][j];
-        scalar_t tmp_sum = 0;
-        for (int64_t l = 0; l < N; l++) {
-          auto key_j = k[i][l];
-          scalar_t si = 0;
-          for (int64_t k = 0; k < K; k++) {
-            si += query_i[k] * key_j[k];
-          }
-          scalar_t attn_b =
-              attn_bias.data() == nullptr ? scalar_t(0) : attn_bias[i][j][l];
-          scalar_t attn_v = std::exp(si * scale - normalizer + attn_b);
-
-          for (int64_t k = 0; k < K; k++) {
-            grad_v[i][l][k] += attn_v * grad_out[i][j][k];
-          }
-
-          // now compute grad_q and grad_k
-          // first compute the gradient for the self-attention
-          // after softmax
-          scalar_t grad_attn_v = 0;
-          for (int64_t k = 0; k < K; k++) {
-            grad_attn_v += grad_out[i][j][k] * v[i][l][k];
-            // grad_attn_v[i][j][l] += grad_out[i][j][k] * v[i][l][k];
-          }
-
-          // those are temporaries for the gradient of the softmax
-          scalar_t tmp = attn_v * grad_attn_v * scale;
-          tmp_sum += tmp;
-
-          // grad_q is easy
-          for (int64_t k = 0; k < K; k++) {
-            grad_q[i][j][k] += tmp * key_j[k];
-            buf[k] += attn_v * key_j[k];
-          }
+        at::vec::convert(q[i][j].data(), query_j, K);
+        _vec_scale(query_j, scale, K);
+        at::vec::convert(grad_out[i][j].data(), grad_out_j, K);
+        _attention_backward_scores(
+            i,
+            j,
+            n0,
+            n_len,
+            K,
+            query_j,
+            grad_out_j,
+            normalizer,
+            delta[i][j],
+            kt_tile,
+            vt_tile,
+            p,
+            ds,
+            attn_bias);
+        for (int64_t c = 0; c < n_len; c++) {
+          _vec_axpy(grad_v_acc + c * K, p[c], grad_out_j, K);
+          _vec_axpy(grad_k_acc + c * K, ds[c], query_j, K);
+        }
+      }
+      for (int64_t c = 0; c < n_len; c++) {
+        at::vec::convert(grad_k_acc + c * K, grad_k[i][n0 + c].data(), K);
+        at::vec::convert(grad_v_acc + c * K, grad_v[i][n0 + c].data(), K);
+      }
+    }
+  });
 
-          //  but grad_k is a bit trickier
-          buf2[l] = attn_v;
-          for (int64_t k = 0; k < K; k++) {
-            grad_k[i][l][k] += tmp * query_i[k];
+  // dQ
+  const int64_t block_m = _query_block_size(B, M);
+  const int64_t num_m_blocks = (M + block_m - 1) / block_m;
+  const int64_t num_m_work = B * num_m_blocks;
+  at::parallel_for(0, num_m_work, 1, [&](int64_t start, int64_t end) {
+    accum_t* kt_tile = buffer[at::get_thread_num()].data();
+    accum_t* vt_tile = kt_tile + K * kBlockN;
+    accum_t* p = vt_tile + K * kBlockN;
+    accum_t* ds = p + kBlockN;
+    accum_t* q_tile = ds + kBlockN;
+    accum_t* grad_out_tile = q_tile + kBlockM * K;
+    accum_t* grad_q_acc = grad_out_tile + kBlockM * K;
+    for (int64_t w = start; w < end; w++) {
+      const int64_t i = w / num_m_blocks;
+      const int64_t m0 = (w % num_m_blocks) * block_m;
+      const int64_t m_len = std::min(block_m, M - m0);
+      _pack_rows(q_tile, q[i][m0].data(), q.stride(1), m_len, K);
+      _vec_scale(q_tile, scale, m_len * K);
+      _pack_rows(
+          grad_out_tile, grad_out[i][m0].data(), grad_out.stride(1), m_len, K);
+      fill_zero<accum_t>(grad_q_acc, m_len * K);
+      for (int64_t n0 = 0; n0 < N; n0 += kBlockN) {
+        const int64_t n_len = std::min(kBlockN, N - n0);
+        _pack_transposed(
+            kt_tile, kBlockN, k[i][n0].data(), k.stride(1), n_len, K);
+        _pack_transposed(
+            vt_tile, kBlockN, v[i][n0].data(), v.stride(1), n_len, K);
+        for (int64_t r = 0; r < m_len; r++) {
+          const int64_t j = m0 + r;
+          const accum_t normalizer = logsumexp_normalizer[i][j];
+          if (normalizer == neg_inf) {
+            continue;
           }
-        }
-        for (int64_t l = 0; l < N; l++) {
-          for (int64_t k = 0; k < K; k++) {
-            grad_k[i][l][k] -= buf2[l] * query_i[k] * tmp_sum;
+          _attention_backward_scores(
+              i,
+              j,
+              n0,
+              n_len,
+              K,
+              q_tile + r * K,
+              grad_out_tile + r * K,
+              normalizer,
+              delta[i][j],
+              kt_tile,
+              vt_tile,
+              p,
+              ds,
+              attn_bias);
+          accum_t* grad_q_j = grad_q_acc + r * K;
+          for (int64_t kk = 0; kk < K; kk++) {
+            grad_q_j[kk] +=
+                scale * _vec_dot(ds, kt_tile + kk * kBlockN, n_len);
           }
         }
-        for (int64_t k = 0; k < K; k++) {
-          grad_q[i][j][k] -= buf[k] * tmp_sum;
-        }
+      }
+      for (int64_t r = 0; r < m_len; r++) {
+        at::vec::convert(grad_q_acc + r * K, grad_q[i][m0 + r].data(), K);
       }
     }
   });
@@ -291,6 +519,7 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> attention_backward(
   TORCH_CHECK(query.size(0) == grad_out.size(0));
   TORCH_CHECK(query.size(1) == grad_out.size(1));
   TORCH_CHECK(query.size(2) == grad_out.size(2));
+  TORCH_CHECK(grad_out.sizes() == output.sizes());
 
   TORCH_CHECK(query.size(2) == key.size(2));
   TORCH_CHECK(query.size(0) == key.size(0));
@@ -301,6 +530,14 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> attention_backward(
       query.size(2) ==
       value.size(2)); // TODO: drop this limitation in the future
 
+  TORCH_CHECK(query.scalar_type() == key.scalar_type());
+  TORCH_CHECK(query.scalar_type() == value.scalar_type());
+  TORCH_CHECK(query.scalar_type() == grad_out.scalar_type());
+  TORCH_CHECK(query.scalar_type() == output.scalar_type());
+  TORCH_CHECK(
+      logsumexp.scalar_type() == at::toOpMathType(query.scalar_type()),
+      "logsumexp should be in the accumulation type");
+
   at::Tensor attn_bias;
   if (attn_bias_.has_value()) {
     attn_bias = *attn_bias_;
@@ -309,6 +546,7 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> attention_backward(
     TORCH_CHECK(query.size(1) == attn_bias.size(1));
     TORCH_CHECK(key.size(1) == attn_bias.size(2));
     TORCH_CHECK(attn_bias.stride(1) == 0);
+    TORCH_CHECK(query.scalar_type() == attn_bias.scalar_type());
   }
 
   TORCH_CHECK(!query.is_cuda(), "query must be a CPU tensor");
@@ -321,26 +559,39 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> attention_backward(
   TORCH_CHECK(!value.is_sparse(), "value must be a dense tensor");
   TORCH_CHECK(!grad_out.is_sparse(), "grad_out must be a dense tensor");
 
+  TORCH_CHECK(query.is_contiguous());
+  TORCH_CHECK(key.is_contiguous());
+  TORCH_CHECK(value.is_contiguous());
+  TORCH_CHECK(grad_out.is_contiguous());
+  TORCH_CHECK(output.is_contiguous());
+
   TORCH_CHECK(p == 0, "CPU implementation does not support dropout");
 
   int64_t B = query.size(0);
   int64_t M = query.size(1);
-  int64_t N = key.size(1);
   int64_t K = query.size(2);
 
-  at::Tensor res = at::empty({B, M, K}, query.options());
-  at::Tensor grad_q = at::zeros_like(query);
-  at::Tensor grad_k = at::zeros_like(key);
-  at::Tensor grad_v = at::zeros_like(value);
+  // Every row of the gradients is written exactly once by the kernel
+  at::Tensor grad_q = at::empty_like(query);
+  at::Tensor grad_k = at::empty_like(key);
+  at::Tensor grad_v = at::empty_like(value);
 
-  at::Tensor buffer = at::empty({at::get_num_threads(), 1, K}, query.options());
-  at::Tensor buffer2 =
-      at::zeros({at::get_num_threads(), 1, N}, query.options());
+  const auto accum_options =
+      query.options().dtype(at::toOpMathType(query.scalar_type()));
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), _attention_backward_scratch_size(K)},
+      accum_options);
+  at::Tensor delta = at::empty({B, M}, accum_options);
 
   const std::array<int64_t, 3> zeros{{0}};
 
-  AT_DISPATCH_FLOATING_TYPES(
-      query.scalar_type(), "attention_backward_kernel", [&] {
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      query.scalar_type(),
+      "attention_backward_kernel",
+      [&] {
+        using accum_t = at::opmath_type<scalar_t>;
         attention_backward_kernel<scalar_t>(
             grad_q.accessor<scalar_t, 3>(),
             grad_k.accessor<scalar_t, 3>(),
@@ -349,9 +600,10 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> attention_backward(
             query.accessor<scalar_t, 3>(),
             key.accessor<scalar_t, 3>(),
             value.accessor<scalar_t, 3>(),
-            logsumexp.accessor<scalar_t, 2>(),
-            buffer.accessor<scalar_t, 3>(),
-            buffer2.accessor<scalar_t, 3>(),
+            output.accessor<scalar_t, 3>(),
+            logsumexp.accessor<accum_t, 2>(),
+            delta.accessor<accum_t, 2>(),
+            buffer.accessor<accum_t, 2>(),
             _tensor_accessor_or_dummy<scalar_t>(attn_bias, zeros));
       });
 
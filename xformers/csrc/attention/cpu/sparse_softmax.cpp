@@ -6,92 +6,209 @@
  * LICENSE file in the root directory of this source tree.
  */
 #include <ATen/ATen.h>
+#include <ATen/OpMathType.h>
+#include <ATen/Parallel.h>
 #include <torch/types.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#include <ATen/cpu/vec/functional.h>
+#include <ATen/cpu/vec/vec.h>
+
+#include "../../cpu/vec_utils.h"
+#include "csr_utils.h"
 
 namespace {
 
-void SparseSoftmax(
-    int m,
-    int n,
-    int nonzeros,
-    const float* values,
-    const int* row_indices,
-    const int* row_offsets,
-    const int* column_indices,
-    float* output_values,
-    int batch_size) {
-  for (int b = 0; b < batch_size; b++) {
-    for (int i = 0; i < m; ++i) {
-      // find the max in a row
-      float max = -INFINITY;
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        float x = values[b * nonzeros + j];
-        max = x > max ? x : max;
-      }
-      // compute the normalization constant
-      float norm = 0.0f;
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        float x = values[b * nonzeros + j];
-        norm += expf(x - max);
-      }
-      norm = 1.0f / norm;
-
-      // step 3: Normalize the exponentials of the input and store the
-      // results.
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        int offset = b * nonzeros + j;
-        float x = values[offset];
-        float res = expf(x - max) * norm;
-        output_values[offset] = res;
-      }
+using xformers::cpu::_load_row;
+using xformers::cpu::_out_row;
+using xformers::cpu::_store_row;
+
+// Nonzeros of a row processed at a time. Both kernels only ever read an
+// element before writing the same element, so `output_values` may alias
+// `values` (forward) or `gradient` (backward).
+constexpr int64_t kBlockNnz = 256;
+
+// Softmax of the nonzeros `[row_begin, row_end)` of a row
+template <typename scalar_t, typename accum_t>
+void _softmax_row(
+    const scalar_t* values,
+    scalar_t* output_values,
+    int64_t row_begin,
+    int64_t row_end,
+    accum_t* buf) {
+  using Vec = at::vec::Vectorized<accum_t>;
+  const accum_t neg_inf = -std::numeric_limits<accum_t>::infinity();
+
+  // Step 1: max and normalization constant in a single pass, with
+  // the sum rescaled whenever a block raises the max
+  accum_t max = neg_inf;
+  accum_t norm = 0;
+  for (int64_t j = row_begin; j < row_end; j += kBlockNnz) {
+    const int64_t len = std::min(kBlockNnz, row_end - j);
+    const accum_t* x = _load_row(values + j, buf, len);
+    const accum_t block_max = at::vec::reduce_all<accum_t>(
+        [](Vec& a, Vec& b) { return at::vec::maximum(a, b); }, x, len);
+    const accum_t new_max = std::max(max, block_max);
+    if (new_max == neg_inf) {
+      continue;
     }
+    norm = norm * std::exp(max - new_max) +
+        at::vec::map_reduce_all<accum_t>(
+               [new_max](Vec a) { return (a - Vec(new_max)).exp(); },
+               [](Vec a, Vec b) { return a + b; },
+               x,
+               len);
+    max = new_max;
+  }
+  norm = accum_t(1) / norm;
+
+  // Step 2: normalize the exponentials of the input and store them
+  for (int64_t j = row_begin; j < row_end; j += kBlockNnz) {
+    const int64_t len = std::min(kBlockNnz, row_end - j);
+    const accum_t* x = _load_row(values + j, buf, len);
+    accum_t* y = _out_row(output_values + j, buf);
+    at::vec::map(
+        [max, norm](Vec a) { return (a - Vec(max)).exp() * Vec(norm); },
+        y,
+        x,
+        len);
+    _store_row(y, output_values + j, len);
+  }
+}
+
+// Gradient of the softmax for the nonzeros `[row_begin, row_end)` of a row
+template <typename scalar_t, typename accum_t>
+void _softmax_backward_row(
+    const scalar_t* gradient,
+    const scalar_t* values,
+    scalar_t* output_values,
+    int64_t row_begin,
+    int64_t row_end,
+    accum_t* x_buf,
+    accum_t* g_buf) {
+  using Vec = at::vec::Vectorized<accum_t>;
+
+  // Step 1: compute the intermediate sum used for the gradient
+  accum_t sum = 0;
+  for (int64_t j = row_begin; j < row_end; j += kBlockNnz) {
+    const int64_t len = std::min(kBlockNnz, row_end - j);
+    const accum_t* x = _load_row(values + j, x_buf, len);
+    const accum_t* g = _load_row(gradient + j, g_buf, len);
+    sum += at::vec::map2_reduce_all<accum_t>(
+        [](Vec a, Vec b) { return a * b; },
+        [](Vec a, Vec b) { return a + b; },
+        x,
+        g,
+        len);
+  }
+
+  // Step 2: compute the gradients
+  for (int64_t j = row_begin; j < row_end; j += kBlockNnz) {
+    const int64_t len = std::min(kBlockNnz, row_end - j);
+    const accum_t* x = _load_row(values + j, x_buf, len);
+    const accum_t* g = _load_row(gradient + j, g_buf, len);
+    accum_t* y = _out_row(output_values + j, g_buf);
+    at::vec::map2(
+        [sum](Vec a, Vec b) { return a * (b - Vec(sum)); }, y, x, g, len);
+    _store_row(y, output_values + j, len);
   }
 }
 
+template <typename scalar_t>
+void SparseSoftmax(
+    int64_t m,
+    int64_t nonzeros,
+    const scalar_t* values,
+    const int* row_offsets,
+    scalar_t* output_values,
+    int64_t batch_size,
+    at::opmath_type<scalar_t>* buffer) {
+  xformers::cpu::csr_parallel_for_rows(
+      batch_size, m, row_offsets, [&](int64_t b, int64_t i) {
+        _softmax_row(
+            values,
+            output_values,
+            b * nonzeros + row_offsets[i],
+            b * nonzeros + row_offsets[i + 1],
+            buffer + at::get_thread_num() * kBlockNnz);
+      });
+}
+
+template <typename scalar_t>
 void SparseSoftmaxBackwardKernel(
-    int m,
-    int n,
-    const float* gradient,
-    const float* values,
-    const int* row_indices,
+    int64_t m,
+    const scalar_t* gradient,
+    const scalar_t* values,
     const int* row_offsets,
-    const int* column_indices,
-    float* output_values,
-    int nonzeros,
-    int batch_size) {
-  for (int b = 0; b < batch_size; b++) {
-    for (int i = 0; i < m; ++i) {
-      // Step 1: Compute the intermediate sum used for the gradient
-      float sum = 0.0f;
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        float x = values[b * nonzeros + j];
-        float g = gradient[b * nonzeros + j];
-        sum += x * g;
-      }
-
-      // step 2: Compute the gradients
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        float x = values[b * nonzeros + j];
-        float g = gradient[b * nonzeros + j];
-        float res = x * (g - sum);
-        output_values[b * nonzeros + j] = res;
-      }
-    }
-  }
+    scalar_t* output_values,
+    int64_t nonzeros,
+    int64_t batch_size,
+    at::opmath_type<scalar_t>* buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  xformers::cpu::csr_parallel_for_rows(
+      batch_size, m, row_offsets, [&](int64_t b, int64_t i) {
+        accum_t* x_buf = buffer + at::get_thread_num() * 2 * kBlockNnz;
+        _softmax_backward_row(
+            gradient,
+            values,
+            output_values,
+            b * nonzeros + row_offsets[i],
+            b * nonzeros + row_offsets[i + 1],
+            x_buf,
+            x_buf + kBlockNnz);
+      });
 }
 
-at::Tensor sparse_softmax_sputnik(
+// Same as `SparseSoftmax` and `SparseSoftmaxBackwardKernel`, where each
+// batch element has its own sparsity pattern: `row_offsets` are the offsets
+// of the `batch_size * m` rows in the concatenation of their nonzeros, see
+// `csr_batched_row_offsets`. `gradient` is null for the forward.
+template <typename scalar_t>
+void SparseSoftmaxBatched(
     int64_t m,
-    int64_t n,
+    const scalar_t* gradient,
+    const scalar_t* values,
+    const int64_t* row_offsets,
+    scalar_t* output_values,
+    int64_t batch_size,
+    at::opmath_type<scalar_t>* buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  xformers::cpu::csr_parallel_for_rows(
+      1, batch_size * m, row_offsets, [&](int64_t, int64_t r) {
+        accum_t* x_buf = buffer + at::get_thread_num() * 2 * kBlockNnz;
+        if (gradient == nullptr) {
+          _softmax_row(
+              values, output_values, row_offsets[r], row_offsets[r + 1], x_buf);
+        } else {
+          _softmax_backward_row(
+              gradient,
+              values,
+              output_values,
+              row_offsets[r],
+              row_offsets[r + 1],
+              x_buf,
+              x_buf + kBlockNnz);
+        }
+      });
+}
+
+void check_csr_inputs(
     const at::Tensor& row_indices,
     const at::Tensor& values,
     const at::Tensor& row_offsets,
-    const at::Tensor& column_indices) {
+    const at::Tensor& column_indices,
+    int64_t m) {
   TORCH_CHECK(values.dim() == 2);
   TORCH_CHECK(row_indices.dim() == 1);
   TORCH_CHECK(row_offsets.dim() == 1);
   TORCH_CHECK(column_indices.dim() == 1);
   TORCH_CHECK(values.size(1) == column_indices.size(0));
+  TORCH_CHECK(row_offsets.size(0) == m + 1);
+  TORCH_CHECK(row_offsets.scalar_type() == at::ScalarType::Int);
 
   TORCH_CHECK(!row_indices.is_cuda(), "row_indices must be a CPU tensor");
   TORCH_CHECK(!values.is_cuda(), "values must be a CPU tensor");
@@ -112,26 +229,114 @@ at::Tensor sparse_softmax_sputnik(
   TORCH_CHECK(!row_offsets.is_sparse(), "row_offsets must be a dense tensor");
   TORCH_CHECK(
       !column_indices.is_sparse(), "column_offsets must be a dense tensor");
+}
 
-  int batch = values.size(0);
-  int nonzeros = column_indices.size(0);
+// Computes the softmax of `values` into `output`, which may be `values`
+void sparse_softmax_out(
+    int64_t m,
+    const at::Tensor& row_indices,
+    const at::Tensor& values,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    at::Tensor& output) {
+  check_csr_inputs(row_indices, values, row_offsets, column_indices, m);
+
+  int64_t batch = values.size(0);
+  int64_t nonzeros = column_indices.size(0);
 
-  at::Tensor output = at::empty({batch, nonzeros}, values.options());
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), kBlockNnz},
+      values.options().dtype(at::toOpMathType(values.scalar_type())));
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      values.scalar_type(),
+      "sparse_softmax_sputnik",
+      [&] {
+        using accum_t = at::opmath_type<scalar_t>;
+        SparseSoftmax<scalar_t>(
+            m,
+            nonzeros,
+            values.data_ptr<scalar_t>(),
+            row_offsets.data_ptr<int>(),
+            output.data_ptr<scalar_t>(),
+            batch,
+            buffer.data_ptr<accum_t>());
+      });
+}
 
-  SparseSoftmax(
-      m,
-      n,
-      nonzeros,
-      values.data_ptr<float>(),
-      row_indices.data_ptr<int>(),
-      row_offsets.data_ptr<int>(),
-      column_indices.data_ptr<int>(),
-      output.data_ptr<float>(),
-      batch);
+// Computes the gradient of the softmax into `output`, which may be `grad`
+void sparse_softmax_backward_out(
+    int64_t m,
+    const at::Tensor& row_indices,
+    const at::Tensor& values,
+    const at::Tensor& grad,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    at::Tensor& output) {
+  check_csr_inputs(row_indices, values, row_offsets, column_indices, m);
+  TORCH_CHECK(grad.dim() == 2);
+  TORCH_CHECK(values.size(0) == grad.size(0));
+  TORCH_CHECK(values.size(1) == grad.size(1));
+  TORCH_CHECK(
+      values.scalar_type() == grad.scalar_type(),
+      "values and grad must have the same dtype");
+  TORCH_CHECK(!grad.is_cuda(), "grad must be a CPU tensor");
+  TORCH_CHECK(grad.is_contiguous(), "grad must be a contiguous tensor");
+  TORCH_CHECK(!grad.is_sparse(), "grad must be a dense tensor");
 
+  int64_t batch = values.size(0);
+  int64_t nonzeros = column_indices.size(0);
+
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), 2 * kBlockNnz},
+      values.options().dtype(at::toOpMathType(values.scalar_type())));
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      values.scalar_type(),
+      "sparse_softmax_backward_sputnik",
+      [&] {
+        using accum_t = at::opmath_type<scalar_t>;
+        SparseSoftmaxBackwardKernel<scalar_t>(
+            m,
+            grad.data_ptr<scalar_t>(),
+            values.data_ptr<scalar_t>(),
+            row_offsets.data_ptr<int>(),
+            output.data_ptr<scalar_t>(),
+            nonzeros,
+            batch,
+            buffer.data_ptr<accum_t>());
+      });
+}
+
+at::Tensor sparse_softmax_sputnik(
+    int64_t m,
+    int64_t n,
+    const at::Tensor& row_indices,
+    const at::Tensor& values,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices) {
+  at::Tensor output = at::empty_like(values);
+  sparse_softmax_out(
+      m, row_indices, values, row_offsets, column_indices, output);
   return output;
 }
 
+at::Tensor& sparse_softmax_sputnik_(
+    int64_t m,
+    int64_t n,
+    const at::Tensor& row_indices,
+    at::Tensor& values,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices) {
+  sparse_softmax_out(
+      m, row_indices, values, row_offsets, column_indices, values);
+  return values;
+}
+
 at::Tensor sparse_softmax_backward_sputnik(
     int64_t m,
     int64_t n,
@@ -140,56 +345,100 @@ at::Tensor sparse_softmax_backward_sputnik(
     const at::Tensor& grad,
     const at::Tensor& row_offsets,
     const at::Tensor& column_indices) {
-  TORCH_CHECK(grad.dim() == 2);
-  TORCH_CHECK(values.dim() == 2);
-  TORCH_CHECK(row_indices.dim() == 1);
-  TORCH_CHECK(row_offsets.dim() == 1);
-  TORCH_CHECK(column_indices.dim() == 1);
-  TORCH_CHECK(values.size(1) == column_indices.size(0));
-  TORCH_CHECK(values.size(0) == grad.size(0));
-  TORCH_CHECK(values.size(1) == grad.size(1));
+  at::Tensor output = at::empty_like(values);
+  sparse_softmax_backward_out(
+      m, row_indices, values, grad, row_offsets, column_indices, output);
+  return output;
+}
 
-  TORCH_CHECK(!grad.is_cuda(), "grad must be a CPU tensor");
-  TORCH_CHECK(!row_indices.is_cuda(), "row_indices must be a CPU tensor");
-  TORCH_CHECK(!values.is_cuda(), "values must be a CPU tensor");
-  TORCH_CHECK(!row_offsets.is_cuda(), "row_offsets must be a CPU tensor");
-  TORCH_CHECK(!column_indices.is_cuda(), "column_offsets must be a CPU tensor");
+at::Tensor& sparse_softmax_backward_sputnik_(
+    int64_t m,
+    int64_t n,
+    const at::Tensor& row_indices,
+    const at::Tensor& values,
+    at::Tensor& grad,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices) {
+  sparse_softmax_backward_out(
+      m, row_indices, values, grad, row_offsets, column_indices, grad);
+  return grad;
+}
 
-  TORCH_CHECK(grad.is_contiguous(), "grad must be a contiguous tensor");
-  TORCH_CHECK(
-      row_indices.is_contiguous(), "row_indices must be a contiguous tensor");
+// Softmax (`grad` undefined) or its gradient for batch elements with their
+// own sparsity patterns
+at::Tensor sparse_softmax_batched(
+    int64_t m,
+    const at::Tensor& values,
+    const at::Tensor& grad,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    const at::Tensor& batch_offsets) {
+  TORCH_CHECK(values.dim() == 1);
+  TORCH_CHECK(values.size(0) == column_indices.size(0));
+  TORCH_CHECK(!values.is_cuda(), "values must be a CPU tensor");
   TORCH_CHECK(values.is_contiguous(), "values must be a contiguous tensor");
-  TORCH_CHECK(
-      row_offsets.is_contiguous(), "row_offsets must be a contiguous tensor");
-  TORCH_CHECK(
-      column_indices.is_contiguous(),
-      "column_offsets must be a contiguous tensor");
-
-  TORCH_CHECK(!grad.is_sparse(), "grad must be a dense tensor");
-  TORCH_CHECK(!row_indices.is_sparse(), "row_indices must be a dense tensor");
   TORCH_CHECK(!values.is_sparse(), "values must be a dense tensor");
-  TORCH_CHECK(!row_offsets.is_sparse(), "row_offsets must be a dense tensor");
-  TORCH_CHECK(
-      !column_indices.is_sparse(), "column_offsets must be a dense tensor");
+  if (grad.defined()) {
+    TORCH_CHECK(grad.dim() == 1);
+    TORCH_CHECK(values.size(0) == grad.size(0));
+    TORCH_CHECK(
+        values.scalar_type() == grad.scalar_type(),
+        "values and grad must have the same dtype");
+    TORCH_CHECK(!grad.is_cuda(), "grad must be a CPU tensor");
+    TORCH_CHECK(grad.is_contiguous(), "grad must be a contiguous tensor");
+    TORCH_CHECK(!grad.is_sparse(), "grad must be a dense tensor");
+  }
+  int64_t batch = row_offsets.size(0);
+  xformers::cpu::check_batched_csr_inputs(
+      row_offsets, column_indices, batch_offsets, batch, m);
+  const std::vector<int64_t> offsets = xformers::cpu::csr_batched_row_offsets(
+      row_offsets.data_ptr<int>(), batch_offsets.data_ptr<int>(), batch, m);
 
-  int batch = values.size(0);
-  int nonzeros = column_indices.size(0);
+  at::Tensor output = at::empty_like(values);
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), 2 * kBlockNnz},
+      values.options().dtype(at::toOpMathType(values.scalar_type())));
 
-  at::Tensor output = at::empty({batch, nonzeros}, values.options());
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      values.scalar_type(),
+      "sparse_softmax_sputnik_batched",
+      [&] {
+        using accum_t = at::opmath_type<scalar_t>;
+        SparseSoftmaxBatched<scalar_t>(
+            m,
+            grad.defined() ? grad.data_ptr<scalar_t>() : nullptr,
+            values.data_ptr<scalar_t>(),
+            offsets.data(),
+            output.data_ptr<scalar_t>(),
+            batch,
+            buffer.data_ptr<accum_t>());
+      });
+  return output;
+}
 
-  SparseSoftmaxBackwardKernel(
-      m,
-      n,
-      grad.data_ptr<float>(),
-      values.data_ptr<float>(),
-      row_indices.data_ptr<int>(),
-      row_offsets.data_ptr<int>(),
-      column_indices.data_ptr<int>(),
-      output.data_ptr<float>(),
-      nonzeros,
-      batch);
+at::Tensor sparse_softmax_sputnik_batched(
+    int64_t m,
+    int64_t n,
+    const at::Tensor& values,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    const at::Tensor& batch_offsets) {
+  return sparse_softmax_batched(
+      m, values, at::Tensor(), row_offsets, column_indices, batch_offsets);
+}
 
-  return output;
+at::Tensor sparse_softmax_backward_sputnik_batched(
+    int64_t m,
+    int64_t n,
+    const at::Tensor& values,
+    const at::Tensor& grad,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    const at::Tensor& batch_offsets) {
+  return sparse_softmax_batched(
+      m, values, grad, row_offsets, column_indices, batch_offsets);
 }
 
 } // namespace
@@ -198,7 +447,19 @@ TORCH_LIBRARY_IMPL(xformers, CPU, m) {
   m.impl(
       TORCH_SELECTIVE_NAME("xformers::sparse_softmax_sputnik"),
       TORCH_FN(sparse_softmax_sputnik));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sparse_softmax_sputnik_"),
+      TORCH_FN(sparse_softmax_sputnik_));
   m.impl(
       TORCH_SELECTIVE_NAME("xformers::sparse_softmax_backward_sputnik"),
       TORCH_FN(sparse_softmax_backward_sputnik));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sparse_softmax_backward_sputnik_"),
+      TORCH_FN(sparse_softmax_backward_sputnik_));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sparse_softmax_sputnik_batched"),
+      TORCH_FN(sparse_softmax_sputnik_batched));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sparse_softmax_backward_sputnik_batched"),
+      TORCH_FN(sparse_softmax_backward_sputnik_batched));
 }
@@ -1,36 +1,122 @@
 #include <ATen/ATen.h>
+#include <ATen/OpMathType.h>
+#include <ATen/Parallel.h>
 #include <torch/types.h>
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+
+#include <ATen/cpu/vec/functional.h>
+#include <ATen/cpu/vec/vec.h>
+
+#include "../../cpu/vec_utils.h"
+#include "csr_utils.h"
 
 namespace {
+
+using xformers::cpu::_load_row;
+using xformers::cpu::_vec_axpy;
+
+// Columns of the output computed at a time: the accumulators of a tile stay
+// in L1 while the nonzeros of the row stream the matching contiguous slices
+// of the dense operand.
+constexpr int64_t kBlockN = 256;
+
+// `out = sum(values[l] * dense_batch[column_indices[l]])` over the nonzeros
+// `l` in `[begin, end)` of a row, tile by tile of `kBlockN` columns
+template <typename scalar_t, typename accum_t>
+inline void _spmm_row(
+    const scalar_t* values,
+    const int* column_indices,
+    int64_t begin,
+    int64_t end,
+    const scalar_t* dense_batch,
+    int64_t n,
+    scalar_t* out,
+    accum_t* acc,
+    accum_t* dense_buf) {
+  for (int64_t n0 = 0; n0 < n; n0 += kBlockN) {
+    const int64_t n_len = std::min(kBlockN, n - n0);
+    std::fill(acc, acc + n_len, accum_t(0));
+    for (int64_t l = begin; l < end; ++l) {
+      const accum_t* dense_row = _load_row(
+          dense_batch + column_indices[l] * n + n0, dense_buf, n_len);
+      _vec_axpy(acc, accum_t(values[l]), dense_row, n_len);
+    }
+    if constexpr (std::is_same<scalar_t, accum_t>::value) {
+      std::copy(acc, acc + n_len, out + n0);
+    } else {
+      at::vec::convert(acc, out + n0, n_len);
+    }
+  }
+}
+
 // taken from
 // https://github.com/google-research/google-research/blob/master/sgk/sparse/ops/cc/spmm_launcher.cc
-// with slight modifications to add batch support
-// Simple CPU kernel launcher.
+// with slight modifications to add batch support, and parallelized over the
+// rows of every batch element
+template <typename scalar_t>
 void LaunchSpmm(
-    int m,
-    int k,
-    int n,
-    int nonzeros,
-    const int* row_indices,
-    const float* values,
+    int64_t m,
+    int64_t k,
+    int64_t n,
+    int64_t nonzeros,
+    const scalar_t* values,
     const int* row_offsets,
     const int* column_indices,
-    const float* dense_matrix,
-    float* output_matrix,
-    int batch_size) {
-  for (int b = 0; b < batch_size; b++) {
-    for (int i = 0; i < m; ++i) {
-      for (int j = 0; j < n; ++j) {
-        float accumulator = 0.0f;
-        for (int l = row_offsets[i]; l < row_offsets[i + 1]; ++l) {
-          int column_index = column_indices[l];
-          accumulator += values[b * nonzeros + l] *
-              dense_matrix[b * k * n + column_index * n + j];
-        }
-        output_matrix[b * m * n + i * n + j] = accumulator;
-      }
-    }
-  }
+    const scalar_t* dense_matrix,
+    scalar_t* output_matrix,
+    int64_t batch_size,
+    at::opmath_type<scalar_t>* buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  xformers::cpu::csr_parallel_for_rows(
+      batch_size, m, row_offsets, [&](int64_t b, int64_t i) {
+        accum_t* acc = buffer + at::get_thread_num() * 2 * kBlockN;
+        accum_t* dense_buf = acc + kBlockN;
+        _spmm_row(
+            values + b * nonzeros,
+            column_indices,
+            row_offsets[i],
+            row_offsets[i + 1],
+            dense_matrix + b * k * n,
+            n,
+            output_matrix + (b * m + i) * n,
+            acc,
+            dense_buf);
+      });
+}
+
+// Same as `LaunchSpmm`, where each batch element has its own sparsity
+// pattern: `row_offsets` are the offsets of the `batch_size * m` rows in the
+// concatenation of their nonzeros, see `csr_batched_row_offsets`
+template <typename scalar_t>
+void LaunchSpmmBatched(
+    int64_t m,
+    int64_t k,
+    int64_t n,
+    const scalar_t* values,
+    const int64_t* row_offsets,
+    const int* column_indices,
+    const scalar_t* dense_matrix,
+    scalar_t* output_matrix,
+    int64_t batch_size,
+    at::opmath_type<scalar_t>* buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  xformers::cpu::csr_parallel_for_rows(
+      1, batch_size * m, row_offsets, [&](int64_t, int64_t r) {
+        accum_t* acc = buffer + at::get_thread_num() * 2 * kBlockN;
+        accum_t* dense_buf = acc + kBlockN;
+        _spmm_row(
+            values,
+            column_indices,
+            row_offsets[r],
+            row_offsets[r + 1],
+            dense_matrix + (r / m) * k * n,
+            n,
+            output_matrix + r * n,
+            acc,
+            dense_buf);
+      });
 }
 
 at::Tensor spmm_sputnik(
@@ -47,6 +133,12 @@ at::Tensor spmm_sputnik(
   TORCH_CHECK(row_offsets.dim() == 1);
   TORCH_CHECK(column_indices.dim() == 1);
   TORCH_CHECK(values.size(1) == column_indices.size(0));
+  TORCH_CHECK(row_offsets.size(0) == m + 1);
+  TORCH_CHECK(
+      b.scalar_type() == values.scalar_type(),
+      "b and values must have the same dtype");
+  TORCH_CHECK(row_offsets.scalar_type() == at::ScalarType::Int);
+  TORCH_CHECK(column_indices.scalar_type() == at::ScalarType::Int);
 
   TORCH_CHECK(!b.is_cuda(), "b must be a CPU tensor");
   TORCH_CHECK(!row_indices.is_cuda(), "row_indices must be a CPU tensor");
@@ -71,29 +163,102 @@ at::Tensor spmm_sputnik(
   TORCH_CHECK(
       !column_indices.is_sparse(), "column_offsets must be a dense tensor");
 
-  int batch = b.size(0);
-  int k = b.size(1);
-  int n = b.size(2);
+  int64_t batch = b.size(0);
+  int64_t k = b.size(1);
+  int64_t n = b.size(2);
 
-  int nonzeros = column_indices.size(0);
+  int64_t nonzeros = column_indices.size(0);
   TORCH_CHECK(
       batch == 1 || nonzeros % 4 == 0,
       "If batch size > 1 then number of nonzeros should be a multiple of 4");
 
   at::Tensor output = at::empty({batch, m, n}, b.options());
+  // Accumulators and converted slices of `b`, per thread
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), 2 * kBlockN},
+      b.options().dtype(at::toOpMathType(b.scalar_type())));
 
-  LaunchSpmm(
-      m,
-      k,
-      n,
-      nonzeros,
-      row_indices.data_ptr<int>(),
-      values.data_ptr<float>(),
-      row_offsets.data_ptr<int>(),
-      column_indices.data_ptr<int>(),
-      b.data_ptr<float>(),
-      output.data_ptr<float>(),
-      batch);
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      b.scalar_type(),
+      "spmm_sputnik",
+      [&] {
+        using accum_t = at::opmath_type<scalar_t>;
+        LaunchSpmm<scalar_t>(
+            m,
+            k,
+            n,
+            nonzeros,
+            values.data_ptr<scalar_t>(),
+            row_offsets.data_ptr<int>(),
+            column_indices.data_ptr<int>(),
+            b.data_ptr<scalar_t>(),
+            output.data_ptr<scalar_t>(),
+            batch,
+            buffer.data_ptr<accum_t>());
+      });
+
+  return output;
+}
+
+// `output[b, i] = sum(values[j] * b[b, column_indices[j]])` over the
+// nonzeros `j` of the row `i` of the sparsity pattern of batch element `b`.
+// The patterns may differ between batch elements, and have any number of
+// nonzeros.
+at::Tensor spmm_sputnik_batched(
+    const at::Tensor& b,
+    const at::Tensor& values,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    const at::Tensor& batch_offsets,
+    int64_t m) {
+  TORCH_CHECK(b.dim() == 3);
+  TORCH_CHECK(values.dim() == 1);
+  TORCH_CHECK(values.size(0) == column_indices.size(0));
+  TORCH_CHECK(
+      b.scalar_type() == values.scalar_type(),
+      "b and values must have the same dtype");
+  TORCH_CHECK(!b.is_cuda(), "b must be a CPU tensor");
+  TORCH_CHECK(!values.is_cuda(), "values must be a CPU tensor");
+  TORCH_CHECK(b.is_contiguous(), "b must be a contiguous tensor");
+  TORCH_CHECK(values.is_contiguous(), "values must be a contiguous tensor");
+  TORCH_CHECK(!b.is_sparse(), "b must be a dense tensor");
+  TORCH_CHECK(!values.is_sparse(), "values must be a dense tensor");
+
+  int64_t batch = b.size(0);
+  int64_t k = b.size(1);
+  int64_t n = b.size(2);
+  xformers::cpu::check_batched_csr_inputs(
+      row_offsets, column_indices, batch_offsets, batch, m);
+  const std::vector<int64_t> offsets = xformers::cpu::csr_batched_row_offsets(
+      row_offsets.data_ptr<int>(), batch_offsets.data_ptr<int>(), batch, m);
+
+  at::Tensor output = at::empty({batch, m, n}, b.options());
+  // Accumulators and converted slices of `b`, per thread
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), 2 * kBlockN},
+      b.options().dtype(at::toOpMathType(b.scalar_type())));
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      b.scalar_type(),
+      "spmm_sputnik_batched",
+      [&] {
+        using accum_t = at::opmath_type<scalar_t>;
+        LaunchSpmmBatched<scalar_t>(
+            m,
+            k,
+            n,
+            values.data_ptr<scalar_t>(),
+            offsets.data(),
+            column_indices.data_ptr<int>(),
+            b.data_ptr<scalar_t>(),
+            output.data_ptr<scalar_t>(),
+            batch,
+            buffer.data_ptr<accum_t>());
+      });
 
   return output;
 }
@@ -103,4 +268,7 @@ at::Tensor spmm_sputnik(
 TORCH_LIBRARY_IMPL(xformers, CPU, m) {
   m.impl(
       TORCH_SELECTIVE_NAME("xformers::spmm_sputnik"), TORCH_FN(spmm_sputnik));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::spmm_sputnik_batched"),
+      TORCH_FN(spmm_sputnik_batched));
 }
@@ -48,7 +48,19 @@ mem_efficient_attention_backward_cutlass(
     const c10::optional<double> scale,
     // how many parallel blocks across the keys dimension. Use `-1` to
     // determine automatically
-    int64_t num_splits_key) {
+    int64_t num_splits_key,
+    // (Mode 1MHK only) [b]: number of keys used in each sequence, when
+    // they are padded - only supported on CPU
+    const c10::optional<at::Tensor>& seqlen_k,
+    // Sliding window of `LocalFromBottomRight` - only supported on CPU
+    const c10::optional<int64_t> window_left,
+    const c10::optional<int64_t> window_right,
+    // [num_heads] ALiBi slopes, see the forward
+    const c10::optional<at::Tensor>& alibi_slopes,
+    // Rotary embedding of Q and K - only supported on CPU
+    const c10::optional<at::Tensor>& rotary_cos,
+    const c10::optional<at::Tensor>& rotary_sin,
+    const c10::optional<at::Tensor>& rotary_positions) {
 #ifdef XFORMERS_MEM_EFF_ATTENTION_DISABLE_BACKWARD
   TORCH_CHECK(
       false,
@@ -90,6 +102,14 @@ mem_efficient_attention_backward_cutlass(
   CHECK_NOSPARSE_LASTCONTIGUOUS_CUDA(value);
 
   TORCH_CHECK(cu_seqlens_q.has_value() == cu_seqlens_k.has_value());
+  TORCH_CHECK(!seqlen_k.has_value(), "seqlen_k is not supported");
+  TORCH_CHECK(
+      !window_left.has_value() && !window_right.has_value(),
+      "window_left / window_right are not supported");
+  TORCH_CHECK(
+      !rotary_cos.has_value() && !rotary_sin.has_value() &&
+          !rotary_positions.has_value(),
+      "rotary_cos / rotary_sin / rotary_positions are not supported");
   TORCH_CHECK(
       !(cu_seqlens_q.has_value() && bias.has_value()),
       "cu seqlen + bias not supported");
@@ -306,6 +326,16 @@ mem_efficient_attention_backward_cutlass(
         ASSIGN_CHECK_OVERFLOW(p.gB_strideM, grad_bias.stride(2));
       }
     }
+    if (alibi_slopes.has_value()) {
+      CHECK_NOSPARSE_CONTIGUOUS_CUDA((*alibi_slopes));
+      TORCH_CHECK(
+          alibi_slopes->scalar_type() == at::ScalarType::Float,
+          "alibi_slopes must be a float32 tensor");
+      TORCH_CHECK(
+          alibi_slopes->dim() == 1 && alibi_slopes->size(0) == query.size(2),
+          "alibi_slopes: expected one slope per head");
+      p.alibi_slopes_ptr = (const float*)alibi_slopes->data_ptr();
+    }
 
     if (use_dropout) {
       p.rng_engine_inputs = rng_engine_inputs;
@@ -47,7 +47,19 @@ efficient_attention_forward_cutlass(
     bool compute_logsumexp,
     int64_t custom_mask_type,
     c10::optional<double> scale,
-    const c10::optional<at::Tensor>& seqlen_k) {
+    const c10::optional<at::Tensor>& seqlen_k,
+    // Only with `LocalFromBottomRight`: number of keys visible on the left /
+    // on the right of the (bottom-right aligned) diagonal, unbounded if not
+    // set
+    const c10::optional<int64_t> window_left,
+    const c10::optional<int64_t> window_right,
+    // [num_heads] ALiBi slopes: `slope * (key_pos - query_pos)` is added to
+    // the attention scores, without materializing it
+    const c10::optional<at::Tensor>& alibi_slopes,
+    // Rotary embedding of Q and K - only supported on CPU
+    const c10::optional<at::Tensor>& rotary_cos,
+    const c10::optional<at::Tensor>& rotary_sin,
+    const c10::optional<at::Tensor>& rotary_positions) {
 #ifdef XFORMERS_MEM_EFF_ATTENTION_DISABLE_FORWARD
   TORCH_CHECK(
       false,
@@ -71,6 +83,10 @@ efficient_attention_forward_cutlass(
 
   // Embedding per head
   TORCH_CHECK(query.size(3) == key.size(3));
+  TORCH_CHECK(
+      !rotary_cos.has_value() && !rotary_sin.has_value() &&
+          !rotary_positions.has_value(),
+      "rotary_cos / rotary_sin / rotary_positions are not supported");
 
   int64_t max_seqlen_q, max_seqlen_k;
   TORCH_CHECK(seqstart_q.has_value() == seqstart_k.has_value());
@@ -138,7 +154,8 @@ efficient_attention_forward_cutlass(
     if (!Kernel::kSupportsDropout && use_dropout) {
       return;
     }
-    if (!Kernel::kSupportsBias && bias.has_value()) {
+    if (!Kernel::kSupportsBias &&
+        (bias.has_value() || alibi_slopes.has_value())) {
       return;
     }
 
@@ -205,6 +222,22 @@ efficient_attention_forward_cutlass(
     p.num_keys = max_seqlen_k;
     p.num_batches = seqstart_q.has_value() ? seqstart_q->size(0) - 1 : B;
     p.custom_mask_type = custom_mask_type;
+    if (custom_mask_type == Kernel::LocalFromBottomRight) {
+      // `causal_diagonal_offset` is unsigned
+      TORCH_CHECK(
+          key.size(1) >= query.size(1),
+          "`LocalFromBottomRight` requires at least as many keys as queries");
+    }
+    if (window_left.has_value() || window_right.has_value()) {
+      TORCH_CHECK(
+          custom_mask_type == Kernel::LocalFromBottomRight,
+          "window_left / window_right require `custom_mask_type=LocalFromBottomRight`");
+      TORCH_CHECK(
+          window_left.value_or(0) >= 0 && window_right.value_or(0) >= 0,
+          "window_left / window_right must be non-negative");
+    }
+    ASSIGN_CHECK_OVERFLOW(p.window_left, window_left.value_or(-1));
+    ASSIGN_CHECK_OVERFLOW(p.window_right, window_right.value_or(-1));
 
     p.seqlen_k_ptr = nullptr;
     if (seqlen_k.has_value()) {
@@ -257,6 +290,16 @@ efficient_attention_forward_cutlass(
           bias->stride(3) == 1,
           "attn_bias: wrong alignment (last dimension must be contiguous)");
     }
+    if (alibi_slopes.has_value()) {
+      CHECK_NOSPARSE_CONTIGUOUS_CUDA((*alibi_slopes));
+      TORCH_CHECK(
+          alibi_slopes->scalar_type() == at::ScalarType::Float,
+          "alibi_slopes must be a float32 tensor");
+      TORCH_CHECK(
+          alibi_slopes->dim() == 1 && alibi_slopes->size(0) == query.size(2),
+          "alibi_slopes: expected one slope per head");
+      p.alibi_slopes_ptr = (const float*)alibi_slopes->data_ptr();
+    }
 
     p.use_dropout = use_dropout;
     if (p.use_dropout) {
@@ -17,19 +17,22 @@
 #include <cuda_bf16.h>
 #include <cuda_fp16.h>
 
+#include <algorithm>
+#include <limits>
+
 #if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 700
 #include <cuda/atomic>
 #endif
 
 namespace {
 
-// Each block handles a single batch and head
+// Each block handles a single batch, head and split of the KV cache
 
 // Each warp handles separate D dimension.
 
 // Load Q into registers in all warps.
 // Split T across warps in a block
-// Compute S[T_MAX] = for i in range(T): S[t] = sum(Q[d] * K[t, d])
+// Compute S[t_max] = for i in range(T): S[t] = sum(Q[d] * K[t, d])
 // Use shared reduction to compute max and compute softmax on shared memory.
 
 // Split T across warps in a block
@@ -37,10 +40,18 @@ namespace {
 // each warp compute sum(t_subset) P[t] * V[t_subset, d]
 // outputs are of size float[D]
 
+// When the cache is split (flash-decoding), every split writes its
+// normalized partial output and logsumexp, and `mqa_attn_merge_kernel`
+// combines the splits of each (batch, head).
+
 constexpr int32_t kThreadsPerWarp = 32;
 constexpr int32_t kWarpsPerBlock = 32;
 constexpr int32_t D_H = 128;
-constexpr int32_t T_MAX = 8192;
+// Keys handled by a single block, bounded by the shared memory used to
+// hold their scores
+constexpr int32_t kMaxKeysPerSplit = 8192;
+// Splits are not made smaller than this when splitting only to fill the GPU
+constexpr int32_t kMinKeysPerSplit = 512;
 
 #if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 700
 
@@ -213,6 +224,9 @@ __global__ void mqa_attn_kernel(
     at::PackedTensorAccessor64<scalar_t, 4, at::RestrictPtrTraits> cache_V,
     at::PackedTensorAccessor32<scalar_t, 4, at::RestrictPtrTraits> O,
     at::PackedTensorAccessor32<int32_t, 1, at::RestrictPtrTraits> seq_positions,
+    // [B, H, split_k, D] and [B, H, split_k], only used when split_k > 1
+    at::PackedTensorAccessor32<float, 4, at::RestrictPtrTraits> O_splits,
+    at::PackedTensorAccessor32<float, 3, at::RestrictPtrTraits> LSE_splits,
     float qk_scale) {
 #if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 700
   using whole_int_t = typename scalar4<scalar_t>::whole_int_t;
@@ -221,13 +235,21 @@ __global__ void mqa_attn_kernel(
 
   extern __shared__ __align__(16) float smem[];
 
-  // Each block handles a single batch and head
+  // Each block handles a single batch, head and split
   int32_t b = blockIdx.x;
   int32_t h = blockIdx.y;
+  int32_t split = blockIdx.z;
+  int32_t split_k = gridDim.z;
 
   // Note: this is decoding case where we attent to current and all previous
-  // tokens.
-  int32_t t_max = seq_positions[b] + seq_positions_shift;
+  // tokens. The keys of the batch element are divided evenly between the
+  // splits, and `t_max` counts those of this split.
+  int32_t seq_len = seq_positions[b] + seq_positions_shift;
+  int32_t keys_per_split = (seq_len + split_k - 1) / split_k;
+  int32_t t_begin = min(split * keys_per_split, seq_len);
+  int32_t t_max = min(keys_per_split, seq_len - t_begin);
+  // Shared scratch for the per-warp reductions, after the scores
+  float* smem_reduce = smem + t_max;
 
   int32_t warp_idx = threadIdx.y;
   // need kWarpsPerBlock == blockDim.y;
@@ -235,8 +257,8 @@ __global__ void mqa_attn_kernel(
   auto* q_ = &(XQ[b][0][h][0]);
 
   bool multiquery = cache_K.size(2) == 1;
-  auto* cache_K_base = &cache_K[b][0][multiquery ? 0 : h][0];
-  auto* cache_V_base = &cache_V[b][0][multiquery ? 0 : h][0];
+  auto* cache_K_base = &cache_K[b][t_begin][multiquery ? 0 : h][0];
+  auto* cache_V_base = &cache_V[b][t_begin][multiquery ? 0 : h][0];
 
   // Load Q into registers in all warps.
   // Each thread handles 4 D dimensions
@@ -247,7 +269,7 @@ __global__ void mqa_attn_kernel(
   // Each block computes different B value
   float max_qk_acc = std::numeric_limits<float>::lowest();
 
-  // Compute S[T_MAX] = for i in range(T): S[t] = sum(Q[d] * K[t, d])
+  // Compute S[t_max] = for i in range(T): S[t] = sum(Q[d] * K[t, d])
   // Split T across warps in a block, unroll loads to expose more
   // parallelism.
 
@@ -313,11 +335,11 @@ __global__ void mqa_attn_kernel(
   // Use shared reduction to compute max and compute softmax on shared memory.
   // write max acc
   if (threadIdx.x == 0) {
-    smem[T_MAX + warp_idx] = max_qk_acc;
+    smem_reduce[warp_idx] = max_qk_acc;
   }
   __syncthreads();
   if (threadIdx.x < kWarpsPerBlock) {
-    max_qk_acc = max(max_qk_acc, smem[T_MAX + threadIdx.x]);
+    max_qk_acc = max(max_qk_acc, smem_reduce[threadIdx.x]);
   }
   // shared across all threads in block
   max_qk_acc = warpReduceMax(max_qk_acc);
@@ -331,13 +353,13 @@ __global__ void mqa_attn_kernel(
 
   __syncthreads();
   if (threadIdx.x == 0) {
-    smem[T_MAX + warp_idx] = softmax_denominator;
+    smem_reduce[warp_idx] = softmax_denominator;
   }
   __syncthreads();
   // now, compute sum of exp(x - max(x)) over all intermediate results.
   softmax_denominator = 0.0;
   if (threadIdx.x < kWarpsPerBlock) {
-    softmax_denominator = smem[T_MAX + threadIdx.x];
+    softmax_denominator = smem_reduce[threadIdx.x];
   }
   softmax_denominator = warpReduceSum(softmax_denominator);
 
@@ -408,23 +430,137 @@ __global__ void mqa_attn_kernel(
           reinterpret_cast<fx4*>(&smem[0]) + w * kThreadsPerWarp + threadIdx.x);
       r = fx4_acc(r, partial_r);
     }
-    // write output D row
-    auto* o_ = (&O[b][0][h][0]);
-    auto bf_r = fx4_to_scalar4<scalar_t>(r);
-    *(reinterpret_cast<whole_int_t*>(o_) + threadIdx.x) =
-        *reinterpret_cast<const whole_int_t*>(&bf_r);
+    if (split_k == 1) {
+      // write output D row
+      auto* o_ = (&O[b][0][h][0]);
+      auto bf_r = fx4_to_scalar4<scalar_t>(r);
+      *(reinterpret_cast<whole_int_t*>(o_) + threadIdx.x) =
+          *reinterpret_cast<const whole_int_t*>(&bf_r);
+    } else {
+      // write the partial output of this split and its logsumexp, which is
+      // -inf for an empty split
+      *(reinterpret_cast<fx4*>(&O_splits[b][h][split][0]) + threadIdx.x) = r;
+      if (threadIdx.x == 0) {
+        LSE_splits[b][h][split] = max_qk_acc + __logf(softmax_denominator);
+      }
+    }
   }
 #else
   printf("FATAL: kernel is for sm80+ only");
 #endif // defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 700
 }
 
+// Combines the partial outputs of the splits of each (batch, head):
+// O = sum_s exp(LSE_s - LSE) * O_s, with LSE = logsumexp_s(LSE_s)
+template <typename scalar_t>
+__global__ void mqa_attn_merge_kernel(
+    at::PackedTensorAccessor32<float, 4, at::RestrictPtrTraits> O_splits,
+    at::PackedTensorAccessor32<float, 3, at::RestrictPtrTraits> LSE_splits,
+    at::PackedTensorAccessor32<scalar_t, 4, at::RestrictPtrTraits> O) {
+#if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 700
+  using whole_int_t = typename scalar4<scalar_t>::whole_int_t;
+
+  // Each block handles a single batch and head, each thread 4 D dimensions
+  int32_t b = blockIdx.x;
+  int32_t h = blockIdx.y;
+  int32_t split_k = LSE_splits.size(2);
+
+  float lse_max = -std::numeric_limits<float>::infinity();
+  for (int32_t split = 0; split < split_k; ++split) {
+    lse_max = max(lse_max, LSE_splits[b][h][split]);
+  }
+  fx4 r;
+  // Every split is empty if the maximum is -inf: the output is zero
+  if (lse_max != -std::numeric_limits<float>::infinity()) {
+    float denominator = 0;
+    for (int32_t split = 0; split < split_k; ++split) {
+      float alpha = __expf(LSE_splits[b][h][split] - lse_max);
+      auto partial_r =
+          *(reinterpret_cast<const fx4*>(&O_splits[b][h][split][0]) +
+            threadIdx.x);
+      denominator += alpha;
+      r.x += alpha * partial_r.x;
+      r.y += alpha * partial_r.y;
+      r.z += alpha * partial_r.z;
+      r.w += alpha * partial_r.w;
+    }
+    r.x /= denominator;
+    r.y /= denominator;
+    r.z /= denominator;
+    r.w /= denominator;
+  }
+  auto* o_ = (&O[b][0][h][0]);
+  auto bf_r = fx4_to_scalar4<scalar_t>(r);
+  *(reinterpret_cast<whole_int_t*>(o_) + threadIdx.x) =
+      *reinterpret_cast<const whole_int_t*>(&bf_r);
+#else
+  printf("FATAL: kernel is for sm80+ only");
+#endif // defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 700
+}
+
+// Number of splits of the KV cache: enough for the scores of a split to
+// fit in shared memory, and more when there are too few (batch, head)
+// pairs to fill the GPU, as long as every split keeps `kMinKeysPerSplit`
+// keys
+int64_t mqa_attn_num_splits(int64_t B, int64_t H, int64_t T) {
+  const int64_t num_sms =
+      at::cuda::getCurrentDeviceProperties()->multiProcessorCount;
+  const int64_t min_splits = (T + kMaxKeysPerSplit - 1) / kMaxKeysPerSplit;
+  const int64_t occupancy_splits =
+      std::min((num_sms + B * H - 1) / (B * H), T / kMinKeysPerSplit);
+  return std::max<int64_t>({1, min_splits, occupancy_splits});
+}
+
+template <typename scalar_t>
+void mqa_attn_launch(
+    at::Tensor& XQ,
+    at::Tensor& cache_K,
+    at::Tensor& cache_V,
+    at::Tensor& O,
+    at::Tensor& seq_positions,
+    at::Tensor& O_splits,
+    at::Tensor& LSE_splits,
+    double qk_scale,
+    dim3 blocks,
+    dim3 threads,
+    int32_t smem) {
+  if (smem > 48 * 1024) {
+    C10_CUDA_CHECK(cudaFuncSetAttribute(
+        mqa_attn_kernel<scalar_t>,
+        cudaFuncAttributeMaxDynamicSharedMemorySize,
+        smem));
+  }
+  mqa_attn_kernel<scalar_t>
+      <<<blocks, threads, smem, at::cuda::getCurrentCUDAStream()>>>(
+          XQ.packed_accessor32<scalar_t, 4, at::RestrictPtrTraits>(),
+          cache_K.packed_accessor64<scalar_t, 4, at::RestrictPtrTraits>(),
+          cache_V.packed_accessor64<scalar_t, 4, at::RestrictPtrTraits>(),
+          O.packed_accessor32<scalar_t, 4, at::RestrictPtrTraits>(),
+          seq_positions.packed_accessor32<int32_t, 1, at::RestrictPtrTraits>(),
+          O_splits.packed_accessor32<float, 4, at::RestrictPtrTraits>(),
+          LSE_splits.packed_accessor32<float, 3, at::RestrictPtrTraits>(),
+          qk_scale);
+  C10_CUDA_KERNEL_LAUNCH_CHECK();
+  if (blocks.z > 1) {
+    mqa_attn_merge_kernel<scalar_t><<<
+        dim3(blocks.x, blocks.y),
+        kThreadsPerWarp,
+        0,
+        at::cuda::getCurrentCUDAStream()>>>(
+        O_splits.packed_accessor32<float, 4, at::RestrictPtrTraits>(),
+        LSE_splits.packed_accessor32<float, 3, at::RestrictPtrTraits>(),
+        O.packed_accessor32<scalar_t, 4, at::RestrictPtrTraits>());
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+  }
+}
+
 at::Tensor mqa_attn(
     at::Tensor XQ, // [B, 1, H, D]
-    at::Tensor cache_K, // [B, T_MAX, H or 1, D]
-    at::Tensor cache_V, // [B, T_MAX, H or 1, D]
+    at::Tensor cache_K, // [B, T, H or 1, D]
+    at::Tensor cache_V, // [B, T, H or 1, D]
     at::Tensor seq_positions, // [B]
-    double qk_scale) {
+    double qk_scale,
+    c10::optional<int64_t> split_k_) {
   at::OptionalDeviceGuard guard(XQ.device());
   TORCH_CHECK(XQ.is_cuda());
   TORCH_CHECK(cache_K.is_cuda());
@@ -432,73 +568,85 @@ at::Tensor mqa_attn(
 
   TORCH_CHECK(seq_positions.is_cuda());
 
-  TORCH_CHECK(cache_K.size(1) <= T_MAX);
   TORCH_CHECK(cache_K.size(3) == D_H);
 
   auto O = at::empty_like(XQ);
   auto B = XQ.size(0);
   auto H = XQ.size(2);
-  dim3 blocks(B, H);
+  auto T = cache_K.size(1);
+
+  int64_t split_k = split_k_.has_value() ? *split_k_
+                                         : mqa_attn_num_splits(B, H, T);
+  TORCH_CHECK(split_k >= 1 && split_k <= 65535, "invalid split_k");
+  // Upper bound on the number of keys of a split, whatever its batch element
+  int64_t max_keys_per_split = (T + split_k - 1) / split_k;
+  TORCH_CHECK(
+      max_keys_per_split <= kMaxKeysPerSplit,
+      "split_k=",
+      split_k,
+      " is too small for ",
+      T,
+      " keys");
+
+  dim3 blocks(B, H, split_k);
   dim3 threads(kThreadsPerWarp, kWarpsPerBlock);
 
-  int32_t smem_softmax = T_MAX * sizeof(float) + kWarpsPerBlock * sizeof(float);
+  int32_t smem_softmax =
+      max_keys_per_split * sizeof(float) + kWarpsPerBlock * sizeof(float);
   int32_t smem_output = D_H * sizeof(float) * kWarpsPerBlock;
   int32_t smem = max(smem_softmax, smem_output);
 
+  // Partial outputs and logsumexp of the splits, merged by a second kernel
+  auto split_options = XQ.options().dtype(at::ScalarType::Float);
+  at::Tensor O_splits = split_k > 1
+      ? at::empty({B, H, split_k, D_H}, split_options)
+      : at::empty({0, 0, 0, 0}, split_options);
+  at::Tensor LSE_splits = split_k > 1
+      ? at::empty({B, H, split_k}, split_options)
+      : at::empty({0, 0, 0}, split_options);
+
   if (XQ.scalar_type() == at::ScalarType::Half) {
-    if (smem > 48 * 1024) {
-      C10_CUDA_CHECK(cudaFuncSetAttribute(
-          mqa_attn_kernel<at::Half>,
-          cudaFuncAttributeMaxDynamicSharedMemorySize,
-          smem));
-    }
-    mqa_attn_kernel<at::Half>
-        <<<blocks, threads, smem, at::cuda::getCurrentCUDAStream()>>>(
-            XQ.packed_accessor32<at::Half, 4, at::RestrictPtrTraits>(),
-            cache_K.packed_accessor64<at::Half, 4, at::RestrictPtrTraits>(),
-            cache_V.packed_accessor64<at::Half, 4, at::RestrictPtrTraits>(),
-            O.packed_accessor32<at::Half, 4, at::RestrictPtrTraits>(),
-            seq_positions
-                .packed_accessor32<int32_t, 1, at::RestrictPtrTraits>(),
-            qk_scale);
-    C10_CUDA_KERNEL_LAUNCH_CHECK();
+    mqa_attn_launch<at::Half>(
+        XQ,
+        cache_K,
+        cache_V,
+        O,
+        seq_positions,
+        O_splits,
+        LSE_splits,
+        qk_scale,
+        blocks,
+        threads,
+        smem);
   } else if (XQ.scalar_type() == at::ScalarType::BFloat16) {
-    if (smem > 48 * 1024) {
-      C10_CUDA_CHECK(cudaFuncSetAttribute(
-          mqa_attn_kernel<at::BFloat16>,
-          cudaFuncAttributeMaxDynamicSharedMemorySize,
-          smem));
-    }
-    mqa_attn_kernel<at::BFloat16>
-        <<<blocks, threads, smem, at::cuda::getCurrentCUDAStream()>>>(
-            XQ.packed_accessor32<at::BFloat16, 4, at::RestrictPtrTraits>(),
-            cache_K.packed_accessor64<at::BFloat16, 4, at::RestrictPtrTraits>(),
-            cache_V.packed_accessor64<at::BFloat16, 4, at::RestrictPtrTraits>(),
-            O.packed_accessor32<at::BFloat16, 4, at::RestrictPtrTraits>(),
-            seq_positions
-                .packed_accessor32<int32_t, 1, at::RestrictPtrTraits>(),
-            qk_scale);
-    C10_CUDA_KERNEL_LAUNCH_CHECK();
+    mqa_attn_launch<at::BFloat16>(
+        XQ,
+        cache_K,
+        cache_V,
+        O,
+        seq_positions,
+        O_splits,
+        LSE_splits,
+        qk_scale,
+        blocks,
+        threads,
+        smem);
   } else {
     TORCH_CHECK(
         XQ.scalar_type() == at::ScalarType::Float,
         "Only supports bf16/f16/f32");
-    if (smem > 48 * 1024) {
-      C10_CUDA_CHECK(cudaFuncSetAttribute(
-          mqa_attn_kernel<float>,
-          cudaFuncAttributeMaxDynamicSharedMemorySize,
-          smem));
-    }
-    mqa_attn_kernel<float>
-        <<<blocks, threads, smem, at::cuda::getCurrentCUDAStream()>>>(
-            XQ.packed_accessor32<float, 4, at::RestrictPtrTraits>(),
-            cache_K.packed_accessor64<float, 4, at::RestrictPtrTraits>(),
-            cache_V.packed_accessor64<float, 4, at::RestrictPtrTraits>(),
-            O.packed_accessor32<float, 4, at::RestrictPtrTraits>(),
-            seq_positions
-                .packed_accessor32<int32_t, 1, at::RestrictPtrTraits>(),
-            qk_scale);
-    C10_CUDA_KERNEL_LAUNCH_CHECK();
+    mqa_attn_launch<float>(
+        XQ,
+        cache_K,
+        cache_V,
+        O,
+        seq_positions,
+        O_splits,
+        LSE_splits,
+        qk_scale,
+        blocks,
+        threads,
+        smem);
   }
   return O;
 }
@@ -632,6 +632,8 @@ struct AttentionBackwardKernel {
     scalar_t* key_ptr = nullptr; // [Mk, nH, K]
     scalar_t* value_ptr = nullptr; // [Mk, nH, Kv]
     scalar_t* bias_ptr = nullptr;
+    // [nH] - `slope * (key - query)` is added to the attention scores
+    const float* alibi_slopes_ptr = nullptr;
     lse_scalar_t* logsumexp_ptr = nullptr; // [nH, Mq]
     scalar_t* output_ptr = nullptr; // [Mq, nH, Kv]
     scalar_t* grad_output_ptr = nullptr; // [Mq, nH, Kv]
@@ -654,6 +656,8 @@ struct AttentionBackwardKernel {
 
     // Scale
     accum_t scale = 1.0f;
+    // ALiBi slope of the current head
+    accum_t alibi_slope = 0.0f;
 
     // Dimensions/strides
     int32_t head_dim = -1;
@@ -805,6 +809,9 @@ struct AttentionBackwardKernel {
       if (grad_bias_ptr != nullptr) {
         grad_bias_ptr += batch_id * gB_strideB + head_id * gB_strideH;
       }
+      if (alibi_slopes_ptr != nullptr) {
+        alibi_slope = alibi_slopes_ptr[head_id];
+      }
 
       // Some values are modified above
       // Signal to the compiler that they are the same in all threads
@@ -1603,6 +1610,21 @@ struct AttentionBackwardKernel {
             [&](int accum_n) {});
       }
 
+      // apply ALiBi if applicable: Pij += slope * (key - query)
+      if (p.alibi_slopes_ptr != nullptr) {
+        auto lane_offset = MatmulQK::AccumLambdaIterator::get_lane_offset(
+            lane_id, warp_id, output_tile_coords);
+        // remember we are transposed
+        int shift = key_start - query_start;
+        MatmulQK::AccumLambdaIterator::iterateRows(
+            lane_offset,
+            [&](int accum_m) {},
+            [&](int accum_m, int accum_n, int idx) {
+              accum[idx] += p.alibi_slope * accum_t(accum_m - accum_n + shift);
+            },
+            [&](int accum_m) {});
+      }
+
       // Apply mask
       if (p.custom_mask_type == CausalFromTopLeft ||
           p.custom_mask_type == CausalFromBottomRight) {
@@ -108,6 +108,9 @@ struct AttentionKernel {
     NoCustomMask = 0,
     CausalFromTopLeft = 1,
     CausalFromBottomRight = 2,
+    // Sliding window around the bottom-right aligned diagonal: query `i` sees
+    // the keys `j` with `-window_left <= j - i - offset <= window_right`
+    LocalFromBottomRight = 3,
     NumCustomMaskTypes,
   };
 
@@ -151,11 +154,16 @@ struct AttentionKernel {
     scalar_t* key_ptr = nullptr; // [num_keys, num_heads, head_dim]
     scalar_t* value_ptr = nullptr; // [num_keys, num_heads, head_dim_value]
     scalar_t* attn_bias_ptr = nullptr; // [num_heads, num_queries, num_keys]
+    // [num_heads] - `slope * (key - query)` is added to the attention scores
+    const float* alibi_slopes_ptr = nullptr;
     int32_t* seqstart_q_ptr = nullptr;
     int32_t* seqstart_k_ptr = nullptr;
 
     int32_t* seqlen_k_ptr = nullptr;
     uint32_t causal_diagonal_offset = 0;
+    // Only for `LocalFromBottomRight` - negative means unbounded
+    int32_t window_left = -1;
+    int32_t window_right = -1;
 
     // Output tensors
     output_t* output_ptr = nullptr; // [num_queries, num_heads, head_dim_value]
@@ -166,6 +174,8 @@ struct AttentionKernel {
 
     // Scale
     accum_t scale = 0.0;
+    // ALiBi slope of the current head
+    accum_t alibi_slope = 0.0;
 
     // Dimensions/strides
     int32_t head_dim = 0;
@@ -293,8 +303,13 @@ struct AttentionKernel {
             batch_id * lse_dim * num_heads + head_id * lse_dim + query_start;
       }
 
+      if (kSupportsBias && alibi_slopes_ptr != nullptr) {
+        alibi_slope = alibi_slopes_ptr[head_id];
+      }
+
       // Custom masking
-      if (custom_mask_type == CausalFromBottomRight) {
+      if (custom_mask_type == CausalFromBottomRight ||
+          custom_mask_type == LocalFromBottomRight) {
         causal_diagonal_offset = num_keys - num_queries;
       }
       // We use num_keys_absolute to index into the rng_state
@@ -309,6 +324,14 @@ struct AttentionKernel {
         num_keys = cutlass::fast_min(
             int32_t(query_start + causal_diagonal_offset + kQueriesPerBlock),
             num_keys);
+      } else if (
+          custom_mask_type == LocalFromBottomRight && window_right >= 0) {
+        // same as above, with `window_right` extra keys after the diagonal
+        num_keys = cutlass::fast_min(
+            int32_t(
+                query_start + causal_diagonal_offset + kQueriesPerBlock +
+                window_right),
+            num_keys);
       }
 
       num_queries -= query_start;
@@ -318,7 +341,11 @@ struct AttentionKernel {
       // 15/16th of tensor core compute In that case :
       //  - we only launch kernels for head_id % kQueriesPerBlock == 0
       //  - we iterate over heads instead of queries (strideM = strideH)
-      if (num_queries == 1 && k_strideH == 0 && v_strideH == 0) {
+      // (not with a sliding window, which also masks on the left, nor with
+      // ALiBi, whose slope depends on the head)
+      if (num_queries == 1 && k_strideH == 0 && v_strideH == 0 &&
+          custom_mask_type != LocalFromBottomRight &&
+          alibi_slopes_ptr == nullptr) {
         if (head_id % kQueriesPerBlock != 0)
           return false;
         q_strideM = q_strideH;
@@ -696,8 +723,17 @@ struct AttentionKernel {
     }
 #endif
 
+    // With a sliding window, the keys before the window of the first query of
+    // the block are never visible: skip the corresponding key blocks
+    int32_t key_start = 0;
+    if (p.custom_mask_type == LocalFromBottomRight && p.window_left >= 0) {
+      key_start = cutlass::fast_max(
+          int32_t(query_start + p.causal_diagonal_offset) - p.window_left, 0);
+      key_start = (key_start / kKeysPerBlock) * kKeysPerBlock;
+    }
+
     // Iterate through keys
-    for (int32_t iter_key_start = 0; iter_key_start < p.num_keys;
+    for (int32_t iter_key_start = key_start; iter_key_start < p.num_keys;
          iter_key_start += kKeysPerBlock) {
       int32_t problem_size_0_m =
           cutlass::fast_min((int32_t)kQueriesPerBlock, p.num_queries);
@@ -827,6 +863,22 @@ struct AttentionKernel {
             [&](int accum_m) {});
       }
 
+      // apply ALiBi if applicable: Pij += slope * (j - i)
+      if (kSupportsBias && p.alibi_slopes_ptr != nullptr) {
+        auto lane_offset = MM0::AccumLambdaIterator::get_lane_offset(
+            my_lane_id, my_warp_id, iteratorC_tile_offset);
+        MM0::AccumLambdaIterator::iterateRows(
+            lane_offset,
+            [&](int accum_m) {},
+            [&](int accum_m, int accum_n, int idx) {
+              accum[idx] += p.alibi_slope *
+                  accum_t(
+                      int32_t(iter_key_start + accum_n) -
+                      int32_t(query_start + accum_m));
+            },
+            [&](int accum_m) {});
+      }
+
       // Mask out last if causal
       // This is only needed if upper-right corner of current query / key block
       // intersects the mask Coordinates of upper-right corner of current block
@@ -834,9 +886,16 @@ struct AttentionKernel {
       // first masked element is x = y + offset -> query_start + offset There is
       // intersection (and we need to mask) if min(iter_key_start +
       // kKeysPerBlock, num_keys)) >= query_start + offset
-      if (p.custom_mask_type &&
+      // For a sliding window, the first masked element is further right, by
+      // `window_right` (or never, if unbounded)
+      const bool is_local = p.custom_mask_type == LocalFromBottomRight;
+      int32_t right_extent = p.custom_mask_type ? 0 : -1;
+      if (is_local) {
+        right_extent = p.window_right;
+      }
+      if (right_extent >= 0 &&
           cutlass::fast_min(iter_key_start + kKeysPerBlock, p.num_keys) >=
-              (query_start + p.causal_diagonal_offset)) {
+              (query_start + p.causal_diagonal_offset + right_extent)) {
         auto query_start = blockIdx.x * kQueriesPerBlock;
         auto lane_offset = MM0::AccumLambdaIterator::get_lane_offset(
             my_lane_id, my_warp_id, iteratorC_tile_offset);
@@ -847,8 +906,8 @@ struct AttentionKernel {
               // last absolute col is (last absolute query + offset)
               // last local col is (last absolute query + offset -
               // iter_key_start)
-              last_col = query_start + accum_m + p.causal_diagonal_offset -
-                  iter_key_start;
+              last_col = query_start + accum_m + p.causal_diagonal_offset +
+                  right_extent - iter_key_start;
             },
             [&](int accum_m, int accum_n, int idx) {
               if (accum_n > last_col) {
@@ -858,6 +917,35 @@ struct AttentionKernel {
             },
             [&](int accum_m) {});
       }
+      // Mask out the keys on the left of the sliding window
+      // This is only needed if the lower-left corner of the current block is
+      // on the left of the window of the last query of the block
+      if (is_local && p.window_left >= 0 &&
+          iter_key_start <
+              int32_t(
+                  query_start + kQueriesPerBlock - 1 +
+                  p.causal_diagonal_offset) -
+                  p.window_left) {
+        auto query_start = blockIdx.x * kQueriesPerBlock;
+        auto lane_offset = MM0::AccumLambdaIterator::get_lane_offset(
+            my_lane_id, my_warp_id, iteratorC_tile_offset);
+        int32_t first_col;
+        MM0::AccumLambdaIterator::iterateRows(
+            lane_offset,
+            [&](int accum_m) {
+              first_col = int32_t(
+                              query_start + accum_m +
+                              p.causal_diagonal_offset) -
+                  p.window_left - iter_key_start;
+            },
+            [&](int accum_m, int accum_n, int idx) {
+              if (accum_n < first_col) {
+                accum[idx] =
+                    -cutlass::platform::numeric_limits<accum_t>::infinity();
+              }
+            },
+            [&](int accum_m) {});
+      }
       // Update `mi` from accum stored in registers
       // Also does accum[i] <- exp(accum[i] - mi)
       iterative_softmax<typename MM0::Mma::Operator::IteratorC>(
@@ -872,7 +960,8 @@ struct AttentionKernel {
           thread_id(),
           my_warp_id,
           p.num_keys - iter_key_start,
-          iter_key_start == 0,
+          iter_key_start == key_start,
+          is_local,
           iteratorC_tile_offset,
           kSupportsBias ? 1.0f : p.scale);
 
@@ -1001,7 +1090,7 @@ struct AttentionKernel {
         if (!kKeepOutputInRF) {
           MM1::Mma::drain_cp_asyncs();
           DISPATCH_BOOL(
-              iter_key_start == 0, kIsFirst, ([&] {
+              iter_key_start == key_start, kIsFirst, ([&] {
                 DISPATCH_BOOL(
                     (iter_key_start + kKeysPerBlock) >= p.num_keys,
                     kIsLast,
@@ -1142,6 +1231,7 @@ struct AttentionKernel {
       int8_t warp_id,
       int max_col,
       bool is_first,
+      bool may_mask_full_rows,
       typename WarpIteratorC::TensorCoord const& tile_offset,
       float scaling) {
     /* Iterates on the accumulator and corresponding position on result matrix
@@ -1207,10 +1297,11 @@ struct AttentionKernel {
         out_rescale[id] = m_prime_exp;
         s_prime[id] *= m_prime_exp;
       } else {
-        // Only when bias is enabled, it's possible that all the first values
-        // of attention are masked to `-inf`. In that case we want to avoid
-        // `nan = exp2f(-inf - (-inf))` so we temporarily set `mi` to 0
-        if (kSupportsBias &&
+        // Only when bias is enabled (or with a sliding window), it's possible
+        // that all the first values of attention are masked to `-inf`. In that
+        // case we want to avoid `nan = exp2f(-inf - (-inf))` so we temporarily
+        // set `mi` to 0
+        if ((kSupportsBias || may_mask_full_rows) &&
             mi_id == -cutlass::platform::numeric_limits<accum_t>::infinity()) {
           restore_mi_to_minus_inf = true;
           mi[id] = 0.0f;
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <torch/types.h>
+
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDAGuard.h>
+
+#include <algorithm>
+
+#include "../rotary.h"
+
+namespace {
+
+using xformers::rotary::RotaryParams;
+
+// One thread per pair of elements `(i, i + D / 2)` of a row, consecutive
+// threads handling consecutive `i` of the same row. The positions are
+// bounds-checked on the host, by `make_rotary_params`.
+template <typename scalar_t>
+__global__ void rotary_embedding_cu(scalar_t* x, RotaryParams p) {
+  const int64_t half = p.head_dim / 2;
+  const int64_t total = p.num_rows * half;
+  for (int64_t idx = int64_t(blockIdx.x) * blockDim.x + threadIdx.x;
+       idx < total;
+       idx += int64_t(gridDim.x) * blockDim.x) {
+    const int64_t row = idx / half;
+    const int64_t i = idx - row * half;
+    scalar_t* x_row = x + xformers::rotary::row_offset(p, row);
+    const int64_t pos = xformers::rotary::row_position(p, row);
+    const float c = p.cos[pos * half + i];
+    const float s = p.sign * p.sin[pos * half + i];
+    const float x1 = static_cast<float>(x_row[i]);
+    const float x2 = static_cast<float>(x_row[i + half]);
+    x_row[i] = static_cast<scalar_t>(x1 * c - x2 * s);
+    x_row[i + half] = static_cast<scalar_t>(x2 * c + x1 * s);
+  }
+}
+
+void rotary_embedding_cuda(
+    const at::Tensor& x,
+    const at::Tensor& cos,
+    const at::Tensor& sin,
+    const c10::optional<at::Tensor>& positions,
+    bool inverse) {
+  TORCH_CHECK(x.is_cuda(), "x must be a CUDA tensor");
+  RotaryParams p =
+      xformers::rotary::make_rotary_params(x, cos, sin, positions, inverse);
+  const int64_t total = p.num_rows * (p.head_dim / 2);
+  if (total == 0) {
+    return;
+  }
+  at::cuda::CUDAGuard device_guard(x.device());
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+
+  const int threads = 256;
+  const int64_t grid =
+      std::min<int64_t>((total + threads - 1) / threads, 65535);
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      x.scalar_type(),
+      "rotary_embedding_cuda",
+      [&] {
+        rotary_embedding_cu<scalar_t>
+            <<<grid, threads, 0, stream>>>(x.data_ptr<scalar_t>(), p);
+      });
+  AT_CUDA_CHECK(cudaGetLastError());
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::rotary_embedding_"),
+      TORCH_FN(rotary_embedding_cuda));
+}
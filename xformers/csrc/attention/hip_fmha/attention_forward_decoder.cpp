@@ -8,6 +8,7 @@
 #include <ATen/Dispatch.h>
 #include <ATen/Functions.h>
 #include <ATen/Tensor.h>
+#include <ATen/cuda/CUDAContext.h>
 #include <c10/cuda/CUDAStream.h>
 #include <torch/library.h>
 
@@ -17,6 +18,10 @@ namespace {
 constexpr int32_t kThreadsPerWavefront = 64;
 constexpr int32_t kWavefrontsPerBlock  = 16;
 constexpr int32_t K_MAX                = 4 * kThreadsPerWavefront;
+// Keys handled by a single block, bounded by the LDS used to hold their scores
+constexpr int32_t kMaxKeysPerSplit = 8192;
+// Splits are not made smaller than this when splitting only to fill the GPU
+constexpr int32_t kMinKeysPerSplit = 512;
 } // namespace
 
 namespace {
@@ -53,14 +58,23 @@ namespace {
     AT_DISPATCH_SWITCH(                                                              \
         TYPE, NAME, AT_DISPATCH_CASE_3(SCALARTYPE1, SCALARTYPE2, SCALARTYPE3, __VA_ARGS__))
 
-template <int32_t ThreadsPerWavefront,
-          int32_t WavefrontsPerBlock,
-          int32_t KV_M_MAX = 8192,
-          int32_t K_MAX    = 256>
+// Number of splits of the KV cache: enough for the scores of a split to fit
+// in LDS, and more when there are too few rows of output to fill the GPU, as
+// long as every split keeps `kMinKeysPerSplit` keys
+int64_t get_split_k(int64_t num_rows, int64_t T)
+{
+    const int64_t num_cus = at::cuda::getCurrentDeviceProperties()->multiProcessorCount;
+    const int64_t min_splits = (T + kMaxKeysPerSplit - 1) / kMaxKeysPerSplit;
+    const int64_t occupancy_splits =
+        std::min((num_cus + num_rows - 1) / num_rows, T / kMinKeysPerSplit);
+    return std::max<int64_t>({1, min_splits, occupancy_splits});
+}
+
+template <int32_t ThreadsPerWavefront, int32_t WavefrontsPerBlock, int32_t K_MAX = 256>
 at::Tensor& efficient_attention_forward_decoder_ck_out_impl(
     const at::Tensor& XQ,                 // [B, 1, G, H, D]
-    const at::Tensor& cache_K,            // [B, KV_M_MAX, G, H or 1, D]
-    const at::Tensor& cache_V,            // [B, KV_M_MAX, G, H or 1, D]
+    const at::Tensor& cache_K,            // [B, T, G, H or 1, D]
+    const at::Tensor& cache_V,            // [B, T, G, H or 1, D]
     at::optional<at::Tensor> seq_kv_lens, // [B]
     double qk_scale,
     at::Tensor& O)
@@ -75,7 +89,6 @@ at::Tensor& efficient_attention_forward_decoder_ck_out_impl(
 
     TORCH_CHECK(!seq_kv_lens || seq_kv_lens->is_cuda());
 
-    TORCH_CHECK(cache_K.size(1) <= KV_M_MAX);
     TORCH_CHECK(cache_K.size(4) <= K_MAX);
 
     constexpr auto rank = 5;
@@ -89,10 +102,24 @@ at::Tensor& efficient_attention_forward_decoder_ck_out_impl(
     TORCH_CHECK(M <= 1024);
     TORCH_CHECK(H <= 1024);
 
-    dim3 blocks(B * H * M * G);
+    auto T = cache_K.size(1);
+    auto D = XQ.size(4);
+
+    // The keys are split over `blocks.y`, and the partial outputs of the
+    // splits are merged by a second kernel
+    const int64_t split_k = get_split_k(B * H * M * G, T);
+    // Upper bound on the number of keys of a split, whatever its batch element
+    const int64_t max_keys_per_split = (T + split_k - 1) / split_k;
+    dim3 blocks(B * H * M * G, split_k);
     dim3 threads(ThreadsPerWavefront, WavefrontsPerBlock);
 
-    int32_t smem_softmax = KV_M_MAX * sizeof(float) + threads.y * sizeof(float);
+    auto split_options = XQ.options().dtype(at::ScalarType::Float);
+    at::Tensor split_O =
+        split_k > 1 ? at::empty({B * H * M * G, split_k, D}, split_options) : at::Tensor();
+    at::Tensor split_lse =
+        split_k > 1 ? at::empty({B * H * M * G, split_k}, split_options) : at::Tensor();
+
+    int32_t smem_softmax = max_keys_per_split * sizeof(float) + threads.y * sizeof(float);
     int32_t smem_output  = K_MAX * sizeof(float) *
                           threads.y; // 4 * threadsPerBlock * sizeof(float) == sizeof(O[b][0][h][:])
     const size_t lds_bytes = max(smem_softmax, smem_output);
@@ -122,6 +149,8 @@ at::Tensor& efficient_attention_forward_decoder_ck_out_impl(
                 reinterpret_cast<const ck_data_t* __restrict__>(K_acc.data()),
                 reinterpret_cast<const ck_data_t* __restrict__>(V_acc.data()),
                 reinterpret_cast<ck_data_t* __restrict__>(O_acc.data()),
+                split_k > 1 ? split_O.data_ptr<float>() : nullptr,
+                split_k > 1 ? split_lse.data_ptr<float>() : nullptr,
                 seq_acc,
                 XQ_acc.stride(0),
                 XQ_acc.stride(1),
@@ -155,8 +184,8 @@ at::Tensor& efficient_attention_forward_decoder_ck_out_impl(
 template <int32_t ThreadsPerWavefront, int32_t WavefrontsPerBlock>
 at::Tensor efficient_attention_forward_decoder_ck_impl(
     const at::Tensor& XQ,                 // [B, 1, G, H, D]
-    const at::Tensor& cache_K,            // [B, KV_M_MAX, G, H or 1, D]
-    const at::Tensor& cache_V,            // [B, KV_M_MAX, H or 1, D]
+    const at::Tensor& cache_K,            // [B, T, G, H or 1, D]
+    const at::Tensor& cache_V,            // [B, T, G, H or 1, D]
     at::optional<at::Tensor> seq_kv_lens, // [B]
     double qk_scale)
 {
@@ -168,8 +197,8 @@ at::Tensor efficient_attention_forward_decoder_ck_impl(
 
 at::Tensor
 efficient_attention_forward_decoder_ck(const at::Tensor& XQ,      // [B, 1, G, H, D]
-                                       const at::Tensor& cache_K, // [B, KV_M_MAX, G, H or 1, D]
-                                       const at::Tensor& cache_V, // [B, KV_M_MAX, G, H or 1, D]
+                                       const at::Tensor& cache_K, // [B, T, G, H or 1, D]
+                                       const at::Tensor& cache_V, // [B, T, G, H or 1, D]
                                        at::optional<at::Tensor> seq_kv_lens, // [B]
                                        double qk_scale)
 {
@@ -13,6 +13,8 @@
 #include <ck/utility/inner_product.hpp>
 #include <ck/utility/math.hpp>
 
+#include <limits>
+
 namespace {
 
 template <typename data_t, int32_t vec_size>
@@ -66,17 +68,23 @@ store_v(TData* __restrict__ data_ptr, int32_t vector_offset, TDataVec value)
     *(reinterpret_cast<TDataVec*>(data_ptr) + vector_offset) = value;
 }
 
+// Each block handles one split of the keys of a (batch, query, group, head).
+// With a single split, the block writes the output directly. Otherwise it
+// writes its normalized partial output to `split_O` ([B * M * G * H, split_k, K])
+// and its logsumexp to `split_lse` ([B * M * G * H, split_k]), and the
+// splits are combined by `efficient_attention_forward_decoder_splitk_reduce_ck_kernel`.
 template <typename scalar_t,
           int32_t vec_size               = 4,
           int32_t n_loop_unroll          = 16,
           int32_t n_loop_unroll_tail     = 2,
-          int32_t KV_M_MAX               = 8192,
           int32_t n_wavefronts_per_block = 16>
 __global__ void
 efficient_attention_forward_decoder_ck_kernel(const scalar_t* __restrict__ XQ,
                                               const scalar_t* __restrict__ cache_K,
                                               const scalar_t* __restrict__ cache_V,
                                               scalar_t* __restrict__ O,
+                                              float* __restrict__ split_O,
+                                              float* __restrict__ split_lse,
                                               const int32_t* __restrict__ seq_kv_lens,
                                               const ptrdiff_t XQ_stride_b,
                                               const ptrdiff_t XQ_stride_m,
@@ -103,8 +111,14 @@ efficient_attention_forward_decoder_ck_kernel(const scalar_t* __restrict__ XQ,
     const int32_t h = blockIdx.x % Q_size_h;
 
     // Note: this is decoding case where we attend to current and all previous
-    // tokens.
-    const int32_t t_max = seq_kv_lens ? seq_kv_lens[b] : K_size_m;
+    // tokens. The keys are divided evenly between the splits, and `t_max`
+    // counts those of this split.
+    const int32_t split          = blockIdx.y;
+    const int32_t split_k        = gridDim.y;
+    const int32_t seq_len        = seq_kv_lens ? seq_kv_lens[b] : K_size_m;
+    const int32_t keys_per_split = (seq_len + split_k - 1) / split_k;
+    const int32_t t_begin        = ck::math::min(split * keys_per_split, seq_len);
+    const int32_t t_max          = ck::math::min(keys_per_split, seq_len - t_begin);
 
     const int32_t lane_idx              = threadIdx.x;
     const int32_t wavefront_idx         = threadIdx.y;
@@ -117,8 +131,8 @@ efficient_attention_forward_decoder_ck_kernel(const scalar_t* __restrict__ XQ,
         b * XQ_stride_b + m * XQ_stride_m + g * XQ_stride_g + h * XQ_stride_h;
     const auto* __restrict__ q_ = XQ + XQO_base_offset;
 
-    const auto cache_KV_base_offset =
-        b * K_stride_b + 0 * K_stride_m + g * K_stride_g + (multiquery ? 0 : h * K_stride_h);
+    const auto cache_KV_base_offset = b * K_stride_b + t_begin * K_stride_m + g * K_stride_g +
+                                      (multiquery ? 0 : h * K_stride_h);
     const auto* __restrict__ cache_K_base = cache_K + cache_KV_base_offset;
     const auto* __restrict__ cache_V_base = cache_V + cache_KV_base_offset;
 
@@ -130,6 +144,8 @@ efficient_attention_forward_decoder_ck_kernel(const scalar_t* __restrict__ XQ,
     const bool lane_active_for_io = lane_idx * vec_size < Q_size_k;
 
     extern __shared__ __align__(16) compute_t smem[];
+    // Per-wavefront reduction scratch, after the scores of the split
+    compute_t* smem_reduce = smem + t_max;
 
     data_vec_t q_thread = 0;
     // Load Q into registers in all wavefronts.
@@ -235,12 +251,12 @@ efficient_attention_forward_decoder_ck_kernel(const scalar_t* __restrict__ XQ,
     // write max acc
     if(lane_idx == 0)
     {
-        smem[KV_M_MAX + wavefront_idx] = max_qk_acc;
+        smem_reduce[wavefront_idx] = max_qk_acc;
     }
     __syncthreads();
     if(lane_idx < wavefronts_per_block)
     {
-        max_qk_acc = ck::math::max(max_qk_acc, smem[KV_M_MAX + lane_idx]);
+        max_qk_acc = ck::math::max(max_qk_acc, smem_reduce[lane_idx]);
     }
     // shared across all threads in block
     max_qk_acc = wavefrontReduce(max_qk_acc, [](auto a, auto b) { return a > b ? a : b; });
@@ -256,7 +272,7 @@ efficient_attention_forward_decoder_ck_kernel(const scalar_t* __restrict__ XQ,
 
     if(lane_idx == 0)
     {
-        smem[KV_M_MAX + wavefront_idx] = softmax_denominator;
+        smem_reduce[wavefront_idx] = softmax_denominator;
     }
     __syncthreads();
 
@@ -264,7 +280,7 @@ efficient_attention_forward_decoder_ck_kernel(const scalar_t* __restrict__ XQ,
     softmax_denominator = 0.0;
     if(lane_idx < wavefronts_per_block)
     {
-        softmax_denominator = smem[KV_M_MAX + lane_idx];
+        softmax_denominator = smem_reduce[lane_idx];
     }
     softmax_denominator =
         wavefrontReduce(softmax_denominator, [](auto a, auto b) { return a + b; });
@@ -358,23 +374,116 @@ efficient_attention_forward_decoder_ck_kernel(const scalar_t* __restrict__ XQ,
                 smem, w * threads_per_wavefront + lane_idx, &partial_r);
             r.vec += partial_r;
         }
-        // elementwise convert from compute_t result to data_t out to be written
-        union
+        if(split_k == 1)
         {
-            data_vec_t vec;
-            data_t arr[vec_size];
-        } bf_r;
+            // elementwise convert from compute_t result to data_t out to be written
+            union
+            {
+                data_vec_t vec;
+                data_t arr[vec_size];
+            } bf_r;
 #pragma unroll
-        for(int32_t i = 0; i < vec_size; ++i)
+            for(int32_t i = 0; i < vec_size; ++i)
+            {
+                bf_r.arr[i] = ck::type_convert<data_t>(r.arr[i]);
+            }
+            // write output row O[b][m][g][h][:]
+            data_t* __restrict__ o_ = O + XQO_base_offset;
+            store_v<data_t, data_vec_t>(o_, lane_idx, bf_r.vec);
+        }
+        else
         {
-            bf_r.arr[i] = ck::type_convert<data_t>(r.arr[i]);
+            // write the partial output of this split and its logsumexp,
+            // which is -inf for an empty split
+            const int32_t split_idx = blockIdx.x * split_k + split;
+            store_v<compute_t, compute_vec_t>(split_O + split_idx * Q_size_k, lane_idx, r.vec);
+            if(lane_idx == 0)
+            {
+                split_lse[split_idx] = max_qk_acc + __logf(softmax_denominator);
+            }
         }
-        // write output row O[b][m][g][h][:]
-        data_t* __restrict__ o_ = O + XQO_base_offset;
-        store_v<data_t, data_vec_t>(o_, lane_idx, bf_r.vec);
     }
 }
 
+// Combines the partial outputs of the splits of each (batch, query, group, head):
+// O = sum_s exp(LSE_s - LSE) * O_s, with LSE = logsumexp_s(LSE_s).
+// Each block handles one row of O, each thread `vec_size` elements of it.
+template <typename scalar_t, int32_t vec_size = 4>
+__global__ void
+efficient_attention_forward_decoder_splitk_reduce_ck_kernel(const float* __restrict__ split_O,
+                                                            const float* __restrict__ split_lse,
+                                                            scalar_t* __restrict__ O,
+                                                            const ptrdiff_t XQ_stride_b,
+                                                            const ptrdiff_t XQ_stride_m,
+                                                            const ptrdiff_t XQ_stride_g,
+                                                            const ptrdiff_t XQ_stride_h,
+                                                            const int32_t Q_size_m,
+                                                            const int32_t Q_size_g,
+                                                            const int32_t Q_size_h,
+                                                            const int32_t Q_size_k,
+                                                            const int32_t split_k)
+{
+    const int32_t b = blockIdx.x / (Q_size_m * Q_size_g * Q_size_h);
+    const int32_t m = (blockIdx.x / (Q_size_g * Q_size_h)) % Q_size_m;
+    const int32_t g = (blockIdx.x / Q_size_h) % Q_size_g;
+    const int32_t h = blockIdx.x % Q_size_h;
+
+    const int32_t lane_idx = threadIdx.x;
+    if(lane_idx * vec_size >= Q_size_k)
+    {
+        return;
+    }
+
+    using data_t        = scalar_t;
+    using data_vec_t    = typename ck::vector_type<data_t, vec_size>::type;
+    using compute_t     = float;
+    using compute_vec_t = typename ck::vector_type<compute_t, vec_size>::type;
+
+    const compute_t* __restrict__ row_lse = split_lse + blockIdx.x * split_k;
+    const compute_t* __restrict__ row_O   = split_O + blockIdx.x * split_k * Q_size_k;
+
+    constexpr compute_t neg_inf = -std::numeric_limits<compute_t>::infinity();
+    compute_t lse_max           = neg_inf;
+    for(int32_t split = 0; split < split_k; ++split)
+    {
+        lse_max = ck::math::max(lse_max, row_lse[split]);
+    }
+
+    union
+    {
+        compute_vec_t vec = 0;
+        compute_t arr[vec_size];
+    } r;
+    // Every split is empty if the maximum is -inf: the output is zero
+    if(lse_max != neg_inf)
+    {
+        compute_t denominator = 0;
+        for(int32_t split = 0; split < split_k; ++split)
+        {
+            const compute_t alpha = ck::math::exp(row_lse[split] - lse_max);
+            compute_vec_t partial_r;
+            load_v<compute_t, compute_vec_t>(row_O + split * Q_size_k, lane_idx, &partial_r);
+            denominator += alpha;
+            r.vec += alpha * partial_r;
+        }
+        r.vec *= compute_t(1) / denominator;
+    }
+
+    union
+    {
+        data_vec_t vec;
+        data_t arr[vec_size];
+    } bf_r;
+#pragma unroll
+    for(int32_t i = 0; i < vec_size; ++i)
+    {
+        bf_r.arr[i] = ck::type_convert<data_t>(r.arr[i]);
+    }
+    data_t* __restrict__ o_ =
+        O + b * XQ_stride_b + m * XQ_stride_m + g * XQ_stride_g + h * XQ_stride_h;
+    store_v<data_t, data_vec_t>(o_, lane_idx, bf_r.vec);
+}
+
 } // namespace
 
 namespace ck {
@@ -390,6 +499,8 @@ struct FMHADecoderSeqlen1DeviceOp : public BaseOperator
         const scalar_t* __restrict__ cache_K;
         const scalar_t* __restrict__ cache_V;
         scalar_t* __restrict__ O;
+        float* __restrict__ split_O;
+        float* __restrict__ split_lse;
         const int32_t* __restrict__ seq_kv_lens;
         const ptrdiff_t XQ_stride_b;
         const ptrdiff_t XQ_stride_m;
@@ -415,6 +526,8 @@ struct FMHADecoderSeqlen1DeviceOp : public BaseOperator
                  const scalar_t* __restrict__ cache_K,
                  const scalar_t* __restrict__ cache_V,
                  scalar_t* __restrict__ O,
+                 float* __restrict__ split_O,
+                 float* __restrict__ split_lse,
                  const int32_t* __restrict__ seq_kv_lens,
                  const ptrdiff_t XQ_stride_b,
                  const ptrdiff_t XQ_stride_m,
@@ -438,6 +551,8 @@ struct FMHADecoderSeqlen1DeviceOp : public BaseOperator
               cache_K(cache_K),
               cache_V(cache_V),
               O(O),
+              split_O(split_O),
+              split_lse(split_lse),
               seq_kv_lens(seq_kv_lens),
               XQ_stride_b(XQ_stride_b),
               XQ_stride_m(XQ_stride_m),
@@ -488,7 +603,7 @@ struct FMHADecoderSeqlen1DeviceOp : public BaseOperator
                 throw std::runtime_error("Unsupported alignment for Q_size_k");
             }
 
-            return launch_and_time_kernel(
+            float time = launch_and_time_kernel(
                 stream_config,
                 Q_size_k_alignment_necessary == 4
                     ? efficient_attention_forward_decoder_ck_kernel<scalar_t, 4>
@@ -504,6 +619,8 @@ struct FMHADecoderSeqlen1DeviceOp : public BaseOperator
                 arg.cache_K,
                 arg.cache_V,
                 arg.O,
+                arg.split_O,
+                arg.split_lse,
                 arg.seq_kv_lens,
                 arg.XQ_stride_b,
                 arg.XQ_stride_m,
@@ -520,6 +637,38 @@ struct FMHADecoderSeqlen1DeviceOp : public BaseOperator
                 arg.K_size_m,
                 arg.multiquery,
                 arg.qk_scale);
+
+            // The cache was split along the keys (`grid_dim.y` splits):
+            // merge the partial outputs
+            const int32_t split_k = arg.grid_dim.y;
+            if(split_k > 1)
+            {
+                time += launch_and_time_kernel(
+                    stream_config,
+                    Q_size_k_alignment_necessary == 4
+                        ? efficient_attention_forward_decoder_splitk_reduce_ck_kernel<scalar_t, 4>
+                        : Q_size_k_alignment_necessary == 2
+                              ? efficient_attention_forward_decoder_splitk_reduce_ck_kernel<scalar_t,
+                                                                                            2>
+                              : efficient_attention_forward_decoder_splitk_reduce_ck_kernel<scalar_t,
+                                                                                            1>,
+                    dim3(arg.grid_dim.x),
+                    dim3(threads_per_wavefront),
+                    0,
+                    arg.split_O,
+                    arg.split_lse,
+                    arg.O,
+                    arg.XQ_stride_b,
+                    arg.XQ_stride_m,
+                    arg.XQ_stride_g,
+                    arg.XQ_stride_h,
+                    arg.Q_size_m,
+                    arg.Q_size_g,
+                    arg.Q_size_h,
+                    arg.Q_size_k,
+                    split_k);
+            }
+            return time;
         }
     };
 };
@@ -21,6 +21,25 @@ at::Tensor matmul_with_mask_kernel(
   return result;
 }
 
+// Gradients of `matmul_with_mask` for a dense mask, computed only for the
+// inputs in `output_mask`
+std::tuple<at::Tensor, at::Tensor> matmul_with_mask_backward_kernel(
+    const at::Tensor& grad,
+    const at::Tensor& a,
+    const at::Tensor& b,
+    const at::Tensor& mask,
+    std::array<bool, 2> output_mask) {
+  auto grad_o = grad.masked_fill(mask.logical_not(), 0.);
+  at::Tensor grad_a, grad_b;
+  if (output_mask[0]) {
+    grad_a = grad_o.bmm(b.transpose(-2, -1));
+  }
+  if (output_mask[1]) {
+    grad_b = grad_o.transpose(-2, -1).bmm(a).transpose(-2, -1);
+  }
+  return std::make_tuple(grad_a, grad_b);
+}
+
 } // namespace
 
 at::Tensor matmul_with_mask(
@@ -34,19 +53,32 @@ at::Tensor matmul_with_mask(
   return result;
 }
 
+std::tuple<at::Tensor, at::Tensor> matmul_with_mask_backward(
+    const at::Tensor& grad,
+    const at::Tensor& a,
+    const at::Tensor& b,
+    const at::Tensor& mask,
+    std::array<bool, 2> output_mask) {
+  static auto op =
+      c10::Dispatcher::singleton()
+          .findSchemaOrThrow("xformers::matmul_with_mask_backward", "")
+          .typed<decltype(matmul_with_mask_backward)>();
+  return op.call(grad, a, b, mask, output_mask);
+}
+
 TORCH_LIBRARY_FRAGMENT(xformers, m) {
   m.def(TORCH_SELECTIVE_SCHEMA(
       "xformers::matmul_with_mask(Tensor a, Tensor b, Tensor mask) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::matmul_with_mask_backward(Tensor grad, Tensor a, Tensor b, Tensor mask, bool[2] output_mask) -> (Tensor, Tensor)"));
 }
 
-TORCH_LIBRARY_IMPL(xformers, CPU, m) {
-  m.impl(
-      TORCH_SELECTIVE_NAME("xformers::matmul_with_mask"),
-      TORCH_FN(matmul_with_mask_kernel));
-}
-
+// The CPU kernels for dense masks are in `cpu/matmul.cpp`
 TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
   m.impl(
       TORCH_SELECTIVE_NAME("xformers::matmul_with_mask"),
       TORCH_FN(matmul_with_mask_kernel));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::matmul_with_mask_backward"),
+      TORCH_FN(matmul_with_mask_backward_kernel));
 }
@@ -8,9 +8,18 @@
 #pragma once
 
 #include <ATen/ATen.h>
+#include <array>
+#include <tuple>
 #include "macros.h"
 
 XFORMERS_API at::Tensor matmul_with_mask(
     const at::Tensor& a,
     const at::Tensor& b,
     const at::Tensor& mask);
+
+XFORMERS_API std::tuple<at::Tensor, at::Tensor> matmul_with_mask_backward(
+    const at::Tensor& grad,
+    const at::Tensor& a,
+    const at::Tensor& b,
+    const at::Tensor& mask,
+    std::array<bool, 2> output_mask);
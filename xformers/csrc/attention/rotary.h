@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#pragma once
+
+#include <ATen/ATen.h>
+#include <c10/macros/Macros.h>
+#include <torch/types.h>
+#include <cstdint>
+#include <tuple>
+
+namespace xformers {
+namespace rotary {
+
+// In-place rotary embedding of `x`, viewed as [B, H, S, D]: for `i < D / 2`
+// and the position `p` of row `s`,
+// ```
+//   x[..., s, i]         = x1 * cos[p, i] - x2 * sin[p, i]
+//   x[..., s, i + D / 2] = x2 * cos[p, i] + x1 * sin[p, i]
+// ```
+// where `x1 = x[..., s, i]` and `x2 = x[..., s, i + D / 2]`. This is
+// `x * cos + rotate_half(x) * sin` with the [S, D] tables of
+// `components/positional_embedding/rotary.py`, of which `cos` and `sin` only
+// store the first half. Strides are in elements.
+struct RotaryParams {
+  int64_t num_heads;
+  int64_t seqlen;
+  int64_t head_dim;
+  int64_t num_rows; // B * H * S
+  int64_t stride_b;
+  int64_t stride_h;
+  int64_t stride_s;
+  const float* cos; // [P, D / 2]
+  const float* sin; // [P, D / 2]
+  // Position of each row of the sequence ([S]), or null for `arange(S)`
+  const int64_t* positions;
+  // -1 applies the inverse rotation, which is the backward
+  float sign;
+};
+
+C10_HOST_DEVICE inline int64_t row_offset(const RotaryParams& p, int64_t row) {
+  const int64_t s = row % p.seqlen;
+  const int64_t h = (row / p.seqlen) % p.num_heads;
+  const int64_t b = row / (p.seqlen * p.num_heads);
+  return b * p.stride_b + h * p.stride_h + s * p.stride_s;
+}
+
+C10_HOST_DEVICE inline int64_t row_position(
+    const RotaryParams& p,
+    int64_t row) {
+  const int64_t s = row % p.seqlen;
+  return p.positions ? p.positions[s] : s;
+}
+
+// Rotates in place one row of `head_dim` elements, `inc` apart, at position
+// `pos`. This is for kernels which apply the embedding to rows they have
+// already loaded, possibly transposed, rather than to `x` in memory.
+template <typename T>
+C10_HOST_DEVICE inline void rotate_row(
+    const RotaryParams& p,
+    T* x,
+    int64_t inc,
+    int64_t pos) {
+  const int64_t half = p.head_dim / 2;
+  const float* cos_row = p.cos + pos * half;
+  const float* sin_row = p.sin + pos * half;
+  for (int64_t i = 0; i < half; i++) {
+    const T a = x[i * inc];
+    const T b = x[(i + half) * inc];
+    const T c = static_cast<T>(cos_row[i]);
+    const T s = static_cast<T>(sin_row[i] * p.sign);
+    x[i * inc] = a * c - b * s;
+    x[(i + half) * inc] = b * c + a * s;
+  }
+}
+
+// `x` has 2 to 4 dimensions, the sequence being the second to last one, and
+// may be any view of a larger tensor as long as its last dimension is dense
+inline RotaryParams make_rotary_params(
+    const at::Tensor& x,
+    const at::Tensor& cos,
+    const at::Tensor& sin,
+    const c10::optional<at::Tensor>& positions,
+    bool inverse) {
+  TORCH_CHECK(x.dim() >= 2 && x.dim() <= 4, "x should have 2 to 4 dimensions");
+  TORCH_CHECK(x.stride(-1) == 1, "x should be contiguous in the last dim");
+  TORCH_CHECK(x.size(-1) % 2 == 0, "the last dim of x should be even");
+  TORCH_CHECK(cos.dim() == 2 && sin.sizes() == cos.sizes());
+  TORCH_CHECK(
+      cos.size(1) * 2 == x.size(-1),
+      "cos and sin should have shape [num_positions, x.shape[-1] / 2]");
+  TORCH_CHECK(cos.scalar_type() == at::ScalarType::Float);
+  TORCH_CHECK(sin.scalar_type() == at::ScalarType::Float);
+  TORCH_CHECK(cos.is_contiguous() && sin.is_contiguous());
+  TORCH_CHECK(cos.device() == x.device() && sin.device() == x.device());
+  at::Tensor x4 = x;
+  while (x4.dim() < 4) {
+    x4 = x4.unsqueeze(0);
+  }
+
+  RotaryParams p;
+  p.num_heads = x4.size(1);
+  p.seqlen = x4.size(2);
+  p.head_dim = x4.size(3);
+  p.num_rows = x4.size(0) * p.num_heads * p.seqlen;
+  p.stride_b = x4.stride(0);
+  p.stride_h = x4.stride(1);
+  p.stride_s = x4.stride(2);
+  p.cos = cos.data_ptr<float>();
+  p.sin = sin.data_ptr<float>();
+  p.positions = nullptr;
+  if (positions.has_value()) {
+    TORCH_CHECK(positions->dim() == 1 && positions->size(0) == p.seqlen);
+    TORCH_CHECK(positions->scalar_type() == at::ScalarType::Long);
+    TORCH_CHECK(positions->is_contiguous());
+    TORCH_CHECK(positions->device() == x.device());
+    p.positions = positions->data_ptr<int64_t>();
+    // The kernels index `cos` and `sin` with the positions unchecked, so
+    // they are validated here, before any launch
+    if (positions->numel() > 0) {
+      const auto minmax = at::aminmax(*positions);
+      const int64_t min_pos = std::get<0>(minmax).item<int64_t>();
+      const int64_t max_pos = std::get<1>(minmax).item<int64_t>();
+      TORCH_CHECK(
+          min_pos >= 0 && max_pos < cos.size(0),
+          "positions should be in [0, ",
+          cos.size(0),
+          "), but range from ",
+          min_pos,
+          " to ",
+          max_pos);
+    }
+  } else {
+    TORCH_CHECK(
+        p.seqlen <= cos.size(0),
+        "cos and sin only have ",
+        cos.size(0),
+        " positions for a sequence of length ",
+        p.seqlen);
+  }
+  p.sign = inverse ? -1.0f : 1.0f;
+  return p;
+}
+
+} // namespace rotary
+} // namespace xformers
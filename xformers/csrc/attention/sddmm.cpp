@@ -11,4 +11,6 @@
 TORCH_LIBRARY_FRAGMENT(xformers, m) {
   m.def(TORCH_SELECTIVE_SCHEMA(
       "xformers::sddmm_sputnik(Tensor a, Tensor b, Tensor row_indices, Tensor row_offsets, Tensor column_indices) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::sddmm_sputnik_batched(Tensor a, Tensor b, Tensor row_offsets, Tensor column_indices, Tensor batch_offsets) -> Tensor"));
 }
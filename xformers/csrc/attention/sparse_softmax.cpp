@@ -11,6 +11,14 @@
 TORCH_LIBRARY_FRAGMENT(xformers, m) {
   m.def(TORCH_SELECTIVE_SCHEMA(
       "xformers::sparse_softmax_sputnik(int m, int n, Tensor row_indices, Tensor values, Tensor row_offsets, Tensor column_indices) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::sparse_softmax_sputnik_(int m, int n, Tensor row_indices, Tensor(a!) values, Tensor row_offsets, Tensor column_indices) -> Tensor(a!)"));
   m.def(TORCH_SELECTIVE_SCHEMA(
       "xformers::sparse_softmax_backward_sputnik(int m, int n, Tensor row_indices, Tensor values, Tensor gradient, Tensor row_offsets, Tensor column_indices) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::sparse_softmax_backward_sputnik_(int m, int n, Tensor row_indices, Tensor values, Tensor(a!) gradient, Tensor row_offsets, Tensor column_indices) -> Tensor(a!)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::sparse_softmax_sputnik_batched(int m, int n, Tensor values, Tensor row_offsets, Tensor column_indices, Tensor batch_offsets) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::sparse_softmax_backward_sputnik_batched(int m, int n, Tensor values, Tensor gradient, Tensor row_offsets, Tensor column_indices, Tensor batch_offsets) -> Tensor"));
 }
@@ -11,4 +11,6 @@
 TORCH_LIBRARY_FRAGMENT(xformers, m) {
   m.def(TORCH_SELECTIVE_SCHEMA(
       "xformers::spmm_sputnik(Tensor b, Tensor row_indices, Tensor values, Tensor row_offsets, Tensor column_indices, int m) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::spmm_sputnik_batched(Tensor b, Tensor values, Tensor row_offsets, Tensor column_indices, Tensor batch_offsets, int m) -> Tensor"));
 }
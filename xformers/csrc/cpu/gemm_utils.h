@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#pragma once
+
+#include <ATen/ATen.h>
+#include <ATen/OpMathType.h>
+#include <ATen/native/CPUBlas.h>
+#include <algorithm>
+#include <cstdint>
+
+// GEMMs on raw pointers for the tiled CPU kernels. Unlike `at::mm_out`, they
+// don't go through the dispatcher, whose thread-local state (grad mode,
+// excluded keys) isn't set on the worker threads of `at::parallel_for`, and
+// they run the single-threaded BLAS kernel of the calling thread.
+namespace xformers {
+namespace cpu {
+
+// A [rows, cols] matrix with strides `(stride0, stride1)`, one of which is 1
+template <typename scalar_t>
+struct GemmOperand {
+  const scalar_t* data;
+  int64_t stride0;
+  int64_t stride1;
+
+  GemmOperand t() const {
+    return {data, stride1, stride0};
+  }
+  // The submatrix starting at `(i, j)`
+  GemmOperand block(int64_t i, int64_t j) const {
+    return {data + i * stride0 + j * stride1, stride0, stride1};
+  }
+};
+
+// Whether the matrices of `t` (its last 2 dimensions) are row or column
+// major, without overlapping rows or columns, as `gemm` requires. Other
+// tensors should be made contiguous first.
+inline bool is_gemm_operand(const at::Tensor& t) {
+  const int64_t rows = t.size(-2);
+  const int64_t cols = t.size(-1);
+  const int64_t s0 = t.stride(-2);
+  const int64_t s1 = t.stride(-1);
+  return (s1 == 1 && (rows <= 1 || s0 >= cols)) ||
+      (s0 == 1 && (cols <= 1 || s1 >= rows));
+}
+
+// The [rows, cols] matrix `i` of the batch of matrices `t`
+template <typename scalar_t>
+GemmOperand<scalar_t> gemm_operand(const at::Tensor& t, int64_t i = 0) {
+  const int64_t offset = t.dim() == 3 ? i * t.stride(0) : 0;
+  return {t.data_ptr<scalar_t>() + offset, t.stride(-2), t.stride(-1)};
+}
+
+// `c = alpha * a @ b + beta * c`, for an [m, k] `a`, a [k, n] `b` and a
+// row-major [m, n] `c` with leading dimension `ldc`. With `beta == 0`, `c`
+// may be uninitialized.
+template <typename scalar_t>
+void gemm(
+    int64_t m,
+    int64_t n,
+    int64_t k,
+    at::opmath_type<scalar_t> alpha,
+    GemmOperand<scalar_t> a,
+    GemmOperand<scalar_t> b,
+    at::opmath_type<scalar_t> beta,
+    scalar_t* c,
+    int64_t ldc) {
+  using accum_t = at::opmath_type<scalar_t>;
+  if (m == 0 || n == 0) {
+    return;
+  }
+  if (k == 0) {
+    for (int64_t i = 0; i < m; i++) {
+      for (int64_t j = 0; j < n; j++) {
+        c[i * ldc + j] = beta == accum_t(0)
+            ? scalar_t(0)
+            : scalar_t(beta * accum_t(c[i * ldc + j]));
+      }
+    }
+    return;
+  }
+  // BLAS is column major: the row-major `c` is `c.T = b.T @ a.T` there, and
+  // a row-major operand is its own transpose
+  const bool trans_a = a.stride1 != 1;
+  const bool trans_b = b.stride1 != 1;
+  const int64_t lda =
+      std::max<int64_t>(trans_a ? a.stride1 : a.stride0, trans_a ? m : k);
+  const int64_t ldb =
+      std::max<int64_t>(trans_b ? b.stride1 : b.stride0, trans_b ? k : n);
+  at::native::cpublas::gemm(
+      trans_b ? at::native::TransposeType::Transpose
+              : at::native::TransposeType::NoTranspose,
+      trans_a ? at::native::TransposeType::Transpose
+              : at::native::TransposeType::NoTranspose,
+      n,
+      m,
+      k,
+      alpha,
+      b.data,
+      ldb,
+      a.data,
+      lda,
+      beta,
+      c,
+      std::max<int64_t>(ldc, n));
+}
+
+// `out = x @ w.T + b`, for an [m, k] `x`, an [n, k] `w`, an optional [n] `b`
+// and a row-major [m, n] `out` with leading dimension `ldo`
+template <typename scalar_t>
+void linear(
+    int64_t m,
+    int64_t n,
+    int64_t k,
+    GemmOperand<scalar_t> x,
+    GemmOperand<scalar_t> w,
+    const scalar_t* b,
+    scalar_t* out,
+    int64_t ldo) {
+  using accum_t = at::opmath_type<scalar_t>;
+  if (b != nullptr) {
+    for (int64_t i = 0; i < m; i++) {
+      std::copy(b, b + n, out + i * ldo);
+    }
+  }
+  gemm<scalar_t>(
+      m,
+      n,
+      k,
+      accum_t(1),
+      x,
+      w.t(),
+      b != nullptr ? accum_t(1) : accum_t(0),
+      out,
+      ldo);
+}
+
+} // namespace cpu
+} // namespace xformers
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#pragma once
+
+#include <ATen/cpu/vec/functional.h>
+#include <ATen/cpu/vec/vec.h>
+#include <cstdint>
+#include <type_traits>
+
+// Row helpers shared by the CPU kernels: vectorized BLAS-1 operations, the
+// packing of tiles, and conversions between the storage type `scalar_t` and
+// the accumulation type `accum_t`, which are no-ops when both are the same
+namespace xformers {
+namespace cpu {
+
+// out[0:size] *= alpha
+template <typename scalar_t>
+inline void _vec_scale(scalar_t* out, scalar_t alpha, int64_t size) {
+  using Vec = at::vec::Vectorized<scalar_t>;
+  at::vec::map([alpha](Vec x) { return x * Vec(alpha); }, out, out, size);
+}
+
+// out[0:size] += alpha * x[0:size]
+template <typename scalar_t>
+inline void _vec_axpy(
+    scalar_t* out,
+    scalar_t alpha,
+    const scalar_t* x,
+    int64_t size) {
+  using Vec = at::vec::Vectorized<scalar_t>;
+  at::vec::map2(
+      [alpha](Vec o, Vec v) { return at::vec::fmadd(Vec(alpha), v, o); },
+      out,
+      out,
+      x,
+      size);
+}
+
+template <typename scalar_t>
+inline scalar_t _vec_dot(const scalar_t* x, const scalar_t* y, int64_t size) {
+  using Vec = at::vec::Vectorized<scalar_t>;
+  return at::vec::map2_reduce_all<scalar_t>(
+      [](Vec a, Vec b) { return a * b; },
+      [](Vec a, Vec b) { return a + b; },
+      x,
+      y,
+      size);
+}
+
+// Loads `n_len` rows of `K` elements, `stride` apart from `x`, as the
+// columns of a [K, ld] tile of accumulation type
+template <typename scalar_t, typename accum_t>
+inline void _pack_transposed(
+    accum_t* tile,
+    int64_t ld,
+    const scalar_t* x,
+    int64_t stride,
+    int64_t n_len,
+    int64_t K) {
+  for (int64_t c = 0; c < n_len; c++) {
+    const scalar_t* x_c = x + c * stride;
+    for (int64_t k = 0; k < K; k++) {
+      tile[k * ld + c] = static_cast<accum_t>(x_c[k]);
+    }
+  }
+}
+
+// Loads `n_len` rows of `K` elements, `stride` apart from `x`, as a
+// [n_len, K] tile of accumulation type
+template <typename scalar_t, typename accum_t>
+inline void _pack_rows(
+    accum_t* tile,
+    const scalar_t* x,
+    int64_t stride,
+    int64_t n_len,
+    int64_t K) {
+  for (int64_t c = 0; c < n_len; c++) {
+    at::vec::convert(x + c * stride, tile + c * K, K);
+  }
+}
+
+// Returns `row` as `accum_t`, converting it into `buf` if needed
+template <typename scalar_t, typename accum_t>
+inline const accum_t* _load_row(
+    const scalar_t* row,
+    accum_t* buf,
+    int64_t size) {
+  if constexpr (std::is_same<scalar_t, accum_t>::value) {
+    return row;
+  } else {
+    at::vec::convert(row, buf, size);
+    return buf;
+  }
+}
+
+// Where to compute a block of output: directly in `out` if no conversion
+// is needed, otherwise in `buf`, to be stored with `_store_row`
+template <typename scalar_t, typename accum_t>
+inline accum_t* _out_row(scalar_t* out, accum_t* buf) {
+  if constexpr (std::is_same<scalar_t, accum_t>::value) {
+    return out;
+  } else {
+    return buf;
+  }
+}
+
+template <typename accum_t, typename scalar_t>
+inline void _store_row(const accum_t* row, scalar_t* out, int64_t size) {
+  if constexpr (!std::is_same<scalar_t, accum_t>::value) {
+    at::vec::convert(row, out, size);
+  }
+}
+
+} // namespace cpu
+} // namespace xformers
@@ -0,0 +1,101 @@
+#include <ATen/ATen.h>
+#include <ATen/Parallel.h>
+#include <torch/types.h>
+#include <algorithm>
+#include <cstring>
+
+#include "../grouped_index.h"
+
+namespace {
+
+using xformers::indexing::GroupedRows;
+
+void _check_indices(at::TensorList tensors, at::TensorList indices) {
+  for (size_t i = 0; i < tensors.size(); ++i) {
+    const int64_t size = tensors[i].size(0);
+    const int64_t* idx = indices[i].data_ptr<int64_t>();
+    for (int64_t r = 0; r < indices[i].size(0); ++r) {
+      TORCH_CHECK(
+          idx[r] >= 0 && idx[r] < size,
+          "index ",
+          idx[r],
+          " is out of bounds for dimension 0 with size ",
+          size);
+    }
+  }
+}
+
+// Copies the rows of all the groups in a single parallel loop, so that
+// many small groups are spread over the threads as well as a few large ones
+void grouped_index_copy(
+    const std::vector<GroupedRows>& groups,
+    int64_t num_rows) {
+  if (num_rows == 0) {
+    return;
+  }
+  const GroupedRows* groups_p = groups.data();
+  const int64_t num_groups = groups.size();
+  int64_t total_bytes = 0;
+  for (int64_t g = 0; g < num_groups; ++g) {
+    const int64_t end =
+        g + 1 < num_groups ? groups[g + 1].row_begin : num_rows;
+    total_bytes += (end - groups[g].row_begin) * groups[g].row_bytes;
+  }
+  // Rows of the average size per task
+  const int64_t grain_size = std::max<int64_t>(
+      1,
+      at::internal::GRAIN_SIZE * num_rows /
+          std::max<int64_t>(total_bytes, 1));
+  at::parallel_for(0, num_rows, grain_size, [&](int64_t start, int64_t end) {
+    int64_t g = xformers::indexing::find_group(groups_p, num_groups, start);
+    for (int64_t row = start; row < end; ++row) {
+      while (g + 1 < num_groups && groups_p[g + 1].row_begin <= row) {
+        ++g;
+      }
+      const GroupedRows& p = groups_p[g];
+      const int64_t r = row - p.row_begin;
+      const int64_t src_row = p.src_index ? p.src_index[r] : r;
+      const int64_t dst_row = p.dst_index ? p.dst_index[r] : r;
+      std::memcpy(
+          p.dst + dst_row * p.dst_stride,
+          p.src + src_row * p.src_stride,
+          p.row_bytes);
+    }
+  });
+}
+
+at::Tensor grouped_index_select(
+    at::Tensor output,
+    at::TensorList sources,
+    at::TensorList indices) {
+  TORCH_CHECK(!output.is_cuda(), "output must be a CPU tensor");
+  int64_t num_rows = 0;
+  auto groups = xformers::indexing::grouped_index_select_rows(
+      output, sources, indices, num_rows);
+  _check_indices(sources, indices);
+  grouped_index_copy(groups, num_rows);
+  return output;
+}
+
+void grouped_index_scatter(
+    at::TensorList outputs,
+    at::Tensor source,
+    at::TensorList indices) {
+  TORCH_CHECK(!source.is_cuda(), "source must be a CPU tensor");
+  int64_t num_rows = 0;
+  auto groups = xformers::indexing::grouped_index_scatter_rows(
+      outputs, source, indices, num_rows);
+  _check_indices(outputs, indices);
+  grouped_index_copy(groups, num_rows);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::grouped_index_select"),
+      TORCH_FN(grouped_index_select));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::grouped_index_scatter"),
+      TORCH_FN(grouped_index_scatter));
+}
@@ -0,0 +1,84 @@
+#include <ATen/ATen.h>
+#include <ATen/Parallel.h>
+#include <torch/types.h>
+#include <algorithm>
+
+namespace {
+
+// `output = source[index]`
+template <typename scalar_t>
+void index_select_kernel(
+    at::Tensor& output,
+    const at::Tensor& source,
+    const at::Tensor& index) {
+  const int64_t D = source.size(1);
+  scalar_t* output_p = output.data_ptr<scalar_t>();
+  const scalar_t* source_p = source.data_ptr<scalar_t>();
+  const int64_t* index_p = index.data_ptr<int64_t>();
+  const int64_t output_stride0 = output.stride(0);
+  const int64_t source_stride0 = source.stride(0);
+
+  // Rows of `D` elements per task
+  const int64_t grain_size = std::max<int64_t>(
+      1, at::internal::GRAIN_SIZE / std::max<int64_t>(D, 1));
+  at::parallel_for(
+      0, output.size(0), grain_size, [&](int64_t start, int64_t end) {
+        for (int64_t b = start; b < end; ++b) {
+          const scalar_t* src = source_p + index_p[b] * source_stride0;
+          std::copy(src, src + D, output_p + b * output_stride0);
+        }
+      });
+}
+
+at::Tensor index_select(
+    at::Tensor output,
+    at::Tensor source,
+    at::Tensor index) {
+  // dim
+  TORCH_CHECK(output.dim() == 2);
+  TORCH_CHECK(source.dim() == 2);
+  TORCH_CHECK(index.dim() == 1);
+
+  // shapes
+  TORCH_CHECK(output.size(1) == source.size(1));
+  TORCH_CHECK(output.size(0) == index.size(0));
+
+  // strides
+  TORCH_CHECK(source.stride(1) == 1);
+  TORCH_CHECK(output.stride(1) == 1);
+
+  // dtypes
+  TORCH_CHECK(output.scalar_type() == source.scalar_type());
+  TORCH_CHECK(index.scalar_type() == at::ScalarType::Long);
+
+  // devices
+  TORCH_CHECK(!output.is_cuda(), "output must be a CPU tensor");
+  TORCH_CHECK(!source.is_cuda(), "source must be a CPU tensor");
+  TORCH_CHECK(!index.is_cuda(), "index must be a CPU tensor");
+
+  index = index.contiguous();
+  const int64_t* idx = index.data_ptr<int64_t>();
+  for (int64_t i = 0; i < index.size(0); ++i) {
+    TORCH_CHECK(
+        idx[i] >= 0 && idx[i] < source.size(0),
+        "index ",
+        idx[i],
+        " is out of bounds for dimension 0 with size ",
+        source.size(0));
+  }
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      source.scalar_type(),
+      "index_select",
+      [&] { index_select_kernel<scalar_t>(output, source, index); });
+  return output;
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::index_select"), TORCH_FN(index_select));
+}
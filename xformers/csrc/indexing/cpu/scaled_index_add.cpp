@@ -0,0 +1,394 @@
+#include <ATen/ATen.h>
+#include <ATen/OpMathType.h>
+#include <ATen/Parallel.h>
+#include <torch/types.h>
+#include <algorithm>
+#include <type_traits>
+
+#include <ATen/cpu/vec/functional.h>
+#include <ATen/cpu/vec/vec.h>
+
+#include "../../cpu/vec_utils.h"
+
+namespace {
+
+using xformers::cpu::_load_row;
+using xformers::cpu::_out_row;
+using xformers::cpu::_store_row;
+
+// Elements of a row processed at a time, converted to `opmath` in per-thread
+// buffers for f16/bf16. Every kernel reads an element of its inputs before
+// writing the same element of its outputs, so `output` may alias `input`.
+constexpr int64_t kBlockD = 256;
+
+// Rows of `d` elements per task of `at::parallel_for`
+inline int64_t _grain_size(int64_t d) {
+  return std::max<int64_t>(
+      1, at::internal::GRAIN_SIZE / std::max<int64_t>(d, 1));
+}
+
+// `source_scaling` as `opmath`, so that it's converted once rather than
+// once per row
+inline at::Tensor _scaling_opmath(
+    const c10::optional<at::Tensor>& source_scaling) {
+  if (!source_scaling.has_value()) {
+    return at::Tensor();
+  }
+  return source_scaling->to(at::toOpMathType(source_scaling->scalar_type()))
+      .contiguous();
+}
+
+// Indices are assumed to be unique: every row of the output is written by
+// at most one row of `source`, so the rows can be processed in parallel
+// without atomics
+inline void _check_index(const at::Tensor& index, int64_t size) {
+  const int64_t* idx = index.data_ptr<int64_t>();
+  for (int64_t i = 0; i < index.size(0); ++i) {
+    TORCH_CHECK(
+        idx[i] >= 0 && idx[i] < size,
+        "index ",
+        idx[i],
+        " is out of bounds for dimension 0 with size ",
+        size);
+  }
+}
+
+// #################################################################################
+// #################################### FW PASS
+// ####################################
+// #################################################################################
+
+// `output[index] = input[index] + alpha * source_scaling * source`
+template <typename scalar_t, bool kHasScaling, bool kHasInput>
+void scaled_index_addF_kernel(
+    at::Tensor& output,
+    const at::Tensor& input,
+    const at::Tensor& source,
+    const at::Tensor& index,
+    const at::Tensor& scaling,
+    double alpha_,
+    at::Tensor& buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  using Vec = at::vec::Vectorized<accum_t>;
+  const int64_t M = source.size(1);
+  const int64_t D = source.size(2);
+  const accum_t alpha = accum_t(alpha_);
+
+  scalar_t* output_p = output.data_ptr<scalar_t>();
+  const scalar_t* input_p = kHasInput ? input.data_ptr<scalar_t>() : nullptr;
+  const scalar_t* source_p = source.data_ptr<scalar_t>();
+  const int64_t* index_p = index.data_ptr<int64_t>();
+  const accum_t* scaling_p =
+      kHasScaling ? scaling.data_ptr<accum_t>() : nullptr;
+  accum_t* buffer_p = buffer.data_ptr<accum_t>();
+
+  at::parallel_for(
+      0, source.size(0) * M, _grain_size(D), [&](int64_t start, int64_t end) {
+        accum_t* src_buf = buffer_p + at::get_thread_num() * 3 * kBlockD;
+        accum_t* inp_buf = src_buf + kBlockD;
+        accum_t* out_buf = inp_buf + kBlockD;
+        for (int64_t row = start; row < end; ++row) {
+          const int64_t b = row / M;
+          const int64_t m = row % M;
+          const int64_t b_o = index_p[b];
+          const scalar_t* source_row =
+              source_p + b * source.stride(0) + m * source.stride(1);
+          scalar_t* output_row =
+              output_p + b_o * output.stride(0) + m * output.stride(1);
+          const scalar_t* input_row = kHasInput
+              ? input_p + b_o * input.stride(0) + m * input.stride(1)
+              : nullptr;
+          for (int64_t d0 = 0; d0 < D; d0 += kBlockD) {
+            const int64_t d_len = std::min(kBlockD, D - d0);
+            const accum_t* src = _load_row(source_row + d0, src_buf, d_len);
+            accum_t* out = _out_row(output_row + d0, out_buf);
+            if constexpr (kHasScaling && kHasInput) {
+              const accum_t* inp = _load_row(input_row + d0, inp_buf, d_len);
+              at::vec::map3(
+                  [alpha](Vec s, Vec sc, Vec i) {
+                    return at::vec::fmadd(s * sc, Vec(alpha), i);
+                  },
+                  out,
+                  src,
+                  scaling_p + d0,
+                  inp,
+                  d_len);
+            } else if constexpr (kHasScaling) {
+              at::vec::map2(
+                  [alpha](Vec s, Vec sc) { return s * sc * Vec(alpha); },
+                  out,
+                  src,
+                  scaling_p + d0,
+                  d_len);
+            } else if constexpr (kHasInput) {
+              const accum_t* inp = _load_row(input_row + d0, inp_buf, d_len);
+              at::vec::map2(
+                  [alpha](Vec s, Vec i) {
+                    return at::vec::fmadd(s, Vec(alpha), i);
+                  },
+                  out,
+                  src,
+                  inp,
+                  d_len);
+            } else {
+              at::vec::map(
+                  [alpha](Vec s) { return s * Vec(alpha); }, out, src, d_len);
+            }
+            _store_row(out, output_row + d0, d_len);
+          }
+        }
+      });
+}
+
+at::Tensor scaled_index_addF(
+    at::Tensor output,
+    const c10::optional<at::Tensor>& input_,
+    at::Tensor source,
+    at::Tensor index,
+    const c10::optional<at::Tensor>& source_scaling,
+    double alpha) {
+  at::Tensor input = input_.has_value() ? *input_ : output;
+  // dim
+  TORCH_CHECK(output.dim() == 3);
+  TORCH_CHECK(input.dim() == 3);
+  TORCH_CHECK(source.dim() == 3);
+  TORCH_CHECK(index.dim() == 1);
+  TORCH_CHECK(!source_scaling.has_value() || source_scaling->dim() == 1);
+
+  // shapes
+  TORCH_CHECK(output.size(0) == input.size(0));
+  TORCH_CHECK(output.size(1) == input.size(1));
+  TORCH_CHECK(output.size(1) == source.size(1));
+  TORCH_CHECK(output.size(2) == input.size(2));
+  TORCH_CHECK(output.size(2) == source.size(2));
+  TORCH_CHECK(source.size(0) == index.size(0));
+  TORCH_CHECK(
+      !source_scaling.has_value() || source_scaling->size(0) == output.size(2));
+
+  // strides
+  TORCH_CHECK(source.stride(-1) == 1);
+  TORCH_CHECK(input.stride(-1) == 1);
+  TORCH_CHECK(output.stride(-1) == 1);
+
+  // dtypes
+  TORCH_CHECK(output.scalar_type() == source.scalar_type());
+  TORCH_CHECK(output.scalar_type() == input.scalar_type());
+  TORCH_CHECK(
+      !source_scaling.has_value() ||
+      source_scaling->scalar_type() == output.scalar_type());
+  TORCH_CHECK(index.scalar_type() == at::ScalarType::Long);
+
+  // devices
+  TORCH_CHECK(!output.is_cuda(), "output must be a CPU tensor");
+  TORCH_CHECK(!input.is_cuda(), "input must be a CPU tensor");
+  TORCH_CHECK(!source.is_cuda(), "source must be a CPU tensor");
+  TORCH_CHECK(!index.is_cuda(), "index must be a CPU tensor");
+  TORCH_CHECK(
+      !source_scaling.has_value() || !source_scaling->is_cuda(),
+      "source_scaling must be a CPU tensor");
+
+  index = index.contiguous();
+  _check_index(index, output.size(0));
+  at::Tensor scaling = _scaling_opmath(source_scaling);
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), 3 * kBlockD},
+      source.options().dtype(at::toOpMathType(source.scalar_type())));
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      source.scalar_type(),
+      "scaled_index_addF",
+      [&] {
+        if (input_.has_value() && source_scaling.has_value()) {
+          scaled_index_addF_kernel<scalar_t, true, true>(
+              output, input, source, index, scaling, alpha, buffer);
+        } else if (source_scaling.has_value()) {
+          scaled_index_addF_kernel<scalar_t, true, false>(
+              output, input, source, index, scaling, alpha, buffer);
+        } else if (input_.has_value()) {
+          scaled_index_addF_kernel<scalar_t, false, true>(
+              output, input, source, index, scaling, alpha, buffer);
+        } else {
+          scaled_index_addF_kernel<scalar_t, false, false>(
+              output, input, source, index, scaling, alpha, buffer);
+        }
+      });
+  return output;
+}
+
+// #################################################################################
+// #################################### BW PASS
+// ####################################
+// #################################################################################
+
+// `grad_source = alpha * source_scaling * grad_output[index]`
+// `grad_source_scaling = alpha * source * grad_output[index]`, summed over
+// the first two dimensions by the caller
+template <typename scalar_t, bool kHasScaling>
+void scaled_index_addB_kernel(
+    at::Tensor& grad_source,
+    at::Tensor& grad_source_scaling,
+    const at::Tensor& grad_output,
+    const at::Tensor& source,
+    const at::Tensor& index,
+    const at::Tensor& scaling,
+    double alpha_,
+    at::Tensor& buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  using Vec = at::vec::Vectorized<accum_t>;
+  const int64_t M = source.size(1);
+  const int64_t D = source.size(2);
+  const accum_t alpha = accum_t(alpha_);
+
+  scalar_t* grad_source_p = grad_source.data_ptr<scalar_t>();
+  scalar_t* grad_scaling_p =
+      kHasScaling ? grad_source_scaling.data_ptr<scalar_t>() : nullptr;
+  const scalar_t* grad_output_p = grad_output.data_ptr<scalar_t>();
+  const scalar_t* source_p =
+      kHasScaling ? source.data_ptr<scalar_t>() : nullptr;
+  const int64_t* index_p = index.data_ptr<int64_t>();
+  const accum_t* scaling_p =
+      kHasScaling ? scaling.data_ptr<accum_t>() : nullptr;
+  accum_t* buffer_p = buffer.data_ptr<accum_t>();
+
+  at::parallel_for(
+      0, source.size(0) * M, _grain_size(D), [&](int64_t start, int64_t end) {
+        accum_t* gout_buf = buffer_p + at::get_thread_num() * 4 * kBlockD;
+        accum_t* src_buf = gout_buf + kBlockD;
+        accum_t* gsrc_buf = src_buf + kBlockD;
+        accum_t* gscaling_buf = gsrc_buf + kBlockD;
+        for (int64_t row = start; row < end; ++row) {
+          const int64_t b = row / M;
+          const int64_t m = row % M;
+          const scalar_t* grad_output_row = grad_output_p +
+              index_p[b] * grad_output.stride(0) + m * grad_output.stride(1);
+          scalar_t* grad_source_row = grad_source_p +
+              b * grad_source.stride(0) + m * grad_source.stride(1);
+          for (int64_t d0 = 0; d0 < D; d0 += kBlockD) {
+            const int64_t d_len = std::min(kBlockD, D - d0);
+            const accum_t* gout =
+                _load_row(grad_output_row + d0, gout_buf, d_len);
+            accum_t* gsrc = _out_row(grad_source_row + d0, gsrc_buf);
+            if constexpr (kHasScaling) {
+              const scalar_t* source_row =
+                  source_p + b * source.stride(0) + m * source.stride(1);
+              scalar_t* grad_scaling_row = grad_scaling_p +
+                  b * grad_source_scaling.stride(0) +
+                  m * grad_source_scaling.stride(1);
+              const accum_t* src = _load_row(source_row + d0, src_buf, d_len);
+              accum_t* gscaling = _out_row(grad_scaling_row + d0, gscaling_buf);
+              at::vec::map2(
+                  [alpha](Vec g, Vec sc) { return g * sc * Vec(alpha); },
+                  gsrc,
+                  gout,
+                  scaling_p + d0,
+                  d_len);
+              at::vec::map2(
+                  [alpha](Vec g, Vec s) { return g * s * Vec(alpha); },
+                  gscaling,
+                  gout,
+                  src,
+                  d_len);
+              _store_row(gscaling, grad_scaling_row + d0, d_len);
+            } else {
+              at::vec::map(
+                  [alpha](Vec g) { return g * Vec(alpha); }, gsrc, gout, d_len);
+            }
+            _store_row(gsrc, grad_source_row + d0, d_len);
+          }
+        }
+      });
+}
+
+std::tuple<at::Tensor, const c10::optional<at::Tensor>> scaled_index_addB(
+    // outputs:
+    at::Tensor grad_source,
+    const c10::optional<at::Tensor>& grad_source_scaling,
+    // inputs:
+    at::Tensor grad_output,
+    at::Tensor source,
+    at::Tensor index,
+    const c10::optional<at::Tensor>& source_scaling,
+    double alpha) {
+  TORCH_CHECK(source_scaling.has_value() == grad_source_scaling.has_value());
+  TORCH_CHECK(grad_source.dim() == 3);
+  TORCH_CHECK(grad_output.dim() == 3);
+  TORCH_CHECK(source.dim() == 3);
+  TORCH_CHECK(index.dim() == 1);
+  TORCH_CHECK(grad_source.sizes() == source.sizes());
+  TORCH_CHECK(grad_output.size(1) == source.size(1));
+  TORCH_CHECK(grad_output.size(2) == source.size(2));
+  TORCH_CHECK(source.size(0) == index.size(0));
+  TORCH_CHECK(grad_source.stride(-1) == 1);
+  TORCH_CHECK(grad_output.stride(-1) == 1);
+  TORCH_CHECK(source.stride(-1) == 1);
+  TORCH_CHECK(grad_source.scalar_type() == source.scalar_type());
+  TORCH_CHECK(grad_output.scalar_type() == source.scalar_type());
+  TORCH_CHECK(index.scalar_type() == at::ScalarType::Long);
+  if (grad_source_scaling.has_value()) {
+    TORCH_CHECK(source_scaling->dim() == 1);
+    TORCH_CHECK(source_scaling->size(0) == source.size(2));
+    TORCH_CHECK(source_scaling->scalar_type() == source.scalar_type());
+    TORCH_CHECK(grad_source_scaling->sizes() == source.sizes());
+    TORCH_CHECK(grad_source_scaling->stride(-1) == 1);
+    TORCH_CHECK(grad_source_scaling->scalar_type() == source.scalar_type());
+    TORCH_CHECK(
+        !grad_source_scaling->is_cuda(),
+        "grad_source_scaling must be a CPU tensor");
+  }
+  TORCH_CHECK(!grad_source.is_cuda(), "grad_source must be a CPU tensor");
+  TORCH_CHECK(!grad_output.is_cuda(), "grad_output must be a CPU tensor");
+  TORCH_CHECK(!source.is_cuda(), "source must be a CPU tensor");
+  TORCH_CHECK(!index.is_cuda(), "index must be a CPU tensor");
+
+  index = index.contiguous();
+  _check_index(index, grad_output.size(0));
+  at::Tensor scaling = _scaling_opmath(source_scaling);
+  at::Tensor grad_scaling =
+      grad_source_scaling.has_value() ? *grad_source_scaling : at::Tensor();
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), 4 * kBlockD},
+      source.options().dtype(at::toOpMathType(source.scalar_type())));
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      source.scalar_type(),
+      "scaled_index_addB",
+      [&] {
+        if (source_scaling.has_value()) {
+          scaled_index_addB_kernel<scalar_t, true>(
+              grad_source,
+              grad_scaling,
+              grad_output,
+              source,
+              index,
+              scaling,
+              alpha,
+              buffer);
+        } else {
+          scaled_index_addB_kernel<scalar_t, false>(
+              grad_source,
+              grad_scaling,
+              grad_output,
+              source,
+              index,
+              scaling,
+              alpha,
+              buffer);
+        }
+      });
+  return std::make_tuple(grad_source, grad_source_scaling);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::scaled_index_addF"),
+      TORCH_FN(scaled_index_addF));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::scaled_index_addB"),
+      TORCH_FN(scaled_index_addB));
+}
@@ -0,0 +1,129 @@
+#include <ATen/ATen.h>
+#include <torch/types.h>
+
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDAGuard.h>
+
+#include <cstring>
+#include <limits>
+
+#include "grouped_index.h"
+
+namespace {
+
+using xformers::indexing::GroupedRows;
+
+// One block per row, over the rows of all the groups: the whole
+// gather/scatter is a single launch whatever the number of tensors
+template <typename AccessType>
+__global__ void grouped_index_copy_cu(
+    const GroupedRows* groups,
+    int64_t num_groups) {
+  const int64_t row = blockIdx.x;
+  const GroupedRows& p =
+      groups[xformers::indexing::find_group(groups, num_groups, row)];
+  const int64_t r = row - p.row_begin;
+  const int64_t src_row = p.src_index ? p.src_index[r] : r;
+  const int64_t dst_row = p.dst_index ? p.dst_index[r] : r;
+  AccessType const* src =
+      reinterpret_cast<AccessType const*>(p.src + src_row * p.src_stride);
+  AccessType* dst =
+      reinterpret_cast<AccessType*>(p.dst + dst_row * p.dst_stride);
+  const int64_t num_accesses = p.row_bytes / sizeof(AccessType);
+  for (int64_t i = threadIdx.x; i < num_accesses; i += blockDim.x) {
+    dst[i] = src[i];
+  }
+}
+
+// Largest access size (up to 128 bits) that all the pointers, strides and
+// row sizes are aligned to
+int _access_size(const std::vector<GroupedRows>& groups) {
+  uint64_t bits = 16;
+  for (const GroupedRows& p : groups) {
+    bits |= reinterpret_cast<uintptr_t>(p.src) |
+        reinterpret_cast<uintptr_t>(p.dst) | uint64_t(p.src_stride) |
+        uint64_t(p.dst_stride) | uint64_t(p.row_bytes);
+  }
+  return int(bits & (~bits + 1));
+}
+
+void grouped_index_copy(
+    const std::vector<GroupedRows>& groups,
+    int64_t num_rows,
+    const at::Tensor& like) {
+  if (num_rows == 0) {
+    return;
+  }
+  TORCH_CHECK(num_rows < std::numeric_limits<int>::max());
+  at::cuda::CUDAGuard device_guard(like.device());
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+
+  // The table is copied asynchronously from pinned memory
+  const int64_t table_bytes = groups.size() * sizeof(GroupedRows);
+  at::Tensor table_cpu = at::empty(
+      {table_bytes}, at::TensorOptions().dtype(at::kByte).pinned_memory(true));
+  std::memcpy(table_cpu.data_ptr(), groups.data(), table_bytes);
+  at::Tensor table = table_cpu.to(like.device(), /*non_blocking=*/true);
+  const GroupedRows* groups_p =
+      reinterpret_cast<const GroupedRows*>(table.data_ptr());
+  const int64_t num_groups = groups.size();
+
+  int grid = num_rows;
+  int threads = 128;
+  switch (_access_size(groups)) {
+    case 16:
+      grouped_index_copy_cu<uint4>
+          <<<grid, threads, 0, stream>>>(groups_p, num_groups);
+      break;
+    case 8:
+      grouped_index_copy_cu<uint2>
+          <<<grid, threads, 0, stream>>>(groups_p, num_groups);
+      break;
+    case 4:
+      grouped_index_copy_cu<uint32_t>
+          <<<grid, threads, 0, stream>>>(groups_p, num_groups);
+      break;
+    case 2:
+      grouped_index_copy_cu<uint16_t>
+          <<<grid, threads, 0, stream>>>(groups_p, num_groups);
+      break;
+    default:
+      grouped_index_copy_cu<uint8_t>
+          <<<grid, threads, 0, stream>>>(groups_p, num_groups);
+  }
+  AT_CUDA_CHECK(cudaGetLastError());
+}
+
+at::Tensor grouped_index_select(
+    at::Tensor output,
+    at::TensorList sources,
+    at::TensorList indices) {
+  TORCH_CHECK(output.is_cuda(), "output must be a CUDA tensor");
+  int64_t num_rows = 0;
+  auto groups = xformers::indexing::grouped_index_select_rows(
+      output, sources, indices, num_rows);
+  grouped_index_copy(groups, num_rows, output);
+  return output;
+}
+
+void grouped_index_scatter(
+    at::TensorList outputs,
+    at::Tensor source,
+    at::TensorList indices) {
+  TORCH_CHECK(source.is_cuda(), "source must be a CUDA tensor");
+  int64_t num_rows = 0;
+  auto groups = xformers::indexing::grouped_index_scatter_rows(
+      outputs, source, indices, num_rows);
+  grouped_index_copy(groups, num_rows, source);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::grouped_index_select"),
+      TORCH_FN(grouped_index_select));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::grouped_index_scatter"),
+      TORCH_FN(grouped_index_scatter));
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <ATen/ATen.h>
+#include <c10/macros/Macros.h>
+#include <torch/types.h>
+#include <cstdint>
+#include <vector>
+
+namespace xformers {
+namespace indexing {
+
+// Rows copied for one tensor of a grouped operator:
+// `dst[dst_index[r]] = src[src_index[r]]` for `r < num_rows`, where a null
+// index stands for the identity. Strides and sizes are in bytes, so that the
+// kernels are independent of the dtype.
+struct GroupedRows {
+  const char* src;
+  int64_t src_stride;
+  const int64_t* src_index;
+  char* dst;
+  int64_t dst_stride;
+  const int64_t* dst_index;
+  int64_t row_bytes;
+  // First row of this group, over the rows of all the groups
+  int64_t row_begin;
+};
+
+// Index of the group that contains `row`. Groups are never empty, so
+// `row_begin` is strictly increasing.
+C10_HOST_DEVICE inline int64_t find_group(
+    const GroupedRows* groups,
+    int64_t num_groups,
+    int64_t row) {
+  int64_t lo = 0;
+  int64_t hi = num_groups - 1;
+  while (lo < hi) {
+    const int64_t mid = (lo + hi + 1) / 2;
+    if (groups[mid].row_begin <= row) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+inline void _check_group(
+    const at::Tensor& output,
+    const at::Tensor& tensor,
+    const at::Tensor& index) {
+  TORCH_CHECK(tensor.dim() == 2);
+  TORCH_CHECK(index.dim() == 1);
+  TORCH_CHECK(tensor.stride(1) == 1);
+  TORCH_CHECK(index.is_contiguous());
+  TORCH_CHECK(tensor.scalar_type() == output.scalar_type());
+  TORCH_CHECK(index.scalar_type() == at::ScalarType::Long);
+  TORCH_CHECK(tensor.device() == output.device());
+  TORCH_CHECK(index.device() == output.device());
+}
+
+// `output = cat([sources[i][indices[i]].flatten() for i])`
+// Returns the rows to copy and sets `num_rows` to their total number
+inline std::vector<GroupedRows> grouped_index_select_rows(
+    const at::Tensor& output,
+    at::TensorList sources,
+    at::TensorList indices,
+    int64_t& num_rows) {
+  TORCH_CHECK(sources.size() == indices.size());
+  TORCH_CHECK(output.dim() == 1);
+  TORCH_CHECK(output.is_contiguous());
+  const int64_t element_size = output.element_size();
+  std::vector<GroupedRows> groups;
+  int64_t output_offset = 0;
+  num_rows = 0;
+  for (size_t i = 0; i < sources.size(); ++i) {
+    _check_group(output, sources[i], indices[i]);
+    const int64_t rows = indices[i].size(0);
+    const int64_t d = sources[i].size(1);
+    if (rows != 0 && d != 0) {
+      groups.push_back(GroupedRows{
+          static_cast<const char*>(sources[i].data_ptr()),
+          sources[i].stride(0) * element_size,
+          indices[i].data_ptr<int64_t>(),
+          static_cast<char*>(output.data_ptr()) +
+              output_offset * element_size,
+          d * element_size,
+          nullptr,
+          d * element_size,
+          num_rows});
+      num_rows += rows;
+    }
+    output_offset += rows * d;
+  }
+  TORCH_CHECK(output.size(0) == output_offset);
+  return groups;
+}
+
+// `outputs[i][indices[i]] = source[offset_i:offset_i + I_i * D_i]`, with the
+// slices of `source` laid out as in `grouped_index_select_rows`
+inline std::vector<GroupedRows> grouped_index_scatter_rows(
+    at::TensorList outputs,
+    const at::Tensor& source,
+    at::TensorList indices,
+    int64_t& num_rows) {
+  TORCH_CHECK(outputs.size() == indices.size());
+  TORCH_CHECK(source.dim() == 1);
+  TORCH_CHECK(source.is_contiguous());
+  const int64_t element_size = source.element_size();
+  std::vector<GroupedRows> groups;
+  int64_t source_offset = 0;
+  num_rows = 0;
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    _check_group(source, outputs[i], indices[i]);
+    const int64_t rows = indices[i].size(0);
+    const int64_t d = outputs[i].size(1);
+    if (rows != 0 && d != 0) {
+      groups.push_back(GroupedRows{
+          static_cast<const char*>(source.data_ptr()) +
+              source_offset * element_size,
+          d * element_size,
+          nullptr,
+          static_cast<char*>(outputs[i].data_ptr()),
+          outputs[i].stride(0) * element_size,
+          indices[i].data_ptr<int64_t>(),
+          d * element_size,
+          num_rows});
+      num_rows += rows;
+    }
+    source_offset += rows * d;
+  }
+  TORCH_CHECK(source.size(0) == source_offset);
+  return groups;
+}
+
+} // namespace indexing
+} // namespace xformers
@@ -7,4 +7,8 @@ TORCH_LIBRARY_FRAGMENT(xformers, m) {
       "xformers::scaled_index_addB(Tensor grad_source, Tensor? grad_source_scaling, Tensor grad_output, Tensor source, Tensor index, Tensor? source_scaling, float alpha) -> (Tensor, Tensor?)"));
   m.def(TORCH_SELECTIVE_SCHEMA(
       "xformers::index_select(Tensor output, Tensor source, Tensor index) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::grouped_index_select(Tensor output, Tensor[] sources, Tensor[] indices) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::grouped_index_scatter(Tensor[] outputs, Tensor source, Tensor[] indices) -> ()"));
 }
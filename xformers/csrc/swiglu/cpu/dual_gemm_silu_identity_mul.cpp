@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/OpMathType.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+#include <algorithm>
+#include <type_traits>
+
+#include <ATen/cpu/vec/functional.h>
+#include <ATen/cpu/vec/vec.h>
+
+#include "../../cpu/gemm_utils.h"
+#include "../../cpu/vec_utils.h"
+
+namespace {
+
+using xformers::cpu::_load_row;
+using xformers::cpu::_out_row;
+using xformers::cpu::_store_row;
+
+// Output tile of a task. Both GEMMs write their tile of x1 and x2 directly
+// into the outputs, and the SiLU-identity epilogue reads it back while it's
+// still in cache to produce x4, instead of a separate pass over memory.
+constexpr int64_t kBlockM = 64;
+constexpr int64_t kBlockH = 256;
+
+// `x4 = silu(x1) * x2`, where x1 and x2 are rounded to `scalar_t` like the
+// CUDA kernel does
+template <typename scalar_t>
+void dual_gemm_silu_identity_mul_kernel(
+    const at::Tensor& x,
+    const at::Tensor& w0,
+    const c10::optional<at::Tensor>& b0,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1,
+    at::Tensor& d0,
+    at::Tensor& d1,
+    at::Tensor& d2,
+    at::Tensor& buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  using Vec = at::vec::Vectorized<accum_t>;
+  const int64_t B = x.size(0);
+  const int64_t H = w0.size(0);
+  const int64_t num_m_blocks = (B + kBlockM - 1) / kBlockM;
+  const int64_t num_h_blocks = (H + kBlockH - 1) / kBlockH;
+
+  const int64_t K = x.size(1);
+  const auto x_op = xformers::cpu::gemm_operand<scalar_t>(x);
+  const auto w0_op = xformers::cpu::gemm_operand<scalar_t>(w0);
+  const auto w1_op = xformers::cpu::gemm_operand<scalar_t>(w1);
+  const scalar_t* b0_p = b0.has_value() ? b0->data_ptr<scalar_t>() : nullptr;
+  const scalar_t* b1_p = b1.has_value() ? b1->data_ptr<scalar_t>() : nullptr;
+  scalar_t* d0_p = d0.data_ptr<scalar_t>();
+  scalar_t* d1_p = d1.data_ptr<scalar_t>();
+  scalar_t* d2_p = d2.data_ptr<scalar_t>();
+  accum_t* buffer_p = buffer.data_ptr<accum_t>();
+
+  // Consecutive tasks share the same tile of the weights
+  at::parallel_for(
+      0, num_m_blocks * num_h_blocks, 1, [&](int64_t start, int64_t end) {
+        accum_t* x1_buf = buffer_p + at::get_thread_num() * 3 * kBlockH;
+        accum_t* x2_buf = x1_buf + kBlockH;
+        accum_t* x4_buf = x2_buf + kBlockH;
+        for (int64_t work = start; work < end; ++work) {
+          const int64_t m0 = (work % num_m_blocks) * kBlockM;
+          const int64_t h0 = (work / num_m_blocks) * kBlockH;
+          const int64_t m_len = std::min(kBlockM, B - m0);
+          const int64_t h_len = std::min(kBlockH, H - h0);
+          xformers::cpu::linear(
+              m_len,
+              h_len,
+              K,
+              x_op.block(m0, 0),
+              w0_op.block(h0, 0),
+              b0_p != nullptr ? b0_p + h0 : nullptr,
+              d0_p + m0 * H + h0,
+              H);
+          xformers::cpu::linear(
+              m_len,
+              h_len,
+              K,
+              x_op.block(m0, 0),
+              w1_op.block(h0, 0),
+              b1_p != nullptr ? b1_p + h0 : nullptr,
+              d1_p + m0 * H + h0,
+              H);
+          for (int64_t m = m0; m < m0 + m_len; ++m) {
+            const accum_t* x1 = _load_row(d0_p + m * H + h0, x1_buf, h_len);
+            const accum_t* x2 = _load_row(d1_p + m * H + h0, x2_buf, h_len);
+            accum_t* x4 = _out_row(d2_p + m * H + h0, x4_buf);
+            at::vec::map2(
+                [](Vec a, Vec b) {
+                  return a / (Vec(accum_t(1)) + a.neg().exp()) * b;
+                },
+                x4,
+                x1,
+                x2,
+                h_len);
+            _store_row(x4, d2_p + m * H + h0, h_len);
+          }
+        }
+      });
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul(
+    const at::Tensor& x,
+    const at::Tensor& w0,
+    const c10::optional<at::Tensor>& b0,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1) {
+  TORCH_CHECK(x.dim() == 2);
+  TORCH_CHECK(w0.dim() == 2);
+  TORCH_CHECK(w1.dim() == 2);
+  TORCH_CHECK(w0.sizes() == w1.sizes());
+  TORCH_CHECK(x.size(1) == w0.size(1));
+  TORCH_CHECK(
+      !b0.has_value() || (b0->dim() == 1 && b0->size(0) == w0.size(0)));
+  TORCH_CHECK(
+      !b1.has_value() || (b1->dim() == 1 && b1->size(0) == w1.size(0)));
+  TORCH_CHECK(x.stride(-1) == 1);
+  TORCH_CHECK(w0.stride(-1) == 1);
+  TORCH_CHECK(w1.stride(-1) == 1);
+  TORCH_CHECK(w0.scalar_type() == x.scalar_type());
+  TORCH_CHECK(w1.scalar_type() == x.scalar_type());
+  TORCH_CHECK(!b0.has_value() || b0->scalar_type() == x.scalar_type());
+  TORCH_CHECK(!b1.has_value() || b1->scalar_type() == x.scalar_type());
+  TORCH_CHECK(!x.is_cuda(), "x must be a CPU tensor");
+  TORCH_CHECK(!w0.is_cuda(), "w0 must be a CPU tensor");
+  TORCH_CHECK(!w1.is_cuda(), "w1 must be a CPU tensor");
+
+  int64_t B = x.size(0);
+  int64_t H = w0.size(0);
+  // The tiles are read through raw pointers
+  at::Tensor x_ = xformers::cpu::is_gemm_operand(x) ? x : x.contiguous();
+  at::Tensor w0_ = xformers::cpu::is_gemm_operand(w0) ? w0 : w0.contiguous();
+  at::Tensor w1_ = xformers::cpu::is_gemm_operand(w1) ? w1 : w1.contiguous();
+  c10::optional<at::Tensor> b0_, b1_;
+  if (b0.has_value()) {
+    b0_ = b0->contiguous();
+  }
+  if (b1.has_value()) {
+    b1_ = b1->contiguous();
+  }
+
+  at::Tensor d0 = at::empty({B, H}, x.options());
+  at::Tensor d1 = at::empty({B, H}, x.options());
+  at::Tensor d2 = at::empty({B, H}, x.options());
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), 3 * kBlockH},
+      x.options().dtype(at::toOpMathType(x.scalar_type())));
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      x.scalar_type(),
+      "dual_gemm_silu_identity_mul",
+      [&] {
+        dual_gemm_silu_identity_mul_kernel<scalar_t>(
+            x_, w0_, b0_, w1_, b1_, d0, d1, d2, buffer);
+      });
+  return std::make_tuple(d0, d1, d2);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::dual_gemm_silu_identity_mul"),
+      TORCH_FN(dual_gemm_silu_identity_mul));
+}
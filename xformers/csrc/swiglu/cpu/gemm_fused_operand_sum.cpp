@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/OpMathType.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+#include <algorithm>
+#include <type_traits>
+
+#include <ATen/cpu/vec/functional.h>
+#include <ATen/cpu/vec/vec.h>
+
+#include "../../cpu/gemm_utils.h"
+
+namespace {
+
+// Output tile of a task. The task computing the first tile of a block of
+// rows also sums these rows of `a`, which it just read for the GEMM.
+constexpr int64_t kBlockM = 64;
+constexpr int64_t kBlockN = 512;
+
+// `out_sum[m0:m0+m_len] = a[m0:m0+m_len].sum(1)`, in `opmath`
+template <typename scalar_t>
+void _sum_rows(
+    const at::Tensor& a,
+    at::Tensor& out_sum,
+    int64_t m0,
+    int64_t m_len,
+    at::opmath_type<scalar_t>* buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  using Vec = at::vec::Vectorized<accum_t>;
+  const int64_t K = a.size(1);
+  const scalar_t* a_p = a.data_ptr<scalar_t>();
+  scalar_t* out_p = out_sum.data_ptr<scalar_t>();
+  accum_t* acc = buffer;
+  accum_t* a_buf = buffer + kBlockM;
+  if (a.stride(0) == 1) {
+    // Column-major (the weight-gradient case, `a = dy.T`): accumulate the
+    // contiguous slices of the columns
+    std::fill(acc, acc + m_len, accum_t(0));
+    for (int64_t k = 0; k < K; ++k) {
+      const scalar_t* col = a_p + k * a.stride(1) + m0;
+      const accum_t* col_acc;
+      if constexpr (std::is_same<scalar_t, accum_t>::value) {
+        col_acc = col;
+      } else {
+        at::vec::convert(col, a_buf, m_len);
+        col_acc = a_buf;
+      }
+      at::vec::map2(
+          [](Vec s, Vec x) { return s + x; }, acc, acc, col_acc, m_len);
+    }
+    for (int64_t m = 0; m < m_len; ++m) {
+      out_p[(m0 + m) * out_sum.stride(0)] = scalar_t(acc[m]);
+    }
+  } else {
+    for (int64_t m = m0; m < m0 + m_len; ++m) {
+      accum_t sum = 0;
+      for (int64_t k = 0; k < K; ++k) {
+        sum += accum_t(a_p[m * a.stride(0) + k * a.stride(1)]);
+      }
+      out_p[m * out_sum.stride(0)] = scalar_t(sum);
+    }
+  }
+}
+
+// `out_mm = a @ b` and `out_sum = a.sum(1)`: the bias gradient is computed
+// with the weight gradient, rather than in a separate pass over `dy`
+template <typename scalar_t>
+void gemm_fused_operand_sum_kernel(
+    const at::Tensor& a,
+    const at::Tensor& b,
+    at::Tensor& out_mm,
+    at::Tensor& out_sum,
+    at::Tensor& buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  const int64_t M = a.size(0);
+  const int64_t N = b.size(1);
+  const int64_t K = a.size(1);
+  const auto a_op = xformers::cpu::gemm_operand<scalar_t>(a);
+  const auto b_op = xformers::cpu::gemm_operand<scalar_t>(b);
+  scalar_t* out_p = out_mm.data_ptr<scalar_t>();
+  const int64_t ldc = out_mm.stride(0);
+  const int64_t num_m_blocks = (M + kBlockM - 1) / kBlockM;
+  const int64_t num_n_blocks = (N + kBlockN - 1) / kBlockN;
+  accum_t* buffer_p = buffer.data_ptr<accum_t>();
+
+  at::parallel_for(
+      0, num_m_blocks * num_n_blocks, 1, [&](int64_t start, int64_t end) {
+        accum_t* buf = buffer_p + at::get_thread_num() * 2 * kBlockM;
+        for (int64_t work = start; work < end; ++work) {
+          const int64_t m0 = (work / num_n_blocks) * kBlockM;
+          const int64_t n0 = (work % num_n_blocks) * kBlockN;
+          const int64_t m_len = std::min(kBlockM, M - m0);
+          const int64_t n_len = std::min(kBlockN, N - n0);
+          xformers::cpu::gemm<scalar_t>(
+              m_len,
+              n_len,
+              K,
+              accum_t(1),
+              a_op.block(m0, 0),
+              b_op.block(0, n0),
+              accum_t(0),
+              out_p + m0 * ldc + n0,
+              ldc);
+          if (n0 == 0) {
+            _sum_rows<scalar_t>(a, out_sum, m0, m_len, buf);
+          }
+        }
+      });
+  // `N == 0`: there is no GEMM tile to attach the sum to
+  if (num_n_blocks == 0) {
+    for (int64_t m0 = 0; m0 < M; m0 += kBlockM) {
+      _sum_rows<scalar_t>(a, out_sum, m0, std::min(kBlockM, M - m0), buffer_p);
+    }
+  }
+}
+
+std::tuple<at::Tensor, at::Tensor> gemm_fused_operand_sum(
+    const at::Tensor& a,
+    const at::Tensor& b,
+    at::Tensor& out_mm,
+    at::Tensor& out_sum) {
+  TORCH_CHECK(a.dim() == 2);
+  TORCH_CHECK(b.dim() == 2);
+  TORCH_CHECK(out_mm.dim() == 2);
+  TORCH_CHECK(out_sum.dim() == 1);
+  TORCH_CHECK(a.size(1) == b.size(0));
+  TORCH_CHECK(out_mm.size(0) == a.size(0));
+  TORCH_CHECK(out_mm.size(1) == b.size(1));
+  TORCH_CHECK(out_sum.size(0) == a.size(0));
+  TORCH_CHECK(out_mm.stride(1) == 1);
+  TORCH_CHECK(b.scalar_type() == a.scalar_type());
+  TORCH_CHECK(out_mm.scalar_type() == a.scalar_type());
+  TORCH_CHECK(out_sum.scalar_type() == a.scalar_type());
+  TORCH_CHECK(!a.is_cuda(), "a must be a CPU tensor");
+  TORCH_CHECK(!b.is_cuda(), "b must be a CPU tensor");
+  TORCH_CHECK(!out_mm.is_cuda(), "out_mm must be a CPU tensor");
+  TORCH_CHECK(!out_sum.is_cuda(), "out_sum must be a CPU tensor");
+  TORCH_CHECK(
+      xformers::cpu::is_gemm_operand(out_mm), "out_mm can't overlap itself");
+
+  // Accumulators and converted columns of `a`, per thread
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), 2 * kBlockM},
+      a.options().dtype(at::toOpMathType(a.scalar_type())));
+
+  // The tiles are read through raw pointers
+  at::Tensor a_ = xformers::cpu::is_gemm_operand(a) ? a : a.contiguous();
+  at::Tensor b_ = xformers::cpu::is_gemm_operand(b) ? b : b.contiguous();
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      a.scalar_type(),
+      "gemm_fused_operand_sum",
+      [&] {
+        gemm_fused_operand_sum_kernel<scalar_t>(
+            a_, b_, out_mm, out_sum, buffer);
+      });
+  return std::make_tuple(out_mm, out_sum);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::gemm_fused_operand_sum"),
+      TORCH_FN(gemm_fused_operand_sum));
+}
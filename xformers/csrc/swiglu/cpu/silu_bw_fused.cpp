@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/OpMathType.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+#include <algorithm>
+#include <type_traits>
+
+#include <ATen/cpu/vec/functional.h>
+#include <ATen/cpu/vec/vec.h>
+
+#include "../../cpu/gemm_utils.h"
+#include "../../cpu/vec_utils.h"
+
+namespace {
+
+using xformers::cpu::_load_row;
+using xformers::cpu::_out_row;
+using xformers::cpu::_store_row;
+
+// Elements of a row processed at a time, converted to `opmath` in per-thread
+// buffers for f16/bf16
+constexpr int64_t kBlockH = 256;
+// Rows of the x1/x2 tiles recomputed at a time by `dual_gemm_silu_bw_fused`
+constexpr int64_t kBlockM = 64;
+
+// `dx1`, `dx2` and `x4` of `h_len` elements of a row, see `silu_bw_fused`
+template <typename accum_t>
+inline void _silu_bw_row(
+    const accum_t* x1,
+    const accum_t* x2,
+    const accum_t* dx4,
+    accum_t* dx1,
+    accum_t* dx2,
+    accum_t* x4,
+    int64_t h_len) {
+  using Vec = at::vec::Vectorized<accum_t>;
+  const Vec one(accum_t(1));
+  for (int64_t h = 0; h < h_len; h += Vec::size()) {
+    const int64_t count = std::min<int64_t>(Vec::size(), h_len - h);
+    const Vec a = Vec::loadu(x1 + h, count);
+    const Vec c = Vec::loadu(x2 + h, count);
+    const Vec g = Vec::loadu(dx4 + h, count);
+    const Vec sigm = one / (one + a.neg().exp());
+    const Vec x3 = sigm * a;
+    (g * c * sigm * (one + a * (one - sigm))).store(dx1 + h, count);
+    (g * x3).store(dx2 + h, count);
+    (x3 * c).store(x4 + h, count);
+  }
+}
+
+/*
+Computes the following, in a single pass over the inputs:
+
+def silu_bw_fused(x1, x2, dx4):
+    x3 = F.silu(x1)
+    dx3 = dx4 * x2
+    dx2 = dx4 * x3
+    x4 = x2 * x3  # checkpointing
+    # silu bw
+    sigm = 1 / (1 + torch.exp(-x1.float()))
+    dx1 = (dx3.float() * sigm * (1 + x1.float() * (1 - sigm))).to(x1.dtype)
+    return dx1, dx2, x4
+*/
+template <typename scalar_t>
+void silu_bw_fused_kernel(
+    const at::Tensor& x1,
+    const at::Tensor& x2,
+    const at::Tensor& dx4,
+    at::Tensor& dx1dx2,
+    at::Tensor& x4,
+    at::Tensor& buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  const int64_t B = x2.size(0);
+  const int64_t H = x2.size(1);
+
+  const scalar_t* x1_p = x1.data_ptr<scalar_t>();
+  const scalar_t* x2_p = x2.data_ptr<scalar_t>();
+  const scalar_t* dx4_p = dx4.data_ptr<scalar_t>();
+  scalar_t* dx1dx2_p = dx1dx2.data_ptr<scalar_t>();
+  scalar_t* x4_p = x4.data_ptr<scalar_t>();
+  accum_t* buffer_p = buffer.data_ptr<accum_t>();
+
+  // Rows of `H` elements per task
+  const int64_t grain_size = std::max<int64_t>(
+      1, at::internal::GRAIN_SIZE / std::max<int64_t>(H, 1));
+  at::parallel_for(0, B, grain_size, [&](int64_t start, int64_t end) {
+    accum_t* x1_buf = buffer_p + at::get_thread_num() * 6 * kBlockH;
+    accum_t* x2_buf = x1_buf + kBlockH;
+    accum_t* dx4_buf = x2_buf + kBlockH;
+    accum_t* dx1_buf = dx4_buf + kBlockH;
+    accum_t* dx2_buf = dx1_buf + kBlockH;
+    accum_t* x4_buf = dx2_buf + kBlockH;
+    for (int64_t b = start; b < end; ++b) {
+      scalar_t* dx1_row = dx1dx2_p + b * 2 * H;
+      scalar_t* dx2_row = dx1_row + H;
+      scalar_t* x4_row = x4_p + b * H;
+      for (int64_t h0 = 0; h0 < H; h0 += kBlockH) {
+        const int64_t h_len = std::min(kBlockH, H - h0);
+        const accum_t* x1_ =
+            _load_row(x1_p + b * x1.stride(0) + h0, x1_buf, h_len);
+        const accum_t* x2_ =
+            _load_row(x2_p + b * x2.stride(0) + h0, x2_buf, h_len);
+        const accum_t* dx4_ =
+            _load_row(dx4_p + b * dx4.stride(0) + h0, dx4_buf, h_len);
+        accum_t* dx1_ = _out_row(dx1_row + h0, dx1_buf);
+        accum_t* dx2_ = _out_row(dx2_row + h0, dx2_buf);
+        accum_t* x4_ = _out_row(x4_row + h0, x4_buf);
+        _silu_bw_row(x1_, x2_, dx4_, dx1_, dx2_, x4_, h_len);
+        _store_row(dx1_, dx1_row + h0, h_len);
+        _store_row(dx2_, dx2_row + h0, h_len);
+        _store_row(x4_, x4_row + h0, h_len);
+      }
+    }
+  });
+}
+
+std::tuple<at::Tensor, at::Tensor> silu_bw_fused(
+    const at::Tensor& x1,
+    const at::Tensor& x2,
+    const at::Tensor& dx4) {
+  TORCH_CHECK(x1.dim() == 2);
+  TORCH_CHECK(x2.dim() == 2);
+  TORCH_CHECK(dx4.dim() == 2);
+  TORCH_CHECK(x1.sizes() == x2.sizes());
+  TORCH_CHECK(x2.sizes() == dx4.sizes());
+  TORCH_CHECK(x1.stride(1) == 1);
+  TORCH_CHECK(x2.stride(1) == 1);
+  TORCH_CHECK(dx4.stride(1) == 1);
+  TORCH_CHECK(x1.scalar_type() == x2.scalar_type());
+  TORCH_CHECK(dx4.scalar_type() == x2.scalar_type());
+  TORCH_CHECK(!x1.is_cuda(), "x1 must be a CPU tensor");
+  TORCH_CHECK(!x2.is_cuda(), "x2 must be a CPU tensor");
+  TORCH_CHECK(!dx4.is_cuda(), "dx4 must be a CPU tensor");
+
+  int64_t B = x2.size(0);
+  int64_t H = x2.size(1);
+  at::Tensor dx1dx2 = at::empty({B, 2, H}, x2.options());
+  at::Tensor x4 = at::empty({B, H}, x2.options());
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), 6 * kBlockH},
+      x2.options().dtype(at::toOpMathType(x2.scalar_type())));
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      x2.scalar_type(),
+      "silu_bw_fused",
+      [&] {
+        silu_bw_fused_kernel<scalar_t>(x1, x2, dx4, dx1dx2, x4, buffer);
+      });
+  return std::make_tuple(dx1dx2, x4);
+}
+
+// `silu_bw_fused` of the x1 and x2 of `dual_gemm_silu_identity_mul`, which
+// are recomputed from `x` tile by tile in per-thread scratch rather than
+// read from [B, H] tensors. Like in the forward, they are rounded to
+// `scalar_t` before the SiLU.
+template <typename scalar_t>
+void dual_gemm_silu_bw_fused_kernel(
+    const at::Tensor& x,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1,
+    const at::Tensor& w2,
+    const c10::optional<at::Tensor>& b2,
+    const at::Tensor& dx4,
+    at::Tensor& dx1dx2,
+    at::Tensor& x4,
+    at::Tensor& tiles,
+    at::Tensor& buffer) {
+  using accum_t = at::opmath_type<scalar_t>;
+  const int64_t B = x.size(0);
+  const int64_t K = x.size(1);
+  const int64_t H = w1.size(0);
+  const int64_t num_m_blocks = (B + kBlockM - 1) / kBlockM;
+  const int64_t num_h_blocks = (H + kBlockH - 1) / kBlockH;
+
+  const auto x_op = xformers::cpu::gemm_operand<scalar_t>(x);
+  const auto w1_op = xformers::cpu::gemm_operand<scalar_t>(w1);
+  const auto w2_op = xformers::cpu::gemm_operand<scalar_t>(w2);
+  const scalar_t* b1_p = b1.has_value() ? b1->data_ptr<scalar_t>() : nullptr;
+  const scalar_t* b2_p = b2.has_value() ? b2->data_ptr<scalar_t>() : nullptr;
+  const scalar_t* dx4_p = dx4.data_ptr<scalar_t>();
+  scalar_t* dx1dx2_p = dx1dx2.data_ptr<scalar_t>();
+  scalar_t* x4_p = x4.data_ptr<scalar_t>();
+  scalar_t* tiles_p = tiles.data_ptr<scalar_t>();
+  accum_t* buffer_p = buffer.data_ptr<accum_t>();
+
+  // Consecutive tasks share the same tile of the weights
+  at::parallel_for(
+      0, num_m_blocks * num_h_blocks, 1, [&](int64_t start, int64_t end) {
+        const int64_t tid = at::get_thread_num();
+        scalar_t* x1_tile = tiles_p + tid * 2 * kBlockM * kBlockH;
+        scalar_t* x2_tile = x1_tile + kBlockM * kBlockH;
+        accum_t* x1_buf = buffer_p + tid * 6 * kBlockH;
+        accum_t* x2_buf = x1_buf + kBlockH;
+        accum_t* dx4_buf = x2_buf + kBlockH;
+        accum_t* dx1_buf = dx4_buf + kBlockH;
+        accum_t* dx2_buf = dx1_buf + kBlockH;
+        accum_t* x4_buf = dx2_buf + kBlockH;
+        for (int64_t work = start; work < end; ++work) {
+          const int64_t m0 = (work % num_m_blocks) * kBlockM;
+          const int64_t h0 = (work / num_m_blocks) * kBlockH;
+          const int64_t m_len = std::min(kBlockM, B - m0);
+          const int64_t h_len = std::min(kBlockH, H - h0);
+          xformers::cpu::linear(
+              m_len,
+              h_len,
+              K,
+              x_op.block(m0, 0),
+              w1_op.block(h0, 0),
+              b1_p != nullptr ? b1_p + h0 : nullptr,
+              x1_tile,
+              kBlockH);
+          xformers::cpu::linear(
+              m_len,
+              h_len,
+              K,
+              x_op.block(m0, 0),
+              w2_op.block(h0, 0),
+              b2_p != nullptr ? b2_p + h0 : nullptr,
+              x2_tile,
+              kBlockH);
+          for (int64_t m = 0; m < m_len; ++m) {
+            scalar_t* dx1_row = dx1dx2_p + (m0 + m) * 2 * H + h0;
+            scalar_t* dx2_row = dx1_row + H;
+            scalar_t* x4_row = x4_p + (m0 + m) * H + h0;
+            const accum_t* x1_ =
+                _load_row(x1_tile + m * kBlockH, x1_buf, h_len);
+            const accum_t* x2_ =
+                _load_row(x2_tile + m * kBlockH, x2_buf, h_len);
+            const accum_t* dx4_ = _load_row(
+                dx4_p + (m0 + m) * dx4.stride(0) + h0, dx4_buf, h_len);
+            accum_t* dx1_ = _out_row(dx1_row, dx1_buf);
+            accum_t* dx2_ = _out_row(dx2_row, dx2_buf);
+            accum_t* x4_ = _out_row(x4_row, x4_buf);
+            _silu_bw_row(x1_, x2_, dx4_, dx1_, dx2_, x4_, h_len);
+            _store_row(dx1_, dx1_row, h_len);
+            _store_row(dx2_, dx2_row, h_len);
+            _store_row(x4_, x4_row, h_len);
+          }
+        }
+      });
+}
+
+std::tuple<at::Tensor, at::Tensor> dual_gemm_silu_bw_fused(
+    const at::Tensor& x,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1,
+    const at::Tensor& w2,
+    const c10::optional<at::Tensor>& b2,
+    const at::Tensor& dx4) {
+  TORCH_CHECK(x.dim() == 2);
+  TORCH_CHECK(w1.dim() == 2);
+  TORCH_CHECK(w2.dim() == 2);
+  TORCH_CHECK(dx4.dim() == 2);
+  TORCH_CHECK(w1.sizes() == w2.sizes());
+  TORCH_CHECK(x.size(1) == w1.size(1));
+  TORCH_CHECK(dx4.size(0) == x.size(0) && dx4.size(1) == w1.size(0));
+  TORCH_CHECK(
+      !b1.has_value() || (b1->dim() == 1 && b1->size(0) == w1.size(0)));
+  TORCH_CHECK(
+      !b2.has_value() || (b2->dim() == 1 && b2->size(0) == w2.size(0)));
+  TORCH_CHECK(dx4.stride(1) == 1);
+  TORCH_CHECK(w1.scalar_type() == x.scalar_type());
+  TORCH_CHECK(w2.scalar_type() == x.scalar_type());
+  TORCH_CHECK(dx4.scalar_type() == x.scalar_type());
+  TORCH_CHECK(!b1.has_value() || b1->scalar_type() == x.scalar_type());
+  TORCH_CHECK(!b2.has_value() || b2->scalar_type() == x.scalar_type());
+  TORCH_CHECK(!x.is_cuda(), "x must be a CPU tensor");
+  TORCH_CHECK(!w1.is_cuda(), "w1 must be a CPU tensor");
+  TORCH_CHECK(!w2.is_cuda(), "w2 must be a CPU tensor");
+  TORCH_CHECK(!dx4.is_cuda(), "dx4 must be a CPU tensor");
+
+  int64_t B = x.size(0);
+  int64_t H = w1.size(0);
+  // The tiles are read through raw pointers
+  at::Tensor x_ = xformers::cpu::is_gemm_operand(x) ? x : x.contiguous();
+  at::Tensor w1_ = xformers::cpu::is_gemm_operand(w1) ? w1 : w1.contiguous();
+  at::Tensor w2_ = xformers::cpu::is_gemm_operand(w2) ? w2 : w2.contiguous();
+  c10::optional<at::Tensor> b1_, b2_;
+  if (b1.has_value()) {
+    b1_ = b1->contiguous();
+  }
+  if (b2.has_value()) {
+    b2_ = b2->contiguous();
+  }
+
+  at::Tensor dx1dx2 = at::empty({B, 2, H}, x.options());
+  at::Tensor x4 = at::empty({B, H}, x.options());
+  at::Tensor tiles =
+      at::empty({at::get_num_threads(), 2 * kBlockM * kBlockH}, x.options());
+  at::Tensor buffer = at::empty(
+      {at::get_num_threads(), 6 * kBlockH},
+      x.options().dtype(at::toOpMathType(x.scalar_type())));
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      x.scalar_type(),
+      "dual_gemm_silu_bw_fused",
+      [&] {
+        dual_gemm_silu_bw_fused_kernel<scalar_t>(
+            x_, w1_, b1_, w2_, b2_, dx4, dx1dx2, x4, tiles, buffer);
+      });
+  return std::make_tuple(dx1dx2, x4);
+}
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::silu_bw_fused"), TORCH_FN(silu_bw_fused));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::dual_gemm_silu_bw_fused"),
+      TORCH_FN(dual_gemm_silu_bw_fused));
+}
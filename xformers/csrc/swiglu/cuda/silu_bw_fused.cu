@@ -9,6 +9,8 @@
 #include <ATen/Dispatch.h>
 #include <ATen/ScalarOps.h>
 #include <ATen/Tensor.h>
+#include <ATen/autocast_mode.h>
+#include <ATen/core/dispatch/Dispatcher.h>
 #include <ATen/cuda/CUDAContext.h>
 #include <ATen/native/ReduceOps.h>
 #include <ATen/native/Resize.h>
@@ -83,9 +85,59 @@ std::tuple<at::Tensor, at::Tensor> silu_bw_fused(
       }));
   return std::make_tuple(dx1dx2, x4);
 }
+
+// On CUDA, x1 and x2 are recomputed by the dual GEMM kernel rather than in
+// the SiLU backward, and the x4 it also produces is discarded
+std::tuple<at::Tensor, at::Tensor> dual_gemm_silu_bw_fused(
+    const at::Tensor& x,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1,
+    const at::Tensor& w2,
+    const c10::optional<at::Tensor>& b2,
+    const at::Tensor& dx4) {
+  static auto dual_gemm =
+      c10::Dispatcher::singleton()
+          .findSchemaOrThrow("xformers::dual_gemm_silu_identity_mul", "")
+          .typed<std::tuple<at::Tensor, at::Tensor, at::Tensor>(
+              const at::Tensor&,
+              const at::Tensor&,
+              const c10::optional<at::Tensor>&,
+              const at::Tensor&,
+              const c10::optional<at::Tensor>&)>();
+  at::Tensor x1, x2;
+  std::tie(x1, x2, std::ignore) = dual_gemm.call(x, w1, b1, w2, b2);
+  return silu_bw_fused(x1, x2, dx4);
+}
+
+std::tuple<at::Tensor, at::Tensor> dual_gemm_silu_bw_fused_autocast(
+    const at::Tensor& x,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1,
+    const at::Tensor& w2,
+    const c10::optional<at::Tensor>& b2,
+    const at::Tensor& dx4) {
+  c10::impl::ExcludeDispatchKeyGuard no_autocast(c10::DispatchKey::Autocast);
+  auto exec_type = at::autocast::get_autocast_gpu_dtype();
+  return dual_gemm_silu_bw_fused(
+      at::autocast::cached_cast(exec_type, x),
+      at::autocast::cached_cast(exec_type, w1),
+      at::autocast::cached_cast(exec_type, b1),
+      at::autocast::cached_cast(exec_type, w2),
+      at::autocast::cached_cast(exec_type, b2),
+      at::autocast::cached_cast(exec_type, dx4));
+}
 } // namespace
 
 TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
   m.impl(
       TORCH_SELECTIVE_NAME("xformers::silu_bw_fused"), TORCH_FN(silu_bw_fused));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::dual_gemm_silu_bw_fused"),
+      TORCH_FN(dual_gemm_silu_bw_fused));
+}
+
+TORCH_LIBRARY_IMPL(xformers, Autocast, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::dual_gemm_silu_bw_fused"),
+      TORCH_FN(dual_gemm_silu_bw_fused_autocast));
 }
@@ -14,7 +14,7 @@
 // clang-format on
 
 namespace {
-// Kernels implemented in `cuda/`
+// Kernels implemented in `cuda/` and `cpu/`
 std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul(
     const at::Tensor& x,
     const at::Tensor& w0,
@@ -36,6 +36,19 @@ std::tuple<at::Tensor, at::Tensor> silu_bw_fused(
                        .typed<decltype(silu_bw_fused)>();
   return op.call(x1, x2, dx4);
 }
+std::tuple<at::Tensor, at::Tensor> dual_gemm_silu_bw_fused(
+    const at::Tensor& x,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1,
+    const at::Tensor& w2,
+    const c10::optional<at::Tensor>& b2,
+    const at::Tensor& dx4) {
+  static auto op =
+      c10::Dispatcher::singleton()
+          .findSchemaOrThrow("xformers::dual_gemm_silu_bw_fused", "")
+          .typed<decltype(dual_gemm_silu_bw_fused)>();
+  return op.call(x, w1, b1, w2, b2, dx4);
+}
 std::tuple<at::Tensor, at::Tensor> gemm_fused_operand_sum(
     const at::Tensor& a,
     const at::Tensor& b,
@@ -87,7 +100,8 @@ class SwiGLUPackedWeights
       const at::Tensor& w1w2,
       const c10::optional<at::Tensor>& b1b2,
       const at::Tensor w3,
-      const c10::optional<at::Tensor>& b3) {
+      const c10::optional<at::Tensor>& b3,
+      bool recompute) {
     at::AutoDispatchBelowADInplaceOrView g;
     auto w1 = w1w2[0];
     auto w2 = w1w2[1];
@@ -102,9 +116,17 @@ class SwiGLUPackedWeights
         x4, w3, b3.has_value() ? b3.value() : at::Tensor());
 
     if (ctx != nullptr) {
-      ctx->save_for_backward({x, w1w2, w3, x1, x2});
+      if (recompute) {
+        // x1 and x2 are recomputed from x in the backward, instead of
+        // keeping two [B, H] activations alive until then
+        ctx->save_for_backward(
+            {x, w1w2, w3, b1b2.has_value() ? b1b2.value() : at::Tensor()});
+      } else {
+        ctx->save_for_backward({x, w1w2, w3, x1, x2});
+      }
       ctx->saved_data["has_b1b2"] = b1b2.has_value();
       ctx->saved_data["has_b3"] = b3.has_value();
+      ctx->saved_data["recompute"] = recompute;
     }
     return x5;
   }
@@ -120,16 +142,12 @@ class SwiGLUPackedWeights
     auto x = saved[0];
     auto w1w2 = saved[1];
     auto w3 = saved[2];
-    auto x1 = saved[3];
-    auto x2 = saved[4];
     bool has_b1b2 = ctx->saved_data["has_b1b2"].toBool();
     bool has_b3 = ctx->saved_data["has_b3"].toBool();
     int64_t B = x.size(0);
-    int64_t H = x2.size(1);
+    int64_t H = w1w2.size(1);
     int64_t I = x.size(1);
     int64_t O = dx5.size(1);
-    TORCH_INTERNAL_ASSERT_SHAPE(x1, B, H);
-    TORCH_INTERNAL_ASSERT_SHAPE(x2, B, H);
     TORCH_INTERNAL_ASSERT_SHAPE(dx5, B, O);
     TORCH_INTERNAL_ASSERT_SHAPE(w1w2, 2, H, I);
     TORCH_INTERNAL_ASSERT_SHAPE(w3, O, H);
@@ -138,11 +156,24 @@ class SwiGLUPackedWeights
     at::Tensor dx1dx2, x4;
     TORCH_INTERNAL_ASSERT(dx5.size(1) == w3.size(0));
     auto dx4 = torch::mm(dx5, w3);
-    std::tie(dx1dx2, x4) = silu_bw_fused(x1, x2, dx4);
+    if (ctx->saved_data["recompute"].toBool()) {
+      c10::optional<at::Tensor> b1, b2;
+      if (has_b1b2) {
+        b1 = saved[3][0];
+        b2 = saved[3][1];
+      }
+      // x1 and x2 are recomputed within the SiLU backward
+      std::tie(dx1dx2, x4) =
+          dual_gemm_silu_bw_fused(x, w1w2[0], b1, w1w2[1], b2, dx4);
+    } else {
+      auto x1 = saved[3];
+      auto x2 = saved[4];
+      TORCH_INTERNAL_ASSERT_SHAPE(x1, B, H);
+      TORCH_INTERNAL_ASSERT_SHAPE(x2, B, H);
+      std::tie(dx1dx2, x4) = silu_bw_fused(x1, x2, dx4);
+    }
     TORCH_INTERNAL_ASSERT_SHAPE(dx1dx2, B, 2, H);
     TORCH_INTERNAL_ASSERT_SHAPE(x4, B, H);
-    x1.reset();
-    x2.reset();
     dx4.reset();
 
     at::Tensor db3, dw3;
@@ -176,7 +207,7 @@ class SwiGLUPackedWeights
       dw1dw2 = torch::mm(dx1dx2.transpose(-2, -1), x);
     }
 
-    return {dx, dw1dw2.view({2, H, I}), db1db2, dw3, db3};
+    return {dx, dw1dw2.view({2, H, I}), db1db2, dw3, db3, at::Tensor()};
   }
 };
 
@@ -185,8 +216,9 @@ at::Tensor swiglu_packedw_autograd(
     const at::Tensor& w1w2,
     const c10::optional<at::Tensor> b1b2,
     const at::Tensor w3,
-    const c10::optional<at::Tensor> b3) {
-  return SwiGLUPackedWeights::apply(x, w1w2, b1b2, w3, b3);
+    const c10::optional<at::Tensor> b3,
+    bool recompute) {
+  return SwiGLUPackedWeights::apply(x, w1w2, b1b2, w3, b3, recompute);
 }
 
 at::Tensor swiglu_packedw_autocast(
@@ -194,7 +226,8 @@ at::Tensor swiglu_packedw_autocast(
     const at::Tensor& w1w2,
     const c10::optional<at::Tensor> b1b2,
     const at::Tensor w3,
-    const c10::optional<at::Tensor> b3) {
+    const c10::optional<at::Tensor> b3,
+    bool recompute) {
   c10::impl::ExcludeDispatchKeyGuard no_autocast(c10::DispatchKey::Autocast);
   auto exec_type = at::autocast::get_autocast_gpu_dtype();
   return SwiGLUPackedWeights::apply(
@@ -202,27 +235,29 @@ at::Tensor swiglu_packedw_autocast(
       at::autocast::cached_cast(exec_type, w1w2),
       at::autocast::cached_cast(exec_type, b1b2),
       at::autocast::cached_cast(exec_type, w3),
-      at::autocast::cached_cast(exec_type, b3));
+      at::autocast::cached_cast(exec_type, b3),
+      recompute);
 }
 
-at::Tensor swiglu_packedw_cuda(
+at::Tensor swiglu_packedw_backend(
     const at::Tensor& x,
     const at::Tensor& w1w2,
     const c10::optional<at::Tensor> b1b2,
     const at::Tensor w3,
-    const c10::optional<at::Tensor> b3) {
+    const c10::optional<at::Tensor> b3,
+    bool recompute) {
   if (x.requires_grad()) {
-    return SwiGLUPackedWeights::apply(x, w1w2, b1b2, w3, b3);
+    return SwiGLUPackedWeights::apply(x, w1w2, b1b2, w3, b3, recompute);
   } else {
     return SwiGLUPackedWeights::forward(
-        /* ctx */ nullptr, x, w1w2, b1b2, w3, b3);
+        /* ctx */ nullptr, x, w1w2, b1b2, w3, b3, recompute);
   }
 }
 } // namespace
 
 TORCH_LIBRARY(xformers, m) {
   m.def(
-      "swiglu_packedw(Tensor x, Tensor w1w2, Tensor? b1b2, Tensor w3, Tensor? b3) -> Tensor");
+      "swiglu_packedw(Tensor x, Tensor w1w2, Tensor? b1b2, Tensor w3, Tensor? b3, bool recompute=False) -> Tensor");
 }
 
 TORCH_LIBRARY_IMPL(xformers, Autograd, m) {
@@ -234,5 +269,9 @@ TORCH_LIBRARY_IMPL(xformers, Autocast, m) {
 }
 
 TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
-  m.impl("swiglu_packedw", swiglu_packedw_cuda);
+  m.impl("swiglu_packedw", swiglu_packedw_backend);
+}
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl("swiglu_packedw", swiglu_packedw_backend);
 }
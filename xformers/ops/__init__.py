@@ -24,6 +24,7 @@ from .fmha import (
     memory_efficient_attention_forward_requires_grad,
 )
 from .indexing import index_select_cat, scaled_index_add
+from .rotary import rotary_embedding, rotary_embedding_
 from .swiglu_op import (
     SwiGLU,
     SwiGLUEagerOp,
@@ -92,4 +93,6 @@ __all__ = [
     "masked_matmul",
     "scaled_index_add",
     "index_select_cat",
+    "rotary_embedding",
+    "rotary_embedding_",
 ]
@@ -7,7 +7,7 @@ from typing import Any, Optional, Sequence, Tuple, Type, Union
 
 import torch
 
-from . import cutlass, decoder, flash, small_k, triton, ck, ck_decoder
+from . import cpu, cutlass, decoder, flash, small_k, triton, ck, ck_decoder
 from .attn_bias import AttentionBias, BlockDiagonalMask, LowerTriangularMask
 from .common import (
     AttentionBwOpBase,
@@ -28,6 +28,7 @@ MemoryEfficientAttentionDecoderOp = (decoder.FwOp, cutlass.BwOp)
 MemoryEfficientAttentionTritonFwdFlashBwOp = (triton.FwOp, flash.BwOp)
 MemoryEfficientAttentionFlashAttentionOp = (flash.FwOp, flash.BwOp)
 MemoryEfficientAttentionOp = (small_k.FwOp, small_k.BwOp)
+MemoryEfficientAttentionCpuOp = (cpu.FwOp, cpu.BwOp)
 TritonFlashAttentionOp = (triton.FwOp, triton.BwOp)
 MemoryEfficientAttentionCkOp = (ck.FwOp, ck.BwOp) 
 MemoryEfficientAttentionCkDecoderOp = (ck_decoder.FwOp, ck.BwOp)
@@ -389,6 +390,7 @@ ALL_FW_OPS: Sequence[Type[AttentionFwOpBase]] = [
     cutlass.FwOp,
     flash.FwOp,
     triton.FwOp,
+    cpu.FwOp,
     small_k.FwOp,
 ]
 
@@ -396,6 +398,7 @@ ALL_BW_OPS: Sequence[Type[AttentionBwOpBase]] = [
     cutlass.BwOp,
     flash.BwOp,
     triton.BwOp,
+    cpu.BwOp,
     small_k.BwOp,
 ]
 
@@ -410,6 +413,7 @@ __all__ = [
     "MemoryEfficientAttentionCutlassOp",
     "MemoryEfficientAttentionFlashAttentionOp",
     "MemoryEfficientAttentionOp",
+    "MemoryEfficientAttentionCpuOp",
     "TritonFlashAttentionOp",
     "memory_efficient_attention",
     "MemoryEfficientAttentionCkOp",
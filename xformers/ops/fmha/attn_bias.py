@@ -39,8 +39,10 @@ class AttentionBias:
 
     - :attr:`xformers.ops.fmha.attn_bias.LowerTriangularMask`
     - :attr:`xformers.ops.fmha.attn_bias.LowerTriangularMaskWithTensorBias`
+    - :attr:`xformers.ops.fmha.attn_bias.LocalAttentionFromBottomRightMask`
     - :attr:`xformers.ops.fmha.attn_bias.BlockDiagonalMask`
     - :attr:`xformers.ops.fmha.attn_bias.BlockDiagonalCausalMask`
+    - :attr:`xformers.ops.fmha.attn_bias.AlibiBias`
 
     """
 
@@ -105,6 +107,48 @@ class LowerTriangularMaskWithTensorBias(LowerTriangularMask):
         return super().materialize(shape, dtype=dtype, device=device) + self._bias
 
 
+@dataclass
+class LocalAttentionFromBottomRightMask(AttentionBias):
+    """
+    A local (aka sliding window) mask, aligned on the bottom-right corner
+    of the attention matrix.
+
+    With `shift = num_keys - num_queries`, the query `i` can attend to the
+    keys `j` such that
+    `i + shift - window_left <= j <= i + shift + window_right`.
+    Setting `window_right=0` gives a causal sliding window.
+
+    The kernels only iterate over the keys inside of the window, so the cost
+    is proportional to the window size rather than to the number of keys.
+    NOTE: `num_keys >= num_queries` is expected, otherwise some queries
+    have no key to attend to.
+    """
+
+    window_left: int
+    window_right: int
+
+    def __post_init__(self) -> None:
+        if self.window_left < 0 or self.window_right < 0:
+            raise ValueError(
+                f"Invalid window: window_left={self.window_left}, "
+                f"window_right={self.window_right}. Expected non-negative values"
+            )
+
+    def materialize(
+        self,
+        shape: Tuple[int, ...],
+        dtype: torch.dtype = torch.float32,
+        device: Union[str, torch.device] = "cpu",
+    ) -> torch.Tensor:
+        create_as = dtype if dtype is not torch.bfloat16 else torch.float32
+        mask = torch.ones(shape, dtype=create_as, device=device)  # type: ignore
+        num_queries, num_keys = shape[-2:]
+        shift = num_keys - num_queries
+        mask = torch.triu(mask, diagonal=shift - self.window_left)
+        mask = torch.tril(mask, diagonal=shift + self.window_right)
+        return torch.log(mask).to(dtype)
+
+
 @dataclass
 class _SeqLenInfo:
     """
@@ -635,3 +679,181 @@ class BlockDiagonalCausalWithOffsetPaddedKeysMask(AttentionBias):
         q_seqinfo = _SeqLenInfo.from_seqlens(q_seqlen)
         k_seqinfo = _PaddedSeqLenInfo.from_seqlens_padded(kv_seqlen, kv_padding)
         return cls(q_seqinfo=q_seqinfo, k_seqinfo=k_seqinfo)
+
+
+@dataclass
+class PagedBlockDiagonalCausalWithOffsetPaddedKeysMask(AttentionBias):
+    """
+    Same as :attr:`xformers.ops.fmha.attn_bias.BlockDiagonalCausalWithOffsetPaddedKeysMask`,
+    except the keys and values are stored in a pool of pages of `page_size` keys,
+    so that a block does not need to be padded out to its maximum length.
+
+    The keys and values are a pool of `num_pages * page_size` keys. Block `i`
+    is made of the pages `block_tables[i, 0]`, `block_tables[i, 1]`, ... of
+    the pool, in that order, and uses its first `kv_seqlen[i]` keys.
+    Pages can be shared between blocks, for instance by beams with a common prefix.
+    `k_seqinfo` describes the blocks as if each was padded to
+    `block_tables.shape[1] * page_size` keys.
+    """
+
+    q_seqinfo: _SeqLenInfo
+    k_seqinfo: _PaddedSeqLenInfo
+    block_tables: torch.Tensor
+    page_size: int
+
+    def materialize(
+        self,
+        shape: Tuple[int, ...],
+        dtype: torch.dtype = torch.float32,
+        device: Union[str, torch.device] = "cpu",
+    ) -> torch.Tensor:
+        """Materialize the attention bias - for debugging & testing"""
+        if shape[-1] % self.page_size != 0:
+            raise ValueError("k shapes wrong")
+        if shape[-2] != self.q_seqinfo.seqstart_py[-1]:
+            raise ValueError("q shapes wrong")
+        mask = torch.empty(shape[-2:], dtype=dtype, device=device)
+        mask.fill_(-math.inf)
+        block_tables = self.block_tables.cpu().long()
+        for i, ((q_start, q_end), k_len) in enumerate(
+            zip(self.q_seqinfo.intervals(), self.k_seqinfo.seqlen_py)
+        ):
+            # Position of the keys of block i in the pool
+            t = torch.arange(k_len)
+            keys = block_tables[i, t // self.page_size] * self.page_size
+            keys += t % self.page_size
+            block_mask = torch.triu(
+                torch.full((q_end - q_start, k_len), -math.inf),
+                diagonal=1 + k_len - (q_end - q_start),
+            )
+            mask[q_start:q_end, keys.to(device)] = block_mask.to(
+                dtype=dtype, device=device
+            )
+        for _ in range(len(shape) - 2):
+            mask = mask.unsqueeze(0)
+        return mask.expand(shape)
+
+    @classmethod
+    def from_seqlens(
+        cls,
+        q_seqlen: Sequence[int],
+        kv_seqlen: Sequence[int],
+        block_tables: torch.Tensor,
+        page_size: int,
+    ) -> "PagedBlockDiagonalCausalWithOffsetPaddedKeysMask":
+        """Creates a :attr:`PagedBlockDiagonalCausalWithOffsetPaddedKeysMask` from a list of
+        tensor lengths for query and key/value, and the pages of each block.
+
+        Args:
+            q_seqlen (Sequence[int]): List or tensor of sequence lengths for query tensors
+            kv_seqlen (Sequence[int]): List or tensor of sequence lengths for key/value.
+            block_tables (torch.Tensor): int32 tensor of shape `[len(kv_seqlen), max_pages]`,
+                with the indices of the pages of each block in the pool
+            page_size (int): Number of keys in a page
+        Returns:
+            PagedBlockDiagonalCausalWithOffsetPaddedKeysMask
+        """
+        assert len(q_seqlen) == len(kv_seqlen) == block_tables.shape[0], (
+            q_seqlen,
+            kv_seqlen,
+            block_tables.shape,
+        )
+        q_seqinfo = _SeqLenInfo.from_seqlens(q_seqlen)
+        k_seqinfo = _PaddedSeqLenInfo.from_seqlens_padded(
+            kv_seqlen, block_tables.shape[1] * page_size
+        )
+        return cls(
+            q_seqinfo=q_seqinfo,
+            k_seqinfo=k_seqinfo,
+            block_tables=block_tables,
+            page_size=page_size,
+        )
+
+
+@dataclass
+class AlibiBias(AttentionBias):
+    """
+    ALiBi_ positional bias: `slopes[h] * (j - i)` is added to the attention
+    score of query `i` and key `j` of the head `h`, optionally on top of a
+    `mask` (eg :attr:`LowerTriangularMask` or one of the block-diagonal masks).
+
+    Only the per-head slopes are stored: the kernels compute the bias on the
+    fly instead of reading a `[B, H, M, N]` tensor.
+    With a block-diagonal mask, `i` and `j` are the positions of the query
+    and key within their own block.
+
+    .. _ALiBi: https://arxiv.org/pdf/2108.12409.pdf
+    """
+
+    slopes: torch.Tensor  # [num_heads], float32
+    mask: Optional[AttentionBias] = None
+
+    def __post_init__(self) -> None:
+        if self.slopes.ndim != 1:
+            raise ValueError(
+                f"Expected one slope per head, got slopes.shape={self.slopes.shape}"
+            )
+        if isinstance(self.mask, AlibiBias) or not (
+            self.mask is None or isinstance(self.mask, AttentionBias)
+        ):
+            raise ValueError(f"Unsupported mask for AlibiBias: {type(self.mask)}")
+
+    @classmethod
+    def from_num_heads(
+        cls, num_heads: int, mask: Optional[AttentionBias] = None
+    ) -> "AlibiBias":
+        """Creates an :attr:`AlibiBias` with the slopes of the ALiBi paper:
+        the geometric sequence `2^(-8i/n)` for the `n` first heads, `n` being
+        the largest power of two not above `num_heads`. The remaining heads
+        get every other slope of the sequence for `2n` heads.
+        """
+
+        def _slopes_power_of_2(n: int) -> List[float]:
+            start = 2 ** (-(2 ** -(math.log2(n) - 3)))
+            return [start**i for i in range(1, n + 1)]
+
+        closest_power_of_2 = 2 ** math.floor(math.log2(num_heads))
+        slopes = _slopes_power_of_2(closest_power_of_2)
+        if closest_power_of_2 != num_heads:
+            slopes += _slopes_power_of_2(2 * closest_power_of_2)[0::2][
+                : num_heads - closest_power_of_2
+            ]
+        return cls(slopes=torch.tensor(slopes, dtype=torch.float32), mask=mask)
+
+    def _positions(
+        self, num_queries: int, num_keys: int
+    ) -> Tuple[torch.Tensor, torch.Tensor]:
+        q_pos = torch.arange(num_queries)
+        k_pos = torch.arange(num_keys)
+        mask = self.mask
+        if isinstance(
+            mask, (BlockDiagonalMask, BlockDiagonalCausalWithOffsetPaddedKeysMask)
+        ):
+            # Positions restart from 0 in every block
+            for (q_start, q_end), (k_start, k_end) in zip(
+                mask.q_seqinfo.intervals(), mask.k_seqinfo.intervals()
+            ):
+                q_pos[q_start:q_end] -= q_start
+                k_pos[k_start:k_end] -= k_start
+        return q_pos, k_pos
+
+    def materialize(
+        self,
+        shape: Tuple[int, ...],
+        dtype: torch.dtype = torch.float32,
+        device: Union[str, torch.device] = "cpu",
+    ) -> torch.Tensor:
+        """
+        Shape should be like `[*, num_heads, q_seqlen, k_seqlen]`
+        """
+        num_heads, num_queries, num_keys = shape[-3:]
+        assert num_heads == self.slopes.shape[0], (shape, self.slopes.shape)
+        q_pos, k_pos = self._positions(num_queries, num_keys)
+        distance = (k_pos[None, :] - q_pos[:, None]).float()
+        bias = self.slopes.float().cpu()[:, None, None] * distance
+        bias = bias.to(device).expand(shape)
+        if self.mask is not None:
+            bias = bias + self.mask.materialize(
+                shape, dtype=torch.float32, device=device
+            )
+        return bias.to(dtype)
@@ -59,9 +59,6 @@ class FwOp(AttentionFwOpBase):
             if bsz != len(q_starts) - 1:
                 reasons.append("empty lanes not supported yet")
 
-            if attn_bias.k_seqinfo.padding > 8192:
-                reasons.append("key padding exceeds 8192")
-
         return reasons
 
     @classmethod
@@ -13,8 +13,10 @@ import torch
 from ..._cpp_lib import _built_with_cuda
 from ..common import BaseOperator
 from .attn_bias import (
+    AlibiBias,
     AttentionBias,
     BlockDiagonalMask,
+    LocalAttentionFromBottomRightMask,
     LowerTriangularMask,
     LowerTriangularMaskWithTensorBias,
 )
@@ -24,7 +26,11 @@ def _is_bias_type_supported_in_BMK(attn_bias_type: Any) -> bool:
     # NoneType
     if isinstance(None, attn_bias_type):
         return True
-    if attn_bias_type in [LowerTriangularMask, torch.Tensor]:
+    if attn_bias_type in [
+        LowerTriangularMask,
+        LocalAttentionFromBottomRightMask,
+        torch.Tensor,
+    ]:
         return True
     return False
 
@@ -154,7 +160,12 @@ class Inputs:
                     f"  key.shape  : {self.key.shape}\n"
                     f"  value.shape: {self.value.shape}"
                 )
-        if isinstance(self.attn_bias, BlockDiagonalMask):
+        mask = (
+            self.attn_bias.mask
+            if isinstance(self.attn_bias, AlibiBias)
+            else self.attn_bias
+        )
+        if isinstance(mask, BlockDiagonalMask):
             if any(x.shape[0] != 1 for x in qkv):
                 raise ValueError(
                     f"Expected batch_size=1 when using block-diagonal bias\n"
@@ -272,6 +283,11 @@ class AttentionOpBase(BaseOperator):
             reasons.append(f"dtype={dtype} (supported: {cls.SUPPORTED_DTYPES})")
         if type(d.attn_bias) not in cls.SUPPORTED_ATTN_BIAS_TYPES:
             reasons.append(f"attn_bias type is {type(d.attn_bias)}")
+        elif (
+            isinstance(d.attn_bias, AlibiBias)
+            and type(d.attn_bias.mask) not in cls.SUPPORTED_ATTN_BIAS_TYPES
+        ):
+            reasons.append(f"AlibiBias with a mask of type {type(d.attn_bias.mask)}")
         if (d.p != 0.0) and not cls.SUPPORTS_DROPOUT:
             reasons.append("dropout > 0.0")
         if d.scale is not None and not cls.SUPPORTS_CUSTOM_SCALE:
@@ -279,9 +295,10 @@ class AttentionOpBase(BaseOperator):
         # bfloat16 is only supported on A100+
         # ... although the kernels can still run and give the
         # correct result
-        if dtype is torch.bfloat16 and (
-            not device_type.startswith("cuda")
-            or torch.cuda.get_device_capability(d.query.device)[0] < 8
+        if (
+            dtype is torch.bfloat16
+            and device_type.startswith("cuda")
+            and torch.cuda.get_device_capability(d.query.device)[0] < 8
         ):
             reasons.append("bf16 is only supported on A100+ GPUs")
         if not cls.is_available():
@@ -0,0 +1,53 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+from typing import Any, List, Set
+
+from ..common import register_operator
+from . import cutlass
+from .attn_bias import (
+    BlockDiagonalCausalWithOffsetPaddedKeysMask,
+    LocalAttentionFromBottomRightMask,
+)
+
+
+@register_operator
+class FwOp(cutlass.FwOp):
+    """xFormers' memory-efficient attention on CPU.
+    Shares the operator schema and the supported features of
+    the CUTLASS kernels (variable sequence lengths, causal masks,
+    tensor bias, ALiBi, custom scale, different value embedding), with
+    f32 accumulation for f16 and bf16 inputs. Dropout is not supported.
+    Causal and block-diagonal attention biases are applied in the
+    kernel, without materializing them: fully masked key tiles are
+    skipped, as are the padding keys of
+    :attr:`xformers.ops.fmha.attn_bias.BlockDiagonalCausalWithOffsetPaddedKeysMask`
+    and the keys outside of the window of
+    :attr:`xformers.ops.fmha.attn_bias.LocalAttentionFromBottomRightMask`.
+    """
+
+    SUPPORTED_DEVICES: Set[str] = {"cpu"}
+    SUPPORTS_DROPOUT = False
+    NAME = "cpuF"
+
+    _TEST_BATCH_SIZES: List[int] = [1, 3]
+
+
+@register_operator
+class BwOp(cutlass.BwOp):
+    __doc__ = FwOp.__doc__
+
+    SUPPORTED_DEVICES = FwOp.SUPPORTED_DEVICES
+    # The padding keys are skipped in-kernel through `seqlen_k`, and the
+    # sliding window is only supported by the CPU backward
+    SUPPORTED_ATTN_BIAS_TYPES: Set[Any] = {
+        *cutlass.BwOp.SUPPORTED_ATTN_BIAS_TYPES,
+        BlockDiagonalCausalWithOffsetPaddedKeysMask,
+        LocalAttentionFromBottomRightMask,
+    }
+    SUPPORTS_DROPOUT = FwOp.SUPPORTS_DROPOUT
+    NAME = "cpuB"
+
+    _TEST_BATCH_SIZES: List[int] = [1, 3]
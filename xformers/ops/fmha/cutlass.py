@@ -12,10 +12,12 @@ import torch
 from ..common import get_xformers_operator, register_operator
 from . import attn_bias
 from .attn_bias import (
+    AlibiBias,
     AttentionBias,
     BlockDiagonalCausalMask,
     BlockDiagonalCausalWithOffsetPaddedKeysMask,
     BlockDiagonalMask,
+    LocalAttentionFromBottomRightMask,
     LowerTriangularMask,
     LowerTriangularMaskWithTensorBias,
 )
@@ -54,10 +56,27 @@ def _minimum_gemm_alignment(inp: Inputs) -> int:
     return matmul_alignment_mn
 
 
+def _strip_alibi(
+    attn_bias: Optional[Union[torch.Tensor, AttentionBias]]
+) -> Optional[Union[torch.Tensor, AttentionBias]]:
+    # The mask an `AlibiBias` is applied on top of
+    if isinstance(attn_bias, AlibiBias):
+        return attn_bias.mask
+    return attn_bias
+
+
+def _get_alibi_slopes(
+    attn_bias: Optional[Union[torch.Tensor, AttentionBias]], device: torch.device
+) -> Optional[torch.Tensor]:
+    if isinstance(attn_bias, AlibiBias):
+        return attn_bias.slopes.to(device=device, dtype=torch.float32).contiguous()
+    return None
+
+
 def _get_seqlen_info(
     inp: Inputs,
 ) -> Tuple[Optional[torch.Tensor], Optional[torch.Tensor], int, int]:
-    attn_bias = inp.attn_bias
+    attn_bias = _strip_alibi(inp.attn_bias)
     if isinstance(
         attn_bias, (BlockDiagonalMask, BlockDiagonalCausalWithOffsetPaddedKeysMask)
     ):
@@ -76,9 +95,26 @@ def _get_seqlen_info(
     return seqstart_k, seqstart_q, max_seqlen_q, max_seqlen_k
 
 
+def _get_seqlen_k(
+    attn_bias: Optional[Union[torch.Tensor, AttentionBias]]
+) -> Optional[torch.Tensor]:
+    if isinstance(attn_bias, BlockDiagonalCausalWithOffsetPaddedKeysMask):
+        return attn_bias.k_seqinfo.seqlen
+    return None
+
+
+def _get_window(
+    attn_bias: Optional[Union[torch.Tensor, AttentionBias]]
+) -> Tuple[Optional[int], Optional[int]]:
+    if isinstance(attn_bias, LocalAttentionFromBottomRightMask):
+        return attn_bias.window_left, attn_bias.window_right
+    return None, None
+
+
 def _get_tensor_bias(
     attn_bias: Optional[Union[torch.Tensor, AttentionBias]]
 ) -> Optional[torch.Tensor]:
+    attn_bias = _strip_alibi(attn_bias)
     if isinstance(attn_bias, torch.Tensor):
         return attn_bias
     elif isinstance(attn_bias, LowerTriangularMaskWithTensorBias):
@@ -91,7 +127,12 @@ def _check_bias_alignment(
 ) -> None:
     attn_bias_tensor = _get_tensor_bias(attn_bias)
     if attn_bias_tensor is not None:
-        alignment = 128 // torch.finfo(attn_bias_tensor.dtype).bits
+        # Only the GPU kernels load the bias with vectorized accesses
+        alignment = (
+            128 // torch.finfo(attn_bias_tensor.dtype).bits
+            if attn_bias_tensor.device.type == "cuda"
+            else 1
+        )
         show_padding_hint = False
         for d in range(attn_bias_tensor.ndim - 1):
             if attn_bias_tensor.stride(d) % alignment != 0:
@@ -122,6 +163,7 @@ class _CustomMaskType(int, Enum):
     NoCustomMask = 0
     CausalFromTopLeft = 1
     CausalFromBottomRight = 2
+    LocalFromBottomRight = 3
 
 
 def _custom_mask_type(bias: Optional[Union[torch.Tensor, AttentionBias]]) -> int:
@@ -141,6 +183,8 @@ def _custom_mask_type(bias: Optional[Union[torch.Tensor, AttentionBias]]) -> int
         ),
     ):
         return int(_CustomMaskType.CausalFromBottomRight)
+    if isinstance(bias, LocalAttentionFromBottomRightMask):
+        return int(_CustomMaskType.LocalFromBottomRight)
     return int(_CustomMaskType.NoCustomMask)
 
 
@@ -164,6 +208,9 @@ class FwOp(AttentionFwOpBase):
         BlockDiagonalCausalMask,
         BlockDiagonalCausalWithOffsetPaddedKeysMask,
         attn_bias.BlockDiagonalCausalFromBottomRightMask,
+        LocalAttentionFromBottomRightMask,
+        # On top of any of the masks above
+        AlibiBias,
     }
     SUPPORTS_DROPOUT = True
     SUPPORTS_CUSTOM_SCALE = True
@@ -183,6 +230,8 @@ class FwOp(AttentionFwOpBase):
         if type(inp.attn_bias) not in FwOp.SUPPORTED_ATTN_BIAS_TYPES:
             raise NotImplementedError("Unsupported attn_bias type")
         seqstart_k, seqstart_q, max_seqlen_q, _ = _get_seqlen_info(inp)
+        mask = _strip_alibi(inp.attn_bias)
+        window_left, window_right = _get_window(mask)
         out, lse, rng_seed, rng_offset = cls.OPERATOR(
             query=inp.query,
             key=inp.key,
@@ -193,11 +242,12 @@ class FwOp(AttentionFwOpBase):
             max_seqlen_q=max_seqlen_q,
             dropout_p=inp.p,
             compute_logsumexp=needs_gradient,
-            custom_mask_type=_custom_mask_type(inp.attn_bias),
+            custom_mask_type=_custom_mask_type(mask),
             scale=inp.scale,
-            seqlen_k=inp.attn_bias.k_seqinfo.seqlen
-            if isinstance(inp.attn_bias, BlockDiagonalCausalWithOffsetPaddedKeysMask)
-            else None,
+            seqlen_k=_get_seqlen_k(mask),
+            window_left=window_left,
+            window_right=window_right,
+            alibi_slopes=_get_alibi_slopes(inp.attn_bias, inp.query.device),
         )
         ctx: Optional[Context] = None
         if needs_gradient:
@@ -266,6 +316,7 @@ class BwOp(AttentionBwOpBase):
         BlockDiagonalMask,
         BlockDiagonalCausalMask,
         attn_bias.BlockDiagonalCausalFromBottomRightMask,
+        AlibiBias,
     }
     SUPPORTS_ATTN_BIAS_GRAD = True
     SUPPORTS_DROPOUT = FwOp.SUPPORTS_DROPOUT
@@ -321,10 +372,12 @@ class BwOp(AttentionBwOpBase):
 
     @classmethod
     def apply(cls, ctx: Context, inp: Inputs, grad: torch.Tensor) -> Gradients:
-        if type(inp.attn_bias) not in BwOp.SUPPORTED_ATTN_BIAS_TYPES:
+        if type(inp.attn_bias) not in cls.SUPPORTED_ATTN_BIAS_TYPES:
             raise NotImplementedError("Unsupported attn_bias type")
 
         seqstart_k, seqstart_q, max_seqlen_q, max_seqlen_k = _get_seqlen_info(inp)
+        mask = _strip_alibi(inp.attn_bias)
+        window_left, window_right = _get_window(mask)
         dtype = inp.query.dtype
 
         rng_seed = rng_offset = 0
@@ -338,7 +391,10 @@ class BwOp(AttentionBwOpBase):
                 raise NotImplementedError(f"Invalid rng_state: {ctx.rng_state}")
             rng_seed, rng_offset = ctx.rng_state.tolist()
 
-        force_pad_inf = torch.cuda.get_device_capability(inp.query.device) == (7, 5)
+        force_pad_inf = (
+            inp.query.device.type == "cuda"
+            and torch.cuda.get_device_capability(inp.query.device) == (7, 5)
+        )
         (grad_q, grad_k, grad_v, grad_bias) = cls.OPERATOR(
             grad.to(dtype),
             inp.query,
@@ -358,9 +414,13 @@ class BwOp(AttentionBwOpBase):
             # was used.
             rng_seed=rng_seed,
             rng_offset=rng_offset,
-            custom_mask_type=_custom_mask_type(inp.attn_bias),
+            custom_mask_type=_custom_mask_type(mask),
             scale=inp.scale,
             num_splits_key=-1,  # Let C++ determine it
+            seqlen_k=_get_seqlen_k(mask),
+            window_left=window_left,
+            window_right=window_right,
+            alibi_slopes=_get_alibi_slopes(inp.attn_bias, inp.query.device),
         )
 
         # c++/CUDA implementation returns an uninitialized tensor if bias doesn't
@@ -9,7 +9,10 @@ import numpy as np
 import torch
 
 from ..common import get_xformers_operator, register_operator
-from .attn_bias import BlockDiagonalCausalWithOffsetPaddedKeysMask
+from .attn_bias import (
+    BlockDiagonalCausalWithOffsetPaddedKeysMask,
+    PagedBlockDiagonalCausalWithOffsetPaddedKeysMask,
+)
 from .common import AttentionFwOpBase, Context, Inputs
 
 
@@ -26,11 +29,15 @@ class FwOp(AttentionFwOpBase):
     """
 
     OPERATOR = get_xformers_operator("efficient_attention_forward_decoder")
-    SUPPORTED_DEVICES = {"cuda"}
+    OPERATOR_PAGED = get_xformers_operator("efficient_attention_forward_decoder_paged")
+    SUPPORTED_DEVICES = {"cuda", "cpu"}
     SUPPORTED_DTYPES = {torch.bfloat16, torch.half, torch.float32}
     CUDA_MINIMUM_COMPUTE_CAPABILITY = (7, 0)
     SUPPORTED_MAX_K: float = 128
-    SUPPORTED_ATTN_BIAS_TYPES: Set[Any] = {BlockDiagonalCausalWithOffsetPaddedKeysMask}
+    SUPPORTED_ATTN_BIAS_TYPES: Set[Any] = {
+        BlockDiagonalCausalWithOffsetPaddedKeysMask,
+        PagedBlockDiagonalCausalWithOffsetPaddedKeysMask,
+    }
     SUPPORTS_DROPOUT = False
     SUPPORTS_CUSTOM_SCALE = True
     NAME = "decoderF"
@@ -40,7 +47,13 @@ class FwOp(AttentionFwOpBase):
         reasons = super(FwOp, cls).not_supported_reasons(d)
 
         attn_bias = d.attn_bias
-        if isinstance(attn_bias, BlockDiagonalCausalWithOffsetPaddedKeysMask):
+        if isinstance(
+            attn_bias,
+            (
+                BlockDiagonalCausalWithOffsetPaddedKeysMask,
+                PagedBlockDiagonalCausalWithOffsetPaddedKeysMask,
+            ),
+        ):
             # If we don't get here, we've an error elsewhere
             if d.query.ndim != 4 or d.key.ndim != 4:
                 reasons.append("Inputs must be BMHK. BMK not supported")
@@ -48,7 +61,8 @@ class FwOp(AttentionFwOpBase):
             if d.query.shape[0] != 1:
                 reasons.append("One formal batch element expected")
 
-            if d.query.shape[-1] != 128:
+            # Only the CUDA kernel is limited to head_dim==128
+            if d.query.device.type == "cuda" and d.query.shape[-1] != 128:
                 reasons.append("Only head_dim==128 for now.")
 
             if d.key.stride(-1) != 1:
@@ -63,8 +77,11 @@ class FwOp(AttentionFwOpBase):
             elif d.query.shape[1] != len(q_starts) - 1:
                 reasons.append("empty lanes not supported yet")
 
-            if attn_bias.k_seqinfo.padding > 8192:
-                reasons.append("key padding exceeds 8192")
+        if isinstance(attn_bias, PagedBlockDiagonalCausalWithOffsetPaddedKeysMask):
+            if d.query.device.type != "cpu":
+                reasons.append("paged KV cache is only supported on CPU")
+            if d.key.ndim == 4 and d.key.shape[1] % attn_bias.page_size != 0:
+                reasons.append("keys must be a whole number of pages")
 
         return reasons
 
@@ -75,12 +92,20 @@ class FwOp(AttentionFwOpBase):
         if needs_gradient:
             raise NotImplementedError("gradient")
         attn_bias = inp.attn_bias
-        assert isinstance(attn_bias, BlockDiagonalCausalWithOffsetPaddedKeysMask)
+        assert isinstance(
+            attn_bias,
+            (
+                BlockDiagonalCausalWithOffsetPaddedKeysMask,
+                PagedBlockDiagonalCausalWithOffsetPaddedKeysMask,
+            ),
+        )
 
         attn_bias.k_seqinfo.to(inp.query.device)
         attn_bias.q_seqinfo.to(inp.query.device)
 
-        padding = attn_bias.k_seqinfo.padding
+        paged = isinstance(attn_bias, PagedBlockDiagonalCausalWithOffsetPaddedKeysMask)
+        # The keys are split in one row per batch element, or per page of the pool
+        padding = attn_bias.page_size if paged else attn_bias.k_seqinfo.padding
         multiquery = inp.key.stride(2) == 0
         if multiquery:
             key = inp.key[0, :, :1].unflatten(0, (-1, padding))
@@ -98,11 +123,23 @@ class FwOp(AttentionFwOpBase):
         else:
             qk_scale = 1.0 / np.sqrt(key.shape[-1])
 
-        out = cls.OPERATOR(
-            query=query,
-            key=key,
-            value=value,
-            seq_positions=seq_positions,
-            scale=qk_scale,
-        )
+        if paged:
+            out = cls.OPERATOR_PAGED(
+                query=query,
+                key=key,
+                value=value,
+                seq_positions=seq_positions,
+                block_tables=attn_bias.block_tables.to(
+                    device=inp.query.device, dtype=torch.int32
+                ),
+                scale=qk_scale,
+            )
+        else:
+            out = cls.OPERATOR(
+                query=query,
+                key=key,
+                value=value,
+                seq_positions=seq_positions,
+                scale=qk_scale,
+            )
         return out, None
@@ -46,6 +46,7 @@ class FwOp(AttentionFwOpBase):
         and f32 pre-Ampere as it does not use TensorCores.
     Only supports contiguous inputs in BMK format, so an extra reshape \
         or contiguous call might be done.
+    On CPU, f16 and bf16 inputs are also supported, with f32 accumulation.
 
     :Deprecated:
 
@@ -54,7 +55,7 @@ class FwOp(AttentionFwOpBase):
 
     OPERATOR = get_xformers_operator("efficient_attention_forward_small_k")
     SUPPORTED_DEVICES = {"cuda", "cpu"}
-    SUPPORTED_DTYPES = {torch.float}
+    SUPPORTED_DTYPES = {torch.float, torch.half, torch.bfloat16}
     SUPPORTED_MAX_K: float = 32
     SUPPORTED_ATTN_BIAS_TYPES: Set[Any] = {type(None), torch.Tensor}
     SUPPORTS_DROPOUT = True
@@ -63,6 +64,8 @@ class FwOp(AttentionFwOpBase):
 
     BACKWARD_ERROR_ATOL: Mapping[torch.dtype, float] = {
         torch.float: 4e-3,
+        torch.half: 9e-2,
+        torch.bfloat16: 0.7,
     }
     # as this kernel is a bit slow, this should make tests run faster
     _TEST_BATCH_SIZES = [1, 3]
@@ -71,6 +74,8 @@ class FwOp(AttentionFwOpBase):
     @classmethod
     def not_supported_reasons(cls, d: Inputs) -> List[str]:
         reasons = super(FwOp, cls).not_supported_reasons(d)
+        if d.device.type != "cpu" and d.query.dtype is not torch.float:
+            reasons.append("f16 and bf16 are only supported on CPU")
         if isinstance(d.attn_bias, torch.Tensor) and d.attn_bias.stride(1) != 0:
             reasons.append("bias with non-zero stride not supported")
         buffer_size = 8
@@ -126,17 +131,21 @@ class BwOp(AttentionBwOpBase):
     SUPPORTS_CUSTOM_SCALE = FwOp.SUPPORTS_CUSTOM_SCALE
     SUPPORTS_DIFFERENT_VALUE_EMBED = FwOp.SUPPORTS_DIFFERENT_VALUE_EMBED
 
-    # there is some extra precision loss in the CPU implementation due to an
-    # extra accumulation step in grad_q, which is not present in the CUDA
-    # implementation
+    # there is some extra precision loss in the CPU implementation, which
+    # recomputes the attention probabilities tile by tile in both of its
+    # dK/dV and dQ passes
     ERROR_ATOL: Mapping[torch.dtype, float] = {
         torch.float: 4e-3,
+        torch.half: 9e-2,
+        torch.bfloat16: 0.7,
     }
     NAME = "smallkB"
 
     @classmethod
     def not_supported_reasons(cls, d: Inputs) -> List[str]:
         reasons = super(BwOp, cls).not_supported_reasons(d)
+        if d.device.type != "cpu" and d.query.dtype is not torch.float:
+            reasons.append("f16 and bf16 are only supported on CPU")
         if isinstance(d.attn_bias, torch.Tensor) and d.attn_bias.stride(1) != 0:
             reasons.append("bias with non-zero stride not supported")
         buffer_size = 8
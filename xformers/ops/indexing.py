@@ -32,6 +32,20 @@ class IndexSelect(BaseOperator):
     NAME = "index_select"
 
 
+@register_operator
+class GroupedIndexSelect(BaseOperator):
+    OPERATOR = get_xformers_operator("grouped_index_select")
+    OPERATOR_CATEGORY = "indexing"
+    NAME = "grouped_index_select"
+
+
+@register_operator
+class GroupedIndexScatter(BaseOperator):
+    OPERATOR = get_xformers_operator("grouped_index_scatter")
+    OPERATOR_CATEGORY = "indexing"
+    NAME = "grouped_index_scatter"
+
+
 class _ScaledIndexAdd(torch.autograd.Function):
     @staticmethod
     # type: ignore
@@ -144,17 +158,10 @@ class _IndexSelectCat(torch.autograd.Function):
         output = torch.empty(
             [output_shape], dtype=sources[0].dtype, device=sources[0].device
         )
-        output_i = 0
-        for source, index in zip(sources, indices):
-            elements_here = index.shape[0] * source.shape[1]
-            IndexSelect.OPERATOR(
-                output=output[output_i : output_i + elements_here].view(
-                    [index.shape[0], source.shape[1]]
-                ),
-                source=source,
-                index=index,
-            )
-            output_i += elements_here
+        # All the sources are gathered in a single call
+        GroupedIndexSelect.OPERATOR(
+            output=output, sources=list(sources), indices=list(indices)
+        )
         ctx.save_for_backward(*indices)
         ctx.total_source_elements = total_source_elements
         ctx.source_shapes = [s.shape for s in sources]
@@ -170,28 +177,17 @@ class _IndexSelectCat(torch.autograd.Function):
             device=grad_output.device,
         )
         grad_sources_i = 0
-        grad_output_i = 0
         gradients = []
-        for source_shape, index in zip(ctx.source_shapes, indices):
-            grad_output_slice = grad_output[
-                grad_output_i : grad_output_i + index.shape[0] * source_shape[1]
-            ].reshape([index.shape[0], source_shape[1]])
-            grad_output_i += index.shape[0] * source_shape[1]
-
-            gradient_source = grad_sources[
-                grad_sources_i : grad_sources_i + source_shape[0] * source_shape[1]
-            ].reshape(source_shape)
-            grad_sources_i += source_shape[0] * source_shape[1]
-
-            ScaledIndexAddFw.OPERATOR(
-                output=gradient_source.unsqueeze(1),
-                input=None,
-                source=grad_output_slice.unsqueeze(1),
-                index=index,
-                source_scaling=None,
-                alpha=1.0,
+        for source_shape in ctx.source_shapes:
+            gradients.append(
+                grad_sources[
+                    grad_sources_i : grad_sources_i + source_shape[0] * source_shape[1]
+                ].view(source_shape)
             )
-            gradients.append(gradient_source)
+            grad_sources_i += source_shape[0] * source_shape[1]
+        GroupedIndexScatter.OPERATOR(
+            outputs=gradients, source=grad_output.contiguous(), indices=list(indices)
+        )
         return (*gradients, *([None] * len(gradients)))
 
 
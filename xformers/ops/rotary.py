@@ -0,0 +1,111 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+
+from typing import Optional
+
+import torch
+
+from .._cpp_lib import _built_with_cuda
+from .common import BaseOperator, get_xformers_operator, register_operator
+
+
+@register_operator
+class RotaryEmbeddingOp(BaseOperator):
+    OPERATOR = get_xformers_operator("rotary_embedding_")
+    OPERATOR_CATEGORY = "rotary"
+    NAME = "rotary_embedding_"
+
+
+def _rotary_supported(x: torch.Tensor) -> bool:
+    if not RotaryEmbeddingOp.is_available():
+        return False
+    if x.device.type == "cuda" and not _built_with_cuda:
+        return False
+    return (
+        x.device.type in ("cpu", "cuda")
+        and x.dtype in (torch.float16, torch.bfloat16, torch.float32)
+        and 2 <= x.ndim <= 4
+        and x.stride(-1) == 1
+    )
+
+
+class _RotaryEmbedding(torch.autograd.Function):
+    @staticmethod
+    # type: ignore
+    def forward(
+        ctx,
+        x: torch.Tensor,
+        cos: torch.Tensor,
+        sin: torch.Tensor,
+        positions: Optional[torch.Tensor],
+    ) -> torch.Tensor:
+        # The copy keeps the layout of `x`, so that a strided view (eg. the
+        # BMHK -> BHMK transposition) is rotated without being made contiguous
+        out = x.clone()
+        RotaryEmbeddingOp.OPERATOR(
+            x=out, cos=cos, sin=sin, positions=positions, inverse=False
+        )
+        ctx.save_for_backward(cos, sin, positions)
+        return out
+
+    @staticmethod
+    @torch.autograd.function.once_differentiable
+    def backward(ctx, grad_output):
+        cos, sin, positions = ctx.saved_tensors
+        # The rotation is orthogonal: its gradient is the inverse rotation
+        grad_x = grad_output.clone(memory_format=torch.contiguous_format)
+        RotaryEmbeddingOp.OPERATOR(
+            x=grad_x, cos=cos, sin=sin, positions=positions, inverse=True
+        )
+        return grad_x, None, None, None
+
+
+def rotary_embedding(
+    x: torch.Tensor,  # [..., S, D]
+    cos: torch.Tensor,  # [P, D / 2] - float32
+    sin: torch.Tensor,  # [P, D / 2] - float32
+    positions: Optional[torch.Tensor] = None,  # [S] - int64
+) -> torch.Tensor:
+    """
+    Rotary position embedding of ``x``, in a single pass over ``x``
+
+    Row ``s`` of the sequence (second to last dimension) is rotated with
+    the angles of position ``positions[s]``, or ``s`` if ``positions``
+    is not given. ``cos`` and ``sin`` only hold the first half of the
+    usual tables, as both halves of ``x`` are rotated by the same angles:
+    they can be computed once for the longest sequence and indexed by
+    position afterwards.
+
+    :Equivalent pytorch code:
+
+    .. code-block:: python
+
+        cos = torch.cat((cos, cos), dim=-1)[positions]
+        sin = torch.cat((sin, sin), dim=-1)[positions]
+        return x * cos + rotate_half(x) * sin
+    """
+    return _RotaryEmbedding.apply(x, cos, sin, positions)
+
+
+def rotary_embedding_(
+    x: torch.Tensor,
+    cos: torch.Tensor,
+    sin: torch.Tensor,
+    positions: Optional[torch.Tensor] = None,
+) -> torch.Tensor:
+    """
+    In-place version of :attr:`xformers.ops.rotary_embedding`, which rotates
+    ``x`` without any copy. ``x`` may be a strided view, for instance
+    the query or key part of a packed QKV tensor.
+
+    :Note:
+
+        This does not support autograd
+    """
+    RotaryEmbeddingOp.OPERATOR(
+        x=x, cos=cos, sin=sin, positions=positions, inverse=False
+    )
+    return x
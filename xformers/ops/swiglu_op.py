@@ -8,6 +8,7 @@ from typing import Dict, Optional, Sequence, Tuple, Union
 
 import torch
 import torch.nn.functional as F
+import torch.utils.checkpoint
 from torch import nn
 
 from .common import BaseOperator, get_xformers_operator, register_operator
@@ -66,7 +67,9 @@ class _SwiGLUDecomposedFunc(torch.autograd.Function):
 
     # 952us
     @classmethod
-    def forward(cls, ctx, x, w1, b1, w2, b2, w3, b3):
+    def forward(cls, ctx, x, w1, b1, w2, b2, w3, b3, recompute=False):
+        if recompute:
+            raise NotImplementedError(f"{cls.NAME} does not support `recompute`")
         x1 = x @ w1.transpose(-2, -1) + b1  # 275us
         x2 = x @ w2.transpose(-2, -1) + b2  # 275us
         x3 = F.silu(x1)  # 62us
@@ -96,7 +99,7 @@ class _SwiGLUDecomposedFunc(torch.autograd.Function):
         dx += dx1 @ w1  # 260us (nn)
         dw1 = dx1.transpose(-2, -1) @ x  # 245us (nt)
         db1 = dx1.sum(0)  # 50us
-        return (dx, dw1, db1, dw2, db2, dw3, db3)
+        return (dx, dw1, db1, dw2, db2, dw3, db3, None)
 
 
 class _SwiGLUFusedFunc(torch.autograd.Function):
@@ -104,11 +107,16 @@ class _SwiGLUFusedFunc(torch.autograd.Function):
 
     @classmethod
     @torch.cuda.amp.custom_fwd
-    def forward(cls, ctx, x, w1, b1, w2, b2, w3, b3):
+    def forward(cls, ctx, x, w1, b1, w2, b2, w3, b3, recompute=False):
         x1, x2, x4 = DualGemmSiluOp.OPERATOR(x, w1, b1, w2, b2)
 
         x5 = F.linear(x4, w3, b3)
-        ctx.save_for_backward(x, w1, w2, w3, x1, x2)
+        if recompute:
+            # x1/x2 are recomputed in the backward
+            ctx.save_for_backward(x, w1, b1, w2, b2, w3)
+        else:
+            ctx.save_for_backward(x, w1, w2, w3, x1, x2)
+        ctx.recompute = recompute
         ctx.bias = [b1 is not None, b2 is not None, b3 is not None]
         return x5
 
@@ -126,13 +134,24 @@ class _SwiGLUFusedFunc(torch.autograd.Function):
     @classmethod
     @torch.cuda.amp.custom_bwd
     def backward(cls, ctx, dx5):
-        x, w1, w2, w3, x1, x2 = ctx.saved_tensors
+        if ctx.recompute:
+            x, w1, b1, w2, b2, w3 = ctx.saved_tensors
+        else:
+            x, w1, w2, w3, x1, x2 = ctx.saved_tensors
         w1w2 = stack_or_none([w1, w2], dim=0)
 
         dx4 = dx5 @ w3  # 255us (nn)
-        dx1dx2, x4 = torch.ops.xformers.silu_bw_fused(x1, x2, dx4)
+        if ctx.recompute:
+            # x1 and x2 are recomputed within the SiLU backward
+            dx1dx2, x4 = torch.ops.xformers.dual_gemm_silu_bw_fused(
+                x, w1, b1, w2, b2, dx4
+            )
+            del b1, b2
+        else:
+            dx1dx2, x4 = torch.ops.xformers.silu_bw_fused(x1, x2, dx4)
+            del x1, x2
         dx1, dx2 = dx1dx2.unbind(1)
-        del x1, x2, dx4
+        del dx4
 
         dw3, db3 = cls._linear_bw(dx5, x4, bias=ctx.bias[2])
         del x4, dx5
@@ -160,7 +179,7 @@ class _SwiGLUFusedFunc(torch.autograd.Function):
             )  # dx += dx1 @ w1
             dw2, db2 = cls._linear_bw(dx2, x, bias=ctx.bias[1])
             dw1, db1 = cls._linear_bw(dx1, x, bias=ctx.bias[0])
-        return (dx, dw1, db1, dw2, db2, dw3, db3)
+        return (dx, dw1, db1, dw2, db2, dw3, db3, None)
 
 
 class SwiGLUOp:
@@ -214,7 +233,12 @@ def _eager_functional_swiglu(
     b2: torch.Tensor,
     w3: torch.Tensor,
     b3: torch.Tensor,
+    recompute: bool = False,
 ) -> torch.Tensor:
+    if recompute:
+        return torch.utils.checkpoint.checkpoint(
+            _eager_functional_swiglu, x, w1, b1, w2, b2, w3, b3, use_reentrant=False
+        )
     x1 = F.linear(x, w1, b1)
     x2 = F.linear(x, w2, b2)
     hidden = F.silu(x1) * x2
@@ -282,6 +306,14 @@ def _only_half_or_autocast(op: SwiGLUOpDispatch) -> bool:
     )
 
 
+def _only_sm80_half_or_cpu(op: SwiGLUOpDispatch) -> bool:
+    # The CPU kernels support all floating-point dtypes
+    device_type = op.device if isinstance(op.device, str) else op.device.type
+    if device_type == "cpu":
+        return True
+    return _only_sm80(op) and _only_half_or_autocast(op)
+
+
 def _bias_enabled(op: SwiGLUOpDispatch) -> bool:
     return op.bias_enabled
 
@@ -290,13 +322,13 @@ _SwiGLUDecomposedOp = _ForwardToPythonAutogradFunc(
     _SwiGLUDecomposedFunc, False, "decomposed", constraints=[_bias_enabled]
 )
 SwiGLUFusedOp = _ForwardToPythonAutogradFunc(
-    _SwiGLUFusedFunc, False, "fused", constraints=[_only_sm80, _only_half_or_autocast]
+    _SwiGLUFusedFunc, False, "fused", constraints=[_only_sm80_half_or_cpu]
 )
 SwiGLUPackedFusedOp = _ForwardToFunc(
     get_xformers_operator("swiglu_packedw"),
     True,
     "fused.p.cpp",
-    constraints=[_only_sm80, _only_half_or_autocast],
+    constraints=[_only_sm80_half_or_cpu],
 )
 SwiGLUEagerOp = _ForwardToFunc(
     _eager_functional_swiglu,
@@ -320,6 +352,7 @@ def swiglu(
     b3: Optional[torch.Tensor],
     *,
     op: SwiGLUOp = None,
+    recompute: bool = False,
 ) -> torch.Tensor:
     """
     Computes a SwiGLU block given the weights/bias of the 3
@@ -327,6 +360,10 @@ def swiglu(
 
     - It is recommended to keep ``op=None`` so the best implementation \
     available for the inputs will be used.
+    - With ``recompute=True``, only the input and the weights are kept for \
+    the backward pass, and the two ``[B, hidden]`` activations of the first \
+    layers are recomputed from them: this trades one more dual GEMM in the \
+    backward pass for less activation memory.
 
 
     :Equivalent pytorch code:
@@ -348,8 +385,8 @@ def swiglu(
     :Supported hardware:
 
     This operator is only optimized on A100+ on ``torch.half`` or ``torch.bfloat16`` \
-        (autocast is supported), and will fallback to a functional pytorch \
-        implementation otherwise.
+        (autocast is supported), and on CPU for all floating-point dtypes, \
+        and will fallback to a functional pytorch implementation otherwise.
     """
 
     batch_shape = x.shape[:-1]
@@ -372,7 +409,7 @@ def swiglu(
         op = SwiGLUOpDispatch.from_arguments(x, w1, b1, w2, b2, w3, b3).op
 
     if not op.PACKED_WEIGHTS:
-        return op(x, w1, b1, w2, b2, w3, b3).reshape([*batch_shape, -1])
+        return op(x, w1, b1, w2, b2, w3, b3, recompute).reshape([*batch_shape, -1])
     w1w2 = stack_or_none((w1, w2), dim=0)
     if b1 is not None and b2 is not None:
         b1b2: Optional[torch.Tensor] = stack_or_none((b1, b2), dim=0)
@@ -384,7 +421,7 @@ def swiglu(
 
     if w1w2 is None:
         raise NotImplementedError("w1/w2 needs to be properly packed")
-    return op(x, w1w2, b1b2, w3, b3).reshape([*batch_shape, -1])
+    return op(x, w1w2, b1b2, w3, b3, recompute).reshape([*batch_shape, -1])
 
 
 class SwiGLU(nn.Module):
@@ -401,6 +438,7 @@ class SwiGLU(nn.Module):
         bias: bool = True,
         *,
         _pack_weights: bool = True,
+        recompute: bool = False,
     ) -> None:
         """Create a SwiGLU module
 
@@ -409,6 +447,8 @@ class SwiGLU(nn.Module):
             hidden_features (int): Number of hidden features
             out_features (Optional[int], optional): Number of features of the input. Defaults to None.
             bias (bool, optional): Whether linear layers also include a bias. Defaults to True.
+            recompute (bool, optional): Recompute the hidden activations in the
+                backward pass instead of keeping them in memory. Defaults to False.
         """
         super().__init__()
         out_features = out_features or in_features
@@ -427,6 +467,7 @@ class SwiGLU(nn.Module):
         self.out_features = out_features
         self.in_features = in_features
         self.op = None
+        self.recompute = recompute
 
     def forward(self, x: torch.Tensor) -> torch.Tensor:
         """Computes :attr:`swiglu` with the module's weights
@@ -437,7 +478,7 @@ class SwiGLU(nn.Module):
         Returns:
             torch.Tensor: A Tensor of shape ``[..., out_features]``
         """
-        return swiglu(x, *self._ordered_params(), op=self.op)
+        return swiglu(x, *self._ordered_params(), op=self.op, recompute=self.recompute)
 
     def _ordered_params(self):
         """Used for testing - returns ordered arguments for operators"""
@@ -0,0 +1,193 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+
+import torch
+
+
+def _get_bsr_info(layout):
+    """
+    Describes the blocks of `layout` (`[heads, block_rows, block_cols]`),
+    numbered in the order of `layout.nonzero()`, for the `bsr_*` operators:
+    `row_offsets` and `column_indices` index them as CSR over the block rows
+    of all the heads, and `row_offsets_t`, `column_indices_t` and
+    `block_indices_t` do the same for the transposed layout, where
+    `block_indices_t` gives the number of each block.
+    """
+    layout = layout != 0
+    H, R, C = layout.shape
+    h, r, c = layout.nonzero(as_tuple=True)
+
+    def _offsets(blocks_per_row):
+        offsets = blocks_per_row.cumsum(0, dtype=torch.int32)
+        return torch.nn.functional.pad(offsets, (1, 0))
+
+    row_offsets = _offsets(layout.reshape(H * R, C).sum(-1))
+    column_indices = c.int()
+
+    # stable sort of the blocks by (head, block column)
+    _, block_indices_t = (h * C + c).sort(stable=True)
+    row_offsets_t = _offsets(layout.transpose(1, 2).reshape(H * C, R).sum(-1))
+    column_indices_t = r[block_indices_t].int()
+    return (
+        row_offsets,
+        column_indices,
+        row_offsets_t,
+        column_indices_t,
+        block_indices_t.int(),
+    )
+
+
+class _bsr_sddmm(torch.autograd.Function):
+    """
+    `a @ b.transpose(-2, -1)`, computed only for the blocks of the layout
+    described by `bsr_info` (see `_get_bsr_info`)
+    """
+
+    @staticmethod
+    def forward(ctx, a, b, bsr_info, block_size):
+        a = a.contiguous()
+        b = b.contiguous()
+        out = torch.ops.xformers.bsr_sddmm(a, b, bsr_info[0], bsr_info[1], block_size)
+        ctx.save_for_backward(a, b, *bsr_info)
+        return out
+
+    @staticmethod
+    def backward(ctx, grad):
+        (
+            a,
+            b,
+            row_offsets,
+            column_indices,
+            row_offsets_t,
+            column_indices_t,
+            block_indices_t,
+        ) = ctx.saved_tensors
+        grad = grad.contiguous()
+        grad_a = grad_b = None
+        if ctx.needs_input_grad[0]:
+            grad_a = torch.ops.xformers.bsr_spmm(
+                grad, b, row_offsets, column_indices, None, False
+            )
+        if ctx.needs_input_grad[1]:
+            grad_b = torch.ops.xformers.bsr_spmm(
+                grad, a, row_offsets_t, column_indices_t, block_indices_t, True
+            )
+        return grad_a, grad_b, None, None
+
+
+class _bsr_spmm(torch.autograd.Function):
+    """
+    `values @ b`, where `values` holds the blocks of the layout described by
+    `bsr_info` (see `_get_bsr_info`)
+    """
+
+    @staticmethod
+    def forward(ctx, values, b, bsr_info):
+        values = values.contiguous()
+        b = b.contiguous()
+        out = torch.ops.xformers.bsr_spmm(
+            values, b, bsr_info[0], bsr_info[1], None, False
+        )
+        ctx.save_for_backward(values, b, *bsr_info)
+        return out
+
+    @staticmethod
+    def backward(ctx, grad):
+        (
+            values,
+            b,
+            row_offsets,
+            column_indices,
+            row_offsets_t,
+            column_indices_t,
+            block_indices_t,
+        ) = ctx.saved_tensors
+        grad = grad.contiguous()
+        grad_values = grad_b = None
+        if ctx.needs_input_grad[0]:
+            grad_values = torch.ops.xformers.bsr_sddmm(
+                grad, b, row_offsets, column_indices, values.shape[-1]
+            )
+        if ctx.needs_input_grad[1]:
+            grad_b = torch.ops.xformers.bsr_spmm(
+                values, grad, row_offsets_t, column_indices_t, block_indices_t, True
+            )
+        return grad_values, grad_b, None
+
+
+class _bsr_softmax(torch.autograd.Function):
+    """
+    Softmax over the rows of the block-sparse matrix, each spanning all the
+    blocks of its block row
+    """
+
+    @staticmethod
+    def forward(ctx, values, bsr_info):
+        out = torch.ops.xformers.bsr_softmax(
+            values.contiguous(), bsr_info[0], bsr_info[1]
+        )
+        ctx.save_for_backward(out, bsr_info[0], bsr_info[1])
+        return out
+
+    @staticmethod
+    def backward(ctx, grad):
+        out, row_offsets, column_indices = ctx.saved_tensors
+        grad_values = torch.ops.xformers.bsr_softmax_backward(
+            out, grad.contiguous(), row_offsets, column_indices
+        )
+        return grad_values, None
+
+
+class _bsr_attention(torch.autograd.Function):
+    """
+    `softmax(q @ k.transpose(-2, -1) * scale) @ v`, with the scores restricted
+    to the blocks of the layout described by `bsr_info` (see `_get_bsr_info`),
+    without materializing them
+    """
+
+    @staticmethod
+    def forward(ctx, q, k, v, bsr_info, block_size, scale, causal):
+        q = q.contiguous()
+        k = k.contiguous()
+        v = v.contiguous()
+        out, lse = torch.ops.xformers.bsr_attention_forward(
+            q, k, v, bsr_info[0], bsr_info[1], block_size, scale, causal
+        )
+        ctx.save_for_backward(q, k, v, out, lse, *bsr_info[:4])
+        ctx.block_size = block_size
+        ctx.scale = scale
+        ctx.causal = causal
+        return out
+
+    @staticmethod
+    def backward(ctx, grad):
+        (
+            q,
+            k,
+            v,
+            out,
+            lse,
+            row_offsets,
+            column_indices,
+            row_offsets_t,
+            column_indices_t,
+        ) = ctx.saved_tensors
+        grad_q, grad_k, grad_v = torch.ops.xformers.bsr_attention_backward(
+            grad.contiguous(),
+            q,
+            k,
+            v,
+            out,
+            lse,
+            row_offsets,
+            column_indices,
+            row_offsets_t,
+            column_indices_t,
+            ctx.block_size,
+            ctx.scale,
+            ctx.causal,
+        )
+        return grad_q, grad_k, grad_v, None, None, None, None
@@ -51,11 +51,26 @@ def _sddmm_func(a, b, row_indices, row_offsets, column_indices):
 
 
 class _SparseSoftmax(torch.autograd.Function):
+    """
+    With `inplace=True`, the softmax overwrites `values` instead of
+    allocating a new `[batch, nnz]` tensor. The backward never writes into
+    the incoming gradient, which autograd may share with other nodes: it only
+    reuses the copy made when that gradient isn't contiguous. Only the CPU
+    kernels support it, other devices fall back to the out-of-place kernels.
+    """
+
     @staticmethod
-    def forward(ctx, m, n, row_indices, values, row_offsets, column_indices):
-        out = torch.ops.xformers.sparse_softmax_sputnik(
-            m, n, row_indices, values, row_offsets, column_indices
-        )
+    def forward(ctx, m, n, row_indices, values, row_offsets, column_indices, inplace):
+        ctx.inplace = inplace and not values.is_cuda
+        if ctx.inplace:
+            out = torch.ops.xformers.sparse_softmax_sputnik_(
+                m, n, row_indices, values, row_offsets, column_indices
+            )
+            ctx.mark_dirty(out)
+        else:
+            out = torch.ops.xformers.sparse_softmax_sputnik(
+                m, n, row_indices, values, row_offsets, column_indices
+            )
         # note: save out and not values, as an optimization step
         ctx.save_for_backward(row_indices, out, row_offsets, column_indices)
         ctx.size = (m, n)
@@ -67,12 +82,18 @@ class _SparseSoftmax(torch.autograd.Function):
         m, n = ctx.size
 
         # gradients w.r.t. values
-        grad = grad.contiguous()
-        ga = torch.ops.xformers.sparse_softmax_backward_sputnik(
-            m, n, row_indices, out, grad, row_offsets, column_indices
-        )
+        grad_ = grad.contiguous()
+        if ctx.inplace and grad_ is not grad:
+            # `grad_` is a private copy
+            ga = torch.ops.xformers.sparse_softmax_backward_sputnik_(
+                m, n, row_indices, out, grad_, row_offsets, column_indices
+            )
+        else:
+            ga = torch.ops.xformers.sparse_softmax_backward_sputnik(
+                m, n, row_indices, out, grad_, row_offsets, column_indices
+            )
 
-        return None, None, None, ga, None, None
+        return None, None, None, ga, None, None, None
 
 
 class _sddmm(torch.autograd.Function):
@@ -164,3 +185,113 @@ class _spmm(torch.autograd.Function):
         )
 
         return grad_dense, None, grad_sparse, None, None, None, None
+
+
+class _SparseSoftmaxBatched(torch.autograd.Function):
+    """
+    Softmax over the rows of a batch of csr matrices with their own sparsity
+    patterns, see `_dense3d_to_batched_sparse`
+    """
+
+    @staticmethod
+    def forward(ctx, m, n, values, row_offsets, column_indices, batch_offsets):
+        out = torch.ops.xformers.sparse_softmax_sputnik_batched(
+            m, n, values, row_offsets, column_indices, batch_offsets
+        )
+        ctx.save_for_backward(out, row_offsets, column_indices, batch_offsets)
+        ctx.size = (m, n)
+        return out
+
+    @staticmethod
+    def backward(ctx, grad):
+        out, row_offsets, column_indices, batch_offsets = ctx.saved_tensors
+        m, n = ctx.size
+        ga = torch.ops.xformers.sparse_softmax_backward_sputnik_batched(
+            m, n, out, grad.contiguous(), row_offsets, column_indices, batch_offsets
+        )
+        return None, None, ga, None, None, None
+
+
+class _sddmm_batched(torch.autograd.Function):
+    """
+    Same as `_sddmm`, for batch elements with their own sparsity patterns.
+    `_transp_info` comes from `_get_batched_transpose_info`.
+    """
+
+    @staticmethod
+    def forward(ctx, a, b, row_offsets, column_indices, batch_offsets, _transp_info):
+        out = torch.ops.xformers.sddmm_sputnik_batched(
+            a, b, row_offsets, column_indices, batch_offsets
+        )
+        ctx.save_for_backward(
+            a, b, row_offsets, column_indices, batch_offsets, *_transp_info
+        )
+        return out
+
+    @staticmethod
+    def backward(ctx, grad):
+        (
+            a,
+            b,
+            row_offsets,
+            column_indices,
+            batch_offsets,
+            row_offsets_t,
+            column_indices_t,
+            perm,
+        ) = ctx.saved_tensors
+        m, n = a.shape[1], b.shape[1]
+
+        grad = grad.contiguous()
+        a = a.contiguous()
+        b = b.contiguous()
+        a_grad = torch.ops.xformers.spmm_sputnik_batched(
+            b, grad, row_offsets, column_indices, batch_offsets, m
+        )
+        b_grad = torch.ops.xformers.spmm_sputnik_batched(
+            a, grad[perm], row_offsets_t, column_indices_t, batch_offsets, n
+        )
+        return a_grad, b_grad, None, None, None, None
+
+
+class _spmm_batched(torch.autograd.Function):
+    """
+    Same as `_spmm`, for batch elements with their own sparsity patterns.
+    `_transp_info` comes from `_get_batched_transpose_info`.
+    """
+
+    @staticmethod
+    def forward(
+        ctx, b, values, row_offsets, column_indices, batch_offsets, m, _transp_info
+    ):
+        b = b.contiguous()
+        out = torch.ops.xformers.spmm_sputnik_batched(
+            b, values, row_offsets, column_indices, batch_offsets, m
+        )
+        ctx.save_for_backward(
+            b, values, row_offsets, column_indices, batch_offsets, *_transp_info
+        )
+        return out
+
+    @staticmethod
+    def backward(ctx, grad):
+        (
+            b,
+            values,
+            row_offsets,
+            column_indices,
+            batch_offsets,
+            row_offsets_t,
+            column_indices_t,
+            perm,
+        ) = ctx.saved_tensors
+        k = b.shape[1]
+
+        grad = grad.contiguous()
+        grad_sparse = torch.ops.xformers.sddmm_sputnik_batched(
+            grad, b, row_offsets, column_indices, batch_offsets
+        )
+        grad_dense = torch.ops.xformers.spmm_sputnik_batched(
+            grad, values[perm], row_offsets_t, column_indices_t, batch_offsets, k
+        )
+        return grad_dense, grad_sparse, None, None, None, None, None
@@ -8,6 +8,7 @@ import logging
 import torch
 
 from xformers.ops import masked_matmul
+from xformers.sparse import _bsr_ops
 
 logger = logging.getLogger("xformers")
 
@@ -122,6 +123,11 @@ class BlockSparseTensor(torch.Tensor):
         self.__values = values
         self.__layout = layout
 
+        # index of the blocks for the CPU operators
+        self.__bsr_info = (
+            _bsr_ops._get_bsr_info(layout) if layout.device.type == "cpu" else None
+        )
+
         # blocksparse operators for triton
         if blocksparse_matmul:
             self._initialize_triton_ops()
@@ -159,13 +165,16 @@ class BlockSparseTensor(torch.Tensor):
         return self.__values
 
     @classmethod
-    def _raw_wrap(cls, values, layout, sparse_dot_sdd, sparse_dot_dsd, sparse_softmax):
+    def _raw_wrap(
+        cls, values, layout, sparse_dot_sdd, sparse_dot_dsd, sparse_softmax, bsr_info
+    ):
         matrix = cls.__new__(cls, values, layout)
         matrix.__values = values
         matrix.__layout = layout
         matrix.__sparse_dot_sdd = sparse_dot_sdd
         matrix.__sparse_dot_dsd = sparse_dot_dsd
         matrix.__sparse_softmax = sparse_softmax
+        matrix.__bsr_info = bsr_info
         return matrix
 
     @classmethod
@@ -176,6 +185,7 @@ class BlockSparseTensor(torch.Tensor):
         matrix.__sparse_dot_sdd = bmat.__sparse_dot_sdd
         matrix.__sparse_dot_dsd = bmat.__sparse_dot_dsd
         matrix.__sparse_softmax = bmat.__sparse_softmax
+        matrix.__bsr_info = bmat.__bsr_info
         return matrix
 
     @classmethod
@@ -184,6 +194,8 @@ class BlockSparseTensor(torch.Tensor):
             return NotImplemented
         if _can_use_triton(arg1):
             res = arg0.__sparse_dot_dsd(arg0.__values, arg1)
+        elif arg0.__bsr_info is not None and arg1.device.type == "cpu":
+            res = _bsr_ops._bsr_spmm.apply(arg0.__values, arg1, arg0.__bsr_info)
         else:
             res = _spmm(arg1, arg0.__layout, arg0.__values)
         return res
@@ -196,6 +208,9 @@ class BlockSparseTensor(torch.Tensor):
         assert b.is_contiguous()
         if _can_use_triton(a):
             res = mask.__sparse_dot_sdd(a, b)
+        elif mask.__bsr_info is not None and a.device.type == "cpu":
+            block_size = mask.__values.shape[-1]
+            res = _bsr_ops._bsr_sddmm.apply(a, b, mask.__bsr_info, block_size)
         else:
             res = _sddmm(a, b, mask.__layout)
         return cls._wrap(res, mask)
@@ -206,6 +221,8 @@ class BlockSparseTensor(torch.Tensor):
             return NotImplemented
         if _can_use_triton(arg0):
             res = arg0.__sparse_softmax(arg0.__values)
+        elif arg0.__bsr_info is not None and arg0.device.type == "cpu":
+            res = _bsr_ops._bsr_softmax.apply(arg0.__values, arg0.__bsr_info)
         else:
             res = _softmax(arg0.__layout, arg0.__values)
         return cls._wrap(res, arg0)
@@ -233,6 +250,7 @@ class BlockSparseTensor(torch.Tensor):
         arg0.__sparse_dot_sdd = out.__sparse_dot_sdd
         arg0.__sparse_dot_dsd = out.__sparse_dot_dsd
         arg0.__sparse_softmax = out.__sparse_softmax
+        arg0.__bsr_info = out.__bsr_info
         return arg0
 
     @classmethod
@@ -329,6 +347,9 @@ class BlockSparseTensor(torch.Tensor):
                 x.__sparse_dot_sdd,
                 x.__sparse_dot_dsd,
                 x.__sparse_softmax,
+                tuple(t.__deepcopy__(memo) for t in x.__bsr_info)
+                if x.__bsr_info is not None
+                else None,
             )
 
         if func in [torch.Tensor.grad.__get__, torch.Tensor._grad.__get__]:
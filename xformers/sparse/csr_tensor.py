@@ -11,8 +11,7 @@ from xformers.sparse import _csr_ops
 from xformers.sparse.utils import (
     _csr_to_coo,
     _dense3d_to_sparse,
-    _diffsort,
-    _get_transpose_info,
+    _get_csr_plan,
     _transpose_with_info,
 )
 
@@ -35,16 +34,13 @@ class SparseCSRTensor(torch.Tensor):
         assert values.ndim == 2
 
         self.__row_offsets = row_offsets.contiguous()
-        self.__row_indices = _diffsort(row_offsets).to(row_offsets.dtype)
         self.__column_indices = column_indices.contiguous()
         self.__values = values.contiguous()
 
-        self.__transp_info = _get_transpose_info(
-            self.shape[1],
-            self.shape[2],
-            self.__row_indices,
-            self.__row_offsets,
-            self.__column_indices,
+        # cached per sparsity pattern, so that re-creating a tensor with the
+        # same pattern (e.g. at every step) doesn't redo the transposition
+        self.__row_indices, self.__transp_info = _get_csr_plan(
+            self.shape[1], self.shape[2], self.__row_offsets, self.__column_indices
         )
 
     def __repr__(self):
@@ -122,7 +118,7 @@ class SparseCSRTensor(torch.Tensor):
         return out
 
     @classmethod
-    def _softmax(cls, arg0, dim):
+    def _softmax(cls, arg0, dim, inplace=False):
         if not (dim == -1 or dim == 2):
             return NotImplemented
 
@@ -133,7 +129,7 @@ class SparseCSRTensor(torch.Tensor):
         row_offsets = self.__row_offsets
         column_indices = self.__column_indices
         out = _csr_ops._SparseSoftmax.apply(
-            m, n, row_indices, values, row_offsets, column_indices
+            m, n, row_indices, values, row_offsets, column_indices, inplace
         )
         return cls._wrap(
             self.shape,
@@ -161,8 +157,8 @@ class SparseCSRTensor(torch.Tensor):
             output_row_offsets,
             output_column_indices,
         ) = _transpose_with_info(values, arg0.__transp_info)
-        new_transp_info = _get_transpose_info(
-            n, m, output_row_indices, output_row_offsets, output_column_indices
+        _, new_transp_info = _get_csr_plan(
+            n, m, output_row_offsets, output_column_indices
         )
 
         return cls._wrap(
@@ -223,14 +219,13 @@ class SparseCSRTensor(torch.Tensor):
         assert arg0.shape == arg1.shape
         av0, av1 = arg0.__values, arg1.__values
         av0.resize_as_(av1).copy_(av1)
-        av0, av1 = arg0.__row_indices, arg1.__row_indices
-        av0.resize_as_(av1).copy_(av1)
-        av0, av1 = arg0.__row_offsets, arg1.__row_offsets
-        av0.resize_as_(av1).copy_(av1)
-        av0, av1 = arg0.__column_indices, arg1.__column_indices
-        av0.resize_as_(av1).copy_(av1)
-        for v0, v1 in zip(arg0.__transp_info, arg1.__transp_info):
-            v0.resize_as_(v1).copy_(v1)
+        # the sparsity pattern and its plan can be shared with other tensors
+        # (see `_get_csr_plan`), so they are replaced rather than overwritten
+        device = arg0.__row_offsets.device
+        arg0.__row_indices = arg1.__row_indices.to(device)
+        arg0.__row_offsets = arg1.__row_offsets.to(device)
+        arg0.__column_indices = arg1.__column_indices.to(device)
+        arg0.__transp_info = tuple(t.to(device) for t in arg1.__transp_info)
         return arg0
 
     @classmethod
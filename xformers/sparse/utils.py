@@ -3,6 +3,9 @@
 # This source code is licensed under the BSD license found in the
 # LICENSE file in the root directory of this source tree.
 
+import hashlib
+import threading
+from collections import OrderedDict
 
 import torch
 
@@ -51,6 +54,108 @@ def _transpose_with_info(values, _transpose_info):
     return row_indices_t, values_t, row_offsets_t, column_indices_t
 
 
+def _csr_pattern_key(m, n, row_offsets, column_indices):
+    # the pattern is hashed on CPU: looking it up costs a single copy of its
+    # indices, however many patterns are cached. `row_offsets` has `m + 1`
+    # elements, so that the digest of both arrays is unambiguous
+    digest = hashlib.blake2b(digest_size=16)
+    for t in (row_offsets, column_indices):
+        digest.update(t.detach().contiguous().cpu().numpy().tobytes())
+    return (
+        m,
+        n,
+        row_offsets.device,
+        row_offsets.dtype,
+        column_indices.dtype,
+        digest.digest(),
+    )
+
+
+class _CSRPlanCache:
+    """LRU cache of the plans of `_get_csr_plan`, keyed by `_csr_pattern_key`
+    and bounded by the memory of the tensors it keeps alive"""
+
+    def __init__(self, max_bytes):
+        self.max_bytes = max_bytes
+        self.nbytes = 0
+        self._plans: "OrderedDict[tuple, tuple]" = OrderedDict()
+        self._lock = threading.Lock()
+
+    @staticmethod
+    def _plan_nbytes(plan):
+        if isinstance(plan, torch.Tensor):
+            return plan.numel() * plan.element_size()
+        return sum(_CSRPlanCache._plan_nbytes(p) for p in plan)
+
+    def get(self, key):
+        with self._lock:
+            entry = self._plans.get(key)
+            if entry is None:
+                return None
+            self._plans.move_to_end(key)
+            return entry[0]
+
+    def put(self, key, plan):
+        nbytes = self._plan_nbytes(plan)
+        with self._lock:
+            if key in self._plans:
+                self.nbytes -= self._plans.pop(key)[1]
+            self._plans[key] = (plan, nbytes)
+            self.nbytes += nbytes
+            while self.nbytes > self.max_bytes:
+                _, (_, evicted) = self._plans.popitem(last=False)
+                self.nbytes -= evicted
+
+    def clear(self):
+        with self._lock:
+            self._plans.clear()
+            self.nbytes = 0
+
+    def __len__(self):
+        return len(self._plans)
+
+
+_csr_plan_cache = _CSRPlanCache(max_bytes=256 * 1024 * 1024)
+
+
+def _clear_csr_plan_cache():
+    _csr_plan_cache.clear()
+
+
+def _get_csr_plan(m, n, row_offsets, column_indices):
+    """Returns `row_indices, transp_info` for the sparsity pattern given by
+    `row_offsets` and `column_indices`, with `m` rows and `n` columns:
+    `row_indices` orders the rows by decreasing number of nonzeros, and
+    `transp_info` is the output of `_get_transpose_info`.
+
+    Sparsity patterns are usually static over training, so these are cached
+    per pattern, and only computed the first time a pattern is seen. The plan
+    of the transposed pattern is derived at the same time, as it is needed
+    for the backward pass. The returned tensors are shared by all the users
+    of a pattern, and must not be modified in place.
+    """
+    key = _csr_pattern_key(m, n, row_offsets, column_indices)
+    plan = _csr_plan_cache.get(key)
+    if plan is not None:
+        return plan
+
+    row_offsets = row_offsets.clone()
+    column_indices = column_indices.clone()
+    row_indices = _diffsort(row_offsets).to(row_offsets.dtype)
+    transp_info = _get_transpose_info(m, n, row_indices, row_offsets, column_indices)
+
+    # transposing back is the inverse permutation of the values
+    row_indices_t, row_offsets_t, column_indices_t, perm = transp_info
+    perm_inv = torch.empty_like(perm)
+    perm_inv[perm] = torch.arange(perm.shape[0], device=perm.device)
+    plan_t = (row_indices_t, (row_indices, row_offsets, column_indices, perm_inv))
+    _csr_plan_cache.put(_csr_pattern_key(n, m, row_offsets_t, column_indices_t), plan_t)
+
+    plan = (row_indices, transp_info)
+    _csr_plan_cache.put(key, plan)
+    return plan
+
+
 def _transpose(m, n, row_indices, values, row_offsets, column_indices):
     _transpose_info = _get_transpose_info(
         m, n, row_indices, row_offsets, column_indices
@@ -121,3 +226,55 @@ def _dense3d_to_sparse(matrix, device):
         mask[0], device
     )
     return values, row_indices, row_offsets, column_indices
+
+
+def _dense3d_to_batched_sparse(matrix, device):
+    """Converts a dense 3d matrix to a batch of csr sparse matrices, each with
+    its own sparsity pattern.
+
+    The nonzeros of all the batch elements are concatenated, and those of
+    element ``b`` are ``[batch_offsets[b], batch_offsets[b + 1])``. The
+    ``row_offsets`` (``[B, M + 1]``) are relative to each element. There is no
+    constraint on the number of nonzeros of each element.
+    """
+
+    assert len(matrix.shape) == 3
+    index_dtype = torch.int32
+    mask = matrix != 0
+    values = matrix[mask].to(device)
+
+    row_offsets = mask.sum(dim=-1, dtype=index_dtype).cumsum(dim=-1, dtype=index_dtype)
+    row_offsets = torch.nn.functional.pad(row_offsets, (1, 0))
+    batch_offsets = torch.nn.functional.pad(
+        row_offsets[:, -1].cumsum(dim=0, dtype=index_dtype), (1, 0)
+    )
+    column_indices = torch.where(mask)[2].to(index_dtype).contiguous()
+
+    row_offsets = row_offsets.contiguous().to(device)
+    column_indices = column_indices.to(device)
+    batch_offsets = batch_offsets.to(device)
+    return values, row_offsets, column_indices, batch_offsets
+
+
+def _get_batched_transpose_info(m, n, row_offsets, column_indices, batch_offsets):
+    # same strategy as `_get_transpose_info`, with the batch element as the
+    # primary sort key: the transposed matrices keep the same `batch_offsets`
+    batch_size = row_offsets.shape[0]
+    device = row_offsets.device
+    batch_coo = torch.repeat_interleave(
+        torch.arange(batch_size, device=device), torch.diff(batch_offsets).long()
+    )
+    row_coo = torch.repeat_interleave(
+        torch.arange(m, device=device).repeat(batch_size),
+        torch.diff(row_offsets, dim=1).flatten().long(),
+    )
+
+    key = batch_coo * n + column_indices.long()
+    _, perm = key.sort(dim=0, stable=True)
+    column_indices_t = row_coo[perm].int()
+
+    row_sizes_t = key.bincount(minlength=batch_size * n).view(batch_size, n)
+    row_offsets_t = torch.nn.functional.pad(
+        row_sizes_t.cumsum(dim=1, dtype=torch.int32), (1, 0)
+    )
+    return row_offsets_t.contiguous(), column_indices_t, perm